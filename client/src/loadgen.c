@@ -0,0 +1,647 @@
+/**
+ * loadgen.c
+ *
+ * Load generator and benchmark harness for the PAP server.
+ *
+ * Drives N concurrent clients through the same code paths the TUI uses
+ * (send-file-socket.c) with a weighted mix of downloads, uploads and
+ * directory listings, then reports per-operation throughput and
+ * p50/p99/p99.9 latencies, plus the server's CPU time per GB moved.
+ *
+ * Every run is reproducible: the payload bytes and each client's sequence
+ * of operations come from the seed (-S), so two runs with the same
+ * options issue the same requests in the same order per client.
+ *
+ * Setup (done once, over one session, before the clock starts):
+ *   <remote_dir>/dl.bin        the file every 'D' downloads (-s bytes)
+ *   <remote_dir>/list/         a directory of -e small files for 'L'
+ *   <remote_dir>/up-<n>.bin    overwritten by client n's uploads
+ * The remote files are left in place so later runs can reuse them (-K).
+ *
+ * Server CPU is read from /proc/<pid>/stat when -C gives the server's pid
+ * (same host), otherwise from the process_cpu_seconds_total metric, which
+ * needs the benchmark user to be root.
+ *
+ * Build (Linux):
+ *   gcc -Wall -Wextra -O2 loadgen.c -o loadgen -lcrypt -pthread -lz -lssl -lcrypto
+ *
+ * Example: 16 clients for 30 s, mostly 1 MiB downloads
+ *   ./loadgen -H 192.168.1.102 -u root -w secret -c 16 -d 30 -m D=80,U=10,L=10
+ */
+
+#include "./send-file-socket.c"
+
+#include <ctype.h>
+#include <time.h>
+
+/* ── Defaults ──────────────────────────────────────────────────────────── */
+
+#define DEFAULT_PORT        "9001"
+#define DEFAULT_CLIENTS     4
+#define DEFAULT_DURATION    10          /* seconds */
+#define DEFAULT_FILE_SIZE   (1024 * 1024)
+#define DEFAULT_DIR_ENTRIES 1000
+#define DEFAULT_REMOTE_DIR  "~/pap-loadgen"
+#define DEFAULT_MIX         "D=70,U=20,L=10"
+#define DEFAULT_SEED        1
+#define MAX_CLIENTS         1024
+
+/* ── Operations ────────────────────────────────────────────────────────── */
+
+enum op {
+	OP_DOWNLOAD,
+	OP_UPLOAD,
+	OP_LIST,
+	OP_COUNT
+};
+
+static const char op_letters[OP_COUNT] = { 'D', 'U', 'L' };
+
+/*
+ * Latencies of one operation type, in microseconds. Each client records
+ * into its own arrays; they are merged after all clients stop.
+ */
+typedef struct {
+	uint64_t *usec;
+	size_t    count;
+	size_t    cap;
+	uint64_t  errors;
+	uint64_t  bytes;
+} op_stats_t;
+
+typedef struct {
+	int        id;
+	pthread_t  thread;
+	unsigned   seed;
+	op_stats_t stats[OP_COUNT];
+} client_t;
+
+/* ── Options ───────────────────────────────────────────────────────────── */
+
+static struct {
+	const char *host;
+	const char *port;
+	const char *username;
+	const char *password;
+	const char *remote_dir;
+	const char *work_dir;
+	int         clients;
+	int         duration;           /* seconds; ignored when ops > 0 */
+	long        ops;                /* operations per client, 0 = timed run */
+	uint64_t    file_size;
+	int         dir_entries;
+	int         weights[OP_COUNT];
+	int         per_request;        /* 1 = new connection + login per op */
+	int         compress_level;
+	int         keep_setup;         /* 1 = reuse files from an earlier run */
+	unsigned    seed;
+	long        server_pid;         /* 0 = read CPU time from the metrics */
+	const char *tls_ca;             /* non-NULL = connect with TLS ("" = system store) */
+	sock_options_t sock;            /* TCP tuning for every connection */
+} opt;
+
+static char payload_path[MAX_PATH_LEN + 1];
+static char remote_dl[MAX_PATH_LEN + 1];
+static char remote_list[MAX_PATH_LEN + 1];
+static uint64_t deadline_usec;
+
+/* ── Helpers ───────────────────────────────────────────────────────────── */
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s -H host -u user [-w password] [-p port]\n"
+	        "          [-c clients] [-d seconds | -n ops_per_client] [-m D=70,U=20,L=10]\n"
+	        "          [-s file_bytes] [-e dir_entries] [-r remote_dir] [-k work_dir]\n"
+	        "          [-x] [-z level] [-K] [-S seed] [-C server_pid] [-T ca_file|system]\n"
+	        "          [-b sockbuf_bytes] [-g congestion] [-N] [-F]\n"
+	        "  -x  open a new connection and log in for every operation\n"
+	        "  -T  connect with TLS, trusting ca_file or the system CA store\n"
+	        "  -b  SO_SNDBUF/SO_RCVBUF; -g  TCP congestion control (e.g. bbr)\n"
+	        "  -N  leave Nagle on; -F  TCP Fast Open\n"
+	        "  -K  skip setup, reuse the remote files of an earlier run\n"
+	        "  The password may also be given in PAP_PASSWORD.\n",
+	        prog);
+}
+
+/**
+ * parse_mix - Parse "D=70,U=20,L=10" into opt.weights.
+ *
+ * Letters left out get weight 0.
+ *
+ * @return 0 on success, -1 on a malformed mix or all-zero weights.
+ */
+static int parse_mix(const char *mix)
+{
+	int total = 0;
+	memset(opt.weights, 0, sizeof(opt.weights));
+
+	while (*mix) {
+		int o;
+		for (o = 0; o < OP_COUNT; o++)
+			if (toupper((unsigned char)*mix) == op_letters[o])
+				break;
+		if (o == OP_COUNT || mix[1] != '=')
+			return -1;
+
+		char *end;
+		long w = strtol(mix + 2, &end, 10);
+		if (end == mix + 2 || w < 0 || w > 1000000)
+			return -1;
+		opt.weights[o] = (int)w;
+		total += (int)w;
+
+		mix = end;
+		if (*mix == ',')
+			mix++;
+		else if (*mix)
+			return -1;
+	}
+	return total > 0 ? 0 : -1;
+}
+
+/**
+ * parse_size - Parse a byte count with an optional K/M/G suffix (powers of 1024).
+ */
+static int parse_size(const char *arg, uint64_t *out)
+{
+	char *end;
+	unsigned long long v = strtoull(arg, &end, 10);
+	if (end == arg)
+		return -1;
+	switch (toupper((unsigned char)*end)) {
+	case 'K': v <<= 10; end++; break;
+	case 'M': v <<= 20; end++; break;
+	case 'G': v <<= 30; end++; break;
+	default:  break;
+	}
+	if (*end != '\0')
+		return -1;
+	*out = v;
+	return 0;
+}
+
+static int parse_args(int argc, char **argv)
+{
+	opt.port           = DEFAULT_PORT;
+	opt.password       = getenv("PAP_PASSWORD");
+	opt.remote_dir     = DEFAULT_REMOTE_DIR;
+	opt.clients        = DEFAULT_CLIENTS;
+	opt.duration       = DEFAULT_DURATION;
+	opt.file_size      = DEFAULT_FILE_SIZE;
+	opt.dir_entries    = DEFAULT_DIR_ENTRIES;
+	opt.seed           = DEFAULT_SEED;
+	opt.sock.nodelay   = 1;
+	parse_mix(DEFAULT_MIX);
+
+	int c;
+	while ((c = getopt(argc, argv, "H:p:u:w:c:d:n:m:s:e:r:k:xz:KS:C:T:b:g:NF")) != -1) {
+		switch (c) {
+		case 'H': opt.host = optarg; break;
+		case 'p': opt.port = optarg; break;
+		case 'u': opt.username = optarg; break;
+		case 'w': opt.password = optarg; break;
+		case 'c': opt.clients = atoi(optarg); break;
+		case 'd': opt.duration = atoi(optarg); break;
+		case 'n': opt.ops = atol(optarg); break;
+		case 'm':
+			if (parse_mix(optarg) != 0) {
+				fprintf(stderr, "Bad mix '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case 's':
+			if (parse_size(optarg, &opt.file_size) != 0) {
+				fprintf(stderr, "Bad size '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case 'e': opt.dir_entries = atoi(optarg); break;
+		case 'r': opt.remote_dir = optarg; break;
+		case 'k': opt.work_dir = optarg; break;
+		case 'x': opt.per_request = 1; break;
+		case 'z': opt.compress_level = atoi(optarg); break;
+		case 'K': opt.keep_setup = 1; break;
+		case 'S': opt.seed = (unsigned)strtoul(optarg, NULL, 10); break;
+		case 'C': opt.server_pid = atol(optarg); break;
+		case 'T': opt.tls_ca = strcmp(optarg, "system") == 0 ? "" : optarg; break;
+		case 'b': {
+			uint64_t bytes;
+			if (parse_size(optarg, &bytes) != 0 || bytes > INT_MAX) {
+				fprintf(stderr, "Bad buffer size '%s'\n", optarg);
+				return -1;
+			}
+			opt.sock.sndbuf = opt.sock.rcvbuf = (int)bytes;
+			break;
+		}
+		case 'g': opt.sock.congestion = optarg; break;
+		case 'N': opt.sock.nodelay = 0; break;
+		case 'F': opt.sock.fastopen = 1; break;
+		default:  return -1;
+		}
+	}
+
+	if (!opt.host || !opt.username || !opt.password || optind < argc)
+		return -1;
+	if (opt.clients < 1 || opt.clients > MAX_CLIENTS || opt.duration < 1 ||
+	    opt.ops < 0 || opt.dir_entries < 0)
+		return -1;
+	return 0;
+}
+
+static int record(op_stats_t *st, uint64_t usec)
+{
+	if (st->count == st->cap) {
+		size_t cap = st->cap ? st->cap * 2 : 1024;
+		uint64_t *p = realloc(st->usec, cap * sizeof(*p));
+		if (!p)
+			return -1;
+		st->usec = p;
+		st->cap = cap;
+	}
+	st->usec[st->count++] = usec;
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * percentile - Nearest-rank percentile of a sorted array, in milliseconds.
+ */
+static double percentile(const uint64_t *sorted, size_t n, double p)
+{
+	if (n == 0)
+		return 0.0;
+	size_t rank = (size_t)(p / 100.0 * (double)n + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+	return (double)sorted[rank - 1] / 1000.0;
+}
+
+/* ── Server CPU ────────────────────────────────────────────────────────── */
+
+/**
+ * proc_cpu_seconds - utime + stime of a local process from /proc/<pid>/stat.
+ *
+ * @return CPU seconds, or -1.0 if the process can't be read.
+ */
+static double proc_cpu_seconds(long pid)
+{
+	char path[64], line[1024];
+	snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return -1.0;
+	size_t n = fread(line, 1, sizeof(line) - 1, fp);
+	fclose(fp);
+	line[n] = '\0';
+
+	/* The command name may contain spaces; fields resume after its ')'. */
+	char *p = strrchr(line, ')');
+	unsigned long long utime, stime;
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+	                 &utime, &stime) != 2)
+		return -1.0;
+	return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * server_cpu_seconds - Current CPU time of the server, or -1.0 if unknown.
+ */
+static double server_cpu_seconds(session_t *s)
+{
+	if (opt.server_pid > 0)
+		return proc_cpu_seconds(opt.server_pid);
+
+	char *text = session_metrics(s);
+	if (!text)
+		return -1.0;
+	double cpu = -1.0;
+	char *line = strstr(text, "\nprocess_cpu_seconds_total ");
+	if (line)
+		cpu = strtod(line + strlen("\nprocess_cpu_seconds_total "), NULL);
+	free(text);
+	return cpu;
+}
+
+/* ── Setup ─────────────────────────────────────────────────────────────── */
+
+/**
+ * write_payload - Create the local upload source: size bytes from the seed.
+ *
+ * xorshift output is incompressible, so compressed runs (-z) measure the
+ * worst case rather than zlib on zeros.
+ */
+static int write_payload(const char *path, uint64_t size, unsigned seed)
+{
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+		return -1;
+
+	uint64_t x = 0x9E3779B97F4A7C15ULL ^ seed;
+	uint64_t block[512];
+	uint64_t left = size;
+	while (left > 0) {
+		for (size_t i = 0; i < sizeof(block) / sizeof(block[0]); i++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			block[i] = x;
+		}
+		size_t n = left < sizeof(block) ? (size_t)left : sizeof(block);
+		if (fwrite(block, 1, n, fp) != n) {
+			fclose(fp);
+			return -1;
+		}
+		left -= n;
+	}
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+/**
+ * setup_remote - Upload the download file and fill the listing directory.
+ */
+static int setup_remote(session_t *s)
+{
+	char tiny[MAX_PATH_LEN + 1], target[MAX_PATH_LEN + 1];
+
+	printf("Setup: uploading %llu-byte %s\n", (unsigned long long)opt.file_size, remote_dl);
+	if (session_upload(s, payload_path, remote_dl) != ERR_NONE) {
+		fprintf(stderr, "Setup upload to %s failed\n", remote_dl);
+		return -1;
+	}
+
+	snprintf(tiny, sizeof(tiny), "%s/entry.txt", opt.work_dir);
+	FILE *fp = fopen(tiny, "wb");
+	if (!fp || fputs("pap-loadgen\n", fp) < 0 || fclose(fp) != 0) {
+		perror(tiny);
+		return -1;
+	}
+
+	printf("Setup: creating %d entries in %s\n", opt.dir_entries, remote_list);
+	for (int i = 0; i < opt.dir_entries; i++) {
+		int n = snprintf(target, sizeof(target), "%s/f%06d.txt", remote_list, i);
+		if (n < 0 || (size_t)n >= sizeof(target) || session_upload(s, tiny, target) != ERR_NONE) {
+			fprintf(stderr, "Setup upload to %s failed\n", target);
+			return -1;
+		}
+	}
+	remove(tiny);
+	return 0;
+}
+
+/* ── Clients ───────────────────────────────────────────────────────────── */
+
+static enum op pick_op(unsigned *seed)
+{
+	int total = 0;
+	for (int o = 0; o < OP_COUNT; o++)
+		total += opt.weights[o];
+
+	int r = rand_r(seed) % total;
+	for (int o = 0; o < OP_COUNT; o++) {
+		if (r < opt.weights[o])
+			return (enum op)o;
+		r -= opt.weights[o];
+	}
+	return OP_DOWNLOAD;
+}
+
+/**
+ * run_op - Perform one operation, on the session or on its own connection.
+ *
+ * @return Payload bytes moved, or -1 on failure.
+ */
+static int64_t run_op(session_t *s, enum op op, const char *remote_up, const char *dl_dir)
+{
+	char out_path[MAX_PATH_LEN + 1];
+	char *listing;
+	int rc;
+
+	switch (op) {
+	case OP_DOWNLOAD:
+		rc = opt.per_request
+		   ? download_from_server(opt.host, opt.port, opt.username, opt.password,
+		                          remote_dl, dl_dir, out_path)
+		   : session_download(s, remote_dl, dl_dir, out_path);
+		return rc == ERR_NONE ? (int64_t)opt.file_size : -1;
+
+	case OP_UPLOAD:
+		rc = opt.per_request
+		   ? upload_to_server(opt.host, opt.port, opt.username, opt.password,
+		                      payload_path, remote_up)
+		   : session_upload(s, payload_path, remote_up);
+		return rc == ERR_NONE ? (int64_t)opt.file_size : -1;
+
+	case OP_LIST:
+		listing = opt.per_request
+		        ? list_directory(opt.host, opt.port, opt.username, opt.password, remote_list)
+		        : session_list(s, remote_list);
+		if (!listing)
+			return -1;
+		free(listing);
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+static void *client_main(void *arg)
+{
+	client_t *c = arg;
+	char remote_up[MAX_PATH_LEN + 1], dl_dir[MAX_PATH_LEN + 1];
+	session_t s;
+
+	snprintf(remote_up, sizeof(remote_up), "%s/up-%d.bin", opt.remote_dir, c->id);
+	snprintf(dl_dir, sizeof(dl_dir), "%s/c%d", opt.work_dir, c->id);
+	if (make_dirs(dl_dir) != 0) {
+		perror(dl_dir);
+		return NULL;
+	}
+
+	/* A login that fails counts against the first operation it delays. */
+	int opened = 0;
+	if (!opt.per_request) {
+		opened = (session_open(&s, opt.host, opt.port, opt.username, opt.password) == ERR_NONE);
+		if (opened)
+			session_set_compression(&s, opt.compress_level);
+	}
+
+	for (long i = 0; opt.ops == 0 || i < opt.ops; i++) {
+		uint64_t start = now_usec();
+		if (opt.ops == 0 && start >= deadline_usec)
+			break;
+
+		enum op op = pick_op(&c->seed);
+		op_stats_t *st = &c->stats[op];
+		int64_t bytes = (opt.per_request || opened) ? run_op(&s, op, remote_up, dl_dir) : -1;
+		if (bytes < 0) {
+			st->errors++;
+			continue;
+		}
+		st->bytes += (uint64_t)bytes;
+		record(st, now_usec() - start);
+	}
+
+	if (opened)
+		session_close(&s);
+
+	char saved[MAX_PATH_LEN + 1];
+	if (join_output_path(dl_dir, "dl.bin", saved) == 0)
+		remove(saved);
+	rmdir(dl_dir);
+	return NULL;
+}
+
+/* ── Report ────────────────────────────────────────────────────────────── */
+
+static void report(client_t *clients, double elapsed, double cpu)
+{
+	uint64_t total_ops = 0, total_bytes = 0, total_errors = 0;
+
+	printf("\nop   %9s %8s %10s %9s %9s %9s %9s\n",
+	       "count", "errors", "MB/s", "ops/s", "p50 ms", "p99 ms", "p99.9 ms");
+	for (int o = 0; o < OP_COUNT; o++) {
+		op_stats_t all = { 0 };
+		for (int i = 0; i < opt.clients; i++) {
+			op_stats_t *st = &clients[i].stats[o];
+			for (size_t k = 0; k < st->count; k++)
+				record(&all, st->usec[k]);
+			all.errors += st->errors;
+			all.bytes  += st->bytes;
+		}
+		if (all.count == 0 && all.errors == 0)
+			continue;
+
+		qsort(all.usec, all.count, sizeof(*all.usec), cmp_u64);
+		printf("%c    %9zu %8llu %10.1f %9.1f %9.2f %9.2f %9.2f\n",
+		       op_letters[o], all.count, (unsigned long long)all.errors,
+		       (double)all.bytes / 1e6 / elapsed, (double)all.count / elapsed,
+		       percentile(all.usec, all.count, 50.0),
+		       percentile(all.usec, all.count, 99.0),
+		       percentile(all.usec, all.count, 99.9));
+
+		total_ops    += all.count;
+		total_bytes  += all.bytes;
+		total_errors += all.errors;
+		free(all.usec);
+	}
+
+	printf("all  %9llu %8llu %10.1f %9.1f\n",
+	       (unsigned long long)total_ops, (unsigned long long)total_errors,
+	       (double)total_bytes / 1e6 / elapsed, (double)total_ops / elapsed);
+	printf("\n%.2f s, %llu bytes moved\n", elapsed, (unsigned long long)total_bytes);
+
+	if (cpu < 0.0)
+		printf("server CPU: unknown (use -C <server pid>, or run as root)\n");
+	else if (total_bytes == 0)
+		printf("server CPU: %.2f s\n", cpu);
+	else
+		printf("server CPU: %.2f s, %.3f s per GB, %.0f%% of one core\n",
+		       cpu, cpu / ((double)total_bytes / 1e9), 100.0 * cpu / elapsed);
+}
+
+int main(int argc, char **argv)
+{
+	char work_buf[64];
+
+	if (parse_args(argc, argv) != 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (opt.tls_ca && tls_client_init(*opt.tls_ca ? opt.tls_ca : NULL) != 0)
+		return 1;
+	if (sock_set_options(&opt.sock) != 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!opt.work_dir) {
+		snprintf(work_buf, sizeof(work_buf), "/tmp/pap-loadgen.%ld", (long)getpid());
+		opt.work_dir = work_buf;
+	}
+	snprintf(payload_path, sizeof(payload_path), "%s/payload.bin", opt.work_dir);
+	snprintf(remote_dl, sizeof(remote_dl), "%s/dl.bin", opt.remote_dir);
+	snprintf(remote_list, sizeof(remote_list), "%s/list", opt.remote_dir);
+
+	if (make_dirs(opt.work_dir) != 0 ||
+	    write_payload(payload_path, opt.file_size, opt.seed) != 0) {
+		perror(opt.work_dir);
+		return 1;
+	}
+
+	/* The control session does the setup and the CPU readings. */
+	session_t ctl;
+	int rc = session_open(&ctl, opt.host, opt.port, opt.username, opt.password);
+	if (rc != ERR_NONE) {
+		fprintf(stderr, "Cannot open a session to %s:%s (error bits 0x%x)\n",
+		        opt.host, opt.port, rc);
+		return 1;
+	}
+	if (!opt.keep_setup && setup_remote(&ctl) != 0) {
+		session_close(&ctl);
+		return 1;
+	}
+
+	printf("%d clients, %s%s, mix D=%d U=%d L=%d, file %llu bytes, dir %d entries, seed %u\n",
+	       opt.clients, opt.per_request ? "connection per op" : "persistent sessions",
+	       opt.compress_level ? ", compressed" : "",
+	       opt.weights[OP_DOWNLOAD], opt.weights[OP_UPLOAD], opt.weights[OP_LIST],
+	       (unsigned long long)opt.file_size, opt.dir_entries, opt.seed);
+	if (opt.ops > 0)
+		printf("Running %ld operations per client...\n", opt.ops);
+	else
+		printf("Running for %d s...\n", opt.duration);
+	fflush(stdout);
+
+	client_t *clients = calloc((size_t)opt.clients, sizeof(*clients));
+	if (!clients) {
+		session_close(&ctl);
+		return 1;
+	}
+
+	double cpu_before = server_cpu_seconds(&ctl);
+	uint64_t started = now_usec();
+	deadline_usec = started + (uint64_t)opt.duration * 1000000u;
+
+	int launched = 0;
+	for (; launched < opt.clients; launched++) {
+		clients[launched].id   = launched;
+		clients[launched].seed = opt.seed * 7919u + (unsigned)launched;
+		if (pthread_create(&clients[launched].thread, NULL, client_main, &clients[launched]) != 0) {
+			fprintf(stderr, "Started only %d of %d clients\n", launched, opt.clients);
+			break;
+		}
+	}
+	for (int i = 0; i < launched; i++)
+		pthread_join(clients[i].thread, NULL);
+
+	double elapsed = (double)(now_usec() - started) / 1e6;
+	double cpu_after = server_cpu_seconds(&ctl);
+	double cpu = (cpu_before < 0.0 || cpu_after < 0.0) ? -1.0 : cpu_after - cpu_before;
+	session_close(&ctl);
+
+	opt.clients = launched;
+	report(clients, elapsed, cpu);
+
+	for (int i = 0; i < launched; i++)
+		for (int o = 0; o < OP_COUNT; o++)
+			free(clients[i].stats[o].usec);
+	free(clients);
+	remove(payload_path);
+	rmdir(opt.work_dir);
+	return 0;
+}
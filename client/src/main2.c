@@ -7,6 +7,7 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <stdatomic.h>
 
 /* ── DEBUG ─────────────────────────────────────────────────────────────── */
 #define DEBUG 0
@@ -14,6 +15,7 @@
 /* ── Network target ────────────────────────────────────────────────────── */
 #define SERVER_ADDRESS "192.168.1.102" //10.0.0.1
 #define SERVER_PORT    "9001"
+#define COMPRESS_LEVEL 6      /* zlib level for downloads/uploads, 0 = off */
 
 /* ── Layout constants ──────────────────────────────────────────────────── */
 #define USERNAME_ROW   0
@@ -82,6 +84,7 @@ enum SPRITES
 #define TILE_WIDTH    24
 #define TILE_HEIGHT   6
 #define LIST_TOP_ROW  6
+#define TRANSFER_ROW  5
 
 typedef struct
 {
@@ -294,67 +297,30 @@ static enum SPRITES classify_sprite(const char *name, int is_dir)
     return GENERIC_FILE;
 }
 
-static int parse_listing_entries(const char *listing, char ***entries_out, int **types_out)
+/**
+ * format_size – Writes a short human-readable size ("512 B", "3.4 MB").
+ */
+static void format_size(uint64_t size, char *out, size_t out_size)
 {
-    char  *copy;
-    char  *tok;
-    char **entries = NULL;
-    int   *types   = NULL;
-    int    count   = 0;
-
-    *entries_out = NULL;
-    *types_out   = NULL;
-    if (!listing || !listing[0])
-        return 0;
+    static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    double value = (double)size;
+    int    unit  = 0;
 
-    copy = strdup(listing);
-    if (!copy)
-        return 0;
+    while (value >= 1024.0 && unit < 4) { value /= 1024.0; unit++; }
 
-    tok = strtok(copy, "\n");
-    while (tok)
-    {
-        char **etmp = realloc(entries, (size_t)(count + 1) * sizeof(*entries));
-        int   *ttmp = realloc(types,   (size_t)(count + 1) * sizeof(*types));
-        if (!etmp || !ttmp)
-            break;
-
-        entries = etmp;
-        types   = ttmp;
-
-        /* Strip the "d:" / "f:" prefix written by list_directory_sock(). */
-        int is_dir = 0;
-        const char *name = tok;
-        if (tok[0] == 'd' && tok[1] == ':') { is_dir = 1; name = tok + 2; }
-        else if (tok[0] == 'f' && tok[1] == ':') {          name = tok + 2; }
-
-        entries[count] = strdup(name);
-        if (!entries[count])
-            break;
-
-        types[count] = is_dir;
-        count++;
-        tok = strtok(NULL, "\n");
-    }
-
-    free(copy);
-    *entries_out = entries;
-    *types_out   = types;
-    return count;
-}
-
-static void free_listing_entries(char **entries, int *types, int count)
-{
-    for (int i = 0; i < count; i++)
-        free(entries[i]);
-    free(entries);
-    free(types);
+    if (unit == 0)
+        snprintf(out, out_size, "%llu B", (unsigned long long)size);
+    else
+        snprintf(out, out_size, "%.1f %s", value, units[unit]);
 }
 
 /* ── Stored credential strings (plain buffers, not input_states) ─────────── */
 static char username[INPUT_BUF_MAX] = {0};
 static char password[INPUT_BUF_MAX] = {0};
 
+/* ── Server connection, opened once at login and reused for every listing ── */
+static session_t g_session = { .sock = SOCK_INVALID };
+
 /* ── Helpers ────────────────────────────────────────────────────────────── */
 
 /**
@@ -532,67 +498,98 @@ static void show_explorer_header(char *ip_address, char *uname, char *current_di
 #define ETYPE_NEW_FOLDER -2
 #define ETYPE_NEW_FILE   -3
 
-static int show_explorer_listing(char *listing, int *current_page_zero_based)
+/* ── Transfers ──────────────────────────────────────────────────────────── */
+
+#define TRANSFER_WORKERS 3     /* Downloads running at once */
+#define TRANSFER_POLL_MS 200   /* Status refresh while transfers are active */
+
+static xfer_manager_t g_xfer;
+static int            g_xfer_started;
+static atomic_int     g_xfer_dirty;
+
+/* Runs on a worker thread: only flag the change, the main loop draws it. */
+static void on_transfer_progress(const xfer_status_t *status, void *arg)
+{
+    (void)status;
+    (void)arg;
+    atomic_store(&g_xfer_dirty, 1);
+}
+
+/*
+ * show_transfer_status - Draw a one-line summary of the transfer queue,
+ * with size, rate and ETA of the oldest running job.
+ *
+ * @return Jobs that are queued or still running.
+ */
+static int show_transfer_status(void)
 {
-    /* ── Parse the raw listing from the server ───────────────────────── */
-    char **raw_entries = NULL;
-    int   *raw_types   = NULL;
-    int    raw_count   = parse_listing_entries(listing, &raw_entries, &raw_types);
-
-    /* ── Separate into dirs and files, sort each group alphabetically ── */
-    /* Worst case: raw_count dirs + raw_count files */
-    char **dirs      = malloc((size_t)raw_count * sizeof(*dirs));
-    char **files     = malloc((size_t)raw_count * sizeof(*files));
-    int    dir_count = 0, file_count = 0;
-
-    for (int i = 0; i < raw_count; i++)
+    if (!g_xfer_started)
+        return 0;
+
+    unsigned       total = xfer_manager_snapshot(&g_xfer, NULL, 0);
+    xfer_status_t *jobs  = total ? malloc(total * sizeof(*jobs)) : NULL;
+    if (!jobs)
+        return 0;
+    xfer_manager_snapshot(&g_xfer, jobs, total);   /* Jobs are never removed: all slots fill */
+
+    int running = 0, queued = 0, done = 0, failed = 0;
+    const xfer_status_t *shown = NULL;
+    for (unsigned i = 0; i < total; i++)
     {
-        if (raw_types && raw_types[i] == ETYPE_DIR)
-            dirs[dir_count++]   = raw_entries[i];
-        else
-            files[file_count++] = raw_entries[i];
+        switch (jobs[i].state)
+        {
+            case XFER_RUNNING: running++; if (!shown) shown = &jobs[i]; break;
+            case XFER_QUEUED:  queued++;  break;
+            case XFER_DONE:    done++;    break;
+            default:           failed++;  break;
+        }
     }
 
-    /* Simple insertion sort (directories and files are typically small lists). */
-    for (int i = 1; i < dir_count; i++) {
-        char *key = dirs[i];
-        int j = i - 1;
-        while (j >= 0 && strcasecmp(dirs[j], key) > 0) { dirs[j+1] = dirs[j]; j--; }
-        dirs[j+1] = key;
-    }
-    for (int i = 1; i < file_count; i++) {
-        char *key = files[i];
-        int j = i - 1;
-        while (j >= 0 && strcasecmp(files[j], key) > 0) { files[j+1] = files[j]; j--; }
-        files[j+1] = key;
+    char line[256];
+    int  len = snprintf(line, sizeof(line), "Transfers: %d running, %d queued, %d done, %d failed",
+                        running, queued, done, failed);
+    if (shown && len > 0 && len < (int)sizeof(line))
+    {
+        const char *name = strrchr(shown->source, '/');
+        char done_text[32], rate_text[32];
+        format_size(shown->done, done_text, sizeof(done_text));
+        format_size((uint64_t)shown->rate, rate_text, sizeof(rate_text));
+        len += snprintf(line + len, sizeof(line) - (size_t)len, " | %.40s %s",
+                        name ? name + 1 : shown->source, done_text);
+        if (shown->total && len < (int)sizeof(line))
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " (%d%%)",
+                            (int)(shown->done * 100 / shown->total));
+        if (len < (int)sizeof(line))
+            len += snprintf(line + len, sizeof(line) - (size_t)len, " %s/s", rate_text);
+        if (shown->eta >= 0 && len < (int)sizeof(line))
+            snprintf(line + len, sizeof(line) - (size_t)len, " ETA %d:%02d",
+                     (int)shown->eta / 60, (int)shown->eta % 60);
     }
 
-    /*
-     * ── Build the final display array ───────────────────────────────────
-     *
-     * Layout:
-     *   [0]              MOVE_UP       ".."
-     *   [1 .. dir_count] DIR           real directories
-     *   [dir_count+1]    NEW_FOLDER    sentinel
-     *   [dir_count+2 ..] FILE          real files
-     *   [last]           NEW_FILE      sentinel
-     */
-    int total = 1 + dir_count + 1 + file_count + 1;  /* up + dirs + new_folder + files + new_file */
-
-    char **entries = malloc((size_t)total * sizeof(*entries));
-    int   *etypes  = malloc((size_t)total * sizeof(*etypes));
-
-    int idx = 0;
-    entries[idx] = "..";               etypes[idx] = ETYPE_MOVE_UP;    idx++;
-    for (int i = 0; i < dir_count;  i++) { entries[idx] = dirs[i];  etypes[idx] = ETYPE_DIR;        idx++; }
-    entries[idx] = SENTINEL_NEW_FOLDER; etypes[idx] = ETYPE_NEW_FOLDER; idx++;
-    for (int i = 0; i < file_count; i++) { entries[idx] = files[i]; etypes[idx] = ETYPE_FILE;       idx++; }
-    entries[idx] = SENTINEL_NEW_FILE;   etypes[idx] = ETYPE_NEW_FILE;   idx++;
-
-    free(dirs);
-    free(files);
+    move(TRANSFER_ROW, 0);
+    clrtoeol();
+    mvprintw(TRANSFER_ROW, 0, "%.*s", getmaxx(stdscr), line);
+    free(jobs);
+    return running + queued;
+}
+
+/* ── Listing cache ──────────────────────────────────────────────────────── */
 
-    /* ── Layout maths ────────────────────────────────────────────────── */
+#define LIST_CACHE_BYTES   (64u << 20)  /* Memory for recently visited directories */
+#define LIST_FRESH_SECONDS 5.0          /* Younger cached copies are shown without asking the server */
+
+static list_cache_t    g_list_cache;
+static list_prefetch_t g_prefetch;
+static int             g_prefetching;
+
+/* Directory shown in the explorer, e.g. "~" or "~/src/lib". */
+static char g_current_dir[MAX_PATH_LEN + 1] = "~";
+
+/*
+ * explorer_grid - Tiles that fit on the screen: cols × rows per page.
+ */
+static int explorer_grid(int *cols_out)
+{
     int width            = getmaxx(stdscr);
     int height           = getmaxy(stdscr);
     int available_width  = width - 2;
@@ -603,7 +600,45 @@ static int show_explorer_listing(char *listing, int *current_page_zero_based)
     if (cols < 1) cols = 1;
     if (rows < 1) rows = 1;
 
-    int per_page   = cols * rows;
+    if (cols_out) *cols_out = cols;
+    return cols * rows;
+}
+
+/*
+ * Display layout.  The server sorts directories first and names ignoring
+ * case, and listing->dirs counts the leading directories, so display slots
+ * map straight onto entries without building a copy of the listing:
+ *
+ *   [0]              MOVE_UP       ".."
+ *   [1 .. dirs]      DIR           entries[slot - 1]
+ *   [dirs+1]         NEW_FOLDER    sentinel
+ *   [dirs+2 ..]      FILE          entries[slot - 2]
+ *   [last]           NEW_FILE      sentinel
+ */
+static int explorer_slot_count(const listing_t *listing)
+{
+    return (int)listing->count + 3;  /* up + entries + new_folder + new_file */
+}
+
+static int explorer_slot(const listing_t *listing, int slot, const list_entry_t **meta)
+{
+    int dir_count = (int)listing->dirs;
+
+    *meta = NULL;
+    if (slot == 0)                               return ETYPE_MOVE_UP;
+    if (slot <= dir_count)                       { *meta = &listing->entries[slot - 1]; return ETYPE_DIR; }
+    if (slot == dir_count + 1)                   return ETYPE_NEW_FOLDER;
+    if (slot < explorer_slot_count(listing) - 1) { *meta = &listing->entries[slot - 2]; return ETYPE_FILE; }
+    return ETYPE_NEW_FILE;
+}
+
+static int show_explorer_listing(const listing_t *listing, int selected, int *current_page_zero_based)
+{
+    int total = explorer_slot_count(listing);
+
+    /* ── Layout maths ────────────────────────────────────────────────── */
+    int cols;
+    int per_page   = explorer_grid(&cols);
     int page_count = (total + per_page - 1) / per_page;
 
     int page = *current_page_zero_based;
@@ -620,26 +655,36 @@ static int show_explorer_listing(char *listing, int *current_page_zero_based)
         int draw_row = LIST_TOP_ROW + (grid_row * TILE_HEIGHT);
         int draw_col = 2 + (grid_col * TILE_WIDTH);
 
+        const list_entry_t *meta;
+        int                 etype = explorer_slot(listing, start + i, &meta);
+
         enum SPRITES sprite;
-        const char  *label = entries[start + i];
+        const char  *label = meta ? meta->name : NULL;
 
-        switch (etypes[start + i])
+        switch (etype)
         {
             case ETYPE_MOVE_UP:    sprite = MOVE_UP;    label = "..";           break;
             case ETYPE_DIR:        sprite = FOLDER;     break;
             case ETYPE_NEW_FOLDER: sprite = NEW_FOLDER; label = "New Folder";   break;
-            case ETYPE_FILE:       sprite = classify_sprite(label, 0);          break;
+            case ETYPE_FILE:       sprite = classify_sprite(label, meta->is_dir); break;
             case ETYPE_NEW_FILE:   sprite = NEW_FILE;   label = "New File";     break;
             default:               sprite = GENERIC_FILE; break;
         }
 
-        draw_sprite(draw_row, draw_col, sprite, entries[start + i]);
+        draw_sprite(draw_row, draw_col, sprite, label);
+        if (start + i == selected) attron(A_REVERSE);
         mvprintw(draw_row + SPRITE_HEIGHT, draw_col, "%-20.20s", label);
+        if (start + i == selected) attroff(A_REVERSE);
+
+        /* Spare tile row: size of regular files (sent by the server). */
+        if (etype == ETYPE_FILE && !meta->is_dir)
+        {
+            char size_text[32];
+            format_size(meta->size, size_text, sizeof(size_text));
+            mvprintw(draw_row + SPRITE_HEIGHT + 1, draw_col, "%-20.20s", size_text);
+        }
     }
 
-    free(entries);
-    free(etypes);
-    free_listing_entries(raw_entries, raw_types, raw_count);
     return page_count;
 }
 
@@ -651,7 +696,153 @@ static void show_explorer_footer(void)
     for (int i = 0; i < width; ++i) addch('-');
 
     mvprintw(getmaxy(stdscr) - 1, 0,
-             "Commands: [Esc] Quit | [R] Refresh | [Left/Right] Page");
+             "Commands: [Esc] Quit | [Arrows] Select | [PgUp/PgDn] Page | [Enter] Open/Download | [Backspace] Up | [R] Refresh");
+}
+
+/* Draw the whole explorer screen; returns the page count. */
+static int show_explorer(const listing_t *listing, int selected, int *page, const char *status)
+{
+    clear();
+    int max_pages = show_explorer_listing(listing, selected, page);
+    show_explorer_header(SERVER_ADDRESS, username, g_current_dir, *page + 1, max_pages,
+                         (char *)status);
+    show_explorer_footer();
+    show_transfer_status();
+    wrefresh(stdscr);
+    return max_pages;
+}
+
+/* ── Directory loading ──────────────────────────────────────────────────── */
+
+/*
+ * State for explorer_progress() while session_list_cached() streams a
+ * directory in.  The first page is drawn as soon as it is complete, and
+ * the page header then tracks progress until the listing ends.
+ */
+struct explorer_load
+{
+    int      shown;       /* First page already on screen */
+    uint32_t next_update; /* Entry count at which to redraw */
+};
+
+static void explorer_progress(const listing_t *partial, void *arg)
+{
+    struct explorer_load *ld = arg;
+
+    /* Slots on the first page: "..", the two sentinels and the entries. */
+    uint32_t first_page = (uint32_t)explorer_grid(NULL);
+    uint32_t count      = partial->count;
+
+    if (count < partial->total && count >= ld->next_update &&
+        (ld->shown || count + 3 >= first_page))
+    {
+        char status[64];
+        int  page = 0;
+        snprintf(status, sizeof(status), "loading %u/%u entries", count, partial->total);
+        show_explorer(partial, 0, &page, status);
+        ld->shown       = 1;
+        ld->next_update = count + 4096;
+    }
+}
+
+/*
+ * queue_prefetch - Ask the prefetch thread for the parent directory and
+ * the subdirectories on the visible page, so opening one is instant.
+ */
+static void queue_prefetch(const listing_t *listing, int page)
+{
+    static char paths[LIST_PREFETCH_MAX][MAX_PATH_LEN + 1];
+    const char *queue[LIST_PREFETCH_MAX];
+    unsigned    n = 0;
+
+    if (!g_prefetching)
+        return;
+
+    int per_page = explorer_grid(NULL);
+    int total    = explorer_slot_count(listing);
+    for (int slot = page * per_page; slot < (page + 1) * per_page && slot < total &&
+                                     n < LIST_PREFETCH_MAX; slot++)
+    {
+        const list_entry_t *meta;
+        if (explorer_slot(listing, slot, &meta) != ETYPE_DIR)
+            continue;
+        int len = snprintf(paths[n], sizeof(paths[n]), "%s/%s", g_current_dir, meta->name);
+        if (len > 0 && len < (int)sizeof(paths[n]))
+        {
+            queue[n] = paths[n];
+            n++;
+        }
+    }
+
+    char *slash = strrchr(g_current_dir, '/');
+    if (slash && n < LIST_PREFETCH_MAX)
+    {
+        size_t len = (size_t)(slash - g_current_dir);
+        memcpy(paths[n], g_current_dir, len);
+        paths[n][len] = '\0';
+        queue[n] = paths[n];
+        n++;
+    }
+
+    list_prefetch_set(&g_prefetch, queue, n);
+}
+
+/*
+ * open_explorer_dir - Show `path`, from the cache when possible.
+ *
+ * A cached copy is drawn at once; unless it is younger than
+ * LIST_FRESH_SECONDS it is then revalidated (one round trip when nothing
+ * changed).  A directory that is not cached is streamed in, drawing the
+ * first page early.
+ *
+ * @param path     Directory to show; becomes g_current_dir on success.
+ * @param force    Revalidate even a fresh cached copy (Refresh).
+ * @param listing  In: the listing currently shown.  Out: the new one.
+ * @return         ERR_NONE, or the session_list_cached() error bits
+ *                 (*listing and g_current_dir are then unchanged).
+ */
+static int open_explorer_dir(const char *path, int force, const listing_t **listing)
+{
+    double           age;
+    const listing_t *found = list_cache_lookup(&g_list_cache, &g_session, path,
+                                               LIST_WANT_STAT, &age);
+    int              rc    = ERR_NONE;
+
+    if (!found || force || age > LIST_FRESH_SECONDS)
+    {
+        struct explorer_load ld = { 0 };
+        const listing_t     *fresh;
+
+        if (found && !force)
+        {
+            int page = 0;
+            show_explorer(found, 0, &page, "checking for changes");
+        }
+        rc = session_list_cached(&g_session, &g_list_cache, path, LIST_WANT_STAT,
+                                 found ? NULL : explorer_progress, &ld, &fresh);
+        if (rc == ERR_NONE)
+        {
+            list_cache_release(&g_list_cache, found);
+            found = fresh;
+        }
+        else if (found && rc == ERR_TRANSFER)
+        {
+            rc = ERR_NONE;   /* Keep showing the cached copy */
+        }
+    }
+
+    if (rc != ERR_NONE)
+    {
+        list_cache_release(&g_list_cache, found);
+        return rc;
+    }
+
+    if (path != g_current_dir)
+        snprintf(g_current_dir, sizeof(g_current_dir), "%s", path);
+    list_cache_release(&g_list_cache, *listing);
+    *listing = found;
+    queue_prefetch(found, 0);
+    return ERR_NONE;
 }
 
 /* ── Application state ──────────────────────────────────────────────────── */
@@ -664,6 +855,18 @@ int main(void)
 {
     setlocale(LC_ALL, "");
 
+    /* PAP_TLS_CA=<pem file> connects with TLS; an empty value trusts the system store. */
+    const char *tls_ca = getenv("PAP_TLS_CA");
+    if (tls_ca && tls_client_init(*tls_ca ? tls_ca : NULL) != 0)
+        return 1;
+
+    /* WAN tuning: PAP_SOCKBUF=<bytes> for SO_SNDBUF/SO_RCVBUF, PAP_CONGESTION=bbr. */
+    sock_options_t sock_opts = { 0, 0, 1, getenv("PAP_CONGESTION"), 0 };
+    const char *sockbuf = getenv("PAP_SOCKBUF");
+    if (sockbuf)
+        sock_opts.sndbuf = sock_opts.rcvbuf = atoi(sockbuf);
+    sock_set_options(&sock_opts);
+
     initscr();
     noecho();
     cbreak();
@@ -676,9 +879,11 @@ int main(void)
     bool     needs_full_redraw = true;
     char     debug_message[256] = {0};
     debug_message[0] = '\0';
-    char *listing = NULL;
+    const listing_t *listing = NULL;
     int explorer_page = 0;
-    int explorer_max_pages = 1;
+    int explorer_selected = 0;
+
+    list_cache_init(&g_list_cache, LIST_CACHE_BYTES);
 
     while (1)
     {
@@ -732,18 +937,26 @@ int main(void)
         {
             if (needs_full_redraw)
             {
-                clear();
-                explorer_max_pages = show_explorer_listing(listing, &explorer_page);
-                show_explorer_header(SERVER_ADDRESS, username, "~",
-                                     explorer_page + 1, explorer_max_pages, debug_message);
-                show_explorer_footer();
-                wrefresh(stdscr);
+                int old_page = explorer_page;
+                explorer_page = explorer_selected / explorer_grid(NULL);
+                show_explorer(listing, explorer_selected, &explorer_page, debug_message);
+                if (explorer_page != old_page)
+                    queue_prefetch(listing, explorer_page);
                 needs_full_redraw = false;
             }
+            else if (atomic_exchange(&g_xfer_dirty, 0))
+            {
+                show_transfer_status();
+                wrefresh(stdscr);
+            }
         }
 
         /* ── Input ──────────────────────────────────────────────────────── */
+        /* Poll while transfers run so their progress keeps moving. */
+        int active = (app_state == STATE_EXPLORER) && show_transfer_status() > 0;
+        timeout(active ? TRANSFER_POLL_MS : -1);
         int ch = getch();
+        if (ch == ERR) continue;
 
         if (ch == 27) break; /* Escape – quit. */
 
@@ -776,25 +989,35 @@ int main(void)
                 {
                     flush_input_to(password); /* Save password, clear slot. */
 
-                    listing = list_directory(
-                        SERVER_ADDRESS, SERVER_PORT,
-                        username, password, "~");
-
-                    debug_message[0] = '\0';
-                    if (listing)
+                    int logged_in =
+                        session_open(&g_session, SERVER_ADDRESS, SERVER_PORT,
+                                     username, password) == ERR_NONE;
+                    if (logged_in)
                     {
-                        strncat(debug_message, listing, sizeof(debug_message) - 1);
+                        session_set_compression(&g_session, COMPRESS_LEVEL);
+                        g_prefetching = list_prefetch_start(&g_prefetch, &g_list_cache, &g_session,
+                                                            LIST_WANT_STAT, LIST_FRESH_SECONDS) == 0;
+                        logged_in = open_explorer_dir("~", 0, &listing) == ERR_NONE;
+                        if (logged_in)
+                            g_xfer_started = xfer_manager_start(&g_xfer, &g_session, TRANSFER_WORKERS,
+                                                                on_transfer_progress, NULL) == 0;
                     }
 
-                    if (listing != NULL)
+                    debug_message[0] = '\0';
+                    if (logged_in)
                     {
+                        snprintf(debug_message, sizeof(debug_message), "%u entries", listing->total);
                         explorer_page     = 0;
-                        explorer_max_pages = 1;
+                        explorer_selected = 0;
                         app_state         = STATE_EXPLORER;
                         needs_full_redraw = true;
                     }
                     else
                     {
+                        if (g_prefetching)
+                            list_prefetch_stop(&g_prefetch);
+                        g_prefetching = 0;
+                        session_close(&g_session);
                         mvprintw(PASSWORD_ROW + 1, LABEL_COL,
                                  "Login failed. Press any key to retry.");
                         wrefresh(stdscr);
@@ -813,40 +1036,97 @@ int main(void)
         }
         else if (app_state == STATE_EXPLORER)
         {
-            if (ch == KEY_RIGHT)
+            int cols;
+            int per_page = explorer_grid(&cols);
+            int slots    = explorer_slot_count(listing);
+            int step     = 0;
+            const char *open_path = NULL;
+            char        path[MAX_PATH_LEN + 1];
+
+            if      (ch == KEY_RIGHT) step = 1;
+            else if (ch == KEY_LEFT)  step = -1;
+            else if (ch == KEY_DOWN)  step = cols;
+            else if (ch == KEY_UP)    step = -cols;
+            else if (ch == KEY_NPAGE) step = per_page;
+            else if (ch == KEY_PPAGE) step = -per_page;
+
+            if (step != 0)
             {
-                if (explorer_page + 1 < explorer_max_pages)
+                int target = explorer_selected + step;
+                if (target >= slots) target = slots - 1;
+                if (target < 0)      target = 0;
+                if (target != explorer_selected)
                 {
-                    explorer_page++;
+                    explorer_selected = target;
                     needs_full_redraw = true;
                 }
             }
-            else if (ch == KEY_LEFT)
+            else if (ch == '\n')
             {
-                if (explorer_page > 0)
+                const list_entry_t *meta;
+                int etype = explorer_slot(listing, explorer_selected, &meta);
+
+                if (etype == ETYPE_DIR &&
+                    snprintf(path, sizeof(path), "%s/%s", g_current_dir, meta->name) < (int)sizeof(path))
+                    open_path = path;
+                else if (etype == ETYPE_MOVE_UP)
+                    ch = KEY_BACKSPACE;
+                else if (etype == ETYPE_FILE && g_xfer_started)
                 {
-                    explorer_page--;
-                    needs_full_redraw = true;
+                    char out_dir[MAX_PATH_LEN + 1];
+                    if (snprintf(path, sizeof(path), "%s/%s", g_current_dir, meta->name) < (int)sizeof(path) &&
+                        get_default_download_dir(out_dir, sizeof(out_dir)) &&
+                        xfer_enqueue_download(&g_xfer, path, out_dir) > 0)
+                    {
+                        show_transfer_status();
+                        wrefresh(stdscr);
+                    }
                 }
             }
             else if (ch == 'r' || ch == 'R')
             {
-                char *new_listing = list_directory(
-                    SERVER_ADDRESS, SERVER_PORT,
-                    username, password, "~");
+                if (open_explorer_dir(g_current_dir, 1, &listing) == ERR_NONE)
+                {
+                    if (explorer_selected >= explorer_slot_count(listing))
+                        explorer_selected = 0;
+                    snprintf(debug_message, sizeof(debug_message), "%u entries", listing->total);
+                }
+                needs_full_redraw = true;
+            }
 
-                if (new_listing)
+            /* Leave the directory: "~/a/b" → "~/a"; "~" itself has no parent here. */
+            char *slash = strrchr(g_current_dir, '/');
+            if ((ch == KEY_BACKSPACE || ch == 127 || ch == '\b') && slash)
+            {
+                memcpy(path, g_current_dir, (size_t)(slash - g_current_dir));
+                path[slash - g_current_dir] = '\0';
+                open_path = path;
+            }
+
+            if (open_path)
+            {
+                if (open_explorer_dir(open_path, 0, &listing) == ERR_NONE)
                 {
-                    free(listing);
-                    listing = new_listing;
-                    explorer_page = 0;
-                    needs_full_redraw = true;
+                    explorer_selected = 0;
+                    explorer_page     = 0;
+                    snprintf(debug_message, sizeof(debug_message), "%u entries", listing->total);
+                }
+                else
+                {
+                    snprintf(debug_message, sizeof(debug_message), "cannot open %.200s", open_path);
                 }
+                needs_full_redraw = true;
             }
         }
     }
 
-    free(listing);
+    if (g_xfer_started)
+        xfer_manager_stop(&g_xfer);   /* Lets running downloads finish */
+    if (g_prefetching)
+        list_prefetch_stop(&g_prefetch);
+    list_cache_release(&g_list_cache, listing);
+    list_cache_destroy(&g_list_cache);
+    session_close(&g_session);
     endwin();
     return 0;
 }
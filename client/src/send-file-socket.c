@@ -10,14 +10,17 @@
  * Protocol overview:
  *   1. Client sends UNLOCK_SIGNAL (0x01)
  *   2. Client sends username (4-byte big-endian length prefix + UTF-8 bytes)
- *   3. Client sends mode byte: 'D' (download), 'U' (upload), or 'L' (list)
- *   4. Mode-specific framing follows (see individual function docs)
+ *   3. Client authenticates (crypt setting / hash exchange)
+ *   4. Client sends mode byte: 'D' (download), 'U' (upload), 'L' (list),
+ *      'X' (paged list with metadata), 'R' (directory tree), or 'S'
+ *      (persistent session, see session_open())
+ *   5. Mode-specific framing follows (see individual function docs)
  *
  * All strings returned by list_directory() are heap-allocated and must be
  * freed by the caller.
  *
  * Compile example (Linux/macOS):
- *   gcc -Wall -Wextra -o send_file_socket send_file_socket.c
+ *   gcc -Wall -Wextra -pthread -o send_file_socket send_file_socket.c -lz -lssl -lcrypto
  *
  * Windows note: Link against ws2_32 (-lws2_32) and call WSAStartup/WSACleanup
  * around program entry/exit.
@@ -27,6 +30,9 @@
 	#ifndef _POSIX_C_SOURCE
 		#define _POSIX_C_SOURCE 200809L
 	#endif
+	#ifndef _DEFAULT_SOURCE
+		#define _DEFAULT_SOURCE 1   /* TCP_CORK, TCP_CONGESTION */
+	#endif
 #endif
 
 #include <stdio.h>
@@ -34,40 +40,91 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <zlib.h>
 
 #ifdef _WIN32
   #include <winsock2.h>
   #include <ws2tcpip.h>
   #include <windows.h>
   #include <shlobj.h>          /* SHGetFolderPathA */
+  #define strcasecmp _stricmp
   typedef SOCKET sock_t;
   #define CLOSE_SOCK(s) closesocket(s)
   #define SOCK_INVALID  INVALID_SOCKET
 #else
   #include <unistd.h>
+  #include <strings.h>         /* strcasecmp */
   #include <sys/types.h>
 	#include <sys/time.h>
   #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>     /* TCP_NODELAY, TCP_CORK, ... */
   #include <netdb.h>
   #include <pwd.h>
 	#include <crypt.h>
   #include <sys/stat.h>
+  #include <fcntl.h>           /* posix_fallocate */
+  #include <pthread.h>
+  #include <time.h>            /* clock_gettime */
+  #include <limits.h>          /* INT_MAX */
+  #include <openssl/err.h>
+  #include <openssl/ssl.h>
   typedef int sock_t;
-  #define CLOSE_SOCK(s) close(s)
+  #define CLOSE_SOCK(s) sock_close(s)
   #define SOCK_INVALID  (-1)
+  static void sock_close(sock_t fd);
+#endif
+
+/* Report a dropped connection as a send() error instead of raising SIGPIPE. */
+#ifdef MSG_NOSIGNAL
+  #define SEND_FLAGS MSG_NOSIGNAL
+#else
+  #define SEND_FLAGS 0
 #endif
 
 /* ── Protocol constants ──────────────────────────────────────────────────── */
 
 #define BUFFER_SIZE     4096
 #define UNLOCK_SIGNAL   "\x01"
+#define UNLOCK_TOKEN    0x02   /* Unlock + username + resumption token     */
+#define AUTH_PASSWORD   0x02   /* Token refused; crypt exchange follows    */
 #define MODE_DOWNLOAD   'D'
 #define MODE_UPLOAD     'U'
+#define MODE_DOWNLOAD_FRAMED 'd'
+#define MODE_UPLOAD_FRAMED   'u'
+#define MODE_DOWNLOAD_Z 'C'
+#define MODE_UPLOAD_Z   'P'
+#define MODE_DOWNLOAD_SUM 'H'   /* 'C' plus a CRC-32C trailer */
+#define MODE_CHECKSUM   'K'
+#define MODE_RANGE      'G'
+#define MODE_TREE       'R'
+#define MODE_LIST_EX    'X'
+#define MODE_LIST_COND  'W'   /* 'X' unless the client's token is still current */
 #define MODE_LIST       'L'
+#define MODE_METRICS    'M'
+#define MODE_SESSION    'S'
+#define MODE_QUIT       'Q'
 
 /* Maximum length (bytes) of any path or filename sent over the wire. */
 #define MAX_PATH_LEN    4096
 
+/* Framed size header value meaning "chunked frames follow" ('d'/'u' modes). */
+#define FRAMED_SIZE_CHUNKED UINT64_MAX
+
+/* Range length meaning "up to the end of the file" ('G' mode). */
+#define RANGE_TO_END UINT64_MAX
+
+/* Encoding byte of a 'C'/'P' transfer. */
+#define ENCODING_NONE    0x00   /* Same data as a 'd'/'u' transfer        */
+#define ENCODING_DEFLATE 0x01   /* zlib stream carried in chunked frames  */
+
+/* Buffer for each side of the (de)compressor. */
+#define COMPRESS_BUF_SIZE (64 * 1024)
+
+/* receive_file_framed() flags */
+#define FRAMED_ENCODED  0x01   /* An encoding byte follows the size ('C', 'H') */
+#define FRAMED_CHECKED  0x02   /* A 4-byte CRC-32C follows the data ('H')      */
+
 /*
  * Bitmask error codes returned by the high-level API functions.
  *
@@ -93,6 +150,15 @@
 #define ERR_TRANSFER    64   /* upload_file() / receive_file() failed      */
 #define ERR_AUTH       128   /* authentication failed                       */
 
+/*
+ * Result of one command sent over a persistent session connection.
+ * CMD_REFUSED means the server answered STATUS_ERROR and the connection is
+ * still in sync; CMD_IO_ERROR means it is broken and must be reopened.
+ */
+#define CMD_OK           0
+#define CMD_REFUSED      1
+#define CMD_IO_ERROR   (-1)
+
 /* ── Internal helpers ────────────────────────────────────────────────────── */
 
 /**
@@ -180,12 +246,429 @@ static uint32_t be_to_uint32(const unsigned char buf[4])
 		 |  (uint32_t)buf[3];
 }
 
+/**
+ * uint64_to_be - Encode a uint64 as an 8-byte big-endian buffer.
+ *
+ * @param value  Value to encode.
+ * @param buf    Output buffer (must be at least 8 bytes).
+ */
+static void uint64_to_be(uint64_t value, unsigned char buf[8])
+{
+	for (int i = 7; i >= 0; i--) {
+		buf[i] = (unsigned char)(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+/**
+ * be_to_uint64 - Decode an 8-byte big-endian buffer to uint64.
+ *
+ * @param buf  Input buffer (must be at least 8 bytes).
+ * @return     Decoded value.
+ */
+static uint64_t be_to_uint64(const unsigned char buf[8])
+{
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++)
+		value = (value << 8) | buf[i];
+	return value;
+}
+
+/**
+ * local_file_size - Return the size of an open stdio file, leaving the file
+ *                   position at the start.
+ *
+ * @param fp    Open file.
+ * @param size  Output: file size in bytes.
+ * @return      0 on success, -1 on error.
+ */
+static int local_file_size(FILE *fp, uint64_t *size)
+{
+#ifdef _WIN32
+	if (_fseeki64(fp, 0, SEEK_END) != 0)
+		return -1;
+	__int64 end = _ftelli64(fp);
+	if (end < 0 || _fseeki64(fp, 0, SEEK_SET) != 0)
+		return -1;
+#else
+	if (fseeko(fp, 0, SEEK_END) != 0)
+		return -1;
+	off_t end = ftello(fp);
+	if (end < 0 || fseeko(fp, 0, SEEK_SET) != 0)
+		return -1;
+#endif
+	*size = (uint64_t)end;
+	return 0;
+}
+
+/**
+ * seek_file - Position an open stdio file at an absolute 64-bit offset.
+ *
+ * @param fp      Open file.
+ * @param offset  Byte offset from the start of the file.
+ * @return        0 on success, -1 on error.
+ */
+static int seek_file(FILE *fp, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(fp, (__int64)offset, SEEK_SET) == 0 ? 0 : -1;
+#else
+	return fseeko(fp, (off_t)offset, SEEK_SET) == 0 ? 0 : -1;
+#endif
+}
+
+/**
+ * crc32c_sw - Portable CRC-32C, one nibble-table lookup per 4 bits.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	static const uint32_t nibble[16] = {
+		0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+		0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9, 0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75,
+	};
+	while (len-- > 0) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ nibble[crc & 0x0f];
+		crc = (crc >> 4) ^ nibble[crc & 0x0f];
+	}
+	return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW 1
+
+/**
+ * crc32c_hw - CRC-32C with the SSE4.2 crc32 instruction, 8 bytes per step.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc;
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	return (uint32_t)c;
+}
+#endif
+
+/**
+ * crc32c_update - Extend a CRC-32C (Castagnoli) over more bytes.
+ *
+ * Same checksum the server puts in 'H' trailers and 'K' replies. Start
+ * from 0 and chain like zlib's crc32(). Uses SSE4.2 when the CPU has it.
+ *
+ * @param crc   0, or the result for the preceding bytes.
+ * @param data  Bytes to add.
+ * @param len   Number of bytes.
+ * @return      CRC-32C of everything so far.
+ */
+static uint32_t crc32c_update(uint32_t crc, const void *data, size_t len)
+{
+#ifdef HAVE_CRC32C_HW
+	if (__builtin_cpu_supports("sse4.2"))
+		return ~crc32c_hw(~crc, data, len);
+#endif
+	return ~crc32c_sw(~crc, data, len);
+}
+
+/* ── TLS ─────────────────────────────────────────────────────────────────── */
+
+#ifndef _WIN32
+
+#define TLS_MAX_FD 4096   /* Sockets with a descriptor above this can't use TLS */
+
+static SSL_CTX    *g_tls_ctx;
+static BIO_METHOD *g_tls_bio;
+
+/*
+ * TLS state of each socket descriptor, NULL for plaintext connections.
+ * A slot is only touched by the thread that owns the socket.
+ */
+static SSL *g_tls_conn[TLS_MAX_FD];
+
+/*
+ * OpenSSL's own socket BIO writes with write(), which raises SIGPIPE on a
+ * dropped connection; this one uses send() with SEND_FLAGS like send_all().
+ */
+static int tls_bio_write(BIO *b, const char *data, size_t len, size_t *written)
+{
+	ssize_t n = send((int)(intptr_t)BIO_get_data(b), data, len, SEND_FLAGS);
+	if (n <= 0)
+		return 0;
+	*written = (size_t)n;
+	return 1;
+}
+
+static int tls_bio_read(BIO *b, char *data, size_t len, size_t *readbytes)
+{
+	ssize_t n = recv((int)(intptr_t)BIO_get_data(b), data, len, 0);
+	if (n <= 0)
+		return 0;
+	*readbytes = (size_t)n;
+	return 1;
+}
+
+static long tls_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+	(void)b; (void)num; (void)ptr;
+	return cmd == BIO_CTRL_FLUSH;
+}
+
+/**
+ * tls_client_init - Wrap every connection create_socket() opens in TLS.
+ *
+ * The server has to be started with -T.  Only TLS 1.3 is offered, and the
+ * server certificate must chain to ca_file (a PEM bundle; NULL uses the
+ * system trust store) and match the host name or IP address passed to
+ * create_socket().  Call it before opening any connection.
+ *
+ * @param ca_file  Trusted CA certificates, or NULL.
+ * @return         0 on success, -1 if the certificates could not be loaded.
+ */
+int tls_client_init(const char *ca_file)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx)
+		return -1;
+	SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+	int ok = ca_file ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL)
+	                 : SSL_CTX_set_default_verify_paths(ctx);
+	if (ok != 1) {
+		fprintf(stderr, "tls_client_init: cannot load CA certificates from '%s'\n",
+		        ca_file ? ca_file : "the system store");
+		ERR_clear_error();
+		SSL_CTX_free(ctx);
+		return -1;
+	}
+
+	if (!g_tls_bio) {
+		g_tls_bio = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "pap socket");
+		if (!g_tls_bio) {
+			SSL_CTX_free(ctx);
+			return -1;
+		}
+		BIO_meth_set_write_ex(g_tls_bio, tls_bio_write);
+		BIO_meth_set_read_ex(g_tls_bio, tls_bio_read);
+		BIO_meth_set_ctrl(g_tls_bio, tls_bio_ctrl);
+	}
+
+	SSL_CTX_free(g_tls_ctx);
+	g_tls_ctx = ctx;
+	return 0;
+}
+
+static SSL *tls_conn(sock_t fd)
+{
+	return (fd >= 0 && fd < TLS_MAX_FD) ? g_tls_conn[fd] : NULL;
+}
+
+/**
+ * tls_connect - Run the client handshake on a freshly connected socket.
+ *
+ * @param fd    Connected socket.
+ * @param host  Name or address the certificate has to match.
+ * @return      0 when the connection is encrypted, -1 on failure (reason
+ *              printed to stderr).
+ */
+static int tls_connect(sock_t fd, const char *host)
+{
+	if (fd >= TLS_MAX_FD)
+		return -1;
+	SSL *ssl = SSL_new(g_tls_ctx);
+	BIO *bio = BIO_new(g_tls_bio);
+	if (!ssl || !bio) {
+		BIO_free(bio);
+		SSL_free(ssl);
+		return -1;
+	}
+	BIO_set_data(bio, (void *)(intptr_t)fd);
+	BIO_set_init(bio, 1);
+	SSL_set_bio(ssl, bio, bio);
+
+	/* IP literals are checked against the certificate's IP SANs. */
+	if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host) != 1) {
+		ERR_clear_error();
+		SSL_set_tlsext_host_name(ssl, host);
+		SSL_set1_host(ssl, host);
+	}
+
+	if (SSL_connect(ssl) != 1) {
+		char reason[256];
+		long verify = SSL_get_verify_result(ssl);
+		unsigned long err = ERR_get_error();
+		if (verify != X509_V_OK)
+			snprintf(reason, sizeof(reason), "%s", X509_verify_cert_error_string(verify));
+		else if (err)
+			ERR_error_string_n(err, reason, sizeof(reason));
+		else
+			snprintf(reason, sizeof(reason), "connection closed");
+		fprintf(stderr, "create_socket: TLS handshake with %s failed: %s\n", host, reason);
+		ERR_clear_error();
+		SSL_free(ssl);
+		return -1;
+	}
+	g_tls_conn[fd] = ssl;
+	return 0;
+}
+
+/* recv() for one call, decrypting when the socket uses TLS. */
+static ssize_t sock_recv(sock_t fd, void *buf, size_t len)
+{
+	SSL *ssl = tls_conn(fd);
+	if (!ssl)
+		return recv(fd, buf, len, 0);
+
+	int n = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+	if (n > 0)
+		return n;
+	int err = SSL_get_error(ssl, n);
+	ERR_clear_error();
+	return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;   /* 0 = server sent close_notify */
+}
+
+/* send() for one call, encrypting when the socket uses TLS. */
+static ssize_t sock_send(sock_t fd, const void *buf, size_t len)
+{
+	SSL *ssl = tls_conn(fd);
+	if (!ssl)
+		return send(fd, buf, len, SEND_FLAGS);
+
+	int n = SSL_write(ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+	if (n > 0)
+		return n;
+	ERR_clear_error();
+	return -1;
+}
+
+/* CLOSE_SOCK(): end the TLS session, if any, and close the socket. */
+static void sock_close(sock_t fd)
+{
+	SSL *ssl = tls_conn(fd);
+	if (ssl) {
+		g_tls_conn[fd] = NULL;
+		SSL_shutdown(ssl);   /* close_notify, so the server sees a clean end */
+		ERR_clear_error();
+		SSL_free(ssl);
+	}
+	close(fd);
+}
+
+#else
+
+int tls_client_init(const char *ca_file)
+{
+	(void)ca_file;
+	fprintf(stderr, "tls_client_init: TLS is not available in the Windows build\n");
+	return -1;
+}
+
+#endif
+
 /* ── Core socket primitives ──────────────────────────────────────────────── */
 
+/*
+ * TCP settings create_socket() applies to every new connection.  The
+ * defaults suit a LAN: kernel buffer autotuning and TCP_NODELAY, because the
+ * protocol is a series of small request/reply exchanges that Nagle would
+ * stall on delayed ACKs.  Bulk upload data is sent corked (sock_cork()).
+ */
+typedef struct {
+	int         sndbuf;       /* SO_SNDBUF bytes, 0 = kernel autotuning  */
+	int         rcvbuf;       /* SO_RCVBUF bytes, 0 = kernel autotuning  */
+	int         nodelay;      /* 1 = TCP_NODELAY + TCP_CORK for uploads  */
+	const char *congestion;   /* TCP_CONGESTION (Linux), NULL = default  */
+	int         fastopen;     /* 1 = TCP_FASTOPEN_CONNECT (Linux)        */
+} sock_options_t;
+
+static sock_options_t g_sock_opts = { 0, 0, 1, NULL, 0 };
+static char g_sock_congestion[16];   /* TCP_CA_NAME_MAX */
+
+/**
+ * sock_set_options - Set the TCP options used for connections opened from now on.
+ *
+ * For a high bandwidth-delay WAN link, raise sndbuf/rcvbuf to at least the
+ * path's bandwidth × RTT and pick a model-based congestion control such as
+ * "bbr".  Not thread-safe against concurrent create_socket() calls.
+ *
+ * @param o  New settings (copied).
+ * @return   0, or -1 if the congestion control name is too long.
+ */
+int sock_set_options(const sock_options_t *o)
+{
+	if (o->congestion && strlen(o->congestion) >= sizeof(g_sock_congestion))
+		return -1;
+	g_sock_opts = *o;
+	if (o->congestion) {
+		strcpy(g_sock_congestion, o->congestion);
+		g_sock_opts.congestion = g_sock_congestion;
+	}
+	return 0;
+}
+
+static void set_sock_int(sock_t fd, int level, int name, int value)
+{
+	setsockopt(fd, level, name, (const char *)&value, sizeof(value));
+}
+
+/*
+ * Apply g_sock_opts before connect(): buffer sizes must be in place for the
+ * window scale in the SYN, and Fast Open changes how connect() works.
+ * Failures just leave the kernel default.
+ */
+static void tune_socket(sock_t fd)
+{
+	if (g_sock_opts.sndbuf > 0)
+		set_sock_int(fd, SOL_SOCKET, SO_SNDBUF, g_sock_opts.sndbuf);
+	if (g_sock_opts.rcvbuf > 0)
+		set_sock_int(fd, SOL_SOCKET, SO_RCVBUF, g_sock_opts.rcvbuf);
+	if (g_sock_opts.nodelay)
+		set_sock_int(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+#ifdef TCP_CONGESTION
+	if (g_sock_opts.congestion &&
+	    setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, g_sock_opts.congestion,
+	               (socklen_t)strlen(g_sock_opts.congestion)) != 0)
+		fprintf(stderr, "create_socket: congestion control '%s' unavailable, using the default\n",
+		        g_sock_opts.congestion);
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+	/* The first send() (unlock byte or ClientHello) rides in the SYN once
+	 * the client holds a Fast Open cookie for the server. */
+	if (g_sock_opts.fastopen)
+		set_sock_int(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+#endif
+}
+
+/**
+ * sock_cork - Hold back partial segments while streaming bulk data (on = 1).
+ *
+ * Uncorking sends whatever is queued at once.  Only used with TCP_NODELAY;
+ * without it Nagle coalesces the writes anyway.
+ */
+static void sock_cork(sock_t fd, int on)
+{
+#ifdef TCP_CORK
+	if (g_sock_opts.nodelay)
+		set_sock_int(fd, IPPROTO_TCP, TCP_CORK, on);
+#else
+	(void)fd; (void)on;
+#endif
+}
+
 /**
  * create_socket - Open a TCP connection to host:port with a 10-second timeout.
  *
  * Uses getaddrinfo so both IPv4 and IPv6 addresses are resolved transparently.
+ * TCP options come from sock_set_options().
+ * After tls_client_init() the connection is also put through a TLS handshake.
  *
  * @param host  Hostname or IP address string.
  * @param port  Port number as a string (e.g. "9000").
@@ -218,9 +701,18 @@ sock_t create_socket(const char *host, const char *port)
 		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 #endif
+		tune_socket(fd);
 
-		if (connect(fd, rp->ai_addr, (socklen_t)rp->ai_addrlen) == 0)
+		if (connect(fd, rp->ai_addr, (socklen_t)rp->ai_addrlen) == 0) {
+#ifndef _WIN32
+			if (g_tls_ctx && tls_connect(fd, host) != 0) {
+				CLOSE_SOCK(fd);
+				fd = SOCK_INVALID;
+				break;      /* A failed handshake won't succeed on another address */
+			}
+#endif
 			break;          /* Success */
+		}
 
 		CLOSE_SOCK(fd);
 		fd = SOCK_INVALID;
@@ -247,7 +739,7 @@ int recv_exact(sock_t sock, unsigned char *buf, size_t length)
 #ifdef _WIN32
 		int n = recv(sock, (char *)(buf + received), (int)(length - received), 0);
 #else
-		ssize_t n = recv(sock, buf + received, length - received, 0);
+		ssize_t n = sock_recv(sock, buf + received, length - received);
 #endif
 		if (n <= 0)
 			return -1;   /* Connection closed or error */
@@ -271,7 +763,7 @@ static int send_all(sock_t sock, const unsigned char *buf, size_t length)
 #ifdef _WIN32
 		int n = send(sock, (const char *)(buf + sent), (int)(length - sent), 0);
 #else
-		ssize_t n = send(sock, buf + sent, length - sent, 0);
+		ssize_t n = sock_send(sock, buf + sent, length - sent);
 #endif
 		if (n <= 0)
 			return -1;
@@ -400,9 +892,17 @@ static int authenticate_with_server(sock_t sock, const char *password)
 		fprintf(stderr, "authenticate: failed to receive crypt setting\n");
 		return -1;
 	}
-	char *hashed = crypt(password, setting);
+	/* crypt() returns a static buffer; copy it out before another thread logs in. */
+	static pthread_mutex_t crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+	char hashed[512];
+	pthread_mutex_lock(&crypt_lock);
+	char *result = crypt(password, setting);
+	int ok = result && strlen(result) < sizeof(hashed);
+	if (ok)
+		strcpy(hashed, result);
+	pthread_mutex_unlock(&crypt_lock);
 	free(setting);
-	if (!hashed) {
+	if (!ok) {
 		fprintf(stderr, "authenticate: crypt() failed\n");
 		return -1;
 	}
@@ -426,69 +926,347 @@ static int authenticate_with_server(sock_t sock, const char *password)
 #endif
 }
 
-/* ── File transfer ───────────────────────────────────────────────────────── */
+/* ── Login and resumption tokens ─────────────────────────────────────── */
 
-/**
- * receive_file - Receive a file from the server and write it to output_dir.
- *
- * Wire format received from server:
- *   [1 byte status: 0x00 = OK]
- *   [4 bytes big-endian filename length]
- *   [filename bytes]
- *   [raw file data until connection close]
+/*
+ * After a password login the server may hand out a short-lived token
+ * (server -k). Presenting it on the next connection to the same server as
+ * the same user skips the crypt() exchange, whose cost is set by the hash
+ * algorithm and can reach hundreds of milliseconds: the whole login is then
+ * one round trip. Tokens are opaque bearer credentials and live only in
+ * this process. Each entry also holds a digest of the password that earned
+ * it, so a login with a different password never rides on someone else's
+ * token.
  *
- * @param sock        Connected socket, positioned after the mode byte.
- * @param output_dir  Local directory to write the file into.
- * @param out_path    Buffer to store the resulting file path (at least
- *                    MAX_PATH_LEN + 1 bytes).
- * @return            0 on success, -1 on error.
+ * Servers without token support drop a connection that opens with 0x02;
+ * the entry then remembers the server as legacy and plain 0x01 logins are
+ * used from then on.
  */
-int receive_file(sock_t sock, const char *output_dir, char *out_path)
+#ifndef _WIN32
+
+#define TOKEN_CACHE_SLOTS 16
+#define TOKEN_MAX        256
+
+typedef struct {
+	char          host[256];
+	char          port[16];
+	char          username[256];
+	unsigned char pass_digest[32];   /* SHA-256 of the password that earned it */
+	unsigned char token[TOKEN_MAX];
+	uint32_t      token_len;         /* 0 = none (yet)                         */
+	int           legacy;            /* Server dropped the 0x02 unlock         */
+	uint64_t      used;              /* LRU tick, 0 = free slot                */
+} token_slot_t;
+
+static pthread_mutex_t g_token_lock = PTHREAD_MUTEX_INITIALIZER;
+static token_slot_t    g_tokens[TOKEN_CACHE_SLOTS];
+static uint64_t        g_token_tick;
+
+/* Caller holds g_token_lock. Returns the slot for host/port/user, or with
+ * create set the least recently used slot, reset to that key. */
+static token_slot_t *token_slot(const char *host, const char *port,
+                                const char *username, int create)
 {
-	unsigned char status;
-	if (recv_exact(sock, &status, 1) != 0 || status != 0x00) {
-		fprintf(stderr, "receive_file: server reported error\n");
-		return -1;
+	token_slot_t *lru = &g_tokens[0];
+	for (int i = 0; i < TOKEN_CACHE_SLOTS; i++) {
+		token_slot_t *t = &g_tokens[i];
+		if (t->used && strcmp(t->host, host) == 0 && strcmp(t->port, port) == 0 &&
+		    strcmp(t->username, username) == 0) {
+			t->used = ++g_token_tick;
+			return t;
+		}
+		if (t->used < lru->used)
+			lru = t;
 	}
+	if (!create || strlen(host) >= sizeof(lru->host) || strlen(port) >= sizeof(lru->port) ||
+	    strlen(username) >= sizeof(lru->username))
+		return NULL;
 
-	unsigned char len_buf[4];
-	if (recv_exact(sock, len_buf, 4) != 0) {
-		fprintf(stderr, "receive_file: failed to read filename length\n");
-		return -1;
-	}
-	uint32_t name_len = be_to_uint32(len_buf);
-	if (name_len == 0 || name_len > MAX_PATH_LEN) {
-		fprintf(stderr, "receive_file: invalid filename length %u\n", name_len);
-		return -1;
-	}
+	OPENSSL_cleanse(lru, sizeof(*lru));
+	strcpy(lru->host, host);
+	strcpy(lru->port, port);
+	strcpy(lru->username, username);
+	lru->used = ++g_token_tick;
+	return lru;
+}
 
-	char filename[MAX_PATH_LEN + 1];
-	if (recv_exact(sock, (unsigned char *)filename, name_len) != 0) {
-		fprintf(stderr, "receive_file: failed to read filename\n");
-		return -1;
+static void password_digest(const char *password, unsigned char out[32])
+{
+	unsigned int len = 32;
+	if (EVP_Digest(password, strlen(password), out, &len, EVP_sha256(), NULL) != 1)
+		memset(out, 0, 32);   /* Never matches a stored digest of a real password */
+}
+
+/*
+ * token_lookup - Copy the cached token for a login (len 0 if none).
+ * @return  1 if the server is known not to support tokens, else 0.
+ */
+static int token_lookup(const char *host, const char *port, const char *username,
+                        const unsigned char digest[32], unsigned char *token, uint32_t *len)
+{
+	int legacy = 0;
+	*len = 0;
+	pthread_mutex_lock(&g_token_lock);
+	token_slot_t *t = token_slot(host, port, username, 0);
+	if (t) {
+		legacy = t->legacy;
+		if (t->token_len && CRYPTO_memcmp(t->pass_digest, digest, 32) == 0) {
+			memcpy(token, t->token, t->token_len);
+			*len = t->token_len;
+		}
 	}
-	filename[name_len] = '\0';
+	pthread_mutex_unlock(&g_token_lock);
+	return legacy;
+}
 
-	if (make_dirs(output_dir) != 0) {
-		fprintf(stderr, "receive_file: cannot create output directory '%s'\n", output_dir);
-		return -1;
+/* Store a token (len 0 forgets it), or mark the server legacy. */
+static void token_store(const char *host, const char *port, const char *username,
+                        const unsigned char digest[32], const unsigned char *token,
+                        uint32_t len, int legacy)
+{
+	pthread_mutex_lock(&g_token_lock);
+	token_slot_t *t = token_slot(host, port, username, 1);
+	if (t) {
+		OPENSSL_cleanse(t->token, sizeof(t->token));
+		memcpy(t->pass_digest, digest, 32);
+		if (len)
+			memcpy(t->token, token, len);
+		t->token_len = len;
+		t->legacy    = legacy;
 	}
+	pthread_mutex_unlock(&g_token_lock);
+}
 
-	size_t dir_len  = strlen(output_dir);
-	size_t file_len = strlen(filename);
+/*
+ * login_with_token - Token-capable login on a fresh connection.
+ *
+ * Sends 0x02, the username and the cached token (possibly empty) in one
+ * write. The server answers STATUS_OK if it accepts the token, otherwise
+ * AUTH_PASSWORD followed by the usual crypt exchange and a new token.
+ *
+ * @return  ERR_NONE, ERR_UNLOCK if the server dropped the connection
+ *          before answering (no token support), ERR_PATH or ERR_AUTH.
+ */
+static int login_with_token(sock_t sock, const char *username, const char *password,
+                            const unsigned char *token, uint32_t token_len,
+                            unsigned char *issued, uint32_t *issued_len)
+{
+	size_t ulen = strlen(username);
+	if (ulen == 0 || ulen > MAX_PATH_LEN)
+		return ERR_PATH;
 
-	if (dir_len + 1 + file_len >= MAX_PATH_LEN + 1) {
-	    fprintf(stderr, "receive_file: combined path too long\n");
-	    return -1;
-	}
+	unsigned char flight[1 + 4 + MAX_PATH_LEN + 4 + TOKEN_MAX];
+	size_t off = 0;
+	flight[off++] = UNLOCK_TOKEN;
+	uint32_t be = htonl((uint32_t)ulen);
+	memcpy(flight + off, &be, 4);
+	memcpy(flight + off + 4, username, ulen);
+	off += 4 + ulen;
+	be = htonl(token_len);
+	memcpy(flight + off, &be, 4);
+	memcpy(flight + off + 4, token, token_len);
+	off += 4 + token_len;
+	int sent = send_all(sock, flight, off);
+	OPENSSL_cleanse(flight, off);
+	if (sent != 0)
+		return ERR_UNLOCK;
 
-	memcpy(out_path, output_dir, dir_len);
-	out_path[dir_len] = '/';
-	memcpy(out_path + dir_len + 1, filename, file_len + 1);  /* +1 copies the null terminator */
+	unsigned char reply;
+	*issued_len = 0;
+	if (recv_exact(sock, &reply, 1) != 0)
+		return ERR_UNLOCK;
+	if (reply == 0x00)
+		return ERR_NONE;
+	if (reply != AUTH_PASSWORD)
+		return ERR_AUTH;
 
-	FILE *fp = fopen(out_path, "wb");
-	if (!fp) {
-		fprintf(stderr, "receive_file: cannot open '%s' for writing\n", out_path);
+	if (authenticate_with_server(sock, password) != 0)
+		return ERR_AUTH;
+	if (recv_exact(sock, flight, 4) != 0)
+		return ERR_AUTH;
+	memcpy(&be, flight, 4);
+	uint32_t len = ntohl(be);
+	if (len > TOKEN_MAX || (len && recv_exact(sock, issued, len) != 0))
+		return ERR_AUTH;
+	*issued_len = len;
+	return ERR_NONE;
+}
+
+#endif /* !_WIN32 */
+
+/* The original login: 0x01, username, crypt exchange. */
+static int login_plain(sock_t sock, const char *username, const char *password)
+{
+	if (send_unlock(sock) != 0)
+		return ERR_UNLOCK;
+	if (send_path(sock, username) != 0)
+		return ERR_PATH;
+	if (authenticate_with_server(sock, password) != 0)
+		return ERR_AUTH;
+	return ERR_NONE;
+}
+
+/**
+ * login_to_server - Unlock, send the username and authenticate.
+ *
+ * Uses a cached resumption token when there is one (see above). If the
+ * server turns out not to support tokens, *sock is closed and replaced by a
+ * new connection on which the plain 0x01 login runs.
+ *
+ * @param sock      In/out: fresh connection from create_socket(host, port).
+ * @param host      Server the connection was opened to (token cache key).
+ * @param port      Its port.
+ * @param username  Username sent to the server.
+ * @param password  Plaintext password.
+ * @return          ERR_NONE, or one of ERR_CONNECT (reconnect failed),
+ *                  ERR_UNLOCK, ERR_PATH or ERR_AUTH.
+ */
+static int login_to_server(sock_t *sock, const char *host, const char *port,
+                           const char *username, const char *password)
+{
+#ifndef _WIN32
+	unsigned char digest[32], token[TOKEN_MAX], issued[TOKEN_MAX];
+	uint32_t token_len, issued_len;
+	password_digest(password ? password : "", digest);
+
+	if (!token_lookup(host, port, username, digest, token, &token_len)) {
+		int rc = login_with_token(*sock, username, password, token, token_len,
+		                          issued, &issued_len);
+		OPENSSL_cleanse(token, sizeof(token));
+		if (rc == ERR_NONE) {
+			if (issued_len)
+				token_store(host, port, username, digest, issued, issued_len, 0);
+			OPENSSL_cleanse(issued, sizeof(issued));
+			return ERR_NONE;
+		}
+		if (rc != ERR_UNLOCK) {
+			if (rc == ERR_AUTH && token_len)
+				token_store(host, port, username, digest, NULL, 0, 0);
+			return rc;
+		}
+
+		/* Dropped after 0x02: probably an older server. Retry the old way
+		 * and remember that only if it works, not after a network blip. */
+		CLOSE_SOCK(*sock);
+		*sock = create_socket(host, port);
+		if (*sock == SOCK_INVALID)
+			return ERR_CONNECT;
+		rc = login_plain(*sock, username, password);
+		if (rc == ERR_NONE)
+			token_store(host, port, username, digest, NULL, 0, 1);
+		return rc;
+	}
+#else
+	(void)host; (void)port;
+#endif
+	return login_plain(*sock, username, password);
+}
+
+/* ── Transfer meter ──────────────────────────────────────────────────────── */
+
+#ifdef _WIN32
+  #define THREAD_LOCAL __declspec(thread)
+#else
+  #define THREAD_LOCAL _Thread_local
+#endif
+
+/*
+ * xfer_meter_t - Progress of the transfer running on this thread.
+ *
+ * The transfer manager's workers (see xfer_manager_start()) point t_meter
+ * at the job they run.  The transfer loops report the file bytes written
+ * or read, not wire bytes, so compressed transfers still end at total;
+ * with no meter set the calls cost a branch.
+ */
+typedef struct xfer_meter {
+	void   (*update)(struct xfer_meter *m);   /* Called after every change */
+	uint64_t done;
+	uint64_t total;                           /* 0 = not known */
+} xfer_meter_t;
+
+static THREAD_LOCAL xfer_meter_t *t_meter;
+
+/* A file transfer (or an attempt at one) starts with `done` bytes in place. */
+static void xfer_meter_begin(uint64_t done, uint64_t total)
+{
+	if (t_meter) {
+		t_meter->done  = done;
+		t_meter->total = total;
+		t_meter->update(t_meter);
+	}
+}
+
+static void xfer_meter_add(uint64_t n)
+{
+	if (t_meter) {
+		t_meter->done += n;
+		t_meter->update(t_meter);
+	}
+}
+
+/* ── File transfer ───────────────────────────────────────────────────────── */
+
+/**
+ * receive_file - Receive a file from the server and write it to output_dir.
+ *
+ * Wire format received from server:
+ *   [1 byte status: 0x00 = OK]
+ *   [4 bytes big-endian filename length]
+ *   [filename bytes]
+ *   [raw file data until connection close]
+ *
+ * @param sock        Connected socket, positioned after the mode byte.
+ * @param output_dir  Local directory to write the file into.
+ * @param out_path    Buffer to store the resulting file path (at least
+ *                    MAX_PATH_LEN + 1 bytes).
+ * @return            0 on success, -1 on error.
+ */
+int receive_file(sock_t sock, const char *output_dir, char *out_path)
+{
+	unsigned char status;
+	if (recv_exact(sock, &status, 1) != 0 || status != 0x00) {
+		fprintf(stderr, "receive_file: server reported error\n");
+		return -1;
+	}
+
+	unsigned char len_buf[4];
+	if (recv_exact(sock, len_buf, 4) != 0) {
+		fprintf(stderr, "receive_file: failed to read filename length\n");
+		return -1;
+	}
+	uint32_t name_len = be_to_uint32(len_buf);
+	if (name_len == 0 || name_len > MAX_PATH_LEN) {
+		fprintf(stderr, "receive_file: invalid filename length %u\n", name_len);
+		return -1;
+	}
+
+	char filename[MAX_PATH_LEN + 1];
+	if (recv_exact(sock, (unsigned char *)filename, name_len) != 0) {
+		fprintf(stderr, "receive_file: failed to read filename\n");
+		return -1;
+	}
+	filename[name_len] = '\0';
+
+	if (make_dirs(output_dir) != 0) {
+		fprintf(stderr, "receive_file: cannot create output directory '%s'\n", output_dir);
+		return -1;
+	}
+
+	size_t dir_len  = strlen(output_dir);
+	size_t file_len = strlen(filename);
+
+	if (dir_len + 1 + file_len >= MAX_PATH_LEN + 1) {
+	    fprintf(stderr, "receive_file: combined path too long\n");
+	    return -1;
+	}
+
+	memcpy(out_path, output_dir, dir_len);
+	out_path[dir_len] = '/';
+	memcpy(out_path + dir_len + 1, filename, file_len + 1);  /* +1 copies the null terminator */
+
+	FILE *fp = fopen(out_path, "wb");
+	if (!fp) {
+		fprintf(stderr, "receive_file: cannot open '%s' for writing\n", out_path);
 		return -1;
 	}
 
@@ -497,17 +1275,49 @@ int receive_file(sock_t sock, const char *output_dir, char *out_path)
 #ifdef _WIN32
 		int n = recv(sock, (char *)buf, sizeof(buf), 0);
 #else
-		ssize_t n = recv(sock, buf, sizeof(buf), 0);
+		ssize_t n = sock_recv(sock, buf, sizeof(buf));
 #endif
 		if (n <= 0)
 			break;   /* Connection closed – end of file data */
 		fwrite(buf, 1, (size_t)n, fp);
+		xfer_meter_add((uint64_t)n);
 	}
 
 	fclose(fp);
 	return 0;
 }
 
+/**
+ * default_upload_target - Pick the remote name for an upload.
+ *
+ * @param filepath     Local file being uploaded.
+ * @param target_path  Caller-supplied destination, may be NULL.
+ * @param buf          Scratch buffer for the basename.
+ * @param buf_size     Size of buf.
+ * @return             target_path if given, otherwise the basename of
+ *                     filepath copied into buf (or within filepath, if
+ *                     it doesn't fit).
+ */
+static const char *default_upload_target(const char *filepath, const char *target_path,
+                                         char *buf, size_t buf_size)
+{
+	if (target_path)
+		return target_path;
+
+	/* Use basename: find last '/' or '\' */
+	const char *base = strrchr(filepath, '/');
+#ifdef _WIN32
+	const char *base2 = strrchr(filepath, '\\');
+	if (!base || (base2 && base2 > base))
+		base = base2;
+#endif
+	const char *name = base ? base + 1 : filepath;
+	/* Never upload under a cut-off name; one that doesn't fit is used in place */
+	if (snprintf(buf, buf_size, "%s", name) >= (int)buf_size)
+		return name;
+	return buf;
+}
+
 /**
  * upload_file - Upload a local file to the server.
  *
@@ -536,18 +1346,8 @@ int upload_file(sock_t sock, const char *filepath, const char *target_path)
 
 	/* Resolve target path. */
 	char default_target[MAX_PATH_LEN];
-	if (!target_path) {
-		/* Use basename: find last '/' or '\' */
-		const char *base = strrchr(filepath, '/');
-#ifdef _WIN32
-		const char *base2 = strrchr(filepath, '\\');
-		if (!base || (base2 && base2 > base))
-			base = base2;
-#endif
-		strncpy(default_target, base ? base + 1 : filepath, sizeof(default_target) - 1);
-		default_target[sizeof(default_target) - 1] = '\0';
-		target_path = default_target;
-	}
+	target_path = default_upload_target(filepath, target_path,
+	                                    default_target, sizeof(default_target));
 
 	if (send_path(sock, target_path) != 0) {
 		fclose(fp);
@@ -562,381 +1362,3615 @@ int upload_file(sock_t sock, const char *filepath, const char *target_path)
 		return -1;
 	}
 
-	/* Stream file data. */
+	/* Stream file data; closing the socket flushes the cork. */
 	unsigned char buf[BUFFER_SIZE];
 	size_t n;
+	sock_cork(sock, 1);
 	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
 		if (send_all(sock, buf, n) != 0) {
 			fclose(fp);
 			return -1;
 		}
+		xfer_meter_add(n);
 	}
 
 	fclose(fp);
 	return 0;
 }
 
-/* ── Directory listing ───────────────────────────────────────────────────── */
-
-/*
- * Type byte values sent by the server for each directory entry.
- * Kept in sync with the LIST_TYPE_* constants in session.c.
+/**
+ * join_output_path - Build "<output_dir>/<filename>" into out_path.
+ *
+ * @param output_dir  Local directory.
+ * @param filename    File name received from the server.
+ * @param out_path    Output buffer (at least MAX_PATH_LEN + 1 bytes).
+ * @return            0 on success, -1 if the result would be too long.
  */
-#define LIST_TYPE_EOL  0x00   /* End-of-list marker (no length/name follows) */
-#define LIST_TYPE_FILE 0x01   /* Regular file (or unknown)                   */
-#define LIST_TYPE_DIR  0x02   /* Directory                                   */
+static int join_output_path(const char *output_dir, const char *filename, char *out_path)
+{
+	size_t dir_len  = strlen(output_dir);
+	size_t file_len = strlen(filename);
+
+	if (dir_len + 1 + file_len >= MAX_PATH_LEN + 1)
+		return -1;
+
+	memcpy(out_path, output_dir, dir_len);
+	out_path[dir_len] = '/';
+	memcpy(out_path + dir_len + 1, filename, file_len + 1);
+	return 0;
+}
 
 /**
- * list_directory_sock - Retrieve a directory listing from the server.
- *
- * Wire format received:
- *   [1 byte status: 0x00 = OK]
- *   Repeated until end-of-list:
- *     [1 byte type: LIST_TYPE_FILE (0x01) or LIST_TYPE_DIR (0x02)]
- *     [4 bytes big-endian entry length]
- *     [entry bytes]
- *   End-of-list marker: [1 byte: LIST_TYPE_EOL (0x00)]
- *
- * Each line in the returned string is prefixed with the type:
- *   "d:<name>\n"  for directories
- *   "f:<name>\n"  for files
+ * receive_inflate - Read a zlib stream in chunked frames and write it out.
  *
- * @param sock         Connected socket, positioned after the mode byte.
- * @param remote_path  Directory path on the server to list.
- * @return             Heap-allocated string with one entry per line, or NULL
- *                     on error. The caller must free() the returned string.
+ * @param sock     Connected socket, positioned at the first frame.
+ * @param fp       Output file.
+ * @param written  Output: number of uncompressed bytes written.
+ * @param crc      If non-NULL, extended with the CRC-32C of those bytes.
+ * @return         0 once a complete, verified stream and the terminating
+ *                 frame arrived; -1 on error or corrupt data.
  */
-char *list_directory_sock(sock_t sock, const char *remote_path)
+static int receive_inflate(sock_t sock, FILE *fp, uint64_t *written, uint32_t *crc)
 {
-	if (send_path(sock, remote_path) != 0)
-		return NULL;
+	unsigned char *in = malloc(COMPRESS_BUF_SIZE);
+	unsigned char *out = malloc(COMPRESS_BUF_SIZE);
+	z_stream zs;
+	int rc = -1, done = 0;
 
-	unsigned char status;
-	if (recv_exact(sock, &status, 1) != 0 || status != 0x00) {
-		fprintf(stderr, "list_directory_sock: server reported error\n");
-		return NULL;
+	memset(&zs, 0, sizeof(zs));
+	*written = 0;
+	if (!in || !out || inflateInit(&zs) != Z_OK) {
+		free(in);
+		free(out);
+		return -1;
 	}
 
-	/* Dynamic string accumulator. */
-	size_t buf_cap  = 4096;
-	size_t buf_used = 0;
-	char  *result   = malloc(buf_cap);
-	if (!result)
-		return NULL;
-	result[0] = '\0';
-
-	char entry[MAX_PATH_LEN + 1];
-
 	while (1) {
-		/* Read the type byte first. */
-		unsigned char type_byte;
-		if (recv_exact(sock, &type_byte, 1) != 0) {
-			free(result);
-			return NULL;
-		}
-
-		if (type_byte == LIST_TYPE_EOL)
-			break;   /* End-of-list marker */
-
-		if (type_byte != LIST_TYPE_FILE && type_byte != LIST_TYPE_DIR) {
-			fprintf(stderr, "list_directory_sock: unknown type byte 0x%02x\n", type_byte);
-			free(result);
-			return NULL;
-		}
-
-		/* Read the 4-byte length. */
 		unsigned char len_buf[4];
-		if (recv_exact(sock, len_buf, 4) != 0) {
-			free(result);
-			return NULL;
-		}
-		uint32_t entry_len = be_to_uint32(len_buf);
-
-		if (entry_len == 0 || entry_len > MAX_PATH_LEN) {
-			fprintf(stderr, "list_directory_sock: invalid entry length %u\n", entry_len);
-			free(result);
-			return NULL;
-		}
+		if (recv_exact(sock, len_buf, 4) != 0)
+			goto out;
+		uint32_t left = be_to_uint32(len_buf);
+		if (left == 0)
+			break;   /* Terminating frame */
 
-		if (recv_exact(sock, (unsigned char *)entry, entry_len) != 0) {
-			free(result);
-			return NULL;
-		}
-		entry[entry_len] = '\0';
-
-		/* Build the prefixed line: "d:<name>" or "f:<name>". */
-		const char *prefix = (type_byte == LIST_TYPE_DIR) ? "d:" : "f:";
-		size_t      prefix_len = 2;
+		while (left > 0) {
+			size_t want = left < COMPRESS_BUF_SIZE ? left : COMPRESS_BUF_SIZE;
+			if (recv_exact(sock, in, want) != 0 || done)
+				goto out;   /* Data after the end of the stream is corrupt too */
+			left -= (uint32_t)want;
+			zs.next_in = in;
+			zs.avail_in = (uInt)want;
 
-		/* Grow buffer if needed: prefix(2) + name + newline + NUL. */
-		size_t needed = buf_used + prefix_len + entry_len + 2;
-		if (needed > buf_cap) {
-			buf_cap = needed * 2;
-			char *tmp = realloc(result, buf_cap);
-			if (!tmp) {
-				free(result);
-				return NULL;
+			while (zs.avail_in > 0 && !done) {
+				zs.next_out = out;
+				zs.avail_out = COMPRESS_BUF_SIZE;
+				int zrc = inflate(&zs, Z_NO_FLUSH);
+				if (zrc != Z_OK && zrc != Z_STREAM_END)
+					goto out;
+				size_t produced = COMPRESS_BUF_SIZE - zs.avail_out;
+				if (fwrite(out, 1, produced, fp) != produced)
+					goto out;
+				if (crc)
+					*crc = crc32c_update(*crc, out, produced);
+				*written += produced;
+				xfer_meter_add(produced);
+				done = (zrc == Z_STREAM_END);
 			}
-			result = tmp;
+			if (zs.avail_in > 0)
+				goto out;
 		}
-
-		if (buf_used > 0)
-			result[buf_used++] = '\n';
-
-		memcpy(result + buf_used, prefix, prefix_len);
-		buf_used += prefix_len;
-		memcpy(result + buf_used, entry, entry_len);
-		buf_used += entry_len;
-		result[buf_used] = '\0';
 	}
+	rc = done ? 0 : -1;
 
-	return result;   /* Caller must free() */
+out:
+	inflateEnd(&zs);
+	free(in);
+	free(out);
+	return rc;
 }
 
-/* ── Path utilities ──────────────────────────────────────────────────────── */
-
 /**
- * get_default_download_dir - Return the platform default download directory.
+ * finish_framed_file - Close a received file, checking the 'H' trailer.
  *
- * On Windows: %USERPROFILE%\Downloads (created if absent).
- * On Linux/macOS: "." (current working directory).
- *
- * @param buf      Output buffer to store the path string.
- * @param buf_size Size of buf in bytes.
- * @return         Pointer to buf on success, NULL on error.
+ * @param sock      Connected socket, positioned after the file data.
+ * @param fp        The received file (closed here).
+ * @param out_path  Its path, removed if the checksum doesn't match.
+ * @param flags     receive_file_framed() flags.
+ * @param crc       CRC-32C of the bytes written, if FRAMED_CHECKED.
+ * @return          CMD_OK, or CMD_IO_ERROR.
  */
-char *get_default_download_dir(char *buf, size_t buf_size)
+static int finish_framed_file(sock_t sock, FILE *fp, const char *out_path, int flags,
+                              uint32_t crc)
 {
-#ifdef _WIN32
-	char home[MAX_PATH];
-	if (SHGetFolderPathA(NULL, CSIDL_PROFILE, NULL, 0, home) != S_OK)
-		return NULL;
-	snprintf(buf, buf_size, "%s\\Downloads", home);
-	CreateDirectoryA(buf, NULL);   /* Silently OK if it already exists */
-#else
-	strncpy(buf, ".", buf_size - 1);
-	buf[buf_size - 1] = '\0';
-#endif
-	return buf;
+	unsigned char trailer[4];
+	if (fclose(fp) != 0)
+		return CMD_IO_ERROR;
+	if (!(flags & FRAMED_CHECKED))
+		return CMD_OK;
+	if (recv_exact(sock, trailer, 4) != 0) {
+		fprintf(stderr, "receive_file: transfer interrupted, '%s' is incomplete\n", out_path);
+		return CMD_IO_ERROR;
+	}
+	if (be_to_uint32(trailer) != crc) {
+		fprintf(stderr, "receive_file: checksum mismatch, removed '%s'\n", out_path);
+		remove(out_path);
+		return CMD_IO_ERROR;
+	}
+	return CMD_OK;
 }
 
 /**
- * expand_path - Expand a leading tilde (~) in a path to the home directory.
+ * receive_file_framed - Receive a file whose end is marked in-band, so the
+ *                       connection can stay open afterwards.
  *
- * Handles:
- *   ~/path           → $HOME/path
- *   ~username/path   → home directory of `username` + /path  (POSIX only)
+ * Wire format received from server:
+ *   [1 byte status: 0x00 = OK]
+ *   [4 bytes big-endian filename length]
+ *   [filename bytes]
+ *   [8 bytes big-endian file size, or FRAMED_SIZE_CHUNKED]
+ *   [exactly file-size bytes of data]
+ *
+ * With FRAMED_SIZE_CHUNKED the data arrives as
+ * [4 bytes big-endian length][data] frames ending with a zero-length frame
+ * (the server does this for pipes, devices and files reporting size 0).
+ *
+ * A 'C' download has one more byte after the size: ENCODING_NONE (data as
+ * above) or ENCODING_DEFLATE (a zlib stream in chunked frames; the size,
+ * if known, is the uncompressed length and is checked).
+ *
+ * An 'H' download is a 'C' download followed by
+ * [4 bytes big-endian CRC-32C of the file data]. The local copy is
+ * checksummed as it is written and deleted if the values differ, so a
+ * file damaged or changed during the transfer is never left behind as
+ * if it were complete.
+ *
+ * @param sock        Connected socket, positioned after the remote path.
+ * @param output_dir  Local directory to write the file into.
+ * @param out_path    Buffer (at least MAX_PATH_LEN + 1 bytes) for the
+ *                    resulting local path.
+ * @param flags       FRAMED_ENCODED ('C'), plus FRAMED_CHECKED ('H'), or 0.
+ * @return            CMD_OK, CMD_REFUSED or CMD_IO_ERROR.
+ */
+static int receive_file_framed(sock_t sock, const char *output_dir, char *out_path,
+                               int flags)
+{
+	unsigned char status;
+	if (recv_exact(sock, &status, 1) != 0)
+		return CMD_IO_ERROR;
+	if (status != 0x00) {
+		fprintf(stderr, "receive_file: server reported error\n");
+		return CMD_REFUSED;
+	}
+
+	unsigned char len_buf[8];
+	if (recv_exact(sock, len_buf, 4) != 0)
+		return CMD_IO_ERROR;
+	uint32_t name_len = be_to_uint32(len_buf);
+	if (name_len == 0 || name_len > MAX_PATH_LEN)
+		return CMD_IO_ERROR;
+
+	char filename[MAX_PATH_LEN + 1];
+	if (recv_exact(sock, (unsigned char *)filename, name_len) != 0)
+		return CMD_IO_ERROR;
+	filename[name_len] = '\0';
+
+	if (recv_exact(sock, len_buf, 8) != 0)
+		return CMD_IO_ERROR;
+	uint64_t size = be_to_uint64(len_buf);
+	int chunked = (size == FRAMED_SIZE_CHUNKED);
+	xfer_meter_begin(0, chunked ? 0 : size);
+
+	unsigned char encoding = ENCODING_NONE;
+	if ((flags & FRAMED_ENCODED) && recv_exact(sock, &encoding, 1) != 0)
+		return CMD_IO_ERROR;
+	if (encoding != ENCODING_NONE && encoding != ENCODING_DEFLATE)
+		return CMD_IO_ERROR;
+
+	/* The data is already on its way, so local failures break the session. */
+	if (make_dirs(output_dir) != 0 || join_output_path(output_dir, filename, out_path) != 0) {
+		fprintf(stderr, "receive_file: cannot prepare output path in '%s'\n", output_dir);
+		return CMD_IO_ERROR;
+	}
+
+	FILE *fp = fopen(out_path, "wb");
+	if (!fp) {
+		fprintf(stderr, "receive_file: cannot open '%s' for writing\n", out_path);
+		return CMD_IO_ERROR;
+	}
+
+#ifdef __linux__
+	/* Reserve the space up front; ENOSPC shows up here instead of mid-way. */
+	if (!chunked && size > 0 && size <= (uint64_t)INT64_MAX)
+		posix_fallocate(fileno(fp), 0, (off_t)size);
+#endif
+
+	uint32_t crc = 0;
+	if (encoding == ENCODING_DEFLATE) {
+		uint64_t written;
+		if (receive_inflate(sock, fp, &written, (flags & FRAMED_CHECKED) ? &crc : NULL) != 0 ||
+		    (!chunked && written != size))
+			goto broken;
+		return finish_framed_file(sock, fp, out_path, flags, crc);
+	}
+
+	unsigned char buf[BUFFER_SIZE];
+	uint64_t remaining = chunked ? 0 : size;
+	while (1) {
+		if (remaining == 0) {
+			if (!chunked)
+				break;
+			if (recv_exact(sock, len_buf, 4) != 0)
+				goto broken;
+			remaining = be_to_uint32(len_buf);
+			if (remaining == 0)
+				break;   /* Terminating frame */
+		}
+
+		size_t want = remaining < sizeof(buf) ? (size_t)remaining : sizeof(buf);
+#ifdef _WIN32
+		int n = recv(sock, (char *)buf, (int)want, 0);
+#else
+		ssize_t n = sock_recv(sock, buf, want);
+#endif
+		if (n <= 0 || fwrite(buf, 1, (size_t)n, fp) != (size_t)n)
+			goto broken;
+		if (flags & FRAMED_CHECKED)
+			crc = crc32c_update(crc, buf, (size_t)n);
+		remaining -= (uint64_t)n;
+		xfer_meter_add((uint64_t)n);
+	}
+	return finish_framed_file(sock, fp, out_path, flags, crc);
+
+broken:
+	fclose(fp);
+	fprintf(stderr, "receive_file: transfer interrupted, '%s' is incomplete\n", out_path);
+	return CMD_IO_ERROR;
+}
+
+/*
+ * Record type bytes in a directory tree stream ('R' mode).
+ */
+#define TREE_TYPE_END  0x00   /* End of stream                       */
+#define TREE_TYPE_FILE 0x01   /* path, 8-byte size, data             */
+#define TREE_TYPE_DIR  0x02   /* path only                           */
+
+/**
+ * tree_path_is_safe - Check a relative path received in a tree stream.
+ *
+ * Rejects absolute paths, empty components, "." and "..", and backslashes,
+ * so a hostile server can't make receive_tree() write outside output_dir.
+ *
+ * @return  1 if the path is safe to create under output_dir, 0 otherwise.
+ */
+static int tree_path_is_safe(const char *path)
+{
+	if (*path == '\0' || *path == '/' || strchr(path, '\\') || strchr(path, ':'))
+		return 0;
+
+	const char *p = path;
+	while (*p) {
+		const char *end = strchr(p, '/');
+		size_t len = end ? (size_t)(end - p) : strlen(p);
+		if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+			return 0;
+		p += len;
+		if (*p == '/')
+			p++;
+		if (end && *p == '\0')
+			return 0;   /* Trailing slash */
+	}
+	return 1;
+}
+
+/**
+ * receive_tree - Unpack a directory tree stream into output_dir.
+ *
+ * Wire format received from server:
+ *   [1 byte status: 0x00 = OK]
+ *   then records until TREE_TYPE_END:
+ *     [1 byte type][4 bytes big-endian path length][relative path]
+ *     TREE_TYPE_FILE only: [8 bytes big-endian size][exactly size bytes]
+ *
+ * Paths use '/' and start with the name of the requested directory, which
+ * is always the first record; directories arrive before their contents.
+ *
+ * @param sock        Connected socket, positioned after the remote path.
+ * @param output_dir  Local directory to unpack into (created if needed).
+ * @param out_path    Buffer (at least MAX_PATH_LEN + 1 bytes) for the local
+ *                    path of the unpacked root directory.
+ * @return            CMD_OK, CMD_REFUSED or CMD_IO_ERROR.
+ */
+static int receive_tree(sock_t sock, const char *output_dir, char *out_path)
+{
+	unsigned char status;
+	if (recv_exact(sock, &status, 1) != 0)
+		return CMD_IO_ERROR;
+	if (status != 0x00) {
+		fprintf(stderr, "receive_tree: server reported error\n");
+		return CMD_REFUSED;
+	}
+	if (make_dirs(output_dir) != 0) {
+		fprintf(stderr, "receive_tree: cannot create output directory '%s'\n", output_dir);
+		return CMD_IO_ERROR;
+	}
+
+	char rel[MAX_PATH_LEN + 1];
+	char local[MAX_PATH_LEN + 1];
+	unsigned char buf[BUFFER_SIZE];
+	int first = 1;
+
+	while (1) {
+		unsigned char type;
+		if (recv_exact(sock, &type, 1) != 0)
+			return CMD_IO_ERROR;
+		if (type == TREE_TYPE_END)
+			break;
+
+		if (recv_exact(sock, buf, 4) != 0)
+			return CMD_IO_ERROR;
+		uint32_t len = be_to_uint32(buf);
+		if (len == 0 || len > MAX_PATH_LEN || recv_exact(sock, (unsigned char *)rel, len) != 0)
+			return CMD_IO_ERROR;
+		rel[len] = '\0';
+
+		if ((type != TREE_TYPE_DIR && type != TREE_TYPE_FILE) || !tree_path_is_safe(rel) ||
+		    join_output_path(output_dir, rel, local) != 0) {
+			fprintf(stderr, "receive_tree: bad record for '%s'\n", rel);
+			return CMD_IO_ERROR;
+		}
+
+		if (type == TREE_TYPE_DIR) {
+			if (make_dirs(local) != 0) {
+				fprintf(stderr, "receive_tree: cannot create '%s'\n", local);
+				return CMD_IO_ERROR;
+			}
+			if (first)
+				memcpy(out_path, local, strlen(local) + 1);
+			first = 0;
+			continue;
+		}
+
+		if (recv_exact(sock, buf, 8) != 0)
+			return CMD_IO_ERROR;
+		uint64_t remaining = be_to_uint64(buf);
+
+		FILE *fp = fopen(local, "wb");
+		if (!fp) {
+			fprintf(stderr, "receive_tree: cannot open '%s' for writing\n", local);
+			return CMD_IO_ERROR;
+		}
+		while (remaining > 0) {
+			size_t want = remaining < sizeof(buf) ? (size_t)remaining : sizeof(buf);
+			if (recv_exact(sock, buf, want) != 0 || fwrite(buf, 1, want, fp) != want) {
+				fclose(fp);
+				fprintf(stderr, "receive_tree: transfer interrupted in '%s'\n", local);
+				return CMD_IO_ERROR;
+			}
+			remaining -= want;
+			xfer_meter_add(want);
+		}
+		if (fclose(fp) != 0)
+			return CMD_IO_ERROR;
+	}
+	return first ? CMD_IO_ERROR : CMD_OK;
+}
+
+/**
+ * send_deflate - Send a file as a zlib stream in chunked frames.
+ *
+ * The counterpart of receive_inflate(): frames of compressed bytes, then a
+ * zero-length frame.
+ *
+ * @param sock   Connected socket.
+ * @param fp     Source, read from its current position to EOF.
+ * @param level  zlib compression level (1-9).
+ * @return       0 on success, -1 on read, compression or send failure.
+ */
+static int send_deflate(sock_t sock, FILE *fp, int level)
+{
+	unsigned char *in = malloc(COMPRESS_BUF_SIZE);
+	unsigned char *out = malloc(COMPRESS_BUF_SIZE);
+	unsigned char hdr[4];
+	z_stream zs;
+	int rc = -1;
+
+	memset(&zs, 0, sizeof(zs));
+	if (!in || !out || deflateInit(&zs, level) != Z_OK) {
+		free(in);
+		free(out);
+		return -1;
+	}
+
+	int flush = Z_NO_FLUSH;
+	while (1) {
+		if (zs.avail_in == 0 && flush != Z_FINISH) {
+			size_t n = fread(in, 1, COMPRESS_BUF_SIZE, fp);
+			if (n == 0 && ferror(fp))
+				goto out;   /* No way to signal an abort in-band */
+			xfer_meter_add(n);
+			zs.next_in = in;
+			zs.avail_in = (uInt)n;
+			if (n == 0)
+				flush = Z_FINISH;
+		}
+
+		zs.next_out = out;
+		zs.avail_out = COMPRESS_BUF_SIZE;
+		int zrc = deflate(&zs, flush);
+		if (zrc == Z_STREAM_ERROR)
+			goto out;
+		size_t produced = COMPRESS_BUF_SIZE - zs.avail_out;
+		if (produced > 0) {
+			uint32_to_be((uint32_t)produced, hdr);
+			if (send_all(sock, hdr, 4) != 0 || send_all(sock, out, produced) != 0)
+				goto out;
+		}
+		if (zrc == Z_STREAM_END)
+			break;
+	}
+
+	uint32_to_be(0, hdr);
+	rc = send_all(sock, hdr, 4);
+
+out:
+	deflateEnd(&zs);
+	free(in);
+	free(out);
+	return rc;
+}
+
+/**
+ * compression_worthwhile - Check whether compressing a file can pay off.
+ *
+ * Archives, images, video and audio (the types the TUI shows with its
+ * archive/image/video/audio sprites) plus other compressed formats are
+ * sent as-is; the server applies the same rule to downloads.
+ *
+ * @param name  File name or path.
+ * @return      1 if the file should be compressed, 0 otherwise.
+ */
+static int compression_worthwhile(const char *name)
+{
+	static const char *const exts[] = {
+		"zip", "gz", "tgz", "bz2", "xz", "zst", "lz4", "7z", "rar", "jar", "apk", "deb", "rpm",
+		"png", "jpg", "jpeg", "gif", "webp", "mp4", "mkv", "avi", "mov", "webm",
+		"mp3", "ogg", "flac", "aac", "m4a", "pdf", "docx", "xlsx", "pptx", "odt",
+	};
+	const char *base = strrchr(name, '/');
+	base = base ? base + 1 : name;
+	const char *dot = strrchr(base, '.');
+	if (!dot || dot == base)
+		return 1;
+	for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+		if (strcasecmp(dot + 1, exts[i]) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * upload_file_framed - Upload an open file with an in-band end marker, so
+ *                      the connection can stay open afterwards.
+ *
+ * Wire format:
+ *   → length-prefixed target_path
+ *   ← [1 byte status: 0x00 = OK]
+ *   → [8 bytes big-endian file size][file data]
+ *   ← [1 byte status: 0x00 = stored]
+ *
+ * A size of FRAMED_SIZE_CHUNKED (used when the source can't be measured,
+ * e.g. a pipe) sends the data as length-prefixed frames ending with a
+ * zero-length frame, as in receive_file_framed().
+ *
+ * With a level ('P' mode) an ENCODING_DEFLATE byte follows the size and
+ * the data is sent as a zlib stream in the same frames (see send_deflate()).
+ *
+ * @param sock         Connected socket, positioned after the mode byte.
+ * @param fp           Source file, read from its current position.
+ * @param size         Bytes to send, or FRAMED_SIZE_CHUNKED.
+ * @param target_path  Destination on the server.
+ * @param level        zlib level 1-9 for a 'P' upload, 0 for plain 'u'.
+ * @return             CMD_OK, CMD_REFUSED or CMD_IO_ERROR.
+ */
+static int upload_file_framed(sock_t sock, FILE *fp, uint64_t size, const char *target_path,
+                              int level)
+{
+	unsigned char status;
+	unsigned char hdr[8];
+
+	if (send_path(sock, target_path) != 0 || recv_exact(sock, &status, 1) != 0)
+		return CMD_IO_ERROR;
+	if (status != 0x00) {
+		fprintf(stderr, "upload_file: server refused write to '%s'\n", target_path);
+		return CMD_REFUSED;
+	}
+
+	sock_cork(sock, 1);
+	uint64_to_be(size, hdr);
+	if (send_all(sock, hdr, 8) != 0)
+		return CMD_IO_ERROR;
+	xfer_meter_begin(0, size == FRAMED_SIZE_CHUNKED ? 0 : size);
+
+	unsigned char buf[BUFFER_SIZE];
+	if (level > 0) {
+		buf[0] = ENCODING_DEFLATE;
+		if (send_all(sock, buf, 1) != 0 || send_deflate(sock, fp, level) != 0)
+			return CMD_IO_ERROR;
+	} else if (size == FRAMED_SIZE_CHUNKED) {
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+			uint32_to_be((uint32_t)n, hdr);
+			if (send_all(sock, hdr, 4) != 0 || send_all(sock, buf, n) != 0)
+				return CMD_IO_ERROR;
+			xfer_meter_add(n);
+		}
+		if (ferror(fp))
+			return CMD_IO_ERROR;   /* No way to signal an abort in-band */
+		uint32_to_be(0, hdr);
+		if (send_all(sock, hdr, 4) != 0)
+			return CMD_IO_ERROR;
+	} else {
+		uint64_t remaining = size;
+		while (remaining > 0) {
+			size_t want = remaining < sizeof(buf) ? (size_t)remaining : sizeof(buf);
+			size_t n = fread(buf, 1, want, fp);
+			if (n == 0 || send_all(sock, buf, n) != 0)
+				return CMD_IO_ERROR;   /* File shrank or send failed: stream is out of sync */
+			remaining -= n;
+			xfer_meter_add(n);
+		}
+	}
+
+	sock_cork(sock, 0);
+	if (recv_exact(sock, &status, 1) != 0)
+		return CMD_IO_ERROR;
+	return (status == 0x00) ? CMD_OK : CMD_REFUSED;
+}
+
+/**
+ * open_upload_source - Open a local file for upload_file_framed().
+ *
+ * @param filepath  Local file.
+ * @param size      Output: its size, or FRAMED_SIZE_CHUNKED if the file is
+ *                  not seekable.
+ * @return          Open stream, or NULL if the file cannot be opened.
+ */
+static FILE *open_upload_source(const char *filepath, uint64_t *size)
+{
+	FILE *fp = fopen(filepath, "rb");
+	if (!fp) {
+		fprintf(stderr, "upload_file: cannot open '%s'\n", filepath);
+		return NULL;
+	}
+	if (local_file_size(fp, size) != 0)
+		*size = FRAMED_SIZE_CHUNKED;
+	return fp;
+}
+
+/**
+ * send_range_request - Ask for part of a remote file.
+ *
+ * Wire format sent to server:
+ *   ['G' mode byte]
+ *   [length-prefixed remote_path]   → via send_path()
+ *   [8 bytes big-endian offset]
+ *   [8 bytes big-endian length, RANGE_TO_END for the rest of the file]
+ *
+ * @return  0 on success, -1 on send failure.
+ */
+static int send_range_request(sock_t sock, const char *remote_path,
+                              uint64_t offset, uint64_t length)
+{
+	unsigned char range[16];
+	uint64_to_be(offset, range);
+	uint64_to_be(length, range + 8);
+
+	if (send_mode(sock, MODE_RANGE) != 0 || send_path(sock, remote_path) != 0)
+		return -1;
+	return send_all(sock, range, sizeof(range));
+}
+
+/**
+ * receive_range_header - Read the server's reply to send_range_request().
+ *
+ * Wire format received from server:
+ *   [1 byte status: 0x00 = OK]
+ *   [4 bytes big-endian filename length][filename bytes]
+ *   [8 bytes big-endian total file size]
+ *   [8 bytes big-endian range length]
+ *   ... followed by exactly range-length bytes of data.
+ *
+ * The server refuses (status 0x01) directories, non-regular files and
+ * offsets past the end of the file.
+ *
+ * @param sock    Connected socket, positioned after the request.
+ * @param total   Output: size of the whole remote file.
+ * @param length  Output: number of data bytes that follow.
+ * @return        CMD_OK, CMD_REFUSED or CMD_IO_ERROR.
+ */
+static int receive_range_header(sock_t sock, uint64_t *total, uint64_t *length)
+{
+	unsigned char status;
+	if (recv_exact(sock, &status, 1) != 0)
+		return CMD_IO_ERROR;
+	if (status != 0x00) {
+		fprintf(stderr, "receive_file: server refused range request\n");
+		return CMD_REFUSED;
+	}
+
+	unsigned char buf[MAX_PATH_LEN];
+	if (recv_exact(sock, buf, 4) != 0)
+		return CMD_IO_ERROR;
+	uint32_t name_len = be_to_uint32(buf);
+	if (name_len == 0 || name_len > MAX_PATH_LEN || recv_exact(sock, buf, name_len) != 0)
+		return CMD_IO_ERROR;   /* The caller already chose the local name */
+
+	if (recv_exact(sock, buf, 16) != 0)
+		return CMD_IO_ERROR;
+	*total  = be_to_uint64(buf);
+	*length = be_to_uint64(buf + 8);
+	return CMD_OK;
+}
+
+/**
+ * receive_range_into - Append a range reply to a local file.
+ *
+ * Requests remote_path from offset to the end and writes the data to fp at
+ * offset.  Existing bytes before offset are left alone, which is what lets
+ * an interrupted download continue where it stopped.
+ *
+ * @param sock         Connected socket, positioned after the mode byte
+ *                     would go.
+ * @param remote_path  Path of the file on the server.
+ * @param fp           Local file opened for update.
+ * @param offset       Bytes already present locally.
+ * @return             CMD_OK, CMD_REFUSED or CMD_IO_ERROR.
+ */
+static int receive_range_into(sock_t sock, const char *remote_path, FILE *fp, uint64_t offset)
+{
+	uint64_t total, remaining;
+	if (send_range_request(sock, remote_path, offset, RANGE_TO_END) != 0)
+		return CMD_IO_ERROR;
+	int rc = receive_range_header(sock, &total, &remaining);
+	if (rc != CMD_OK)
+		return rc;
+	if (seek_file(fp, offset) != 0)
+		return CMD_IO_ERROR;
+	xfer_meter_begin(offset, offset + remaining);
+
+	unsigned char buf[BUFFER_SIZE];
+	while (remaining > 0) {
+		size_t want = remaining < sizeof(buf) ? (size_t)remaining : sizeof(buf);
+#ifdef _WIN32
+		int n = recv(sock, (char *)buf, (int)want, 0);
+#else
+		ssize_t n = sock_recv(sock, buf, want);
+#endif
+		if (n <= 0 || fwrite(buf, 1, (size_t)n, fp) != (size_t)n) {
+			fprintf(stderr, "receive_file: transfer interrupted, resume again later\n");
+			return CMD_IO_ERROR;
+		}
+		remaining -= (uint64_t)n;
+		xfer_meter_add((uint64_t)n);
+	}
+	return CMD_OK;
+}
+
+/**
+ * local_target_path - Work out where a download of remote_path is stored
+ *                     before the server has replied.
+ *
+ * The local name is the last component of remote_path, matching the
+ * basename the server would send.  output_dir is created if needed.
+ *
+ * @param remote_path  Path of the file on the server.
+ * @param output_dir   Local directory (already expanded).
+ * @param out_path     Buffer (at least MAX_PATH_LEN + 1 bytes) for the
+ *                     resulting local path.
+ * @return             0 on success, -1 on error.
+ */
+static int local_target_path(const char *remote_path, const char *output_dir, char *out_path)
+{
+	const char *base = strrchr(remote_path, '/');
+	base = base ? base + 1 : remote_path;
+	if (*base == '\0' || *base == '~') {
+		fprintf(stderr, "receive_file: '%s' does not name a file\n", remote_path);
+		return -1;
+	}
+	if (make_dirs(output_dir) != 0 || join_output_path(output_dir, base, out_path) != 0) {
+		fprintf(stderr, "receive_file: cannot prepare output path in '%s'\n", output_dir);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * open_resume_target - Open (or create) the local copy of remote_path for
+ *                      resuming.
+ *
+ * @param remote_path  Path of the file on the server.
+ * @param output_dir   Local directory (already expanded).
+ * @param out_path     Buffer (at least MAX_PATH_LEN + 1 bytes) for the
+ *                     resulting local path.
+ * @param have         Output: bytes already present locally.
+ * @return             Open stream, or NULL on error.
+ */
+static FILE *open_resume_target(const char *remote_path, const char *output_dir,
+                                char *out_path, uint64_t *have)
+{
+	if (local_target_path(remote_path, output_dir, out_path) != 0)
+		return NULL;
+
+	FILE *fp = fopen(out_path, "r+b");
+	if (!fp)
+		fp = fopen(out_path, "w+b");
+	if (!fp || local_file_size(fp, have) != 0) {
+		fprintf(stderr, "receive_file: cannot open '%s' for writing\n", out_path);
+		if (fp) fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/**
+ * close_resume_target - Close a file from open_resume_target(), removing
+ *                       it if the download failed before any byte arrived.
+ *
+ * @param fp        Stream returned by open_resume_target().
+ * @param out_path  Its path.
+ * @param failed    Non-zero if the download failed.
+ * @return          0 on success, -1 if closing the file failed.
+ */
+static int close_resume_target(FILE *fp, const char *out_path, int failed)
+{
+	uint64_t size;
+	int empty = failed && local_file_size(fp, &size) == 0 && size == 0;
+	if (fclose(fp) != 0)
+		return -1;
+	if (empty)
+		remove(out_path);
+	return 0;
+}
+
+/* ── Delta uploads ───────────────────────────────────────────────────────── */
+
+/*
+ * Mode 'Y' re-uploads a file the server already has an older copy of. The
+ * server sends a signature per block of its copy; the client slides a
+ * rolling checksum over the new file and sends "copy blocks i..j" for the
+ * parts the server has and literal bytes for the rest.
+ *
+ *   → length-prefixed target_path
+ *   ← [1 byte status: 0x00 = OK]
+ *   ← [4 bytes block size][4 bytes count]
+ *     count × [4 weak sum][4 CRC-32][8 FNV-1a-64]   (full blocks only)
+ *   → ops: 'L'[4 length ≤ DELTA_LITERAL_MAX][bytes]
+ *          'B'[4 first block][4 block count]
+ *          'E'[4 CRC-32 of the whole new file]
+ *   ← [1 byte status: 0x00 = stored, 0x01 = didn't verify (target unchanged)]
+ */
+
+#define MODE_DELTA        'Y'
+#define DELTA_OP_LITERAL  'L'
+#define DELTA_OP_COPY     'B'
+#define DELTA_OP_END      'E'
+#define DELTA_LITERAL_MAX (64 * 1024)
+#define DELTA_SUM_SIZE    16
+#define DELTA_MAX_BLOCK   (64u << 20)   /* Sanity limit on the server's reply */
+#define DELTA_MAX_COUNT   (1u << 24)
+
+typedef struct {
+	uint32_t weak;
+	uint32_t crc;
+	uint64_t fnv;
+	uint32_t next;   /* Next block with the same hash bucket, UINT32_MAX = none */
+} delta_sig_t;
+
+typedef struct {
+	sock_t   sock;
+	uint32_t run_first;   /* Pending copy run, flushed lazily */
+	uint32_t run_count;
+} delta_out_t;
+
+/**
+ * delta_strong - CRC-32 and FNV-1a-64 of one block, as the server hashes it.
+ */
+static void delta_strong(const unsigned char *p, size_t len, uint32_t *crc, uint64_t *fnv)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * 1099511628211ULL;
+	*fnv = h;
+	*crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), p, (uInt)len);
+}
+
+/**
+ * delta_flush_run - Send the pending 'B' op, if any.
+ */
+static int delta_flush_run(delta_out_t *o)
+{
+	unsigned char op[9];
+	if (o->run_count == 0)
+		return 0;
+	op[0] = DELTA_OP_COPY;
+	uint32_to_be(o->run_first, op + 1);
+	uint32_to_be(o->run_count, op + 5);
+	o->run_count = 0;
+	return send_all(o->sock, op, sizeof(op));
+}
+
+/**
+ * delta_send_literal - Send bytes the server doesn't have as 'L' ops.
+ */
+static int delta_send_literal(delta_out_t *o, const unsigned char *p, size_t len)
+{
+	unsigned char op[5];
+	if (len == 0)
+		return 0;
+	if (delta_flush_run(o) != 0)
+		return -1;
+	while (len > 0) {
+		size_t n = len < DELTA_LITERAL_MAX ? len : DELTA_LITERAL_MAX;
+		op[0] = DELTA_OP_LITERAL;
+		uint32_to_be((uint32_t)n, op + 1);
+		if (send_all(o->sock, op, sizeof(op)) != 0 || send_all(o->sock, p, n) != 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * delta_copy_block - Append block idx to the pending run (or start a new one).
+ */
+static int delta_copy_block(delta_out_t *o, uint32_t idx)
+{
+	if (o->run_count > 0 && o->run_first + o->run_count == idx) {
+		o->run_count++;
+		return 0;
+	}
+	if (delta_flush_run(o) != 0)
+		return -1;
+	o->run_first = idx;
+	o->run_count = 1;
+	return 0;
+}
+
+/**
+ * delta_recv_signature - Receive the server's block signatures.
+ *
+ * Builds a chained hash table on the weak sum: heads[weak & mask] is the
+ * first block with that bucket, sigs[i].next the following one.
+ *
+ * @return  0 on success, -1 on receive failure or an implausible header.
+ */
+static int delta_recv_signature(sock_t sock, uint32_t *block, uint32_t *count,
+                                delta_sig_t **sigs_out, uint32_t **heads_out, uint32_t *mask_out)
+{
+	unsigned char hdr[DELTA_SUM_SIZE];
+	if (recv_exact(sock, hdr, 8) != 0)
+		return -1;
+	*block = be_to_uint32(hdr);
+	*count = be_to_uint32(hdr + 4);
+	if (*block == 0 || *block > DELTA_MAX_BLOCK || *count > DELTA_MAX_COUNT)
+		return -1;
+
+	uint32_t mask = 1023;
+	while (mask < *count * 2u && mask < (1u << 25) - 1)
+		mask = (mask << 1) | 1;
+	delta_sig_t *sigs = malloc(((size_t)*count + 1) * sizeof(*sigs));
+	uint32_t *heads = malloc(((size_t)mask + 1) * sizeof(*heads));
+	if (!sigs || !heads) {
+		free(sigs);
+		free(heads);
+		return -1;
+	}
+	memset(heads, 0xff, ((size_t)mask + 1) * sizeof(*heads));
+
+	for (uint32_t i = 0; i < *count; i++) {
+		if (recv_exact(sock, hdr, DELTA_SUM_SIZE) != 0) {
+			free(sigs);
+			free(heads);
+			return -1;
+		}
+		sigs[i].weak = be_to_uint32(hdr);
+		sigs[i].crc = be_to_uint32(hdr + 4);
+		sigs[i].fnv = be_to_uint64(hdr + 8);
+	}
+	/* Prepend in reverse so each chain lists low indices first */
+	for (uint32_t i = *count; i-- > 0; ) {
+		uint32_t b = sigs[i].weak & mask;
+		sigs[i].next = heads[b];
+		heads[b] = i;
+	}
+
+	*sigs_out = sigs;
+	*heads_out = heads;
+	*mask_out = mask;
+	return 0;
+}
+
+/**
+ * delta_find_block - Look for a server block equal to the current window.
+ *
+ * Prefers the block right after the last match so runs stay contiguous
+ * (many identical blocks, e.g. zeroes, would otherwise split them).
+ *
+ * @return  Block index, or UINT32_MAX if there is none.
+ */
+static uint32_t delta_find_block(const delta_sig_t *sigs, uint32_t count,
+                                 const uint32_t *heads, uint32_t mask, uint32_t weak,
+                                 const unsigned char *win, uint32_t block, uint32_t preferred)
+{
+	uint32_t i = heads[weak & mask];
+	uint32_t crc = 0;
+	uint64_t fnv = 0;
+	int have_strong = 0;
+
+	if (preferred < count && sigs[preferred].weak == weak) {
+		delta_strong(win, block, &crc, &fnv);
+		have_strong = 1;
+		if (sigs[preferred].crc == crc && sigs[preferred].fnv == fnv)
+			return preferred;
+	}
+	for (; i != UINT32_MAX; i = sigs[i].next) {
+		if (sigs[i].weak != weak)
+			continue;
+		if (!have_strong) {
+			delta_strong(win, block, &crc, &fnv);
+			have_strong = 1;
+		}
+		if (sigs[i].crc == crc && sigs[i].fnv == fnv)
+			return i;
+	}
+	return UINT32_MAX;
+}
+
+/**
+ * upload_file_delta - Send a file as a delta against the server's copy.
+ *
+ * The file is read once, front to back, through a buffer holding the
+ * pending literal bytes plus one block of look-ahead.
+ *
+ * @param sock         Connected socket, positioned after the 'Y' mode byte.
+ * @param fp           Source file, read from the start.
+ * @param target_path  Destination on the server.
+ * @return             CMD_OK, CMD_REFUSED (refused, or the result didn't
+ *                     verify; the connection is still usable) or CMD_IO_ERROR.
+ */
+static int upload_file_delta(sock_t sock, FILE *fp, const char *target_path)
+{
+	unsigned char status;
+	if (send_path(sock, target_path) != 0 || recv_exact(sock, &status, 1) != 0)
+		return CMD_IO_ERROR;
+	if (status != 0x00) {
+		fprintf(stderr, "upload_file: server refused delta write to '%s'\n", target_path);
+		return CMD_REFUSED;
+	}
+
+	uint32_t block, count, mask;
+	delta_sig_t *sigs;
+	uint32_t *heads;
+	if (delta_recv_signature(sock, &block, &count, &sigs, &heads, &mask) != 0)
+		return CMD_IO_ERROR;
+
+	/* data[start, pos) is pending literal, data[pos, pos + block) the window */
+	size_t cap = (size_t)DELTA_LITERAL_MAX + 2 * (size_t)block;
+	unsigned char *data = malloc(cap);
+	delta_out_t o = { sock, 0, 0 };
+	uLong file_crc = crc32(0L, Z_NULL, 0);
+	size_t start = 0, pos = 0, end = 0;
+	uint32_t a = 0, b = 0;
+	int have_sum = 0, eof = 0, rc = CMD_IO_ERROR;
+
+	if (!data)
+		goto out;
+	while (1) {
+		/* Top up until the window plus the next byte to roll in are buffered */
+		while (pos + block >= end && !eof) {
+			if (start > 0) {
+				memmove(data, data + start, end - start);
+				pos -= start;
+				end -= start;
+				start = 0;
+			}
+			size_t n = fread(data + end, 1, cap - end, fp);
+			if (n == 0) {
+				if (ferror(fp))
+					goto out;   /* No way to signal an abort in-band */
+				eof = 1;
+			}
+			file_crc = crc32(file_crc, data + end, (uInt)n);
+			end += n;
+		}
+		if (pos + block > end || count == 0)
+			break;   /* Less than a block left: the rest is literal */
+
+		if (!have_sum) {
+			a = b = 0;
+			for (size_t i = 0; i < block; i++) {
+				a += data[pos + i];
+				b += a;
+			}
+			have_sum = 1;
+		}
+
+		uint32_t weak = (a & 0xffff) | (b << 16);
+		uint32_t preferred = o.run_count ? o.run_first + o.run_count : 0;
+		uint32_t idx = delta_find_block(sigs, count, heads, mask, weak,
+		                                data + pos, block, preferred);
+		if (idx != UINT32_MAX) {
+			if (delta_send_literal(&o, data + start, pos - start) != 0 ||
+			    delta_copy_block(&o, idx) != 0)
+				goto out;
+			pos += block;
+			start = pos;
+			have_sum = 0;
+			continue;
+		}
+
+		/* No match: slide one byte, flushing literals before they overflow */
+		if (pos + block == end)
+			break;   /* Only at EOF */
+		if (pos - start + 1 > DELTA_LITERAL_MAX) {
+			if (delta_send_literal(&o, data + start, pos - start) != 0)
+				goto out;
+			start = pos;
+		}
+		unsigned char out_byte = data[pos], in_byte = data[pos + block];
+		a += in_byte - out_byte;
+		b += a - block * (uint32_t)out_byte;
+		pos++;
+	}
+
+	/* Whatever is left (all of it when the server has no blocks) is literal */
+	while (1) {
+		if (delta_send_literal(&o, data + start, end - start) != 0)
+			goto out;
+		start = end = 0;
+		if (eof)
+			break;
+		end = fread(data, 1, cap, fp);
+		if (end == 0) {
+			if (ferror(fp))
+				goto out;
+			eof = 1;
+		}
+		file_crc = crc32(file_crc, data, (uInt)end);
+	}
+
+	unsigned char op[5];
+	op[0] = DELTA_OP_END;
+	uint32_to_be((uint32_t)file_crc, op + 1);
+	if (delta_flush_run(&o) != 0 || send_all(sock, op, sizeof(op)) != 0 ||
+	    recv_exact(sock, &status, 1) != 0)
+		goto out;
+	rc = (status == 0x00) ? CMD_OK : CMD_REFUSED;
+
+out:
+	free(data);
+	free(sigs);
+	free(heads);
+	return rc;
+}
+
+/* ── Directory listing ───────────────────────────────────────────────────── */
+
+/*
+ * Type byte values sent by the server for each directory entry.
+ * Kept in sync with the LIST_TYPE_* constants in session.c.
+ */
+#define LIST_TYPE_EOL  0x00   /* End-of-list marker (no length/name follows) */
+#define LIST_TYPE_FILE 0x01   /* Regular file (or unknown)                   */
+#define LIST_TYPE_DIR  0x02   /* Directory                                   */
+
+/**
+ * list_directory_recv - Retrieve a directory listing from the server.
+ *
+ * Wire format received:
+ *   [1 byte status: 0x00 = OK]
+ *   Repeated until end-of-list:
+ *     [1 byte type: LIST_TYPE_FILE (0x01) or LIST_TYPE_DIR (0x02)]
+ *     [4 bytes big-endian entry length]
+ *     [entry bytes]
+ *   End-of-list marker: [1 byte: LIST_TYPE_EOL (0x00)]
+ *
+ * Each line in the returned string is prefixed with the type:
+ *   "d:<name>\n"  for directories
+ *   "f:<name>\n"  for files
+ *
+ * @param sock         Connected socket, positioned after the mode byte.
+ * @param remote_path  Directory path on the server to list.
+ * @param out          Receives a heap-allocated string with one entry per
+ *                     line on success (caller must free()), NULL otherwise.
+ * @return             CMD_OK, CMD_REFUSED or CMD_IO_ERROR.
+ */
+static int list_directory_recv(sock_t sock, const char *remote_path, char **out)
+{
+	*out = NULL;
+	if (send_path(sock, remote_path) != 0)
+		return CMD_IO_ERROR;
+
+	unsigned char status;
+	if (recv_exact(sock, &status, 1) != 0)
+		return CMD_IO_ERROR;
+	if (status != 0x00) {
+		fprintf(stderr, "list_directory_sock: server reported error\n");
+		return CMD_REFUSED;
+	}
+
+	/* Dynamic string accumulator. */
+	size_t buf_cap  = 4096;
+	size_t buf_used = 0;
+	char  *result   = malloc(buf_cap);
+	if (!result)
+		return CMD_IO_ERROR;
+	result[0] = '\0';
+
+	char entry[MAX_PATH_LEN + 1];
+
+	while (1) {
+		/* Read the type byte first. */
+		unsigned char type_byte;
+		if (recv_exact(sock, &type_byte, 1) != 0) {
+			free(result);
+			return CMD_IO_ERROR;
+		}
+
+		if (type_byte == LIST_TYPE_EOL)
+			break;   /* End-of-list marker */
+
+		if (type_byte != LIST_TYPE_FILE && type_byte != LIST_TYPE_DIR) {
+			fprintf(stderr, "list_directory_sock: unknown type byte 0x%02x\n", type_byte);
+			free(result);
+			return CMD_IO_ERROR;
+		}
+
+		/* Read the 4-byte length. */
+		unsigned char len_buf[4];
+		if (recv_exact(sock, len_buf, 4) != 0) {
+			free(result);
+			return CMD_IO_ERROR;
+		}
+		uint32_t entry_len = be_to_uint32(len_buf);
+
+		if (entry_len == 0 || entry_len > MAX_PATH_LEN) {
+			fprintf(stderr, "list_directory_sock: invalid entry length %u\n", entry_len);
+			free(result);
+			return CMD_IO_ERROR;
+		}
+
+		if (recv_exact(sock, (unsigned char *)entry, entry_len) != 0) {
+			free(result);
+			return CMD_IO_ERROR;
+		}
+		entry[entry_len] = '\0';
+
+		/* Build the prefixed line: "d:<name>" or "f:<name>". */
+		const char *prefix = (type_byte == LIST_TYPE_DIR) ? "d:" : "f:";
+		size_t      prefix_len = 2;
+
+		/* Grow buffer if needed: prefix(2) + name + newline + NUL. */
+		size_t needed = buf_used + prefix_len + entry_len + 2;
+		if (needed > buf_cap) {
+			buf_cap = needed * 2;
+			char *tmp = realloc(result, buf_cap);
+			if (!tmp) {
+				free(result);
+				return CMD_IO_ERROR;
+			}
+			result = tmp;
+		}
+
+		if (buf_used > 0)
+			result[buf_used++] = '\n';
+
+		memcpy(result + buf_used, prefix, prefix_len);
+		buf_used += prefix_len;
+		memcpy(result + buf_used, entry, entry_len);
+		buf_used += entry_len;
+		result[buf_used] = '\0';
+	}
+
+	*out = result;
+	return CMD_OK;
+}
+
+/**
+ * list_directory_sock - Retrieve a directory listing from the server.
+ *
+ * Wrapper around list_directory_recv() for callers that only need the
+ * string (see list_directory_recv() for the wire format).
+ *
+ * @param sock         Connected socket, positioned after the mode byte.
+ * @param remote_path  Directory path on the server to list.
+ * @return             Heap-allocated string with one entry per line, or NULL
+ *                     on error. The caller must free() the returned string.
+ */
+char *list_directory_sock(sock_t sock, const char *remote_path)
+{
+	char *result;
+	list_directory_recv(sock, remote_path, &result);
+	return result;   /* Caller must free() */
+}
+
+/* Flag for list_page_recv() / session_list_page(): include stat metadata. */
+#define LIST_WANT_STAT 0x01
+
+/**
+ * list_entry_t - One entry of a paged listing.
+ *
+ * size, mtime and mode are only filled in when LIST_WANT_STAT was
+ * requested (zero otherwise).
+ */
+typedef struct {
+	const char *name;     /* Points into the owning listing_t's name pool */
+	int         is_dir;
+	uint64_t    size;
+	int64_t     mtime;    /* Seconds since the epoch */
+	uint32_t    mode;     /* Server st_mode bits */
+} list_entry_t;
+
+/**
+ * listing_t - A page of a remote directory, as returned by
+ *             session_list_page().  Release it with listing_free().
+ *
+ * Entries are sorted by the server: directories first, then by name
+ * ignoring case, so consecutive pages line up and entries[0 .. dirs-1]
+ * are exactly the directories.
+ *
+ * The name pool is a chain of blocks that never move once allocated, so
+ * entry names stay valid while listing_append() keeps growing the listing
+ * (a partly received listing can be drawn).
+ */
+typedef struct {
+	list_entry_t *entries;
+	uint32_t      count;  /* Entries in this page */
+	uint32_t      total;  /* Entries in the whole directory */
+	uint32_t      dirs;   /* Leading entries that are directories */
+	uint32_t      cap;    /* Allocated entries (internal) */
+	char         *names;  /* Name pool backing every entry (newest block) */
+	size_t        names_used;
+	size_t        names_cap;
+} listing_t;
+
+/* Name pool block size; longer names get a block of their own. */
+#define LIST_POOL_BLOCK (64 * 1024)
+
+/*
+ * Each pool block starts with a pointer to the previous block, so the
+ * whole chain can be freed from listing_t.names.
+ */
+#define LIST_POOL_LINK sizeof(char *)
+
+/**
+ * listing_free - Release a listing_t filled by list_page_recv() or
+ *                listing_append().
+ */
+void listing_free(listing_t *listing)
+{
+	char *block = listing->names;
+	while (block) {
+		char *prev;
+		memcpy(&prev, block, sizeof(prev));
+		free(block);
+		block = prev;
+	}
+	free(listing->entries);
+	memset(listing, 0, sizeof(*listing));
+}
+
+/**
+ * listing_append - Copy one entry (and its name) onto the end of a listing.
+ *
+ * Handy as the body of a list_entry_fn that collects a streamed listing;
+ * start from a zeroed listing_t.
+ *
+ * @param listing  Listing to grow.
+ * @param entry    Entry to copy; entry->name may be a temporary.
+ * @return         0, or -1 if out of memory (the listing is unchanged).
+ */
+int listing_append(listing_t *listing, const list_entry_t *entry)
+{
+	size_t len = strlen(entry->name) + 1;
+
+	if (listing->count == listing->cap) {
+		uint32_t cap = listing->cap ? listing->cap * 2 : 256;
+		list_entry_t *tmp = realloc(listing->entries, (size_t)cap * sizeof(*tmp));
+		if (!tmp)
+			return -1;
+		listing->entries = tmp;
+		listing->cap     = cap;
+	}
+
+	if (!listing->names || listing->names_used + len > listing->names_cap) {
+		size_t cap = (len + LIST_POOL_LINK > LIST_POOL_BLOCK) ? len + LIST_POOL_LINK
+		                                                      : LIST_POOL_BLOCK;
+		char *block = malloc(cap);
+		if (!block)
+			return -1;
+		memcpy(block, &listing->names, sizeof(listing->names));
+		listing->names      = block;
+		listing->names_used = LIST_POOL_LINK;
+		listing->names_cap  = cap;
+	}
+
+	char *name = listing->names + listing->names_used;
+	memcpy(name, entry->name, len);
+	listing->names_used += len;
+
+	list_entry_t *e = &listing->entries[listing->count];
+	*e = *entry;
+	e->name = name;
+	if (e->is_dir && listing->dirs == listing->count)
+		listing->dirs++;
+	listing->count++;
+	return 0;
+}
+
+/**
+ * list_entry_fn - Called by session_list_each() for every entry, in server
+ *                 order, as soon as it has been received.
+ *
+ * @param entry  The entry.  entry->name is only valid during the call.
+ * @param index  Position of the entry in the directory (0-based).
+ * @param total  Entries in the whole directory.
+ * @param arg    Caller's pointer, passed through.
+ * @return       0 to continue, nonzero to stop the listing early.
+ */
+typedef int (*list_entry_fn)(const list_entry_t *entry, uint32_t index,
+                             uint32_t total, void *arg);
+
+/* The callback asked to stop; the rest of the reply is still in flight. */
+#define LIST_STOPPED 3
+/* Conditional listing: the client's copy is still current. */
+#define LIST_UNCHANGED 4
+
+/* Status byte of a conditional listing whose token still matches. */
+#define LIST_STATUS_NOT_MODIFIED 0x02
+
+/* Receive buffer for streamed listings; must hold the largest entry. */
+#define LIST_READ_BUF (64 * 1024)
+
+/*
+ * list_reader_t - Buffered reader for a listing reply.
+ *
+ * A large directory arrives as a few hundred thousand tiny records, so
+ * reading each field with its own recv() would cost several system calls
+ * per entry.  The server sends nothing after the reply until the next
+ * command, so reading ahead cannot swallow another reply.
+ */
+typedef struct {
+	sock_t        sock;
+	size_t        pos;
+	size_t        len;
+	unsigned char buf[LIST_READ_BUF];
+} list_reader_t;
+
+/**
+ * list_read - Return a pointer to the next `n` bytes of the reply.
+ *
+ * @return  Pointer into the reader's buffer, valid until the next call,
+ *          or NULL if the connection closed.
+ */
+static const unsigned char *list_read(list_reader_t *r, size_t n)
+{
+	if (r->len - r->pos < n) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos  = 0;
+		while (r->len < n) {
+#ifdef _WIN32
+			int got = recv(r->sock, (char *)r->buf + r->len, (int)(sizeof(r->buf) - r->len), 0);
+#else
+			ssize_t got = sock_recv(r->sock, r->buf + r->len, sizeof(r->buf) - r->len);
+#endif
+			if (got <= 0)
+				return NULL;
+			r->len += (size_t)got;
+		}
+	}
+	const unsigned char *p = r->buf + r->pos;
+	r->pos += n;
+	return p;
+}
+
+/**
+ * list_stream_recv - Retrieve (part of) a directory with the extended list
+ *                    mode ('X'), handing each entry to `fn` as it arrives.
+ *
+ * Wire format sent (after the mode byte):
+ *   [length-prefixed remote_path]
+ *   [4 bytes big-endian offset][4 bytes big-endian limit, 0 = all]
+ *   [1 byte flags: LIST_WANT_STAT]
+ *
+ * With MODE_LIST_COND ('W') an 8-byte big-endian token follows the flags:
+ * the one that came with the caller's copy of this page, or 0.
+ *
+ * Wire format received:
+ *   [1 byte status: 0x00 = OK]
+ *   'W' only: [8 bytes big-endian token]; after status 0x02 (not
+ *   modified) nothing else follows
+ *   [4 bytes big-endian total entries][4 bytes big-endian entries in page]
+ *   For each entry:
+ *     [1 byte type: LIST_TYPE_FILE or LIST_TYPE_DIR]
+ *     [4 bytes big-endian name length][name bytes]
+ *     With LIST_WANT_STAT: [8 bytes size][8 bytes mtime][4 bytes mode]
+ *
+ * @param sock         Connected socket, positioned after the mode byte.
+ * @param remote_path  Directory path on the server.
+ * @param offset       Index of the first entry wanted.
+ * @param limit        Maximum entries to return (0 = no limit).
+ * @param flags        LIST_WANT_STAT or 0.
+ * @param fn           Callback for each entry.
+ * @param arg          Passed to fn.
+ * @param total        Receives the directory's entry count on CMD_OK.
+ * @param token        NULL for mode 'X'.  For mode 'W', the token to send
+ *                     on entry and the server's token on CMD_OK or
+ *                     LIST_UNCHANGED.
+ * @return             CMD_OK, CMD_REFUSED, CMD_IO_ERROR, LIST_UNCHANGED,
+ *                     or LIST_STOPPED if fn stopped early (the connection
+ *                     is then out of step and must be dropped).
+ */
+static int list_stream_recv(sock_t sock, const char *remote_path, uint32_t offset,
+                            uint32_t limit, unsigned flags, list_entry_fn fn,
+                            void *arg, uint32_t *total, uint64_t *token)
+{
+	unsigned char req[17];
+	size_t req_len = 9;
+	uint32_to_be(offset, req);
+	uint32_to_be(limit, req + 4);
+	req[8] = (unsigned char)flags;
+	if (token) {
+		uint64_to_be(*token, req + 9);
+		req_len += 8;
+	}
+	if (send_path(sock, remote_path) != 0 || send_all(sock, req, req_len) != 0)
+		return CMD_IO_ERROR;
+
+	unsigned char hdr[8];
+	if (recv_exact(sock, hdr, 1) != 0)
+		return CMD_IO_ERROR;
+	if (token && (hdr[0] == 0x00 || hdr[0] == LIST_STATUS_NOT_MODIFIED)) {
+		int unchanged = (hdr[0] == LIST_STATUS_NOT_MODIFIED);
+		if (recv_exact(sock, hdr, 8) != 0)
+			return CMD_IO_ERROR;
+		*token = be_to_uint64(hdr);
+		if (unchanged)
+			return LIST_UNCHANGED;
+	} else if (hdr[0] != 0x00) {
+		fprintf(stderr, "list_directory_sock: server reported error\n");
+		return CMD_REFUSED;
+	}
+	if (recv_exact(sock, hdr, 8) != 0)
+		return CMD_IO_ERROR;
+	uint32_t dir_total = be_to_uint32(hdr);
+	uint32_t count     = be_to_uint32(hdr + 4);
+	if (count > dir_total)
+		return CMD_IO_ERROR;
+
+	list_reader_t *r = malloc(sizeof(*r));
+	if (!r)
+		return CMD_IO_ERROR;
+	r->sock = sock;
+	r->pos  = r->len = 0;
+
+	char name[MAX_PATH_LEN + 1];
+	size_t stat_len = (flags & LIST_WANT_STAT) ? 20 : 0;
+	int rc = CMD_OK;
+
+	for (uint32_t i = 0; i < count; i++) {
+		const unsigned char *p = list_read(r, 5);
+		if (!p) {
+			rc = CMD_IO_ERROR;
+			break;
+		}
+		uint32_t len = be_to_uint32(p + 1);
+		if ((p[0] != LIST_TYPE_FILE && p[0] != LIST_TYPE_DIR) || len == 0 || len > MAX_PATH_LEN) {
+			rc = CMD_IO_ERROR;
+			break;
+		}
+
+		list_entry_t e = { .name = name, .is_dir = (p[0] == LIST_TYPE_DIR) };
+		if (!(p = list_read(r, len + stat_len))) {
+			rc = CMD_IO_ERROR;
+			break;
+		}
+		memcpy(name, p, len);
+		name[len] = '\0';
+		if (stat_len) {
+			e.size  = be_to_uint64(p + len);
+			e.mtime = (int64_t)be_to_uint64(p + len + 8);
+			e.mode  = be_to_uint32(p + len + 16);
+		}
+
+		if (fn(&e, offset + i, dir_total, arg) != 0) {
+			rc = LIST_STOPPED;
+			break;
+		}
+	}
+
+	free(r);
+	if (rc == CMD_OK)
+		*total = dir_total;
+	return rc;
+}
+
+/* list_entry_fn for list_page_recv(): collect into a listing_t. */
+static int list_collect(const list_entry_t *entry, uint32_t index, uint32_t total, void *arg)
+{
+	(void)index;
+	(void)total;
+	return listing_append(arg, entry);
+}
+
+/**
+ * list_page_recv - Retrieve one page of a directory into a listing_t
+ *                  (see list_stream_recv() for the wire format).
+ *
+ * @param sock         Connected socket, positioned after the mode byte.
+ * @param remote_path  Directory path on the server.
+ * @param offset       Index of the first entry wanted.
+ * @param limit        Maximum entries to return (0 = no limit).
+ * @param flags        LIST_WANT_STAT or 0.
+ * @param out          Filled on CMD_OK; release with listing_free().
+ * @return             CMD_OK, CMD_REFUSED or CMD_IO_ERROR.
+ */
+static int list_page_recv(sock_t sock, const char *remote_path, uint32_t offset,
+                          uint32_t limit, unsigned flags, listing_t *out)
+{
+	memset(out, 0, sizeof(*out));
+
+	uint32_t total;
+	int rc = list_stream_recv(sock, remote_path, offset, limit, flags,
+	                          list_collect, out, &total, NULL);
+	if (rc != CMD_OK) {
+		listing_free(out);
+		return (rc == LIST_STOPPED) ? CMD_IO_ERROR : rc;
+	}
+	out->total = total;
+	return CMD_OK;
+}
+
+/* ── Path utilities ──────────────────────────────────────────────────────── */
+
+/**
+ * get_default_download_dir - Return the platform default download directory.
+ *
+ * On Windows: %USERPROFILE%\Downloads (created if absent).
+ * On Linux/macOS: "." (current working directory).
+ *
+ * @param buf      Output buffer to store the path string.
+ * @param buf_size Size of buf in bytes.
+ * @return         Pointer to buf on success, NULL on error.
+ */
+char *get_default_download_dir(char *buf, size_t buf_size)
+{
+#ifdef _WIN32
+	char home[MAX_PATH];
+	if (SHGetFolderPathA(NULL, CSIDL_PROFILE, NULL, 0, home) != S_OK)
+		return NULL;
+	snprintf(buf, buf_size, "%s\\Downloads", home);
+	CreateDirectoryA(buf, NULL);   /* Silently OK if it already exists */
+#else
+	strncpy(buf, ".", buf_size - 1);
+	buf[buf_size - 1] = '\0';
+#endif
+	return buf;
+}
+
+/**
+ * expand_path - Expand a leading tilde (~) in a path to the home directory.
+ *
+ * Handles:
+ *   ~/path           → $HOME/path
+ *   ~username/path   → home directory of `username` + /path  (POSIX only)
  *   /absolute/path   → unchanged
  *   relative/path    → unchanged
  *
- * @param path     Input path string.
- * @param out      Output buffer.
- * @param out_size Size of out in bytes.
- * @return         Pointer to out on success, NULL on error.
+ * @param path     Input path string.
+ * @param out      Output buffer.
+ * @param out_size Size of out in bytes.
+ * @return         Pointer to out on success, NULL on error.
+ */
+char *expand_path(const char *path, char *out, size_t out_size)
+{
+	if (!path || path[0] == '\0') {
+		if (out_size > 0) out[0] = '\0';
+		return out;
+	}
+
+	if (path[0] != '~') {
+		strncpy(out, path, out_size - 1);
+		out[out_size - 1] = '\0';
+		return out;
+	}
+
+	/* Find where the tilde-prefix ends. */
+	const char *sep = strchr(path, '/');
+	size_t user_len = sep ? (size_t)(sep - path - 1) : strlen(path) - 1;
+
+#ifdef _WIN32
+	/* Windows: only bare ~ is supported. */
+	if (user_len == 0) {
+		char profile[MAX_PATH];
+		if (SHGetFolderPathA(NULL, CSIDL_PROFILE, NULL, 0, profile) != S_OK)
+			return NULL;
+		snprintf(out, out_size, "%s%s", profile, sep ? sep : "");
+		return out;
+	}
+	/* ~username not supported on Windows – return as-is. */
+	strncpy(out, path, out_size - 1);
+	out[out_size - 1] = '\0';
+	return out;
+#else
+	if (user_len == 0) {
+		/* ~/... — use $HOME or getpwuid. */
+		const char *home = getenv("HOME");
+		if (!home) {
+			struct passwd *pw = getpwuid(getuid());
+			if (!pw) return NULL;
+			home = pw->pw_dir;
+		}
+		snprintf(out, out_size, "%s%s", home, sep ? sep : "");
+	} else {
+		/* ~username/... */
+		char username[256];
+		if (user_len >= sizeof(username)) return NULL;
+		strncpy(username, path + 1, user_len);
+		username[user_len] = '\0';
+
+		struct passwd *pw = getpwnam(username);
+		if (!pw) return NULL;
+		snprintf(out, out_size, "%s%s", pw->pw_dir, sep ? sep : "");
+	}
+	return out;
+#endif
+}
+
+/* ── High-level API ──────────────────────────────────────────────────────── */
+
+/**
+ * download_from_server - Download a file from the remote server.
+ *
+ * Connects, performs the unlock/username/mode handshake, sends the remote
+ * path, then saves the received file under output_dir.  Uses the checked
+ * 'H' mode, so a connection dropped mid-transfer or a file whose CRC-32C
+ * doesn't match is reported as ERR_TRANSFER instead of leaving a silently
+ * truncated or damaged file.
+ *
+ * @param host        Server hostname or IP address.
+ * @param port        Server port as a string (e.g. "9000").
+ * @param username    Username sent to the server for tilde expansion.
+ * @param remote_path Path to the file on the server.
+ * @param output_dir  Local directory to save the file into (tilde expanded).
+ * @param out_path    Buffer (≥ MAX_PATH_LEN + 1 bytes) filled with the saved
+ *                    file's local path on success.
+ * @return            ERR_NONE (0) on success, or a bitmask of one or more
+ *                    ERR_* constants indicating which steps failed:
+ *                      ERR_PATH_EXPAND  – output_dir tilde expansion failed
+ *                      ERR_CONNECT      – could not connect to host:port
+ *                      ERR_UNLOCK       – send_unlock() failed
+ *                      ERR_PATH         – sending username failed
+ *                      ERR_MODE         – sending mode byte failed
+ *                      ERR_REMOTE_PATH  – sending remote_path failed
+ *                      ERR_TRANSFER     – receiving / writing the file failed
+ */
+int download_from_server(const char *host,
+						 const char *port,
+						 const char *username,
+						 const char *password,
+						 const char *remote_path,
+						 const char *output_dir,
+						 char       *out_path)
+{
+	char expanded_dir[MAX_PATH_LEN + 1];
+	if (!expand_path(output_dir, expanded_dir, sizeof(expanded_dir)))
+		return ERR_PATH_EXPAND;
+
+	sock_t sock = create_socket(host, port);
+	if (sock == SOCK_INVALID)
+		return ERR_CONNECT;
+
+	int rc = login_to_server(&sock, host, port, username, password);
+	if (rc == ERR_NONE && send_mode(sock, MODE_DOWNLOAD_SUM) != 0)
+		rc |= ERR_MODE;
+	unsigned char level = 0;
+	if (rc == ERR_NONE && (send_path(sock, remote_path) != 0 || send_all(sock, &level, 1) != 0))
+		rc |= ERR_REMOTE_PATH;
+	if (rc == ERR_NONE &&
+	    receive_file_framed(sock, expanded_dir, out_path, FRAMED_ENCODED | FRAMED_CHECKED) != CMD_OK)
+		rc |= ERR_TRANSFER;
+
+	CLOSE_SOCK(sock);
+	return rc;
+}
+
+/**
+ * upload_to_server - Upload a local file to the remote server.
+ *
+ * Connects, performs the unlock/username/mode handshake, then streams the
+ * file to the server using the framed 'u' mode; ERR_TRANSFER is only
+ * cleared once the server confirms the data is stored.
+ *
+ * @param host          Server hostname or IP address.
+ * @param port          Server port as a string (e.g. "9000").
+ * @param username      Username sent to the server for tilde expansion.
+ * @param local_file    Path to the local file (tilde expanded before use).
+ * @param remote_target Destination path on server; if NULL, defaults to the
+ *                      basename of local_file.
+ * @return              ERR_NONE (0) on success, or a bitmask of one or more
+ *                      ERR_* constants indicating which steps failed:
+ *                        ERR_PATH_EXPAND  – local_file tilde expansion failed
+ *                        ERR_CONNECT      – could not connect to host:port
+ *                        ERR_UNLOCK       – send_unlock() failed
+ *                        ERR_PATH         – sending username failed
+ *                        ERR_MODE         – sending mode byte failed
+ *                        ERR_TRANSFER     – local_file unreadable or the
+ *                                           upload failed
+ */
+int upload_to_server(const char *host,
+					 const char *port,
+					 const char *username,
+					 const char *password,
+					 const char *local_file,
+					 const char *remote_target)
+{
+	char expanded_file[MAX_PATH_LEN + 1];
+	if (!expand_path(local_file, expanded_file, sizeof(expanded_file)))
+		return ERR_PATH_EXPAND;
+
+	uint64_t size;
+	FILE *fp = open_upload_source(expanded_file, &size);
+	if (!fp)
+		return ERR_TRANSFER;
+
+	char default_target[MAX_PATH_LEN];
+	remote_target = default_upload_target(expanded_file, remote_target,
+	                                      default_target, sizeof(default_target));
+
+	sock_t sock = create_socket(host, port);
+	if (sock == SOCK_INVALID) {
+		fclose(fp);
+		return ERR_CONNECT;
+	}
+
+	int rc = login_to_server(&sock, host, port, username, password);
+	if (rc == ERR_NONE && send_mode(sock, MODE_UPLOAD_FRAMED) != 0)
+		rc |= ERR_MODE;
+	if (rc == ERR_NONE && upload_file_framed(sock, fp, size, remote_target, 0) != CMD_OK)
+		rc |= ERR_TRANSFER;
+
+	fclose(fp);
+	CLOSE_SOCK(sock);
+	return rc;
+}
+
+/**
+ * download_resume_from_server - Continue (or start) downloading a file,
+ *                               keeping what is already on disk.
+ *
+ * The local file output_dir/<basename of remote_path> is opened without
+ * truncation.  Its current size is sent as the offset of a ranged ('G')
+ * request and the rest of the remote file is appended.  Calling this again
+ * after a failure picks up from the new end of the local file; calling it
+ * on a complete file transfers nothing.
+ *
+ * If the remote file shrank below the local size, the server refuses the
+ * range and ERR_TRANSFER is returned; download_from_server() then starts
+ * over.
+ *
+ * @param host        Server hostname or IP address.
+ * @param port        Server port as a string (e.g. "9000").
+ * @param username    Username sent to the server for tilde expansion.
+ * @param remote_path Path to the file on the server.
+ * @param output_dir  Local directory to save the file into (tilde expanded).
+ * @param out_path    Buffer (≥ MAX_PATH_LEN + 1 bytes) filled with the local
+ *                    file's path.
+ * @return            ERR_NONE (0) on success, or a bitmask of ERR_* constants
+ *                    as for download_from_server().
+ */
+int download_resume_from_server(const char *host,
+                                const char *port,
+                                const char *username,
+                                const char *password,
+                                const char *remote_path,
+                                const char *output_dir,
+                                char       *out_path)
+{
+	char expanded_dir[MAX_PATH_LEN + 1];
+	if (!expand_path(output_dir, expanded_dir, sizeof(expanded_dir)))
+		return ERR_PATH_EXPAND;
+
+	uint64_t have;
+	FILE *fp = open_resume_target(remote_path, expanded_dir, out_path, &have);
+	if (!fp)
+		return ERR_TRANSFER;
+
+	sock_t sock = create_socket(host, port);
+	if (sock == SOCK_INVALID) {
+		fclose(fp);
+		return ERR_CONNECT;
+	}
+
+	int rc = login_to_server(&sock, host, port, username, password);
+	if (rc == ERR_NONE && receive_range_into(sock, remote_path, fp, have) != CMD_OK)
+		rc |= ERR_TRANSFER;
+
+	if (close_resume_target(fp, out_path, rc != ERR_NONE) != 0)
+		rc |= ERR_TRANSFER;
+	CLOSE_SOCK(sock);
+	return rc;
+}
+
+/**
+ * download_tree_from_server - Download a whole remote directory tree.
+ *
+ * Uses the recursive 'R' mode: every file below remote_dir arrives in one
+ * stream on one connection, instead of a list_directory() plus one
+ * download_from_server() (and re-authentication) per file.  Symlinks and
+ * special files are not transferred.
+ *
+ * @param host        Server hostname or IP address.
+ * @param port        Server port as a string (e.g. "9000").
+ * @param username    Username sent to the server for tilde expansion.
+ * @param remote_dir  Directory on the server.
+ * @param output_dir  Local directory to unpack into (tilde expanded); the
+ *                    tree lands in output_dir/<basename of remote_dir>.
+ * @param out_path    Buffer (≥ MAX_PATH_LEN + 1 bytes) filled with the local
+ *                    root directory on success.
+ * @return            ERR_NONE (0) on success, or a bitmask of ERR_* constants
+ *                    as for download_from_server().
+ */
+int download_tree_from_server(const char *host,
+                              const char *port,
+                              const char *username,
+                              const char *password,
+                              const char *remote_dir,
+                              const char *output_dir,
+                              char       *out_path)
+{
+	char expanded_dir[MAX_PATH_LEN + 1];
+	if (!expand_path(output_dir, expanded_dir, sizeof(expanded_dir)))
+		return ERR_PATH_EXPAND;
+
+	sock_t sock = create_socket(host, port);
+	if (sock == SOCK_INVALID)
+		return ERR_CONNECT;
+
+	int rc = login_to_server(&sock, host, port, username, password);
+	if (rc == ERR_NONE && send_mode(sock, MODE_TREE) != 0)
+		rc |= ERR_MODE;
+	if (rc == ERR_NONE && send_path(sock, remote_dir) != 0)
+		rc |= ERR_REMOTE_PATH;
+	if (rc == ERR_NONE && receive_tree(sock, expanded_dir, out_path) != CMD_OK)
+		rc |= ERR_TRANSFER;
+
+	CLOSE_SOCK(sock);
+	return rc;
+}
+
+/**
+ * list_directory - List contents of a remote directory.
+ *
+ * Connects, performs the unlock/username/mode handshake, then retrieves the
+ * directory listing as a newline-separated string.
+ *
+ * Note: because this function returns a heap-allocated string rather than an
+ * int, it cannot use the ERR_* bitmask scheme.  NULL indicates failure;
+ * a non-NULL pointer (possibly pointing to an empty string "") indicates
+ * success.  The caller is responsible for free()-ing the returned pointer.
+ *
+ * @param host        Server hostname or IP address.
+ * @param port        Server port as a string (e.g. "9000").
+ * @param username    Username sent to the server for tilde expansion.
+ * @param remote_path Path to the directory on the server.
+ * @return            Heap-allocated string (entries separated by '\n'), or
+ *                    NULL on error.
+ */
+char *list_directory(const char *host,
+					 const char *port,
+					 const char *username,
+					 const char *password,
+					 const char *remote_path)
+{
+	sock_t sock = create_socket(host, port);
+	if (sock == SOCK_INVALID)
+		return NULL;
+
+	char *result = NULL;
+	if (login_to_server(&sock, host, port, username, password) == ERR_NONE &&
+		send_mode(sock, MODE_LIST) == 0)
+	{
+		result = list_directory_sock(sock, remote_path);
+	}
+
+	CLOSE_SOCK(sock);
+	return result;   /* Caller must free() */
+}
+
+/* ── Persistent sessions ─────────────────────────────────────────────────── */
+
+/*
+ * A persistent session pays the connect + unlock + authentication cost once
+ * and then runs any number of list/download/upload commands on the same
+ * connection (mode 'S' on the server). If the server has dropped an idle
+ * connection, the next command transparently reconnects once.
+ *
+ *   session_t s;
+ *   if (session_open(&s, host, port, user, pass) == ERR_NONE) {
+ *       char *listing = session_list(&s, "~");
+ *       session_download(&s, "~/a.txt", ".", out_path);
+ *       session_close(&s);
+ *   }
+ */
+typedef struct {
+	sock_t sock;
+	char   host[256];
+	char   port[16];
+	char   username[256];
+	char   password[256];
+	int    compress_level;   /* 0 = off; 1-9 = zlib level, see session_set_compression() */
+	int    no_list_cond;     /* Server lacks mode 'W'; session_list_cached() uses 'X' */
+} session_t;
+
+/**
+ * session_connect - (Re)open the session connection and enter session mode.
+ *
+ * @param s  Session holding the connection parameters.
+ * @return   ERR_NONE, or a combination of ERR_CONNECT / ERR_UNLOCK /
+ *           ERR_PATH / ERR_AUTH / ERR_MODE.
+ */
+static int session_connect(session_t *s)
+{
+	s->sock = create_socket(s->host, s->port);
+	if (s->sock == SOCK_INVALID)
+		return ERR_CONNECT;
+
+	unsigned char status;
+	int rc = login_to_server(&s->sock, s->host, s->port, s->username, s->password);
+	if (rc == ERR_NONE && (send_mode(s->sock, MODE_SESSION) != 0 ||
+	                       recv_exact(s->sock, &status, 1) != 0 || status != 0x00))
+		rc |= ERR_MODE;
+
+	if (rc != ERR_NONE) {
+		CLOSE_SOCK(s->sock);
+		s->sock = SOCK_INVALID;
+	}
+	return rc;
+}
+
+/**
+ * session_drop - Close a broken session connection (parameters are kept).
+ */
+static void session_drop(session_t *s)
+{
+	if (s->sock != SOCK_INVALID) {
+		CLOSE_SOCK(s->sock);
+		s->sock = SOCK_INVALID;
+	}
+}
+
+/**
+ * session_open - Connect, authenticate and enter persistent session mode.
+ *
+ * @param s         Session to initialise.
+ * @param host      Server hostname or IP address.
+ * @param port      Server port as a string (e.g. "9001").
+ * @param username  Username to authenticate as.
+ * @param password  Plaintext password (kept in s for reconnects).
+ * @return          ERR_NONE (0) on success, or a bitmask of ERR_CONNECT,
+ *                  ERR_UNLOCK, ERR_PATH, ERR_AUTH, ERR_MODE.
+ */
+int session_open(session_t *s, const char *host, const char *port,
+                 const char *username, const char *password)
+{
+	memset(s, 0, sizeof(*s));
+	s->sock = SOCK_INVALID;
+	if (strlen(host) >= sizeof(s->host) || strlen(port) >= sizeof(s->port) ||
+	    strlen(username) >= sizeof(s->username) || strlen(password) >= sizeof(s->password))
+		return ERR_PATH;
+
+	strcpy(s->host, host);
+	strcpy(s->port, port);
+	strcpy(s->username, username);
+	strcpy(s->password, password);
+
+	int rc = session_connect(s);
+	if (rc != ERR_NONE)
+		memset(s->password, 0, sizeof(s->password));
+	return rc;
+}
+
+/**
+ * session_close - Tell the server the session is over and disconnect.
+ *
+ * Also wipes the stored password.
+ */
+void session_close(session_t *s)
+{
+	if (s->sock != SOCK_INVALID)
+		send_mode(s->sock, MODE_QUIT);
+	session_drop(s);
+	memset(s->password, 0, sizeof(s->password));
+}
+
+/**
+ * session_set_compression - Compress session downloads and uploads.
+ *
+ * Downloads then ask for that level in their 'H' request and uploads use
+ * mode 'P'. The server may still
+ * send a file uncompressed (already-compressed types, small files, its own
+ * level cap); uploads of already-compressed types are sent as-is.
+ *
+ * @param s      Open session.
+ * @param level  zlib level 1 (fast) - 9 (small), or 0 to turn it off.
+ */
+void session_set_compression(session_t *s, int level)
+{
+	s->compress_level = (level < 0) ? 0 : (level > 9) ? 9 : level;
+}
+
+/**
+ * session_begin - Make sure a connection is available for the next command.
+ *
+ * @param s       Session.
+ * @param reused  Set to 1 if an existing connection will be used (so a
+ *                failure may just mean the server timed it out).
+ * @return        ERR_NONE or the session_connect() error bits.
+ */
+static int session_begin(session_t *s, int *reused)
+{
+	*reused = (s->sock != SOCK_INVALID);
+	if (*reused)
+		return ERR_NONE;
+	return session_connect(s);
+}
+
+/**
+ * session_list - List a remote directory over the session connection.
+ *
+ * @param s            Open session.
+ * @param remote_path  Directory path on the server.
+ * @return             Heap-allocated "d:/f:" listing (see list_directory()),
+ *                     or NULL on error. The caller must free() it.
+ */
+char *session_list(session_t *s, const char *remote_path)
+{
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int reused;
+		if (session_begin(s, &reused) != ERR_NONE)
+			return NULL;
+
+		char *result = NULL;
+		int rc = CMD_IO_ERROR;
+		if (send_mode(s->sock, MODE_LIST) == 0)
+			rc = list_directory_recv(s->sock, remote_path, &result);
+		if (rc == CMD_OK)
+			return result;
+		if (rc == CMD_REFUSED)
+			return NULL;
+
+		session_drop(s);
+		if (!reused)
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * session_list_page - Fetch one sorted page of a remote directory, with
+ *                     optional size/mtime/mode, over the session connection.
+ *
+ * @param s            Open session.
+ * @param remote_path  Directory path on the server.
+ * @param offset       Index of the first entry wanted.
+ * @param limit        Maximum entries to return (0 = the whole directory).
+ * @param flags        LIST_WANT_STAT or 0.
+ * @param out          Filled on success; release with listing_free().
+ * @return             ERR_NONE, the session_connect() error bits, or
+ *                     ERR_TRANSFER.
+ */
+int session_list_page(session_t *s, const char *remote_path, uint32_t offset,
+                      uint32_t limit, unsigned flags, listing_t *out)
+{
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int reused;
+		int rc = session_begin(s, &reused);
+		if (rc != ERR_NONE)
+			return rc;
+
+		rc = CMD_IO_ERROR;
+		if (send_mode(s->sock, MODE_LIST_EX) == 0)
+			rc = list_page_recv(s->sock, remote_path, offset, limit, flags, out);
+		if (rc == CMD_OK)
+			return ERR_NONE;
+		if (rc == CMD_REFUSED)
+			return ERR_TRANSFER;
+
+		session_drop(s);
+		if (!reused)
+			break;
+	}
+	return ERR_TRANSFER;
+}
+
+/*
+ * Wraps a session_list_each() callback to note whether any entry has been
+ * delivered, since after that a failed listing can no longer be retried.
+ */
+struct list_probe {
+	list_entry_fn fn;
+	void         *arg;
+	int           seen;
+};
+
+static int list_probe_entry(const list_entry_t *entry, uint32_t index, uint32_t total, void *arg)
+{
+	struct list_probe *probe = arg;
+	probe->seen = 1;
+	return probe->fn(entry, index, total, probe->arg);
+}
+
+/**
+ * session_list_each - Stream a whole remote directory, calling `fn` for
+ *                     every entry as soon as it arrives.
+ *
+ * Entries come in server order (directories first, then by name ignoring
+ * case), so a caller can show the first screenful long before a huge
+ * directory has been received.  If fn stops early the connection is
+ * dropped, since the rest of the reply is still on its way; the next
+ * session command reconnects.
+ *
+ * A reused connection that turns out to be dead is retried once, but
+ * only if fn has not seen any entries yet.
+ *
+ * @param s            Open session.
+ * @param remote_path  Directory path on the server.
+ * @param flags        LIST_WANT_STAT or 0.
+ * @param fn           Callback for each entry (see list_entry_fn).
+ * @param arg          Passed to fn.
+ * @return             ERR_NONE (also when fn stopped early), the
+ *                     session_connect() error bits, or ERR_TRANSFER.
+ */
+int session_list_each(session_t *s, const char *remote_path, unsigned flags,
+                      list_entry_fn fn, void *arg)
+{
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int reused;
+		int rc = session_begin(s, &reused);
+		if (rc != ERR_NONE)
+			return rc;
+
+		struct list_probe probe = { .fn = fn, .arg = arg };
+		uint32_t total;
+		rc = CMD_IO_ERROR;
+		if (send_mode(s->sock, MODE_LIST_EX) == 0)
+			rc = list_stream_recv(s->sock, remote_path, 0, 0, flags,
+			                      list_probe_entry, &probe, &total, NULL);
+		if (rc == CMD_OK)
+			return ERR_NONE;
+		if (rc == CMD_REFUSED)
+			return ERR_TRANSFER;
+
+		session_drop(s);
+		if (rc == LIST_STOPPED)
+			return ERR_NONE;
+		if (!reused || probe.seen)
+			break;
+	}
+	return ERR_TRANSFER;
+}
+
+/**
+ * session_download - Download a remote file over the session connection.
+ *
+ * Uses mode 'H', so the saved file is checked against the server's CRC-32C
+ * (a mismatch is handled like a dropped connection and removes the file).
+ *
+ * @param s            Open session.
+ * @param remote_path  Path to the file on the server.
+ * @param output_dir   Local directory to save into (tilde expanded).
+ * @param out_path     Buffer (≥ MAX_PATH_LEN + 1 bytes) for the saved path.
+ * @return             ERR_NONE, ERR_PATH_EXPAND, the session_connect() error
+ *                     bits, or ERR_TRANSFER.
+ */
+int session_download(session_t *s, const char *remote_path,
+                     const char *output_dir, char *out_path)
+{
+	char expanded_dir[MAX_PATH_LEN + 1];
+	if (!expand_path(output_dir, expanded_dir, sizeof(expanded_dir)))
+		return ERR_PATH_EXPAND;
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int reused;
+		int rc = session_begin(s, &reused);
+		if (rc != ERR_NONE)
+			return rc;
+
+		unsigned char level = (unsigned char)s->compress_level;
+		if (send_mode(s->sock, MODE_DOWNLOAD_SUM) != 0 ||
+		    send_path(s->sock, remote_path) != 0 || send_all(s->sock, &level, 1) != 0)
+			rc = CMD_IO_ERROR;
+		else
+			rc = receive_file_framed(s->sock, expanded_dir, out_path,
+			                         FRAMED_ENCODED | FRAMED_CHECKED);
+		if (rc == CMD_OK)
+			return ERR_NONE;
+		if (rc == CMD_REFUSED)
+			return ERR_TRANSFER;
+
+		session_drop(s);
+		if (!reused)
+			break;
+	}
+	return ERR_TRANSFER;
+}
+
+/**
+ * local_file_crc32c - Size and CRC-32C of a local file.
+ *
+ * @return  0 on success, -1 if the file can't be read.
+ */
+static int local_file_crc32c(const char *path, uint64_t *size, uint32_t *crc)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+
+	unsigned char *buf = malloc(COMPRESS_BUF_SIZE);
+	uint32_t c = 0;
+	uint64_t total = 0;
+	size_t n;
+	while (buf && (n = fread(buf, 1, COMPRESS_BUF_SIZE, fp)) > 0) {
+		c = crc32c_update(c, buf, n);
+		total += n;
+	}
+	int rc = (buf && !ferror(fp)) ? 0 : -1;
+	free(buf);
+	fclose(fp);
+	*size = total;
+	*crc = c;
+	return rc;
+}
+
+/**
+ * session_checksum - Ask the server for a file's size and CRC-32C.
+ *
+ * Uses mode 'K': the server reads the file but sends only
+ * [1 byte status][8 bytes big-endian size][4 bytes big-endian CRC-32C].
+ *
+ * @param s            Open session.
+ * @param remote_path  Regular file on the server.
+ * @param size         Output: file size.
+ * @param crc          Output: CRC-32C of the contents.
+ * @return             ERR_NONE, the session_connect() error bits, or
+ *                     ERR_TRANSFER (also if the server refused the path).
+ */
+int session_checksum(session_t *s, const char *remote_path, uint64_t *size, uint32_t *crc)
+{
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int reused;
+		int rc = session_begin(s, &reused);
+		if (rc != ERR_NONE)
+			return rc;
+
+		unsigned char reply[12];
+		unsigned char status;
+		if (send_mode(s->sock, MODE_CHECKSUM) == 0 && send_path(s->sock, remote_path) == 0 &&
+		    recv_exact(s->sock, &status, 1) == 0) {
+			if (status != 0x00)
+				return ERR_TRANSFER;
+			if (recv_exact(s->sock, reply, sizeof(reply)) == 0) {
+				*size = be_to_uint64(reply);
+				*crc = be_to_uint32(reply + 8);
+				return ERR_NONE;
+			}
+		}
+
+		session_drop(s);
+		if (!reused)
+			break;
+	}
+	return ERR_TRANSFER;
+}
+
+/**
+ * session_metrics - Fetch the server's counters (mode 'M', root only).
+ *
+ * Wire format received from server:
+ *   [1 byte status: 0x00 = OK]
+ *   [4 bytes big-endian length][Prometheus text exposition format]
+ *
+ * @param s  Open session, logged in as root.
+ * @return   Heap-allocated, NUL-terminated text, or NULL if the server
+ *           refused or the connection failed. The caller must free() it.
+ */
+char *session_metrics(session_t *s)
+{
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int reused;
+		if (session_begin(s, &reused) != ERR_NONE)
+			return NULL;
+
+		unsigned char status, len_buf[4];
+		if (send_mode(s->sock, MODE_METRICS) == 0 && recv_exact(s->sock, &status, 1) == 0) {
+			if (status != 0x00)
+				return NULL;
+			if (recv_exact(s->sock, len_buf, 4) == 0) {
+				uint32_t len = be_to_uint32(len_buf);
+				char *text = malloc((size_t)len + 1);
+				if (text && recv_exact(s->sock, (unsigned char *)text, len) == 0) {
+					text[len] = '\0';
+					return text;
+				}
+				free(text);
+			}
+		}
+
+		session_drop(s);
+		if (!reused)
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * session_download_if_changed - Download a file unless an identical copy
+ *                               is already in output_dir.
+ *
+ * The local file <output_dir>/<basename of remote_path> is compared with
+ * the server's size and CRC-32C (session_checksum()); only if they differ,
+ * or there is no local file, is it downloaded with session_download().
+ *
+ * @param s            Open session.
+ * @param remote_path  Path to the file on the server.
+ * @param output_dir   Local directory to save into (tilde expanded).
+ * @param out_path     Buffer (≥ MAX_PATH_LEN + 1 bytes) for the local path.
+ * @param skipped      If non-NULL, set to 1 when the download was skipped.
+ * @return             Same as session_download().
+ */
+int session_download_if_changed(session_t *s, const char *remote_path,
+                                const char *output_dir, char *out_path, int *skipped)
+{
+	char expanded_dir[MAX_PATH_LEN + 1];
+	if (skipped)
+		*skipped = 0;
+	if (!expand_path(output_dir, expanded_dir, sizeof(expanded_dir)))
+		return ERR_PATH_EXPAND;
+
+	const char *base = strrchr(remote_path, '/');
+	base = base ? base + 1 : remote_path;
+	uint64_t remote_size, local_size;
+	uint32_t remote_crc, local_crc;
+	if (*base && join_output_path(expanded_dir, base, out_path) == 0 &&
+	    session_checksum(s, remote_path, &remote_size, &remote_crc) == ERR_NONE &&
+	    local_file_crc32c(out_path, &local_size, &local_crc) == 0 &&
+	    local_size == remote_size && local_crc == remote_crc) {
+		if (skipped)
+			*skipped = 1;
+		return ERR_NONE;
+	}
+	return session_download(s, remote_path, output_dir, out_path);
+}
+
+/**
+ * session_download_resume - download_resume_from_server() over the session
+ *                           connection.
+ *
+ * A dropped reused connection is retried once from the new end of the
+ * local file.
+ *
+ * @param s            Open session.
+ * @param remote_path  Path to the file on the server.
+ * @param output_dir   Local directory to save into (tilde expanded).
+ * @param out_path     Buffer (≥ MAX_PATH_LEN + 1 bytes) for the local path.
+ * @return             ERR_NONE, ERR_PATH_EXPAND, the session_connect() error
+ *                     bits, or ERR_TRANSFER.
+ */
+int session_download_resume(session_t *s, const char *remote_path,
+                            const char *output_dir, char *out_path)
+{
+	char expanded_dir[MAX_PATH_LEN + 1];
+	if (!expand_path(output_dir, expanded_dir, sizeof(expanded_dir)))
+		return ERR_PATH_EXPAND;
+
+	uint64_t have;
+	FILE *fp = open_resume_target(remote_path, expanded_dir, out_path, &have);
+	if (!fp)
+		return ERR_TRANSFER;
+
+	int result = ERR_TRANSFER;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int reused;
+		int rc = session_begin(s, &reused);
+		if (rc != ERR_NONE) {
+			result = rc;
+			break;
+		}
+
+		/* Flush and re-measure so a retry starts after what already arrived. */
+		if (fflush(fp) != 0 || local_file_size(fp, &have) != 0)
+			break;
+		rc = receive_range_into(s->sock, remote_path, fp, have);
+		if (rc == CMD_OK) {
+			result = ERR_NONE;
+			break;
+		}
+		if (rc == CMD_REFUSED)
+			break;
+
+		session_drop(s);
+		if (!reused)
+			break;
+	}
+
+	if (close_resume_target(fp, out_path, result != ERR_NONE) != 0)
+		result = ERR_TRANSFER;
+	return result;
+}
+
+/**
+ * session_download_tree - download_tree_from_server() over the session
+ *                         connection.
+ *
+ * @param s            Open session.
+ * @param remote_dir   Directory on the server.
+ * @param output_dir   Local directory to unpack into (tilde expanded).
+ * @param out_path     Buffer (≥ MAX_PATH_LEN + 1 bytes) for the local root.
+ * @return             ERR_NONE, ERR_PATH_EXPAND, the session_connect() error
+ *                     bits, or ERR_TRANSFER.
+ */
+int session_download_tree(session_t *s, const char *remote_dir,
+                          const char *output_dir, char *out_path)
+{
+	char expanded_dir[MAX_PATH_LEN + 1];
+	if (!expand_path(output_dir, expanded_dir, sizeof(expanded_dir)))
+		return ERR_PATH_EXPAND;
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int reused;
+		int rc = session_begin(s, &reused);
+		if (rc != ERR_NONE)
+			return rc;
+
+		if (send_mode(s->sock, MODE_TREE) != 0 || send_path(s->sock, remote_dir) != 0)
+			rc = CMD_IO_ERROR;
+		else
+			rc = receive_tree(s->sock, expanded_dir, out_path);
+		if (rc == CMD_OK)
+			return ERR_NONE;
+		if (rc == CMD_REFUSED)
+			return ERR_TRANSFER;
+
+		session_drop(s);
+		if (!reused)
+			break;
+	}
+	return ERR_TRANSFER;
+}
+
+/**
+ * session_upload - Upload a local file over the session connection.
+ *
+ * @param s              Open session.
+ * @param local_file     Path to the local file (tilde expanded).
+ * @param remote_target  Destination on the server; NULL means the basename
+ *                       of local_file.
+ * @return               ERR_NONE, ERR_PATH_EXPAND, the session_connect()
+ *                       error bits, or ERR_TRANSFER.
+ */
+int session_upload(session_t *s, const char *local_file, const char *remote_target)
+{
+	char expanded_file[MAX_PATH_LEN + 1];
+	if (!expand_path(local_file, expanded_file, sizeof(expanded_file)))
+		return ERR_PATH_EXPAND;
+
+	uint64_t size;
+	FILE *fp = open_upload_source(expanded_file, &size);
+	if (!fp)
+		return ERR_TRANSFER;
+
+	char default_target[MAX_PATH_LEN];
+	remote_target = default_upload_target(expanded_file, remote_target,
+	                                      default_target, sizeof(default_target));
+
+	int level = compression_worthwhile(expanded_file) ? s->compress_level : 0;
+	int result = ERR_TRANSFER;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		/* A pipe can't be rewound, so only measured files are retried. */
+		if (attempt > 0 && (size == FRAMED_SIZE_CHUNKED || fseek(fp, 0, SEEK_SET) != 0))
+			break;
+
+		int reused;
+		int rc = session_begin(s, &reused);
+		if (rc != ERR_NONE) {
+			result = rc;
+			break;
+		}
+
+		if (send_mode(s->sock, level ? MODE_UPLOAD_Z : MODE_UPLOAD) != 0)
+			rc = CMD_IO_ERROR;
+		else
+			rc = upload_file_framed(s->sock, fp, size, remote_target, level);
+		if (rc == CMD_OK) {
+			result = ERR_NONE;
+			break;
+		}
+		if (rc == CMD_REFUSED)
+			break;
+
+		session_drop(s);
+		if (!reused)
+			break;
+	}
+
+	fclose(fp);
+	return result;
+}
+
+/**
+ * session_upload_delta - Re-upload a file, sending only what changed.
+ *
+ * The server's copy of remote_target is compared block by block (mode
+ * 'Y', see upload_file_delta()); only new data and block references are
+ * sent, so a large file with a few changed regions costs a fraction of a
+ * full upload. Falls back to session_upload() when the delta is refused
+ * or doesn't verify, when the server doesn't support it, and for pipes.
+ *
+ * @param s              Open session.
+ * @param local_file     Path to the local file (tilde expanded).
+ * @param remote_target  Destination on the server; NULL means the basename
+ *                       of local_file.
+ * @return               Same as session_upload().
+ */
+int session_upload_delta(session_t *s, const char *local_file, const char *remote_target)
+{
+	char expanded_file[MAX_PATH_LEN + 1];
+	if (!expand_path(local_file, expanded_file, sizeof(expanded_file)))
+		return ERR_PATH_EXPAND;
+
+	uint64_t size;
+	FILE *fp = open_upload_source(expanded_file, &size);
+	if (!fp)
+		return ERR_TRANSFER;
+	if (size == FRAMED_SIZE_CHUNKED) {
+		fclose(fp);
+		return session_upload(s, local_file, remote_target);
+	}
+
+	char default_target[MAX_PATH_LEN];
+	const char *target = default_upload_target(expanded_file, remote_target,
+	                                           default_target, sizeof(default_target));
+
+	int reused;
+	int rc = session_begin(s, &reused);
+	if (rc != ERR_NONE) {
+		fclose(fp);
+		return rc;
+	}
+	if (send_mode(s->sock, MODE_DELTA) != 0)
+		rc = CMD_IO_ERROR;
+	else
+		rc = upload_file_delta(s->sock, fp, target);
+	fclose(fp);
+	if (rc == CMD_OK)
+		return ERR_NONE;
+
+	/* Servers without mode 'Y' drop the connection; session_upload() reconnects */
+	if (rc == CMD_IO_ERROR)
+		session_drop(s);
+	return session_upload(s, local_file, remote_target);
+}
+
+/* ── Listing cache and prefetch ──────────────────────────────────────────── */
+
+#ifndef _WIN32
+
+/*
+ * A list_cache_t keeps recent listings, keyed by host, port, user, flags
+ * and path, so going back to a directory does not wait for the network.
+ * Entries carry the server's revalidation token (mode 'W'), so checking a
+ * cached copy costs one small round trip, and nothing is resent if the
+ * directory has not changed.  A list_prefetch_t fills the cache in the
+ * background on a second connection.
+ *
+ *   list_cache_init(&cache, 64 << 20);
+ *   const listing_t *l = list_cache_lookup(&cache, &s, "~/src", LIST_WANT_STAT, &age);
+ *   if (!l || age > 5)
+ *       session_list_cached(&s, &cache, "~/src", LIST_WANT_STAT, NULL, NULL, &l);
+ *   ...
+ *   list_cache_release(&cache, l);
+ *
+ * Listings handed out are reference counted and never change, so they stay
+ * valid after being replaced or evicted until released.
+ */
+
+/* One cached listing; `listing` comes first so it can be handed out. */
+typedef struct cached_listing {
+	listing_t              listing;
+	uint64_t               token;     /* From the server; 0 = none ('X' fallback) */
+	double                 checked;   /* Monotonic time it was last fetched or revalidated */
+	size_t                 bytes;     /* Memory charged against the cache */
+	int                    refs;      /* The cache's link counts as one */
+	struct cached_listing *prev, *next;
+	char                   key[];
+} cached_listing_t;
+
+typedef struct {
+	pthread_mutex_t   lock;
+	cached_listing_t *head;       /* Most recently used */
+	cached_listing_t *tail;
+	size_t            bytes;
+	size_t            max_bytes;
+} list_cache_t;
+
+/**
+ * listing_progress_fn - Called by session_list_cached() after each entry
+ *                       of a listing that is being received.
+ *
+ * @param partial  The entries so far (count grows towards total).
+ * @param arg      Caller's pointer, passed through.
+ */
+typedef void (*listing_progress_fn)(const listing_t *partial, void *arg);
+
+static double monotonic_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Cache key: everything that makes two listings different. */
+static int list_cache_key(const session_t *s, const char *remote_path, unsigned flags,
+                          char *key, size_t key_size)
+{
+	int n = snprintf(key, key_size, "%s\n%s\n%s\n%u\n%s", s->host, s->port,
+	                 s->username, flags, remote_path);
+	return (n < 0 || (size_t)n >= key_size) ? -1 : 0;
+}
+
+#define LIST_CACHE_KEY_MAX (sizeof(((session_t *)0)->host) + sizeof(((session_t *)0)->port) + \
+                            sizeof(((session_t *)0)->username) + MAX_PATH_LEN + 16)
+
+/* Approximate memory held by a listing: entry array plus pool blocks. */
+static size_t listing_bytes(const listing_t *l)
+{
+	size_t bytes = (size_t)l->cap * sizeof(list_entry_t);
+	for (char *block = l->names; block; ) {
+		bytes += LIST_POOL_BLOCK;
+		memcpy(&block, block, sizeof(block));
+	}
+	return bytes;
+}
+
+static void cached_unref(cached_listing_t *e)
+{
+	if (--e->refs == 0) {
+		listing_free(&e->listing);
+		free(e);
+	}
+}
+
+/* Caller holds c->lock. */
+static void cache_detach(list_cache_t *c, cached_listing_t *e)
+{
+	if (e->prev) e->prev->next = e->next; else c->head = e->next;
+	if (e->next) e->next->prev = e->prev; else c->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+/* Remove e from the cache and drop the cache's reference.  Caller holds c->lock. */
+static void cache_unlink(list_cache_t *c, cached_listing_t *e)
+{
+	cache_detach(c, e);
+	c->bytes -= e->bytes;
+	cached_unref(e);
+}
+
+/* Caller holds c->lock. */
+static void cache_push_front(list_cache_t *c, cached_listing_t *e)
+{
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head) c->head->prev = e; else c->tail = e;
+	c->head = e;
+}
+
+/* Caller holds c->lock. */
+static cached_listing_t *cache_find(list_cache_t *c, const char *key)
+{
+	for (cached_listing_t *e = c->head; e; e = e->next)
+		if (strcmp(e->key, key) == 0)
+			return e;
+	return NULL;
+}
+
+/**
+ * list_cache_init - Set up an empty listing cache.
+ *
+ * @param c          Cache to initialise.
+ * @param max_bytes  Memory budget; least recently used listings are
+ *                   evicted beyond it.
+ */
+void list_cache_init(list_cache_t *c, size_t max_bytes)
+{
+	memset(c, 0, sizeof(*c));
+	pthread_mutex_init(&c->lock, NULL);
+	c->max_bytes = max_bytes;
+}
+
+/**
+ * list_cache_destroy - Drop every cached listing.
+ *
+ * Listings still held by callers are freed when they are released.
+ */
+void list_cache_destroy(list_cache_t *c)
+{
+	pthread_mutex_lock(&c->lock);
+	while (c->head)
+		cache_unlink(c, c->head);
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_destroy(&c->lock);
+}
+
+/**
+ * list_cache_lookup - Return a cached listing without touching the network.
+ *
+ * @param c            Cache.
+ * @param s            Session the listing would be fetched with (for the key).
+ * @param remote_path  Directory path as passed to session_list_cached().
+ * @param flags        LIST_WANT_STAT or 0.
+ * @param age          If not NULL, receives the seconds since the copy was
+ *                     fetched or last revalidated.
+ * @return             A referenced listing (release with
+ *                     list_cache_release()), or NULL if none is cached.
+ */
+const listing_t *list_cache_lookup(list_cache_t *c, const session_t *s,
+                                   const char *remote_path, unsigned flags, double *age)
+{
+	char key[LIST_CACHE_KEY_MAX];
+	if (list_cache_key(s, remote_path, flags, key, sizeof(key)) != 0)
+		return NULL;
+
+	pthread_mutex_lock(&c->lock);
+	cached_listing_t *e = cache_find(c, key);
+	if (e) {
+		e->refs++;
+		cache_detach(c, e);
+		cache_push_front(c, e);
+		if (age)
+			*age = monotonic_seconds() - e->checked;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return e ? &e->listing : NULL;
+}
+
+/**
+ * list_cache_release - Release a listing from list_cache_lookup() or
+ *                      session_list_cached().  NULL is ignored.
+ */
+void list_cache_release(list_cache_t *c, const listing_t *listing)
+{
+	if (!listing)
+		return;
+	pthread_mutex_lock(&c->lock);
+	cached_unref((cached_listing_t *)(void *)listing);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Make e the cached copy for its key, replacing an older one, and evict
+ * from the cold end until the budget fits.  A listing larger than the
+ * whole budget is handed to the caller without being cached.
+ */
+static void cache_insert(list_cache_t *c, cached_listing_t *e)
+{
+	pthread_mutex_lock(&c->lock);
+	cached_listing_t *old = cache_find(c, e->key);
+	if (old)
+		cache_unlink(c, old);
+	if (e->bytes <= c->max_bytes) {
+		e->refs++;
+		c->bytes += e->bytes;
+		cache_push_front(c, e);
+		while (c->bytes > c->max_bytes && c->tail != e)
+			cache_unlink(c, c->tail);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* list_entry_fn for session_list_cached(): collect, then report progress. */
+struct cache_fill {
+	listing_t          *listing;
+	listing_progress_fn progress;
+	void               *arg;
+};
+
+static int cache_fill_entry(const list_entry_t *entry, uint32_t index, uint32_t total, void *arg)
+{
+	struct cache_fill *fill = arg;
+	(void)index;
+	if (listing_append(fill->listing, entry) != 0)
+		return 1;
+	fill->listing->total = total;
+	if (fill->progress)
+		fill->progress(fill->listing, fill->arg);
+	return 0;
+}
+
+/**
+ * session_list_cached - Fetch or revalidate a whole directory listing
+ *                       through the cache.
+ *
+ * If a copy is cached its token goes along with a mode 'W' request, and
+ * an unchanged directory costs one round trip with no entries.  Otherwise
+ * the listing is streamed into a new cache entry, calling `progress` after
+ * every entry so a caller can draw it while it arrives.
+ *
+ * Servers without mode 'W' drop the connection; the session then
+ * remembers that and uses plain 'X' (always a full transfer) from then on.
+ *
+ * @param s            Open session.
+ * @param c            Cache to read and update.
+ * @param remote_path  Directory path on the server.
+ * @param flags        LIST_WANT_STAT or 0.
+ * @param progress     Optional callback while entries arrive (not called
+ *                     when the cached copy is still current).
+ * @param arg          Passed to progress.
+ * @param out          Receives a referenced listing on success; release it
+ *                     with list_cache_release().
+ * @return             ERR_NONE, the session_connect() error bits, or
+ *                     ERR_TRANSFER.
+ */
+int session_list_cached(session_t *s, list_cache_t *c, const char *remote_path,
+                        unsigned flags, listing_progress_fn progress, void *arg,
+                        const listing_t **out)
+{
+	char key[LIST_CACHE_KEY_MAX];
+	*out = NULL;
+	if (list_cache_key(s, remote_path, flags, key, sizeof(key)) != 0)
+		return ERR_PATH;
+
+	const listing_t *held = list_cache_lookup(c, s, remote_path, flags, NULL);
+	cached_listing_t *old = (cached_listing_t *)(void *)held;
+	size_t key_len = strlen(key) + 1;
+
+	for (int attempt = 0; attempt < 3; attempt++) {
+		int reused;
+		int rc = session_begin(s, &reused);
+		if (rc != ERR_NONE) {
+			list_cache_release(c, held);
+			return rc;
+		}
+
+		cached_listing_t *e = calloc(1, sizeof(*e) + key_len);
+		if (!e) {
+			list_cache_release(c, held);
+			return ERR_TRANSFER;
+		}
+		memcpy(e->key, key, key_len);
+		e->refs = 1;
+
+		struct cache_fill fill = { .listing = &e->listing, .progress = progress, .arg = arg };
+		int      cond  = !s->no_list_cond;
+		uint64_t token = (cond && old) ? old->token : 0;
+		uint32_t total;
+
+		rc = CMD_IO_ERROR;
+		if (send_mode(s->sock, cond ? MODE_LIST_COND : MODE_LIST_EX) == 0)
+			rc = list_stream_recv(s->sock, remote_path, 0, 0, flags, cache_fill_entry,
+			                      &fill, &total, cond ? &token : NULL);
+
+		if (rc == LIST_UNCHANGED && old) {
+			cached_unref(e);
+			pthread_mutex_lock(&c->lock);
+			old->checked = monotonic_seconds();
+			pthread_mutex_unlock(&c->lock);
+			*out = held;
+			return ERR_NONE;
+		}
+		if (rc == CMD_OK) {
+			e->listing.total = total;
+			e->token   = cond ? token : 0;
+			e->checked = monotonic_seconds();
+			e->bytes   = listing_bytes(&e->listing) + sizeof(*e) + key_len;
+			cache_insert(c, e);
+			list_cache_release(c, held);
+			*out = &e->listing;
+			return ERR_NONE;
+		}
+
+		int partial = e->listing.count > 0;
+		cached_unref(e);
+		if (rc == CMD_REFUSED)
+			break;
+
+		/* LIST_UNCHANGED without a copy to reuse would be a server bug. */
+		session_drop(s);
+		if (partial || rc == LIST_STOPPED || rc == LIST_UNCHANGED)
+			break;
+		if (!reused) {
+			if (!cond)
+				break;
+			s->no_list_cond = 1;   /* A fresh connection refused 'W' */
+		}
+	}
+	list_cache_release(c, held);
+	return ERR_TRANSFER;
+}
+
+/* Directories queued per list_prefetch_set() call; the rest are ignored. */
+#define LIST_PREFETCH_MAX 32
+
+/*
+ * list_prefetch_t - Background thread that lists directories into a
+ *                   cache on its own session connection.
+ */
+typedef struct {
+	list_cache_t   *cache;
+	session_t       session;
+	unsigned        flags;
+	double          max_age;     /* Cached copies younger than this are skipped */
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+	char            queue[LIST_PREFETCH_MAX][MAX_PATH_LEN + 1];
+	unsigned        queued;
+	unsigned        next;
+	int             stop;
+} list_prefetch_t;
+
+static void *list_prefetch_main(void *arg)
+{
+	list_prefetch_t *p = arg;
+	char path[MAX_PATH_LEN + 1];
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (!p->stop && p->next == p->queued)
+			pthread_cond_wait(&p->wake, &p->lock);
+		if (p->stop)
+			break;
+		strcpy(path, p->queue[p->next++]);
+		pthread_mutex_unlock(&p->lock);
+
+		double age;
+		const listing_t *l = list_cache_lookup(p->cache, &p->session, path, p->flags, &age);
+		int rc = ERR_NONE;
+		if (!l || age > p->max_age) {
+			list_cache_release(p->cache, l);
+			rc = session_list_cached(&p->session, p->cache, path, p->flags, NULL, NULL, &l);
+		}
+		list_cache_release(p->cache, rc == ERR_NONE ? l : NULL);
+
+		pthread_mutex_lock(&p->lock);
+		if (rc != ERR_NONE && rc != ERR_TRANSFER)
+			p->next = p->queued;   /* Can't log in: drop the batch */
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/**
+ * list_prefetch_start - Start a prefetch thread for a session's server.
+ *
+ * The thread opens its own connection with s's host and credentials the
+ * first time it has work, so a prefetch never delays a command on s.
+ *
+ * @param p        Prefetcher to initialise.
+ * @param c        Cache to fill.
+ * @param s        Open session to copy the connection parameters from.
+ * @param flags    LIST_WANT_STAT or 0, as used for lookups.
+ * @param max_age  Cached listings younger than this many seconds are left
+ *                 alone.
+ * @return         0, or -1 if the thread could not be started.
+ */
+int list_prefetch_start(list_prefetch_t *p, list_cache_t *c, const session_t *s,
+                        unsigned flags, double max_age)
+{
+	memset(p, 0, sizeof(*p));
+	p->cache   = c;
+	p->session = *s;
+	p->session.sock = SOCK_INVALID;
+	p->flags   = flags;
+	p->max_age = max_age;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	if (pthread_create(&p->thread, NULL, list_prefetch_main, p) != 0) {
+		memset(p->session.password, 0, sizeof(p->session.password));
+		pthread_cond_destroy(&p->wake);
+		pthread_mutex_destroy(&p->lock);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * list_prefetch_set - Replace the queue of directories to prefetch.
+ *
+ * Directories still queued from the previous call are forgotten, so the
+ * thread always works on what the user is looking at now.
+ *
+ * @param p      Running prefetcher.
+ * @param paths  Remote directory paths, most wanted first.
+ * @param n      Number of paths (at most LIST_PREFETCH_MAX are used).
  */
-char *expand_path(const char *path, char *out, size_t out_size)
+void list_prefetch_set(list_prefetch_t *p, const char *const *paths, unsigned n)
 {
-	if (!path || path[0] == '\0') {
-		if (out_size > 0) out[0] = '\0';
-		return out;
-	}
+	pthread_mutex_lock(&p->lock);
+	p->queued = p->next = 0;
+	for (unsigned i = 0; i < n && p->queued < LIST_PREFETCH_MAX; i++)
+		if (strlen(paths[i]) <= MAX_PATH_LEN)
+			strcpy(p->queue[p->queued++], paths[i]);
+	pthread_cond_signal(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+}
 
-	if (path[0] != '~') {
-		strncpy(out, path, out_size - 1);
-		out[out_size - 1] = '\0';
-		return out;
-	}
+/**
+ * list_prefetch_stop - Stop the thread, close its session and wipe its
+ *                      copy of the password.
+ *
+ * Waits for a listing in progress to finish.
+ */
+void list_prefetch_stop(list_prefetch_t *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_signal(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+	session_close(&p->session);
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+}
 
-	/* Find where the tilde-prefix ends. */
-	const char *sep = strchr(path, '/');
-	size_t user_len = sep ? (size_t)(sep - path - 1) : strlen(path) - 1;
+#endif /* !_WIN32 */
 
-#ifdef _WIN32
-	/* Windows: only bare ~ is supported. */
-	if (user_len == 0) {
-		char profile[MAX_PATH];
-		if (SHGetFolderPathA(NULL, CSIDL_PROFILE, NULL, 0, profile) != S_OK)
-			return NULL;
-		snprintf(out, out_size, "%s%s", profile, sep ? sep : "");
-		return out;
+/* ── Parallel download ───────────────────────────────────────────────────── */
+
+#define PARALLEL_MAX_STREAMS  16
+#define PARALLEL_MIN_RANGE    (8ULL << 20)   /* Smaller ranges aren't worth a connection */
+#define PARALLEL_BUF_SIZE     (256 * 1024)
+
+#ifndef _WIN32
+
+/* One range of the file, fetched on its own session by range_worker(). */
+typedef struct {
+	session_t   session;
+	const char *remote_path;
+	int         fd;        /* Shared output file, written with pwrite() */
+	uint64_t    offset;
+	uint64_t    length;
+	uint64_t    total;     /* Size the probe saw; a change aborts the job */
+	int         rc;        /* CMD_OK, CMD_REFUSED or CMD_IO_ERROR */
+} range_job_t;
+
+/**
+ * range_worker - Thread body: request one range and pwrite() it in place.
+ *
+ * @param arg  The range_job_t to run; its rc field receives the result.
+ */
+static void *range_worker(void *arg)
+{
+	range_job_t *job = arg;
+	uint64_t total, remaining;
+
+	job->rc = CMD_IO_ERROR;
+	if (send_range_request(job->session.sock, job->remote_path, job->offset, job->length) != 0)
+		return NULL;
+	int rc = receive_range_header(job->session.sock, &total, &remaining);
+	if (rc != CMD_OK) {
+		job->rc = rc;
+		return NULL;
+	}
+	if (total != job->total || remaining != job->length) {
+		fprintf(stderr, "receive_file: remote file changed during parallel download\n");
+		return NULL;
 	}
-	/* ~username not supported on Windows – return as-is. */
-	strncpy(out, path, out_size - 1);
-	out[out_size - 1] = '\0';
-	return out;
-#else
-	if (user_len == 0) {
-		/* ~/... — use $HOME or getpwuid. */
-		const char *home = getenv("HOME");
-		if (!home) {
-			struct passwd *pw = getpwuid(getuid());
-			if (!pw) return NULL;
-			home = pw->pw_dir;
-		}
-		snprintf(out, out_size, "%s%s", home, sep ? sep : "");
-	} else {
-		/* ~username/... */
-		char username[256];
-		if (user_len >= sizeof(username)) return NULL;
-		strncpy(username, path + 1, user_len);
-		username[user_len] = '\0';
 
-		struct passwd *pw = getpwnam(username);
-		if (!pw) return NULL;
-		snprintf(out, out_size, "%s%s", pw->pw_dir, sep ? sep : "");
+	unsigned char *buf = malloc(PARALLEL_BUF_SIZE);
+	if (!buf)
+		return NULL;
+
+	uint64_t pos = job->offset;
+	while (remaining > 0) {
+		size_t want = remaining < PARALLEL_BUF_SIZE ? (size_t)remaining : PARALLEL_BUF_SIZE;
+		ssize_t n = sock_recv(job->session.sock, buf, want);
+		if (n <= 0)
+			break;
+		for (ssize_t done = 0; done < n; ) {
+			ssize_t w = pwrite(job->fd, buf + done, (size_t)(n - done), (off_t)(pos + (uint64_t)done));
+			if (w <= 0)
+				goto out;
+			done += w;
+		}
+		pos       += (uint64_t)n;
+		remaining -= (uint64_t)n;
 	}
-	return out;
-#endif
+	if (remaining == 0)
+		job->rc = CMD_OK;
+out:
+	free(buf);
+	return NULL;
 }
 
-/* ── High-level API ──────────────────────────────────────────────────────── */
+#endif /* !_WIN32 */
 
 /**
- * download_from_server - Download a file from the remote server.
+ * download_parallel_from_server - Download one file over several streams.
  *
- * Connects, performs the unlock/username/mode handshake, sends the remote
- * path, then saves the received file under output_dir.
+ * A single TCP stream on a high-latency link is capped by its window, so
+ * large files are split into up to `streams` contiguous ranges and each
+ * range is fetched with a ranged ('G') request on its own session
+ * connection.  The ranges are written in place with pwrite() into an
+ * output file preallocated to the full size.
+ *
+ * All connections are opened and authenticated up front on the calling
+ * thread (crypt() is not thread-safe); only the data transfer runs on the
+ * worker threads.  The stream count is reduced so that every range is at
+ * least PARALLEL_MIN_RANGE bytes; with one stream left, or on Windows, this
+ * is a plain download_from_server().
+ *
+ * On failure the incomplete output file is removed, because unlike a
+ * sequential download it has holes that download_resume_from_server()
+ * could not fill.
  *
  * @param host        Server hostname or IP address.
  * @param port        Server port as a string (e.g. "9000").
  * @param username    Username sent to the server for tilde expansion.
  * @param remote_path Path to the file on the server.
  * @param output_dir  Local directory to save the file into (tilde expanded).
+ * @param streams     Number of parallel connections (1..PARALLEL_MAX_STREAMS).
  * @param out_path    Buffer (≥ MAX_PATH_LEN + 1 bytes) filled with the saved
  *                    file's local path on success.
- * @return            ERR_NONE (0) on success, or a bitmask of one or more
- *                    ERR_* constants indicating which steps failed:
- *                      ERR_PATH_EXPAND  – output_dir tilde expansion failed
- *                      ERR_CONNECT      – could not connect to host:port
- *                      ERR_UNLOCK       – send_unlock() failed
- *                      ERR_PATH         – sending username failed
- *                      ERR_MODE         – sending mode byte failed
- *                      ERR_REMOTE_PATH  – sending remote_path failed
- *                      ERR_TRANSFER     – receiving / writing the file failed
+ * @return            ERR_NONE (0) on success, or a bitmask of ERR_* constants
+ *                    as for download_from_server().
  */
-int download_from_server(const char *host,
-						 const char *port,
-						 const char *username,
-						 const char *password,
-						 const char *remote_path,
-						 const char *output_dir,
-						 char       *out_path)
+int download_parallel_from_server(const char *host,
+                                  const char *port,
+                                  const char *username,
+                                  const char *password,
+                                  const char *remote_path,
+                                  const char *output_dir,
+                                  int         streams,
+                                  char       *out_path)
 {
+#ifdef _WIN32
+	(void)streams;
+	return download_from_server(host, port, username, password,
+	                            remote_path, output_dir, out_path);
+#else
+	if (streams <= 1)
+		return download_from_server(host, port, username, password,
+		                            remote_path, output_dir, out_path);
+	if (streams > PARALLEL_MAX_STREAMS)
+		streams = PARALLEL_MAX_STREAMS;
+
 	char expanded_dir[MAX_PATH_LEN + 1];
 	if (!expand_path(output_dir, expanded_dir, sizeof(expanded_dir)))
 		return ERR_PATH_EXPAND;
+	if (local_target_path(remote_path, expanded_dir, out_path) != 0)
+		return ERR_TRANSFER;
 
-	sock_t sock = create_socket(host, port);
-	if (sock == SOCK_INVALID)
-		return ERR_CONNECT;
+	range_job_t jobs[PARALLEL_MAX_STREAMS];
+	for (int i = 0; i < streams; i++)
+		jobs[i].session.sock = SOCK_INVALID;
 
-	int rc = ERR_NONE;
-	if (send_unlock(sock) != 0)
-		rc |= ERR_UNLOCK;
-	if (rc == ERR_NONE && send_path(sock, username) != 0)
-		rc |= ERR_PATH;
-	if (rc == ERR_NONE && authenticate_with_server(sock, password) != 0)
-		rc |= ERR_AUTH;
-	if (rc == ERR_NONE && send_mode(sock, MODE_DOWNLOAD) != 0)
-		rc |= ERR_MODE;
-	if (rc == ERR_NONE && send_path(sock, remote_path) != 0)
-		rc |= ERR_REMOTE_PATH;
-	if (rc == ERR_NONE && receive_file(sock, expanded_dir, out_path) != 0)
-		rc |= ERR_TRANSFER;
+	/* Probe the size with an empty range on the first connection. */
+	int rc = session_open(&jobs[0].session, host, port, username, password);
+	if (rc != ERR_NONE)
+		return rc;
 
-	CLOSE_SOCK(sock);
+	uint64_t total, empty;
+	if (send_range_request(jobs[0].session.sock, remote_path, 0, 0) != 0 ||
+	    receive_range_header(jobs[0].session.sock, &total, &empty) != CMD_OK) {
+		session_close(&jobs[0].session);
+		return ERR_TRANSFER;
+	}
+
+	if (total / PARALLEL_MIN_RANGE < (uint64_t)streams)
+		streams = (int)(total / PARALLEL_MIN_RANGE);
+	if (streams <= 1) {
+		session_close(&jobs[0].session);
+		return download_from_server(host, port, username, password,
+		                            remote_path, output_dir, out_path);
+	}
+
+	for (int i = 1; i < streams && rc == ERR_NONE; i++)
+		rc = session_open(&jobs[i].session, host, port, username, password);
+
+	int fd = -1;
+	if (rc == ERR_NONE) {
+		fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			fprintf(stderr, "receive_file: cannot open '%s' for writing\n", out_path);
+			rc = ERR_TRANSFER;
+		}
+	}
+#ifdef __linux__
+	if (rc == ERR_NONE && posix_fallocate(fd, 0, (off_t)total) != 0)
+#else
+	if (rc == ERR_NONE && ftruncate(fd, (off_t)total) != 0)
+#endif
+	{
+		fprintf(stderr, "receive_file: cannot reserve %llu bytes for '%s'\n",
+		        (unsigned long long)total, out_path);
+		rc = ERR_TRANSFER;
+	}
+
+	if (rc == ERR_NONE) {
+		pthread_t threads[PARALLEL_MAX_STREAMS];
+		uint64_t  step = total / (uint64_t)streams;
+		int       started = 0;
+
+		for (int i = 0; i < streams; i++) {
+			jobs[i].remote_path = remote_path;
+			jobs[i].fd          = fd;
+			jobs[i].offset      = step * (uint64_t)i;
+			jobs[i].length      = (i == streams - 1) ? total - jobs[i].offset : step;
+			jobs[i].total       = total;
+			jobs[i].rc          = CMD_IO_ERROR;
+			if (pthread_create(&threads[i], NULL, range_worker, &jobs[i]) != 0)
+				break;
+			started++;
+		}
+		for (int i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		for (int i = 0; i < streams; i++)
+			if (jobs[i].rc != CMD_OK)
+				rc = ERR_TRANSFER;
+	}
+
+	for (int i = 0; i < streams; i++) {
+		if (rc == ERR_NONE)
+			session_close(&jobs[i].session);
+		else
+			session_drop(&jobs[i].session);   /* Streams may be mid-range */
+		memset(jobs[i].session.password, 0, sizeof(jobs[i].session.password));
+	}
+
+	if (fd >= 0 && close(fd) != 0)
+		rc = ERR_TRANSFER;
+	if (rc != ERR_NONE && fd >= 0)
+		remove(out_path);
 	return rc;
+#endif
 }
 
+/* ── Transfer manager ────────────────────────────────────────────────────── */
+
+#ifndef _WIN32
+
+/*
+ * An xfer_manager_t runs queued downloads and uploads on a fixed set of
+ * worker threads.  Each worker keeps its own persistent session, so a
+ * batch of files pays for one login per worker rather than per file.
+ * Progress (bytes, rate, ETA) arrives through a callback on the worker
+ * threads, throttled to one call per XFER_REPORT_INTERVAL per job, and
+ * can also be polled with xfer_manager_snapshot().
+ *
+ *   xfer_manager_t m;
+ *   xfer_manager_start(&m, &session, 4, on_progress, ui);
+ *   xfer_enqueue_download(&m, "~/a.iso", "~/Downloads");
+ *   xfer_enqueue_upload(&m, "notes.txt", "~/notes.txt");
+ *   xfer_manager_wait(&m);
+ *   xfer_manager_stop(&m);
+ */
+
+#define XFER_MAX_WORKERS     8
+#define XFER_REPORT_INTERVAL 0.1   /* Seconds between progress calls per job */
+
+typedef enum { XFER_DOWNLOAD, XFER_UPLOAD } xfer_kind_t;
+
+typedef enum {
+	XFER_QUEUED,
+	XFER_RUNNING,
+	XFER_DONE,
+	XFER_FAILED,
+	XFER_CANCELLED      /* Still queued when xfer_manager_stop() ran */
+} xfer_state_t;
+
 /**
- * upload_to_server - Upload a local file to the remote server.
+ * xfer_status_t - What a progress callback or snapshot reports for a job.
  *
- * Connects, performs the unlock/username/mode handshake, then streams the
- * file to the server.
+ * The strings belong to the manager and stay valid until
+ * xfer_manager_stop().
+ */
+typedef struct {
+	unsigned     id;
+	xfer_kind_t  kind;
+	xfer_state_t state;
+	const char  *source;      /* Remote path (download) or local file (upload) */
+	const char  *dest;        /* Local directory (download) or remote target */
+	const char  *saved_path;  /* Download: local file written, "" until known */
+	uint64_t     done;        /* File bytes transferred */
+	uint64_t     total;       /* File size, 0 while unknown */
+	double       rate;        /* Bytes per second, smoothed */
+	double       eta;         /* Seconds left, -1 while unknown */
+	int          result;      /* ERR_* bits once DONE or FAILED */
+} xfer_status_t;
+
+/**
+ * xfer_progress_fn - Called from a worker thread when a job starts, makes
+ *                    progress or finishes.
  *
- * @param host          Server hostname or IP address.
- * @param port          Server port as a string (e.g. "9000").
- * @param username      Username sent to the server for tilde expansion.
- * @param local_file    Path to the local file (tilde expanded before use).
- * @param remote_target Destination path on server; if NULL, defaults to the
- *                      basename of local_file.
- * @return              ERR_NONE (0) on success, or a bitmask of one or more
- *                      ERR_* constants indicating which steps failed:
- *                        ERR_PATH_EXPAND  – local_file tilde expansion failed
- *                        ERR_CONNECT      – could not connect to host:port
- *                        ERR_UNLOCK       – send_unlock() failed
- *                        ERR_PATH         – sending username failed
- *                        ERR_MODE         – sending mode byte failed
- *                        ERR_TRANSFER     – upload_file() failed
+ * It must not block; a UI would typically note the status and redraw from
+ * its own thread.
  */
-int upload_to_server(const char *host,
-					 const char *port,
-					 const char *username,
-					 const char *password,
-					 const char *local_file,
-					 const char *remote_target)
+typedef void (*xfer_progress_fn)(const xfer_status_t *status, void *arg);
+
+struct xfer_manager;
+
+typedef struct xfer_job {
+	xfer_meter_t         meter;       /* t_meter of the worker running it */
+	struct xfer_manager *mgr;
+	struct xfer_job     *next;
+	xfer_status_t        status;      /* Protected by mgr->lock */
+	double               started;
+	double               last_sample; /* Rate sampling, worker only */
+	uint64_t             last_done;
+	char                 source[MAX_PATH_LEN + 1];
+	char                 dest[MAX_PATH_LEN + 1];
+	char                 saved[MAX_PATH_LEN + 1];
+} xfer_job_t;
+
+typedef struct xfer_manager {
+	pthread_mutex_t  lock;
+	pthread_cond_t   wake;        /* Workers: a job was queued, or stop */
+	pthread_cond_t   idle;        /* xfer_manager_wait(): a job finished */
+	pthread_t        threads[XFER_MAX_WORKERS];
+	unsigned         workers;
+	session_t        login;       /* Copied into each worker's session */
+	xfer_job_t      *jobs;        /* Every job, in queue order */
+	xfer_job_t     **tail;
+	xfer_job_t      *cursor;      /* Next job to hand out */
+	unsigned         next_id;
+	unsigned         pending;     /* Queued or running */
+	int              stop;
+	xfer_progress_fn progress;
+	void            *arg;
+} xfer_manager_t;
+
+static void xfer_report(xfer_manager_t *m, const xfer_status_t *status)
 {
-	char expanded_file[MAX_PATH_LEN + 1];
-	if (!expand_path(local_file, expanded_file, sizeof(expanded_file)))
-		return ERR_PATH_EXPAND;
+	if (m->progress)
+		m->progress(status, m->arg);
+}
 
-	sock_t sock = create_socket(host, port);
-	if (sock == SOCK_INVALID)
-		return ERR_CONNECT;
+/* xfer_meter_t update hook: refresh rate and ETA, report now and then. */
+static void xfer_job_update(xfer_meter_t *meter)
+{
+	xfer_job_t     *job = (xfer_job_t *)meter;
+	xfer_manager_t *m   = job->mgr;
+	double          now = monotonic_seconds();
+	int             end = meter->total != 0 && meter->done >= meter->total;
 
-	int rc = ERR_NONE;
-	if (send_unlock(sock) != 0)
-		rc |= ERR_UNLOCK;
-	if (rc == ERR_NONE && send_path(sock, username) != 0)
-		rc |= ERR_PATH;
-	if (rc == ERR_NONE && authenticate_with_server(sock, password) != 0)
-		rc |= ERR_AUTH;
-	if (rc == ERR_NONE && send_mode(sock, MODE_UPLOAD) != 0)
-		rc |= ERR_MODE;
-	if (rc == ERR_NONE && upload_file(sock, expanded_file, remote_target) != 0)
-		rc |= ERR_TRANSFER;
+	if (meter->done < job->last_done) {   /* Retried on a fresh connection */
+		job->last_done   = meter->done;
+		job->last_sample = now;
+	}
+	if (now - job->last_sample < XFER_REPORT_INTERVAL && !end)
+		return;
 
-	CLOSE_SOCK(sock);
-	return rc;
+	pthread_mutex_lock(&m->lock);
+	xfer_status_t *st = &job->status;
+	double dt = now - job->last_sample;
+	if (dt > 0) {
+		double inst = (double)(meter->done - job->last_done) / dt;
+		st->rate = (st->rate > 0) ? 0.7 * st->rate + 0.3 * inst : inst;
+	}
+	st->done  = meter->done;
+	st->total = meter->total;
+	st->eta   = (st->total && st->rate > 0) ? (double)(st->total - st->done) / st->rate : -1;
+	xfer_status_t copy = *st;
+	pthread_mutex_unlock(&m->lock);
+
+	job->last_sample = now;
+	job->last_done   = meter->done;
+	xfer_report(m, &copy);
+}
+
+static void *xfer_worker(void *arg)
+{
+	xfer_manager_t *m = arg;
+	session_t       s;
+
+	pthread_mutex_lock(&m->lock);
+	s = m->login;
+	s.sock = SOCK_INVALID;   /* Connects on its first job */
+	while (1) {
+		while (!m->stop && !m->cursor)
+			pthread_cond_wait(&m->wake, &m->lock);
+		if (m->stop)
+			break;
+
+		xfer_job_t *job = m->cursor;
+		m->cursor = job->next;
+		job->status.state = XFER_RUNNING;
+		job->started = job->last_sample = monotonic_seconds();
+		xfer_status_t copy = job->status;
+		pthread_mutex_unlock(&m->lock);
+		xfer_report(m, &copy);
+
+		t_meter = &job->meter;
+		int rc = (job->status.kind == XFER_DOWNLOAD)
+		       ? session_download(&s, job->source, job->dest, job->saved)
+		       : session_upload(&s, job->source, job->dest);
+		t_meter = NULL;
+
+		pthread_mutex_lock(&m->lock);
+		xfer_status_t *st = &job->status;
+		st->state  = (rc == ERR_NONE) ? XFER_DONE : XFER_FAILED;
+		st->result = rc;
+		st->done   = job->meter.done;
+		st->total  = job->meter.total;
+		st->eta    = (rc == ERR_NONE) ? 0 : -1;
+		double elapsed = monotonic_seconds() - job->started;
+		if (rc == ERR_NONE && elapsed > 0)
+			st->rate = (double)st->done / elapsed;   /* Final figure: the average */
+		copy = *st;
+		pthread_mutex_unlock(&m->lock);
+		xfer_report(m, &copy);
+
+		/* Only now, so xfer_manager_wait() returns after the last report. */
+		pthread_mutex_lock(&m->lock);
+		m->pending--;
+		pthread_cond_broadcast(&m->idle);
+	}
+	pthread_mutex_unlock(&m->lock);
+	session_close(&s);
+	return NULL;
 }
 
 /**
- * list_directory - List contents of a remote directory.
+ * xfer_manager_start - Start a transfer manager for a session's server.
  *
- * Connects, performs the unlock/username/mode handshake, then retrieves the
- * directory listing as a newline-separated string.
+ * @param m         Manager to initialise.
+ * @param s         Open session to copy the host, credentials and
+ *                  compression level from (s itself is not used).
+ * @param workers   Parallel transfers, 1..XFER_MAX_WORKERS.
+ * @param progress  Optional callback, see xfer_progress_fn.
+ * @param arg       Passed to progress.
+ * @return          0, or -1 if no worker thread could be started.
+ */
+int xfer_manager_start(xfer_manager_t *m, const session_t *s, unsigned workers,
+                       xfer_progress_fn progress, void *arg)
+{
+	memset(m, 0, sizeof(*m));
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->wake, NULL);
+	pthread_cond_init(&m->idle, NULL);
+	m->login    = *s;
+	m->login.sock = SOCK_INVALID;
+	m->tail     = &m->jobs;
+	m->next_id  = 1;
+	m->progress = progress;
+	m->arg      = arg;
+
+	if (workers < 1) workers = 1;
+	if (workers > XFER_MAX_WORKERS) workers = XFER_MAX_WORKERS;
+	while (m->workers < workers &&
+	       pthread_create(&m->threads[m->workers], NULL, xfer_worker, m) == 0)
+		m->workers++;
+	if (m->workers == 0) {
+		memset(m->login.password, 0, sizeof(m->login.password));
+		pthread_cond_destroy(&m->idle);
+		pthread_cond_destroy(&m->wake);
+		pthread_mutex_destroy(&m->lock);
+		return -1;
+	}
+	return 0;
+}
+
+static int xfer_enqueue(xfer_manager_t *m, xfer_kind_t kind, const char *source, const char *dest)
+{
+	if (strlen(source) > MAX_PATH_LEN || strlen(dest) > MAX_PATH_LEN)
+		return -1;
+	xfer_job_t *job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+	strcpy(job->source, source);
+	strcpy(job->dest, dest);
+	job->mgr           = m;
+	job->meter.update  = xfer_job_update;
+	job->status.kind   = kind;
+	job->status.state  = XFER_QUEUED;
+	job->status.source = job->source;
+	job->status.dest   = job->dest;
+	job->status.saved_path = job->saved;
+	job->status.eta    = -1;
+
+	pthread_mutex_lock(&m->lock);
+	job->status.id = m->next_id++;
+	*m->tail = job;
+	m->tail  = &job->next;
+	if (!m->cursor)
+		m->cursor = job;
+	m->pending++;
+	int id = (int)job->status.id;
+	pthread_cond_signal(&m->wake);
+	pthread_mutex_unlock(&m->lock);
+	return id;
+}
+
+/**
+ * xfer_enqueue_download - Queue a download (see session_download()).
  *
- * Note: because this function returns a heap-allocated string rather than an
- * int, it cannot use the ERR_* bitmask scheme.  NULL indicates failure;
- * a non-NULL pointer (possibly pointing to an empty string "") indicates
- * success.  The caller is responsible for free()-ing the returned pointer.
+ * @return  Job id (> 0), or -1 if a path is too long or out of memory.
+ */
+int xfer_enqueue_download(xfer_manager_t *m, const char *remote_path, const char *output_dir)
+{
+	return xfer_enqueue(m, XFER_DOWNLOAD, remote_path, output_dir);
+}
+
+/**
+ * xfer_enqueue_upload - Queue an upload (see session_upload()).
  *
- * @param host        Server hostname or IP address.
- * @param port        Server port as a string (e.g. "9000").
- * @param username    Username sent to the server for tilde expansion.
- * @param remote_path Path to the directory on the server.
- * @return            Heap-allocated string (entries separated by '\n'), or
- *                    NULL on error.
+ * @return  Job id (> 0), or -1 if a path is too long or out of memory.
  */
-char *list_directory(const char *host,
-					 const char *port,
-					 const char *username,
-					 const char *password,
-					 const char *remote_path)
+int xfer_enqueue_upload(xfer_manager_t *m, const char *local_file, const char *remote_target)
 {
-	sock_t sock = create_socket(host, port);
-	if (sock == SOCK_INVALID)
-		return NULL;
+	return xfer_enqueue(m, XFER_UPLOAD, local_file, remote_target);
+}
 
-	char *result = NULL;
-	if (send_unlock(sock)                    == 0 &&
-		send_path(sock, username)            == 0 &&
-		authenticate_with_server(sock, password) == 0 &&
-		send_mode(sock, MODE_LIST)           == 0)
-	{
-		result = list_directory_sock(sock, remote_path);
+/**
+ * xfer_manager_snapshot - Copy the status of up to `max` jobs, oldest
+ *                         first.
+ *
+ * @return  Number of jobs in the manager (may exceed max).
+ */
+unsigned xfer_manager_snapshot(xfer_manager_t *m, xfer_status_t *out, unsigned max)
+{
+	unsigned n = 0;
+	pthread_mutex_lock(&m->lock);
+	for (xfer_job_t *job = m->jobs; job; job = job->next, n++)
+		if (n < max)
+			out[n] = job->status;
+	pthread_mutex_unlock(&m->lock);
+	return n;
+}
+
+/**
+ * xfer_manager_wait - Block until every queued job has finished.
+ */
+void xfer_manager_wait(xfer_manager_t *m)
+{
+	pthread_mutex_lock(&m->lock);
+	while (m->pending > 0)
+		pthread_cond_wait(&m->idle, &m->lock);
+	pthread_mutex_unlock(&m->lock);
+}
+
+/**
+ * xfer_manager_stop - Cancel queued jobs, wait for running ones, close the
+ *                     workers' sessions and free everything.
+ */
+void xfer_manager_stop(xfer_manager_t *m)
+{
+	pthread_mutex_lock(&m->lock);
+	m->stop = 1;
+	for (xfer_job_t *job = m->cursor; job; job = job->next) {
+		job->status.state = XFER_CANCELLED;
+		m->pending--;
 	}
+	m->cursor = NULL;
+	pthread_cond_broadcast(&m->wake);
+	pthread_mutex_unlock(&m->lock);
 
-	CLOSE_SOCK(sock);
-	return result;   /* Caller must free() */
+	for (unsigned i = 0; i < m->workers; i++)
+		pthread_join(m->threads[i], NULL);
+
+	while (m->jobs) {
+		xfer_job_t *next = m->jobs->next;
+		free(m->jobs);
+		m->jobs = next;
+	}
+	memset(m->login.password, 0, sizeof(m->login.password));
+	pthread_cond_destroy(&m->idle);
+	pthread_cond_destroy(&m->wake);
+	pthread_mutex_destroy(&m->lock);
 }
+
+#endif /* !_WIN32 */
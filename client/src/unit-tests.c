@@ -16,6 +16,7 @@
 #define REMOTE_TARGET	"/root/temp.txt"
 #define DOWNLOAD_DIR	"./downloads"
 #define LIST_PATH		"/root"
+#define PARALLEL_STREAMS	4
 
 /* ── Helpers ───────────────────────────────────────────────────────────── */
 
@@ -166,6 +167,129 @@ static void test_download(void)
 	wait_key();
 }
 
+/**
+ * test_parallel_download - Test download_parallel_from_server().
+ *
+ * Fetches REMOTE_TARGET over PARALLEL_STREAMS connections and compares it
+ * against LOCAL_FILE.  Small files fall back to a single stream, so use a
+ * LOCAL_FILE of a few tens of MB to exercise the ranged path.
+ */
+static void test_parallel_download(void)
+{
+	clear();
+	printw("=== TEST 3: download_parallel_from_server() ===\n\n");
+	printw("  remote_path   : %s\n", REMOTE_TARGET);
+	printw("  output_dir    : %s\n", DOWNLOAD_DIR);
+	printw("  streams       : %d\n", PARALLEL_STREAMS);
+	printw("  host          : %s:%s\n\n", HOST, PORT);
+
+	printw("Downloading...\n");
+	refresh();
+
+	char saved_path[MAX_PATH_LEN + 1] = {0};
+	int rc = download_parallel_from_server(HOST, PORT, USERNAME, PASSWORD, REMOTE_TARGET,
+	                                       DOWNLOAD_DIR, PARALLEL_STREAMS, saved_path);
+
+	printw("\nResult (rc = %d):\n", rc);
+	print_err_bits(rc);
+
+	if (rc == ERR_NONE) {
+		int cmp = files_identical(LOCAL_FILE, saved_path);
+		if (cmp == 1)
+			printw("  [OK] Files are identical.\n");
+		else if (cmp == 0)
+			printw("  [FAIL] Files differ – a range was misplaced or corrupted.\n");
+		else
+			printw("  [WARN] Could not open one or both files for comparison.\n");
+	}
+
+	wait_key();
+}
+
+/**
+ * test_checked_download - Test the CRC-32C checked download modes.
+ *
+ * Downloads REMOTE_TARGET with session_download() ('H', CRC-32C trailer),
+ * asks for its size and CRC-32C with session_checksum() ('K') and checks
+ * both against LOCAL_FILE.  session_download_if_changed() must then skip
+ * the download, and fetch the file again once the local copy is damaged.
+ */
+static void test_checked_download(void)
+{
+	clear();
+	printw("=== TEST 4: session_download() / session_checksum() ===\n\n");
+	printw("  remote_path   : %s\n", REMOTE_TARGET);
+	printw("  output_dir    : %s\n", DOWNLOAD_DIR);
+	printw("  host          : %s:%s\n\n", HOST, PORT);
+
+	printw("Downloading...\n");
+	refresh();
+
+	session_t s;
+	char saved_path[MAX_PATH_LEN + 1] = {0};
+	int rc = session_open(&s, HOST, PORT, USERNAME, PASSWORD);
+	if (rc == ERR_NONE)
+		rc = session_download(&s, REMOTE_TARGET, DOWNLOAD_DIR, saved_path);
+
+	printw("\nResult (rc = %d):\n", rc);
+	print_err_bits(rc);
+
+	if (rc == ERR_NONE) {
+		int cmp = files_identical(LOCAL_FILE, saved_path);
+		if (cmp == 1)
+			printw("  [OK] Files are identical.\n");
+		else if (cmp == 0)
+			printw("  [FAIL] Files differ – the CRC-32C trailer missed it.\n");
+		else
+			printw("  [WARN] Could not open one or both files for comparison.\n");
+
+		uint64_t remote_size, local_size;
+		uint32_t remote_crc, local_crc;
+		rc = session_checksum(&s, REMOTE_TARGET, &remote_size, &remote_crc);
+		if (rc != ERR_NONE)
+			print_err_bits(rc);
+		else if (local_file_crc32c(LOCAL_FILE, &local_size, &local_crc) != 0)
+			printw("  [WARN] Could not read '%s'.\n", LOCAL_FILE);
+		else if (remote_size == local_size && remote_crc == local_crc)
+			printw("  [OK] 'K' reply matches: %llu bytes, CRC-32C %08x.\n",
+			       (unsigned long long)remote_size, remote_crc);
+		else
+			printw("  [FAIL] 'K' reply %llu bytes / %08x, local %llu bytes / %08x.\n",
+			       (unsigned long long)remote_size, remote_crc,
+			       (unsigned long long)local_size, local_crc);
+	}
+
+	if (rc == ERR_NONE) {
+		int skipped;
+		rc = session_download_if_changed(&s, REMOTE_TARGET, DOWNLOAD_DIR, saved_path, &skipped);
+		if (rc != ERR_NONE)
+			print_err_bits(rc);
+		else
+			printw(skipped ? "  [OK] Unchanged copy was not downloaded again.\n"
+			               : "  [FAIL] Unchanged copy was downloaded again.\n");
+
+		/* Damage the local copy: it must be fetched again. */
+		FILE *fp = rc == ERR_NONE ? fopen(saved_path, "ab") : NULL;
+		if (fp) {
+			fputc('!', fp);
+			fclose(fp);
+			rc = session_download_if_changed(&s, REMOTE_TARGET, DOWNLOAD_DIR,
+			                                 saved_path, &skipped);
+			if (rc != ERR_NONE)
+				print_err_bits(rc);
+			else if (skipped)
+				printw("  [FAIL] Changed copy was not downloaded again.\n");
+			else if (files_identical(LOCAL_FILE, saved_path) == 1)
+				printw("  [OK] Changed copy was replaced.\n");
+			else
+				printw("  [FAIL] Changed copy was downloaded but differs.\n");
+		}
+	}
+	session_close(&s);
+
+	wait_key();
+}
+
 /**
  * test_list - Test list_directory().
  *
@@ -175,7 +299,7 @@ static void test_download(void)
 static void test_list(void)
 {
 	clear();
-	printw("=== TEST 3: list_directory() ===\n\n");
+	printw("=== TEST 5: list_directory() ===\n\n");
 	printw("  remote_path : %s\n", LIST_PATH);
 	printw("  host        : %s:%s\n", HOST, PORT);
 	printw("  username    : %s\n\n", USERNAME);
@@ -198,6 +322,155 @@ static void test_list(void)
 	wait_key();
 }
 
+/**
+ * test_delta_upload - Test session_upload_delta().
+ *
+ * Re-sends LOCAL_FILE to REMOTE_TARGET (already there after TEST 1), so
+ * only block references should cross the wire, then downloads the result
+ * and compares it against LOCAL_FILE.
+ */
+static void test_delta_upload(void)
+{
+	clear();
+	printw("=== TEST 6: session_upload_delta() ===\n\n");
+	printw("  local_file    : %s\n", LOCAL_FILE);
+	printw("  remote_target : %s\n", REMOTE_TARGET);
+	printw("  host          : %s:%s\n\n", HOST, PORT);
+
+	printw("Uploading...\n");
+	refresh();
+
+	session_t s;
+	char saved_path[MAX_PATH_LEN + 1] = {0};
+	int rc = session_open(&s, HOST, PORT, USERNAME, PASSWORD);
+	if (rc == ERR_NONE)
+		rc = session_upload_delta(&s, LOCAL_FILE, REMOTE_TARGET);
+	if (rc == ERR_NONE)
+		rc = session_download(&s, REMOTE_TARGET, DOWNLOAD_DIR, saved_path);
+	session_close(&s);
+
+	printw("\nResult (rc = %d):\n", rc);
+	print_err_bits(rc);
+
+	if (rc == ERR_NONE) {
+		int cmp = files_identical(LOCAL_FILE, saved_path);
+		if (cmp == 1)
+			printw("  [OK] Files are identical.\n");
+		else if (cmp == 0)
+			printw("  [FAIL] Files differ – the delta was applied incorrectly.\n");
+		else
+			printw("  [WARN] Could not open one or both files for comparison.\n");
+	}
+
+	wait_key();
+}
+
+/**
+ * test_crc32c - Check crc32c_update() against the CRC-32C check value.
+ *
+ * "123456789" must give 0xE3069283 on the table path and, when the CPU
+ * has SSE4.2, on the crc32 instruction path.  Both must also agree on a
+ * longer buffer at every length, so the 8-byte steps and the byte tail
+ * are covered.  No server needed.
+ */
+static void test_crc32c(void)
+{
+	static const unsigned char check[] = "123456789";
+	const uint32_t expected = 0xE3069283;
+
+	clear();
+	printw("=== TEST 7: crc32c_update() ===\n\n");
+
+	uint32_t sw = ~crc32c_sw(~0u, check, 9);
+	printw(sw == expected ? "  [OK] Table path  : %08x\n"
+	                      : "  [FAIL] Table path  : %08x\n", sw);
+
+#ifdef HAVE_CRC32C_HW
+	if (__builtin_cpu_supports("sse4.2")) {
+		uint32_t hw = ~crc32c_hw(~0u, check, 9);
+		printw(hw == expected ? "  [OK] SSE4.2 path : %08x\n"
+		                      : "  [FAIL] SSE4.2 path : %08x\n", hw);
+
+		unsigned char buf[1024];
+		size_t bad = 0;
+		for (size_t i = 0; i < sizeof(buf); i++)
+			buf[i] = (unsigned char)(i * 131 + 7);
+		for (size_t len = 0; len <= sizeof(buf); len++) {
+			if (crc32c_hw(~0u, buf, len) != crc32c_sw(~0u, buf, len))
+				bad++;
+		}
+		printw(bad == 0 ? "  [OK] Paths agree on 0..%zu bytes.\n"
+		                : "  [FAIL] Paths differ on some of 0..%zu bytes.\n", sizeof(buf));
+	} else {
+		printw("  [SKIP] CPU has no SSE4.2.\n");
+	}
+#else
+	printw("  [SKIP] No SSE4.2 path in this build.\n");
+#endif
+
+	wait_key();
+}
+
+/**
+ * test_compressed_roundtrip - Test session_set_compression().
+ *
+ * Uploads LOCAL_FILE to REMOTE_TARGET and downloads it again with zlib
+ * level 6 ('P' up, compressed 'H' down) and compares the result against
+ * LOCAL_FILE.  Then checks that compression_worthwhile() skips
+ * already-compressed types, whatever their case, and nothing else.
+ */
+static void test_compressed_roundtrip(void)
+{
+	static const struct { const char *name; int worthwhile; } names[] = {
+		{ "notes.txt", 1 }, { "Makefile", 1 }, { "backup.tar", 1 }, { ".gz", 1 },
+		{ "release.tar.gz", 0 }, { "photo.JPG", 0 }, { "dir.d/clip.mp4", 0 },
+		{ "report.pdf", 0 }, { "song.Flac", 0 }, { "dir.zip/readme", 1 },
+	};
+
+	clear();
+	printw("=== TEST 8: session_set_compression() ===\n\n");
+	printw("  local_file    : %s\n", LOCAL_FILE);
+	printw("  remote_target : %s\n", REMOTE_TARGET);
+	printw("  level         : 6\n");
+	printw("  host          : %s:%s\n\n", HOST, PORT);
+
+	printw("Uploading and downloading...\n");
+	refresh();
+
+	session_t s;
+	char saved_path[MAX_PATH_LEN + 1] = {0};
+	int rc = session_open(&s, HOST, PORT, USERNAME, PASSWORD);
+	if (rc == ERR_NONE) {
+		session_set_compression(&s, 6);
+		rc = session_upload(&s, LOCAL_FILE, REMOTE_TARGET);
+	}
+	if (rc == ERR_NONE)
+		rc = session_download(&s, REMOTE_TARGET, DOWNLOAD_DIR, saved_path);
+	session_close(&s);
+
+	printw("\nResult (rc = %d):\n", rc);
+	print_err_bits(rc);
+
+	if (rc == ERR_NONE) {
+		int cmp = files_identical(LOCAL_FILE, saved_path);
+		if (cmp == 1)
+			printw("  [OK] Files are identical.\n");
+		else if (cmp == 0)
+			printw("  [FAIL] Files differ – the zlib stream was mangled.\n");
+		else
+			printw("  [WARN] Could not open one or both files for comparison.\n");
+	}
+
+	printw("\nSkip list:\n");
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		int got = compression_worthwhile(names[i].name);
+		printw("  [%s] %-16s %s\n", got == names[i].worthwhile ? "OK" : "FAIL",
+		       names[i].name, got ? "compressed" : "sent as-is");
+	}
+
+	wait_key();
+}
+
 /* ── Entry point ───────────────────────────────────────────────────────── */
 
 int main(void)
@@ -207,10 +480,15 @@ int main(void)
 	noecho();    /* Don't echo typed characters */
 	keypad(stdscr, TRUE);
 
-	/* Run all three tests in sequence. */
+	/* Run all tests in sequence. */
 	test_upload();
 	test_download();
+	test_parallel_download();
+	test_checked_download();
 	test_list();
+	test_delta_upload();
+	test_crc32c();
+	test_compressed_roundtrip();
 
 	/* Final summary screen. */
 	clear();
@@ -0,0 +1,131 @@
+/**
+ * @file bufpool.c
+ * @brief Shared pool of page-aligned transfer buffers, and request arenas
+ *
+ * Every session needs a chunk-sized transfer buffer, and allocating (and
+ * page-faulting) a fresh megabyte per connection shows up once many short
+ * sessions come and go. Released buffers wait on a free list and go to the
+ * next session; at most max_idle of them are kept, so idle memory is
+ * bounded by the worker count rather than by past peaks.
+ *
+ * The buffers are page-aligned, which O_DIRECT and io_uring buffer
+ * registration both need.
+ *
+ * The arena half of this file is a plain bump allocator; sessions use one
+ * for the small per-request strings (see session.c).
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bufpool.h"
+
+/** A buffer on the free list stores the link in its first bytes */
+struct free_buf {
+    struct free_buf *next;
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct free_buf *g_free;
+static unsigned g_idle;
+static unsigned g_max_idle;
+static size_t g_buf_size;
+static size_t g_align = 4096;
+
+/* ========== Buffer Pool ========== */
+
+/**
+ * @brief Set the size of pooled buffers and how many may sit idle
+ *
+ * @param buf_size Bytes per buffer (the transfer chunk size)
+ * @param max_idle Released buffers kept for reuse; more are freed
+ * @return 0
+ */
+int bufpool_init(size_t buf_size, unsigned max_idle) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0) g_align = (size_t)page;
+    g_buf_size = buf_size;
+    g_max_idle = max_idle;
+    return 0;
+}
+
+/**
+ * @brief Size of every buffer bufpool_get() returns
+ */
+size_t bufpool_buf_size(void) {
+    return g_buf_size;
+}
+
+/**
+ * @brief Take a buffer from the pool, allocating one if none is free
+ *
+ * @return Page-aligned buffer of bufpool_buf_size() bytes, or NULL
+ */
+char *bufpool_get(void) {
+    pthread_mutex_lock(&g_lock);
+    struct free_buf *b = g_free;
+    if (b) {
+        g_free = b->next;
+        g_idle--;
+    }
+    pthread_mutex_unlock(&g_lock);
+    if (b) return (char *)b;
+
+    void *buf = NULL;
+    if (posix_memalign(&buf, g_align, g_buf_size) != 0) return NULL;
+    return buf;
+}
+
+/**
+ * @brief Return a buffer from bufpool_get(); NULL is ignored
+ */
+void bufpool_put(char *buf) {
+    if (!buf) return;
+    pthread_mutex_lock(&g_lock);
+    if (g_idle < g_max_idle) {
+        struct free_buf *b = (struct free_buf *)buf;
+        b->next = g_free;
+        g_free = b;
+        g_idle++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&g_lock);
+    free(buf);
+}
+
+/* ========== Arena ========== */
+
+void arena_init(struct arena *a, void *mem, size_t size) {
+    a->base = mem;
+    a->size = size;
+    a->used = 0;
+}
+
+/**
+ * @brief Allocate len bytes, 8-byte aligned
+ *
+ * @return Memory valid until arena_reset(), or NULL if the arena is full
+ */
+void *arena_alloc(struct arena *a, size_t len) {
+    size_t start = (a->used + 7) & ~(size_t)7;
+    if (start > a->size || len > a->size - start) return NULL;
+    a->used = start + len;
+    return a->base + start;
+}
+
+char *arena_strdup(struct arena *a, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(a, len);
+    if (copy) memcpy(copy, s, len);
+    return copy;
+}
+
+void arena_reset(struct arena *a) {
+    a->used = 0;
+}
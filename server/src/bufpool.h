@@ -0,0 +1,28 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+int bufpool_init(size_t buf_size, unsigned max_idle);
+size_t bufpool_buf_size(void);
+char *bufpool_get(void);
+void bufpool_put(char *buf);
+
+/**
+ * @brief Bump allocator over a fixed block, emptied in one step
+ *
+ * Requests allocate their paths from here instead of malloc(); nothing is
+ * freed individually and arena_reset() drops everything at once.
+ */
+struct arena {
+    char   *base;
+    size_t  size;
+    size_t  used;
+};
+
+void arena_init(struct arena *a, void *mem, size_t size);
+void *arena_alloc(struct arena *a, size_t len);
+char *arena_strdup(struct arena *a, const char *s);
+void arena_reset(struct arena *a);
+
+#endif
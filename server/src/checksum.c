@@ -0,0 +1,168 @@
+/**
+ * @file checksum.c
+ * @brief CRC-32C (Castagnoli) for end-to-end transfer checks
+ *
+ * Checked downloads (mode 'H') end with the CRC-32C of the file data, and
+ * mode 'K' returns it without sending the file, so clients can skip files
+ * they already have. The checksum has to keep up with a 10 GbE link, so on
+ * x86-64 CPUs with SSE4.2 (and ARMv8 with the CRC extension) it uses the
+ * crc32 instructions, 8 bytes per step; anything else falls back to a
+ * slicing-by-8 table. The CPU is probed once at run time, so the build
+ * needs no -m flags.
+ *
+ * Values are the standard CRC-32C (iSCSI, ext4, "123456789" = 0xE3069283),
+ * pre- and post-inverted inside, so results chain:
+ *   crc = checksum_crc32c(crc, chunk, len) starting from CHECKSUM_CRC32C_INIT.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "checksum.h"
+#include "log.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CHECKSUM_HW_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CHECKSUM_HW_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u   /**< Reflected Castagnoli polynomial */
+
+static uint32_t g_table[8][256];
+static int g_use_hw;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+
+static void checksum_setup(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        g_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            g_table[t][i] = (g_table[t - 1][i] >> 8) ^ g_table[0][g_table[t - 1][i] & 0xff];
+        }
+    }
+#if defined(CHECKSUM_HW_X86)
+    __builtin_cpu_init();
+    g_use_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(CHECKSUM_HW_ARM)
+    g_use_hw = 1;
+#endif
+}
+
+/**
+ * @brief Table-driven CRC-32C, 8 bytes per step (slicing-by-8)
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = (crc >> 8) ^ g_table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = g_table[7][lo & 0xff] ^ g_table[6][(lo >> 8) & 0xff] ^
+              g_table[5][(lo >> 16) & 0xff] ^ g_table[4][lo >> 24] ^
+              g_table[3][hi & 0xff] ^ g_table[2][(hi >> 8) & 0xff] ^
+              g_table[1][(hi >> 16) & 0xff] ^ g_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc = (crc >> 8) ^ g_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(CHECKSUM_HW_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#elif defined(CHECKSUM_HW_ARM)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+/**
+ * @brief Extend a CRC-32C over len more bytes
+ *
+ * @param crc  CHECKSUM_CRC32C_INIT, or the result for the preceding bytes
+ * @param data Bytes to add
+ * @param len  Number of bytes
+ * @return CRC-32C of everything so far
+ */
+uint32_t checksum_crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&g_once, checksum_setup);
+    const unsigned char *p = data;
+    crc = ~crc;
+#if defined(CHECKSUM_HW_X86) || defined(CHECKSUM_HW_ARM)
+    if (g_use_hw) return ~crc32c_hw(crc, p, len);
+#endif
+    return ~crc32c_sw(crc, p, len);
+}
+
+/**
+ * @brief CRC-32C of a byte range of an open file
+ *
+ * Reads with pread(), so the file offset is left alone. Used after a
+ * sendfile() download, when the pages are still hot in the page cache.
+ *
+ * @param fd       File to read
+ * @param offset   First byte
+ * @param length   Bytes to cover
+ * @param buf      Scratch buffer
+ * @param buf_size Size of buf
+ * @param crc_out  Receives the checksum
+ * @return 0 on success, -1 on read error or if the file ends early
+ */
+int checksum_file(int fd, off_t offset, uint64_t length, char *buf, size_t buf_size,
+                  uint32_t *crc_out) {
+    uint32_t crc = CHECKSUM_CRC32C_INIT;
+    while (length > 0) {
+        size_t want = length < buf_size ? (size_t)length : buf_size;
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) log_errno("pread checksum");
+            return -1;
+        }
+        crc = checksum_crc32c(crc, buf, (size_t)n);
+        offset += n;
+        length -= (uint64_t)n;
+    }
+    *crc_out = crc;
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Initial value for checksum_crc32c(); chain calls like zlib's crc32() */
+#define CHECKSUM_CRC32C_INIT 0u
+
+uint32_t checksum_crc32c(uint32_t crc, const void *data, size_t len);
+int checksum_file(int fd, off_t offset, uint64_t length, char *buf, size_t buf_size,
+                  uint32_t *crc_out);
+
+#endif
@@ -0,0 +1,444 @@
+/**
+ * @file config.c
+ * @brief Runtime configuration for the PAP server
+ *
+ * Holds the settings that used to be compile-time constants in main.c and
+ * lets them be overridden from a config file and on the command line:
+ * - -f FILE     read settings from FILE first (see config_load_file())
+ * - -p PORT     listening port
+ * - -b BACKLOG  listen() backlog
+ * - -A THREADS  accept threads, one SO_REUSEPORT listener each
+ * - -S BYTES    SO_SNDBUF of client sockets (0 = kernel autotuning)
+ * - -R BYTES    SO_RCVBUF of client sockets (0 = kernel autotuning)
+ * - -C ALGO     TCP congestion control, e.g. bbr or cubic
+ * - -F QLEN     enable TCP Fast Open with this queue length
+ * - -N          leave Nagle on (no TCP_NODELAY / TCP_CORK)
+ * - -w THREADS  number of session worker threads
+ * - -q DEPTH    accepted connections allowed to wait for a free worker
+ * - -t SECONDS  idle timeout for blocking socket calls (0 disables)
+ * - -c BYTES    transfer chunk size (per syscall and per buffer)
+ * - -Z          disable zero-copy (sendfile/splice) downloads
+ * - -I          use io_uring for buffered transfers
+ * - -L MIB      directory listing cache size in MiB (0 disables)
+ * - -U SECONDS  lifetime of cached passwd/shadow lookups (0 disables)
+ * - -k SECONDS  lifetime of session resumption tokens (0 disables)
+ * - -z LEVEL    highest zlib level for compressed transfers (0 disables)
+ * - -D LEVEL    upload durability: none, data (fdatasync) or full (fsync)
+ * - -m MIB      largest upload accepted (0 = no limit besides free space)
+ * - -v LEVEL    lowest log level written: debug, info, warn or error
+ * - -j          write the log as JSON lines instead of text
+ * - -T FILE     accept TLS connections with this PEM certificate chain
+ * - -K FILE     PEM private key for -T (default: read from the -T file)
+ * - -E          refuse connections that don't start a TLS handshake
+ * - -g SECONDS  how long SIGTERM waits for running sessions (drain)
+ *
+ * Options given on the command line win over the file. SIGHUP makes main.c
+ * run the whole parse again on a fresh copy, so an edited file (or a file
+ * that was not readable before) takes effect without a restart.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "log.h"
+
+/* ========== Defaults ========== */
+#define DEFAULT_PORT           9001
+#define DEFAULT_WORKER_THREADS 16
+#define DEFAULT_QUEUE_DEPTH    256
+#define DEFAULT_IDLE_TIMEOUT   120
+#define DEFAULT_CHUNK_SIZE     (1024 * 1024)
+#define MIN_CHUNK_SIZE         4096
+#define MAX_CHUNK_SIZE         (64 * 1024 * 1024)
+#define DEFAULT_LIST_CACHE_MIB 64
+#define DEFAULT_USER_CACHE_TTL 60
+#define DEFAULT_TOKEN_LIFETIME 300
+#define DEFAULT_COMPRESS_LEVEL 6
+#define DEFAULT_DRAIN_TIMEOUT  60
+
+struct server_config g_config;
+
+/**
+ * @brief Fill a configuration with the compiled-in defaults
+ */
+void config_set_defaults(struct server_config *cfg) {
+    cfg->port           = DEFAULT_PORT;
+    cfg->listen_backlog = SOMAXCONN;
+    cfg->listeners      = 1;
+    cfg->sndbuf         = 0;
+    cfg->rcvbuf         = 0;
+    cfg->nodelay        = 1;
+    cfg->congestion     = NULL;
+    cfg->fastopen       = 0;
+    cfg->worker_threads = DEFAULT_WORKER_THREADS;
+    cfg->queue_depth    = DEFAULT_QUEUE_DEPTH;
+    cfg->idle_timeout   = DEFAULT_IDLE_TIMEOUT;
+    cfg->zero_copy      = 1;
+    cfg->io_uring       = 0;
+    cfg->chunk_size     = DEFAULT_CHUNK_SIZE;
+    cfg->list_cache_bytes = (size_t)DEFAULT_LIST_CACHE_MIB << 20;
+    cfg->user_cache_ttl = DEFAULT_USER_CACHE_TTL;
+    cfg->token_lifetime = DEFAULT_TOKEN_LIFETIME;
+    cfg->compress_level = DEFAULT_COMPRESS_LEVEL;
+    cfg->durability     = DURABILITY_DATA;
+    cfg->max_upload     = 0;
+    cfg->log_level      = LOG_LEVEL_INFO;
+    cfg->log_json       = 0;
+    cfg->tls_cert       = NULL;
+    cfg->tls_key        = NULL;
+    cfg->tls_required   = 0;
+    cfg->drain_timeout  = DEFAULT_DRAIN_TIMEOUT;
+    cfg->config_file    = NULL;
+}
+
+/**
+ * @brief Parse an integer option and check it lies within [min, max]
+ *
+ * @return 0 on success, -1 if the value is not a number or out of range
+ */
+static int parse_int_opt(const char *arg, int min, int max, int *out) {
+    char *end;
+    long v = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || v < min || v > max) return -1;
+    *out = (int)v;
+    return 0;
+}
+
+/**
+ * @brief Parse a -D level name
+ *
+ * @return 0 on success, -1 for an unknown name
+ */
+static int parse_durability(const char *arg, int *out) {
+    static const char *const names[] = { "none", "data", "full" };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcasecmp(arg, names[i]) == 0) {
+            *out = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-f config_file] [-p port] [-b backlog] [-w threads] [-q queue_depth]\n"
+            "          [-t idle_timeout] [-g drain_timeout]\n"
+            "          [-A accept_threads] [-S sndbuf] [-R rcvbuf] [-C congestion] [-F fastopen_qlen] [-N]\n"
+            "          [-c chunk_size] [-Z] [-I] [-L list_cache_mib] [-U user_cache_ttl]\n"
+            "          [-k token_lifetime] [-z compress_level] [-D none|data|full] [-m max_upload_mib]\n"
+            "          [-v debug|info|warn|error] [-j]\n"
+            "          [-T tls_cert] [-K tls_key] [-E]\n",
+            prog);
+}
+
+/**
+ * @brief Apply one option, given by its command-line letter
+ *
+ * Shared by the command line and the config file, so both accept the same
+ * values. String arguments are stored as given and must outlive cfg.
+ *
+ * @return 0 on success, -1 for an unknown option or invalid value
+ */
+static int apply_option(struct server_config *cfg, int opt, const char *arg) {
+    int chunk, cache_mib, upload_mib, value, rc = 0;
+    switch (opt) {
+    case 'p': rc = parse_int_opt(arg, 1, 65535, &cfg->port); break;
+    case 'b': rc = parse_int_opt(arg, 1, 1 << 20, &cfg->listen_backlog); break;
+    case 'w': rc = parse_int_opt(arg, 1, 4096, &cfg->worker_threads); break;
+    case 'q': rc = parse_int_opt(arg, 1, 1 << 20, &cfg->queue_depth); break;
+    case 't':
+        rc = parse_int_opt(arg, 0, 86400, &value);
+        if (rc == 0) cfg->idle_timeout = value;
+        break;
+    case 'g':
+        rc = parse_int_opt(arg, 0, 86400, &value);
+        if (rc == 0) cfg->drain_timeout = value;
+        break;
+    case 'c':
+        rc = parse_int_opt(arg, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE, &chunk);
+        if (rc == 0) cfg->chunk_size = (size_t)chunk;
+        break;
+    case 'Z': cfg->zero_copy = 0; break;
+    case 'I': cfg->io_uring = 1; break;
+    case 'z':
+        rc = parse_int_opt(arg, 0, 9, &value);
+        if (rc == 0) cfg->compress_level = value;
+        break;
+    case 'D':
+        rc = parse_durability(arg, &value);
+        if (rc == 0) cfg->durability = value;
+        break;
+    case 'm':
+        rc = parse_int_opt(arg, 0, 1 << 30, &upload_mib);
+        if (rc == 0) cfg->max_upload = (uint64_t)upload_mib << 20;
+        break;
+    case 'v': rc = log_parse_level(arg, &cfg->log_level); break;
+    case 'j': cfg->log_json = 1; break;
+    case 'A': rc = parse_int_opt(arg, 1, MAX_LISTENERS, &cfg->listeners); break;
+    case 'S': rc = parse_int_opt(arg, 0, 1 << 30, &cfg->sndbuf); break;
+    case 'R': rc = parse_int_opt(arg, 0, 1 << 30, &cfg->rcvbuf); break;
+    case 'C': cfg->congestion = arg; break;
+    case 'F': rc = parse_int_opt(arg, 0, 65535, &cfg->fastopen); break;
+    case 'N': cfg->nodelay = 0; break;
+    case 'T': cfg->tls_cert = arg; break;
+    case 'K': cfg->tls_key = arg; break;
+    case 'E': cfg->tls_required = 1; break;
+    case 'U': rc = parse_int_opt(arg, 0, 86400, &cfg->user_cache_ttl); break;
+    case 'k': rc = parse_int_opt(arg, 0, 86400, &cfg->token_lifetime); break;
+    case 'L':
+        rc = parse_int_opt(arg, 0, 1 << 16, &cache_mib);
+        if (rc == 0) cfg->list_cache_bytes = (size_t)cache_mib << 20;
+        break;
+    default:  rc = -1; break;
+    }
+    return rc;
+}
+
+/* ========== Config File ========== */
+
+/**
+ * A config file key. Keys with a value take the same argument as their
+ * option letter; on/off keys set an int field directly, since the letters
+ * (-Z, -N, ...) can only switch a default one way.
+ */
+struct file_key {
+    const char *name;
+    int opt;              /**< Option letter, or 0 for an on/off key */
+    size_t flag_offset;   /**< int field set by an on/off key */
+    int flag_atomic;      /**< 1 if that field is an _Atomic int */
+};
+
+#define VALUE_KEY(name, opt) { name, opt, 0, 0 }
+#define FLAG_KEY(name, field) { name, 0, offsetof(struct server_config, field), 0 }
+#define ATOMIC_FLAG_KEY(name, field) { name, 0, offsetof(struct server_config, field), 1 }
+
+static const struct file_key g_file_keys[] = {
+    VALUE_KEY("port", 'p'),
+    VALUE_KEY("backlog", 'b'),
+    VALUE_KEY("accept_threads", 'A'),
+    VALUE_KEY("sndbuf", 'S'),
+    VALUE_KEY("rcvbuf", 'R'),
+    VALUE_KEY("congestion", 'C'),
+    VALUE_KEY("fastopen", 'F'),
+    FLAG_KEY("nodelay", nodelay),
+    VALUE_KEY("workers", 'w'),
+    VALUE_KEY("queue_depth", 'q'),
+    VALUE_KEY("idle_timeout", 't'),
+    VALUE_KEY("drain_timeout", 'g'),
+    VALUE_KEY("chunk_size", 'c'),
+    ATOMIC_FLAG_KEY("zero_copy", zero_copy),
+    FLAG_KEY("io_uring", io_uring),
+    VALUE_KEY("list_cache_mib", 'L'),
+    VALUE_KEY("user_cache_ttl", 'U'),
+    VALUE_KEY("token_lifetime", 'k'),
+    VALUE_KEY("compress_level", 'z'),
+    VALUE_KEY("durability", 'D'),
+    VALUE_KEY("max_upload_mib", 'm'),
+    VALUE_KEY("log_level", 'v'),
+    FLAG_KEY("log_json", log_json),
+    VALUE_KEY("tls_cert", 'T'),
+    VALUE_KEY("tls_key", 'K'),
+    ATOMIC_FLAG_KEY("tls_required", tls_required),
+};
+
+/**
+ * @brief Parse an on/off value: on, off, yes, no, true, false, 1 or 0
+ *
+ * @return 0 on success, -1 for anything else
+ */
+static int parse_flag(const char *arg, int *out) {
+    static const char *const on[] = { "on", "yes", "true", "1" };
+    static const char *const off[] = { "off", "no", "false", "0" };
+    for (int i = 0; i < 4; i++) {
+        if (strcasecmp(arg, on[i]) == 0) { *out = 1; return 0; }
+        if (strcasecmp(arg, off[i]) == 0) { *out = 0; return 0; }
+    }
+    return -1;
+}
+
+/**
+ * @brief Strip leading and trailing whitespace in place
+ */
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+/**
+ * @brief Apply a "key = value" settings file to cfg
+ *
+ * Blank lines and everything after a '#' are ignored. Keys are listed in
+ * g_file_keys, e.g. "workers = 32", "durability = full", "zero_copy = off".
+ *
+ * String values (congestion, tls_cert, tls_key) are copied to the heap and
+ * never freed: cfg may become g_config, and every SIGHUP leaves behind at
+ * most three short strings.
+ *
+ * @return 0 on success, -1 if the file can't be read or has a bad line
+ *         (logged with its line number)
+ */
+static int config_load_file(struct server_config *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        log_errno(path);
+        return -1;
+    }
+
+    char line[1024];
+    int lineno = 0, rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *key = trim(line);
+        if (*key == '\0') continue;
+
+        char *eq = strchr(key, '=');
+        if (!eq) {
+            log_error("%s:%d: expected \"key = value\"", path, lineno);
+            rc = -1;
+            break;
+        }
+        *eq = '\0';
+        char *value = trim(eq + 1);
+        key = trim(key);
+
+        const struct file_key *k = NULL;
+        for (size_t i = 0; i < sizeof(g_file_keys) / sizeof(g_file_keys[0]); i++) {
+            if (strcmp(key, g_file_keys[i].name) == 0) {
+                k = &g_file_keys[i];
+                break;
+            }
+        }
+        if (!k) {
+            log_error("%s:%d: unknown setting '%s'", path, lineno, key);
+            rc = -1;
+        } else if (k->opt == 0) {
+            int on;
+            char *field = (char *)cfg + k->flag_offset;
+            if (parse_flag(value, &on) != 0) {
+                log_error("%s:%d: %s must be on or off", path, lineno, key);
+                rc = -1;
+            } else if (k->flag_atomic) {
+                atomic_store_explicit((_Atomic int *)field, on, memory_order_relaxed);
+            } else {
+                *(int *)field = on;
+            }
+        } else {
+            int keep = (k->opt == 'C' || k->opt == 'T' || k->opt == 'K');
+            char *arg = keep ? strdup(value) : value;
+            if (!arg || apply_option(cfg, k->opt, arg) != 0) {
+                log_error("%s:%d: invalid value '%s' for %s", path, lineno, value, key);
+                if (keep) free(arg);
+                rc = -1;
+            }
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+/* ========== Command Line ========== */
+
+#define OPTSTRING "f:p:b:w:q:t:g:c:ZIL:U:k:z:D:m:v:jT:K:EA:S:R:C:F:N"
+
+/**
+ * @brief Apply the -f file, then the other command-line options
+ *
+ * May be called again with the same argv (SIGHUP) on a config that holds
+ * fresh defaults; getopt() is rewound each time.
+ *
+ * @param cfg  Configuration to update (should already hold defaults)
+ * @param argc Argument count from main()
+ * @param argv Argument vector from main()
+ * @return 0 on success, -1 on an unknown option, an invalid value or a bad
+ *         config file
+ */
+int config_parse_args(struct server_config *cfg, int argc, char **argv) {
+    int opt;
+
+    // The file comes first whatever its position, so the command line wins
+    optind = 1;
+    opterr = 0;  // Reported by the second pass
+    while ((opt = getopt(argc, argv, OPTSTRING)) != -1) {
+        if (opt == 'f') cfg->config_file = optarg;
+    }
+    if (cfg->config_file && config_load_file(cfg, cfg->config_file) != 0) return -1;
+
+    optind = 1;
+    opterr = 1;
+    while ((opt = getopt(argc, argv, OPTSTRING)) != -1) {
+        if (opt == 'f') continue;
+        if (apply_option(cfg, opt, optarg) != 0) {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    if (optind < argc) {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if ((cfg->tls_key || cfg->tls_required) && !cfg->tls_cert) {
+        fprintf(stderr, "%s: -K and -E need a certificate (-T)\n", argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Warn about settings a reload read but cannot apply to a running server
+ *
+ * These size thread pools, buffers or the listening sockets. They take
+ * effect on the next start, including a SIGUSR2 upgrade (except for the
+ * port and the other listener options: an upgrade keeps the sockets).
+ *
+ * @param old Configuration in use
+ * @param cfg Configuration just read
+ */
+void config_report_restart_only(const struct server_config *old, const struct server_config *cfg) {
+    static const struct { const char *name; size_t offset; } ints[] = {
+        { "port", offsetof(struct server_config, port) },
+        { "backlog", offsetof(struct server_config, listen_backlog) },
+        { "accept_threads", offsetof(struct server_config, listeners) },
+        { "sndbuf", offsetof(struct server_config, sndbuf) },
+        { "rcvbuf", offsetof(struct server_config, rcvbuf) },
+        { "nodelay", offsetof(struct server_config, nodelay) },
+        { "fastopen", offsetof(struct server_config, fastopen) },
+        { "workers", offsetof(struct server_config, worker_threads) },
+        { "queue_depth", offsetof(struct server_config, queue_depth) },
+        { "io_uring", offsetof(struct server_config, io_uring) },
+        { "log_json", offsetof(struct server_config, log_json) },
+    };
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+        if (*(const int *)((const char *)old + ints[i].offset) !=
+            *(const int *)((const char *)cfg + ints[i].offset)) {
+            log_warn("Setting %s changed; it takes effect after a restart.", ints[i].name);
+        }
+    }
+    if (old->chunk_size != cfg->chunk_size) {
+        log_warn("Setting chunk_size changed; it takes effect after a restart.");
+    }
+    if (old->list_cache_bytes != cfg->list_cache_bytes) {
+        log_warn("Setting list_cache_mib changed; it takes effect after a restart.");
+    }
+    const char *a = old->congestion ? old->congestion : "";
+    const char *b = cfg->congestion ? cfg->congestion : "";
+    if (strcmp(a, b) != 0) {
+        log_warn("Setting congestion changed; it takes effect after a restart.");
+    }
+}
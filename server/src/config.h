@@ -0,0 +1,67 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_LISTENERS 64  /**< Upper bound for -A */
+
+/** How far an upload is flushed before it replaces its target (-D) */
+enum durability {
+    DURABILITY_NONE,     /**< Rename only; data reaches the disk with normal writeback */
+    DURABILITY_DATA,     /**< fdatasync() the file before the rename */
+    DURABILITY_FULL,     /**< fsync() the file, and the directory after the rename */
+};
+
+/**
+ * @brief Runtime server settings
+ *
+ * Filled with compiled-in defaults by config_set_defaults() and then
+ * overridden by config_parse_args(): first from the -f file, then from the
+ * rest of the command line.
+ *
+ * The _Atomic fields are changed by SIGHUP while workers run; read them
+ * with config_get(), once per use, so one request sees one value.
+ */
+struct server_config {
+    int port;            /**< TCP port to listen on */
+    int listen_backlog;  /**< Backlog passed to listen() */
+    int listeners;       /**< Accept threads, each with its own SO_REUSEPORT socket */
+    int sndbuf;          /**< SO_SNDBUF in bytes (0 = kernel autotuning) */
+    int rcvbuf;          /**< SO_RCVBUF in bytes (0 = kernel autotuning) */
+    int nodelay;         /**< 1 = TCP_NODELAY, with TCP_CORK around replies */
+    const char *congestion; /**< TCP_CONGESTION algorithm; NULL = system default */
+    int fastopen;        /**< TCP Fast Open queue length (0 = off) */
+    int worker_threads;  /**< Number of session worker threads */
+    int queue_depth;     /**< Accepted connections waiting for a worker */
+    _Atomic int idle_timeout; /**< Seconds a session may block on recv/send (0 = none) */
+    _Atomic int zero_copy; /**< 1 = use sendfile()/splice() for downloads */
+    int io_uring;        /**< 1 = run buffered transfers on io_uring (uring.c) */
+    size_t chunk_size;   /**< Bytes moved per transfer syscall / buffer size */
+    size_t list_cache_bytes; /**< Memory budget of the directory listing cache (0 = off) */
+    int user_cache_ttl;  /**< Seconds a passwd/shadow lookup is reused (0 = off) */
+    int token_lifetime;  /**< Seconds a session resumption token is valid (0 = off) */
+    _Atomic int compress_level; /**< Highest zlib level for compressed transfers (0 = never) */
+    _Atomic int durability; /**< enum durability for uploads */
+    _Atomic uint64_t max_upload; /**< Largest upload in bytes (0 = only the free space limits it) */
+    int log_level;       /**< Lowest enum log_level that is written */
+    int log_json;        /**< 1 = write the log as JSON lines */
+    const char *tls_cert; /**< PEM certificate chain; NULL = no TLS */
+    const char *tls_key;  /**< PEM private key; NULL = read from tls_cert */
+    _Atomic int tls_required; /**< 1 = refuse plaintext connections */
+    _Atomic int drain_timeout; /**< Seconds SIGTERM waits for running sessions to finish */
+    const char *config_file; /**< -f file read before the command line; NULL = none */
+};
+
+/** Active configuration, read by main.c and the session handlers */
+extern struct server_config g_config;
+
+/** Relaxed load of a field SIGHUP may change (see reload_config() in main.c) */
+#define config_get(field) atomic_load_explicit(&g_config.field, memory_order_relaxed)
+
+void config_set_defaults(struct server_config *cfg);
+int config_parse_args(struct server_config *cfg, int argc, char **argv);
+void config_report_restart_only(const struct server_config *old, const struct server_config *cfg);
+
+#endif
@@ -0,0 +1,352 @@
+/**
+ * @file daemon.c
+ * @brief Graceful drain, inherited listening sockets and in-place upgrades
+ *
+ * Process lifecycle pieces that main.c's signal loop drives:
+ * - Drain: daemon_drain_begin() makes a pipe readable. Accept threads and
+ *   sessions waiting for their next request poll it next to their socket,
+ *   so on SIGTERM nobody new gets in and every session ends at a request
+ *   boundary, while transfers already under way run to completion.
+ * - Socket activation: listening sockets passed in with the systemd
+ *   protocol (LISTEN_PID/LISTEN_FDS, descriptors from 3 up) are used
+ *   instead of binding new ones, from a .socket unit or from an upgrade.
+ * - Upgrade: on SIGUSR2, daemon_upgrade() starts the binary again with the
+ *   same arguments and hands it the listening sockets the same way, plus
+ *   the session token key. The new process sends SIGTERM to the old one
+ *   once its workers are running; until then both accept from the same
+ *   sockets, so no connection is refused or reset at any point. The old
+ *   process then drains and exits.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   /* pipe2, close_range */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "daemon.h"
+#include "log.h"
+#include "token.h"
+
+#define LISTEN_FDS_START 3   /**< First inherited descriptor (SD_LISTEN_FDS_START) */
+
+extern char **environ;
+
+static char **g_argv;
+static char g_exe[4096];         /**< Binary an upgrade starts, as invoked */
+static int g_drain_pipe[2] = { -1, -1 };
+static atomic_int g_draining;
+static pid_t g_upgrade_parent;   /**< Process to stop once we are ready, 0 = none */
+static pid_t g_child;            /**< Upgrade in progress, 0 = none */
+
+/* ========== Setup ========== */
+
+/**
+ * @brief Remember how to start this binary again, as an absolute path
+ *
+ * Symlinks are kept rather than resolved, so upgrading by moving a
+ * symlink to a new release starts the new release.
+ */
+static void find_exe(const char *argv0) {
+    char cwd[2048];
+    if (strchr(argv0, '/')) {
+        if (argv0[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+            snprintf(g_exe, sizeof(g_exe), "%s/%s", cwd, argv0);
+        } else {
+            snprintf(g_exe, sizeof(g_exe), "%s", argv0);
+        }
+        return;
+    }
+
+    const char *path = getenv("PATH");
+    while (path && *path) {
+        size_t len = strcspn(path, ":");
+        snprintf(g_exe, sizeof(g_exe), "%.*s/%s", (int)len, path, argv0);
+        if (len > 0 && access(g_exe, X_OK) == 0) return;
+        path += len;
+        if (*path == ':') path++;
+    }
+    snprintf(g_exe, sizeof(g_exe), "%s", argv0);
+}
+
+/**
+ * @brief Record argv for upgrades and create the drain pipe
+ *
+ * @return 0 on success, -1 if the pipe can't be created
+ */
+int daemon_init(char **argv) {
+    g_argv = argv;
+    find_exe(argv[0]);
+    if (pipe2(g_drain_pipe, O_CLOEXEC) != 0) {
+        log_errno("pipe2");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read an environment variable as a positive int and remove it
+ *
+ * @return The value, or 0 if unset or not a positive number
+ */
+static int take_env_int(const char *name) {
+    const char *s = getenv(name);
+    long v = 0;
+    if (s) {
+        char *end;
+        v = strtol(s, &end, 10);
+        if (*s == '\0' || *end != '\0' || v <= 0 || v > 1 << 20) v = 0;
+    }
+    unsetenv(name);
+    return (int)v;
+}
+
+/**
+ * @brief Collect listening sockets handed over by systemd or an old process
+ *
+ * Also adopts the token key from an upgrade, so call it before
+ * token_init(). The variables are removed from the environment, so the
+ * descriptors are only claimed once.
+ *
+ * @param fds Filled with the inherited sockets
+ * @param max Capacity of fds
+ * @return Number of sockets (0 = bind new ones), or -1 if an inherited
+ *         descriptor is not a listening TCP socket
+ */
+int daemon_listen_fds(int *fds, int max) {
+    pid_t pid = (pid_t)take_env_int("LISTEN_PID");
+    int n = take_env_int("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    g_upgrade_parent = (pid_t)take_env_int("PAP_UPGRADE_PID");
+    int key_fd = take_env_int("PAP_TOKEN_KEY_FD");
+
+    if (pid != getpid() || n == 0) {
+        g_upgrade_parent = 0;  // Stale variables meant for another process
+        return 0;
+    }
+    if (key_fd > 0) {
+        // An empty pipe (tokens were off) leaves token_init() to make a key
+        token_key_load(key_fd);
+        close(key_fd);
+    }
+
+    if (n > max) {
+        log_error("%d listening sockets inherited, at most %d are supported.", n, max);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        int fd = LISTEN_FDS_START + i;
+        int listening = 0, type = 0;
+        socklen_t len = sizeof(listening), type_len = sizeof(type);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening ||
+            getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) != 0 || type != SOCK_STREAM) {
+            log_error("Inherited descriptor %d is not a listening stream socket.", fd);
+            return -1;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);  // Only an upgrade passes them on, explicitly
+        fds[i] = fd;
+    }
+    return n;
+}
+
+/**
+ * @brief Tell the process we are replacing that we accept connections now
+ *
+ * The old process receives SIGTERM and drains. No-op unless this process
+ * was started by daemon_upgrade() and that process is still our parent.
+ */
+void daemon_ready(void) {
+    if (g_upgrade_parent <= 0) return;
+    if (g_upgrade_parent == getppid()) {
+        log_info("Upgrade complete, stopping previous process %ld.", (long)g_upgrade_parent);
+        kill(g_upgrade_parent, SIGTERM);
+    }
+    g_upgrade_parent = 0;
+}
+
+/* ========== Upgrade ========== */
+
+/**
+ * @brief Whether an environment entry is one daemon_upgrade() sets itself
+ */
+static int is_handoff_var(const char *entry) {
+    static const char *const names[] = {
+        "LISTEN_PID=", "LISTEN_FDS=", "LISTEN_FDNAMES=", "PAP_UPGRADE_PID=", "PAP_TOKEN_KEY_FD=",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strncmp(entry, names[i], strlen(names[i])) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write a decimal number after a prefix; async-signal-safe
+ */
+static void format_pid(char *out, const char *prefix, long pid) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + pid % 10);
+        pid /= 10;
+    } while (pid > 0);
+    size_t len = strlen(prefix);
+    memcpy(out, prefix, len);
+    while (n > 0) out[len++] = digits[--n];
+    out[len] = '\0';
+}
+
+/**
+ * @brief Child side of daemon_upgrade(): place the descriptors and exec
+ *
+ * Runs between fork() and execve() in a multithreaded process, so only
+ * async-signal-safe calls. The signal mask stays blocked across execve();
+ * the new main() blocks the same signals, so a SIGTERM in between is held
+ * rather than killing it.
+ */
+static void exec_successor(const int *fds, int n, int key_fd, char **envp, char *listen_pid) {
+    int high[MAX_LISTENERS];
+    int top = LISTEN_FDS_START + n + 1;
+
+    // Move everything above the target range first, so no dup2() below
+    // overwrites a socket that still has to be moved
+    for (int i = 0; i < n; i++) {
+        high[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, top);
+        if (high[i] < 0) _exit(127);
+    }
+    if (key_fd >= 0) {
+        key_fd = fcntl(key_fd, F_DUPFD_CLOEXEC, top);
+        if (key_fd < 0) _exit(127);
+    }
+    for (int i = 0; i < n; i++) {
+        if (dup2(high[i], LISTEN_FDS_START + i) < 0) _exit(127);
+    }
+    if (key_fd >= 0 && dup2(key_fd, LISTEN_FDS_START + n) < 0) _exit(127);
+    // Client sockets and open files of running sessions stay with us
+    close_range((unsigned)(LISTEN_FDS_START + n + (key_fd >= 0)), ~0U, 0);
+
+    format_pid(listen_pid, "LISTEN_PID=", (long)getpid());
+    execve(g_exe, g_argv, envp);
+    _exit(127);
+}
+
+/**
+ * @brief Start a new server process that takes over the listening sockets
+ *
+ * The new process reads its configuration afresh (same arguments, current
+ * config file), warms up, and then stops this one with SIGTERM. If it
+ * fails to start, daemon_reap() logs why and this process carries on.
+ *
+ * @param fds Listening sockets
+ * @param n   Number of sockets
+ * @return 0 when the new process was started, -1 otherwise (logged)
+ */
+int daemon_upgrade(const int *fds, int n) {
+    if (g_child > 0) {
+        log_warn("Upgrade already in progress (pid %ld).", (long)g_child);
+        return -1;
+    }
+    if (n > MAX_LISTENERS) return -1;
+
+    // The token key goes through a pipe rather than the environment, which
+    // other processes of the same user can read
+    int key_pipe[2] = { -1, -1 };
+    if (pipe2(key_pipe, O_CLOEXEC) == 0) {
+        if (token_key_save(key_pipe[1]) != 0) log_errno("token key handoff");
+        close(key_pipe[1]);
+    }
+    int key_fd = key_pipe[0];
+
+    size_t count = 0;
+    while (environ[count]) count++;
+    char **envp = calloc(count + 5, sizeof(*envp));
+    char listen_fds[32], upgrade_pid[48], token_fd[48], listen_pid[48];
+    if (!envp) {
+        if (key_fd >= 0) close(key_fd);
+        return -1;
+    }
+    size_t e = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!is_handoff_var(environ[i])) envp[e++] = environ[i];
+    }
+    snprintf(listen_fds, sizeof(listen_fds), "LISTEN_FDS=%d", n);
+    snprintf(upgrade_pid, sizeof(upgrade_pid), "PAP_UPGRADE_PID=%ld", (long)getpid());
+    snprintf(token_fd, sizeof(token_fd), "PAP_TOKEN_KEY_FD=%d", LISTEN_FDS_START + n);
+    format_pid(listen_pid, "LISTEN_PID=", 0);  // Filled in by the child
+    envp[e++] = listen_fds;
+    envp[e++] = upgrade_pid;
+    envp[e++] = listen_pid;
+    if (key_fd >= 0) envp[e++] = token_fd;
+    envp[e] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) exec_successor(fds, n, key_fd, envp, listen_pid);
+    int saved = errno;
+    free(envp);
+    if (key_fd >= 0) close(key_fd);
+    if (pid < 0) {
+        errno = saved;
+        log_errno("fork");
+        return -1;
+    }
+
+    g_child = pid;
+    log_info("Upgrading: started %s as pid %ld with %d listening socket%s.",
+             g_exe, (long)pid, n, n == 1 ? "" : "s");
+    return 0;
+}
+
+/**
+ * @brief Collect an upgrade process that exited (on SIGCHLD)
+ *
+ * A successor that exits before it stopped us failed to start; this
+ * process keeps serving.
+ */
+void daemon_reap(void) {
+    int status;
+    if (g_child <= 0 || waitpid(g_child, &status, WNOHANG) != g_child) return;
+
+    if (WIFEXITED(status)) {
+        log_error("Upgrade failed: new process exited with status %d.", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        log_error("Upgrade failed: new process killed by signal %d.", WTERMSIG(status));
+    }
+    g_child = 0;
+}
+
+/* ========== Drain ========== */
+
+/**
+ * @brief Stop taking new connections and requests (idempotent)
+ *
+ * The byte written is never read, so the pipe stays readable for every
+ * poller from now on.
+ */
+void daemon_drain_begin(void) {
+    if (atomic_exchange(&g_draining, 1)) return;
+    char byte = 1;
+    if (write(g_drain_pipe[1], &byte, 1) != 1) log_errno("drain pipe");
+}
+
+/**
+ * @brief Whether daemon_drain_begin() was called
+ */
+int daemon_draining(void) {
+    return atomic_load_explicit(&g_draining, memory_order_relaxed);
+}
+
+/**
+ * @brief Descriptor that polls readable once draining starts
+ */
+int daemon_drain_fd(void) {
+    return g_drain_pipe[0];
+}
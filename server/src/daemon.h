@@ -0,0 +1,15 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+int daemon_init(char **argv);
+int daemon_listen_fds(int *fds, int max);
+void daemon_ready(void);
+
+int daemon_upgrade(const int *fds, int n);
+void daemon_reap(void);
+
+void daemon_drain_begin(void);
+int daemon_draining(void);
+int daemon_drain_fd(void);
+
+#endif
@@ -0,0 +1,312 @@
+/**
+ * @file delta.c
+ * @brief rsync-style delta uploads: block signatures and patch application
+ *
+ * The server splits the existing target into fixed-size blocks and sends
+ * one signature per full block; the client slides a rolling checksum over
+ * its new version of the file and answers with a list of "copy blocks
+ * i..j of the old file" and "literal bytes" instructions. Only data the
+ * server doesn't already have crosses the wire.
+ *
+ * Block signature (DELTA_SUM_SIZE bytes, all big-endian):
+ *   [4 weak rolling sum][4 CRC-32][8 FNV-1a-64]
+ *
+ * The weak sum is the rsync/Adler style pair a = sum(x), b = sum((L-i) x)
+ * (each mod 2^16, packed as a | b << 16), which the client can roll one
+ * byte at a time. CRC-32 plus FNV-1a-64 make the strong check. The file
+ * as a whole is verified against a CRC-32 sent with DELTA_OP_END, so a
+ * block collision is detected instead of silently corrupting the file.
+ *
+ * When the caller keeps the per-block CRCs from the signature pass, copied
+ * blocks are moved with copy_file_range(): on btrfs/XFS that shares the
+ * old extents (a reflink) instead of writing the data again, elsewhere it
+ * is an in-kernel copy. Their part of the whole-file CRC then comes from
+ * crc32_combine() over the signature CRCs, so the caller must make sure the
+ * old file did not change in between (see handle_delta_upload()).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1       /* copy_file_range() */
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "delta.h"
+#include "log.h"
+#include "transfer.h"
+
+#define DELTA_MIN_BLOCK  2048
+#define DELTA_MAX_BLOCK  (128 * 1024)
+#define DELTA_MAX_BLOCKS (1u << 20)   /**< Signature list stays below 16 MiB */
+#define COPY_UNSUPPORTED 2            /**< copy_blocks(): fall back to pread()/pwrite() */
+
+/** Running checksums of one block, fed in pieces by sum_update() */
+struct block_sum {
+    uint32_t a, b;
+    uint32_t crc;
+    uint64_t fnv;
+};
+
+static void sum_init(struct block_sum *s) {
+    s->a = s->b = 0;
+    s->crc = (uint32_t)crc32(0L, Z_NULL, 0);
+    s->fnv = 14695981039346656037ULL;
+}
+
+static void sum_update(struct block_sum *s, const unsigned char *p, size_t len) {
+    uint32_t a = s->a, b = s->b;
+    uint64_t fnv = s->fnv;
+    for (size_t i = 0; i < len; i++) {
+        a += p[i];
+        b += a;
+        fnv = (fnv ^ p[i]) * 1099511628211ULL;
+    }
+    s->a = a;
+    s->b = b;
+    s->fnv = fnv;
+    s->crc = (uint32_t)crc32(s->crc, p, (uInt)len);
+}
+
+/**
+ * @brief Pick the block size for a target of the given size
+ *
+ * About sqrt(size) (as rsync does), as a power of two within
+ * [DELTA_MIN_BLOCK, DELTA_MAX_BLOCK], grown past the maximum only when the
+ * file would otherwise need more than DELTA_MAX_BLOCKS signatures.
+ */
+uint32_t delta_block_size(uint64_t old_size) {
+    uint32_t block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && (uint64_t)block * block < old_size) block <<= 1;
+    while (old_size / block > DELTA_MAX_BLOCKS) block <<= 1;
+    return block;
+}
+
+/**
+ * @brief Send [4-byte block size][4-byte count] and one signature per full block
+ *
+ * A trailing partial block has no signature; the client sends those bytes
+ * as literals.
+ *
+ * @param sock_fd  Connected client socket
+ * @param old_fd   Existing target (-1 if there is none: zero blocks)
+ * @param old_size Size of the existing target
+ * @param block    Block size from delta_block_size()
+ * @param buf      Scratch buffer
+ * @param buf_size Size of buf (at least DELTA_SUM_SIZE)
+ * @param crcs     Optional; receives the CRC-32 of each block, old_size / block entries
+ * @return 0 on success, -1 on read or send failure
+ */
+int delta_send_signature(int sock_fd, int old_fd, uint64_t old_size, uint32_t block,
+                         char *buf, size_t buf_size, uint32_t *crcs) {
+    uint32_t count = old_fd >= 0 ? (uint32_t)(old_size / block) : 0;
+    uint32_t hdr[2] = { htonl(block), htonl(count) };
+    if (transfer_send_full(sock_fd, hdr, sizeof(hdr)) != 0) return -1;
+
+    // The second half of buf collects signatures, the first half reads data
+    size_t half = buf_size / 2;
+    char *sums = buf + half;
+    size_t sums_cap = half - half % DELTA_SUM_SIZE, sums_used = 0;
+    uint64_t off = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct block_sum s;
+        sum_init(&s);
+        uint32_t left = block;
+        while (left > 0) {
+            size_t want = left < half ? left : half;
+            ssize_t n = pread(old_fd, buf, want, (off_t)off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                log_errno("pread signature");
+                return -1;  // File shrank: the count already sent can't be met
+            }
+            sum_update(&s, (const unsigned char *)buf, (size_t)n);
+            off += (uint64_t)n;
+            left -= (uint32_t)n;
+        }
+
+        if (crcs) crcs[i] = s.crc;
+        uint32_t weak = htonl((s.a & 0xffff) | (s.b << 16));
+        uint32_t crc = htonl(s.crc);
+        uint64_t fnv = htobe64(s.fnv);
+        memcpy(sums + sums_used, &weak, 4);
+        memcpy(sums + sums_used + 4, &crc, 4);
+        memcpy(sums + sums_used + 8, &fnv, 8);
+        sums_used += DELTA_SUM_SIZE;
+        if (sums_used == sums_cap || i + 1 == count) {
+            if (transfer_send_full(sock_fd, sums, sums_used) != 0) return -1;
+            sums_used = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Write len bytes at *out_off, updating the whole-file CRC
+ */
+static int write_out(int out_fd, const char *data, size_t len, uint64_t *out_off, uint32_t *crc) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite(out_fd, data + done, len - done, (off_t)(*out_off + done));
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            log_errno("pwrite");
+            return -1;
+        }
+        done += (size_t)w;
+    }
+    *crc = (uint32_t)crc32(*crc, (const Bytef *)data, (uInt)len);
+    *out_off += len;
+    return 0;
+}
+
+/**
+ * @brief Copy len bytes of the old file to *out_off with copy_file_range()
+ *
+ * @return 0 on success, COPY_UNSUPPORTED if the filesystems can't do it
+ *         (nothing was copied), DELTA_MISMATCH if the old file is shorter,
+ *         -1 on I/O errors
+ */
+static int copy_blocks(int old_fd, uint64_t src, int out_fd, uint64_t *out_off, uint64_t len) {
+    loff_t in = (loff_t)src, out = (loff_t)*out_off;
+    uint64_t left = len;
+    while (left > 0) {
+        ssize_t n = copy_file_range(old_fd, &in, out_fd, &out, left, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && left == len &&
+            (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            return COPY_UNSUPPORTED;
+        }
+        if (n < 0) {
+            log_errno("copy_file_range");
+            return -1;
+        }
+        if (n == 0) return DELTA_MISMATCH;  // Old file shrank underneath us
+        left -= (uint64_t)n;
+    }
+    *out_off += len;
+    return 0;
+}
+
+/**
+ * @brief Read delta instructions from the client and build the new file
+ *
+ * @param sock_fd     Connected client socket, positioned at the first op
+ * @param old_fd      Existing target the COPY ops refer to (-1 if none)
+ * @param old_size    Its size
+ * @param block       Block size the signatures were made with
+ * @param out_fd      Empty file receiving the new content
+ * @param buf         Scratch buffer
+ * @param buf_size    Size of buf
+ * @param crcs        Block CRCs from delta_send_signature() to copy blocks with
+ *                    copy_file_range(), or NULL to read and check them
+ * @param written_out Receives the size of the new file
+ * @return 0 when the file was rebuilt and its CRC-32 matches,
+ *         DELTA_MISMATCH when all ops were read but the result is wrong
+ *         (the connection is still in sync), -1 on I/O or protocol errors
+ *
+ * @note The client does not announce the new size, and one COPY op can
+ *       repeat the whole old file, so the output is capped at
+ *       transfer_upload_limit() (-m, and the free space): ops that would
+ *       pass it end the upload with -1.
+ */
+int delta_apply(int sock_fd, int old_fd, uint64_t old_size, uint32_t block,
+                int out_fd, char *buf, size_t buf_size, const uint32_t *crcs,
+                uint64_t *written_out) {
+    uint32_t nblocks = old_fd >= 0 ? (uint32_t)(old_size / block) : 0;
+    uint32_t crc = (uint32_t)crc32(0L, Z_NULL, 0);
+    uint64_t out_off = 0;
+    uint64_t limit = transfer_upload_limit(out_fd);
+    int mismatch = 0;
+
+    while (1) {
+        unsigned char op;
+        uint32_t args[2];
+        if (transfer_recv_full(sock_fd, &op, 1) != 0) {
+            log_warn("Delta stream ended early.");
+            return -1;
+        }
+
+        if (op == DELTA_OP_END) {
+            if (transfer_recv_full(sock_fd, args, 4) != 0) return -1;
+            if (ntohl(args[0]) != crc) mismatch = 1;
+            break;
+        }
+
+        if (op == DELTA_OP_LITERAL) {
+            if (transfer_recv_full(sock_fd, args, 4) != 0) return -1;
+            uint32_t left = ntohl(args[0]);
+            if (left > DELTA_LITERAL_MAX) {
+                log_warn("Delta literal too long (%u bytes).", left);
+                return -1;
+            }
+            if (left > limit - out_off) {
+                log_warn("Delta upload exceeds the upload limit of %llu bytes.", (unsigned long long)limit);
+                return -1;
+            }
+            while (left > 0) {
+                size_t want = left < buf_size ? left : buf_size;
+                if (transfer_recv_full(sock_fd, buf, want) != 0 ||
+                    write_out(out_fd, buf, want, &out_off, &crc) != 0) {
+                    return -1;
+                }
+                left -= (uint32_t)want;
+            }
+        } else if (op == DELTA_OP_COPY) {
+            if (transfer_recv_full(sock_fd, args, 8) != 0) return -1;
+            uint32_t first = ntohl(args[0]), count = ntohl(args[1]);
+            if (first >= nblocks || count > nblocks - first) {
+                // Bad references can't be applied, but the stream stays readable
+                mismatch = 1;
+                continue;
+            }
+            uint64_t src = (uint64_t)first * block;
+            uint64_t left = (uint64_t)count * block;
+            if (left > limit - out_off) {
+                log_warn("Delta upload exceeds the upload limit of %llu bytes.", (unsigned long long)limit);
+                return -1;
+            }
+            if (crcs && !mismatch) {
+                int rc = copy_blocks(old_fd, src, out_fd, &out_off, left);
+                if (rc < 0) return -1;
+                if (rc == DELTA_MISMATCH) {
+                    mismatch = 1;
+                    continue;
+                }
+                if (rc == 0) {
+                    for (uint32_t i = 0; i < count; i++) {
+                        crc = (uint32_t)crc32_combine(crc, crcs[first + i], (z_off_t)block);
+                    }
+                    continue;
+                }
+                crcs = NULL;  // COPY_UNSUPPORTED: read the data from now on
+            }
+            while (left > 0 && !mismatch) {
+                size_t want = left < buf_size ? (size_t)left : buf_size;
+                ssize_t n = pread(old_fd, buf, want, (off_t)src);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    mismatch = 1;  // Old file shrank underneath us
+                    break;
+                }
+                if (write_out(out_fd, buf, (size_t)n, &out_off, &crc) != 0) return -1;
+                src += (uint64_t)n;
+                left -= (uint64_t)n;
+            }
+        } else {
+            log_warn("Unknown delta op 0x%02x.", op);
+            return -1;
+        }
+    }
+
+    *written_out = out_off;
+    return mismatch ? DELTA_MISMATCH : 0;
+}
@@ -0,0 +1,25 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Delta instruction bytes sent by the client after the block signatures */
+#define DELTA_OP_LITERAL 'L'   /**< [4-byte BE length][bytes]: new data          */
+#define DELTA_OP_COPY    'B'   /**< [4-byte BE first block][4-byte BE count]     */
+#define DELTA_OP_END     'E'   /**< [4-byte BE CRC-32 of the whole new file]     */
+
+#define DELTA_LITERAL_MAX (64 * 1024)   /**< Longest literal run in one op */
+#define DELTA_SUM_SIZE    16            /**< Bytes per block signature     */
+
+/** Result of delta_apply() when the ops were read but the file didn't verify */
+#define DELTA_MISMATCH 1
+
+uint32_t delta_block_size(uint64_t old_size);
+int delta_send_signature(int sock_fd, int old_fd, uint64_t old_size, uint32_t block,
+                         char *buf, size_t buf_size, uint32_t *crcs);
+int delta_apply(int sock_fd, int old_fd, uint64_t old_size, uint32_t block,
+                int out_fd, char *buf, size_t buf_size, const uint32_t *crcs,
+                uint64_t *written_out);
+
+#endif
@@ -0,0 +1,292 @@
+/**
+ * @file listcache.c
+ * @brief In-memory cache of serialized directory listings
+ *
+ * Sessions browsing the same directories share one listing_blob per
+ * resolved directory path, so repeated LIST/extended-LIST requests skip
+ * opendir()/readdir()/sorting entirely. Entries are invalidated by an
+ * inotify watch on the directory, serviced by a background thread. When
+ * inotify is unavailable (or a watch can't be added) the entry falls back
+ * to comparing the directory's mtime on every lookup.
+ *
+ * The cache is bounded by the total size of the cached blobs and evicts
+ * the least recently used entry first. With a size of 0 it is disabled and
+ * listcache_get() always misses.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "listcache.h"
+#include "log.h"
+
+#define LISTCACHE_BUCKETS 256
+/** Events that change which names a directory contains */
+#define LISTCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                          IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct cache_entry {
+    char                *path;
+    struct listing_blob *blob;
+    struct timespec      mtime;  /**< Directory mtime when the blob was built */
+    int                  wd;     /**< inotify watch, -1 = check mtime instead */
+    struct cache_entry  *bucket_next;
+    struct cache_entry  *lru_prev;
+    struct cache_entry  *lru_next;
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *g_buckets[LISTCACHE_BUCKETS];
+static struct cache_entry *g_lru_head;   /**< Most recently used */
+static struct cache_entry *g_lru_tail;
+static size_t g_max_bytes;
+static size_t g_used_bytes;
+static int g_inotify_fd = -1;
+
+/* ========== Internal Helpers (call with g_lock held) ========== */
+
+static unsigned bucket_of(const char *path) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h % LISTCACHE_BUCKETS;
+}
+
+static size_t blob_bytes(const struct listing_blob *blob) {
+    return blob->len + (blob->count + 1) * sizeof(size_t);
+}
+
+static void blob_unref_locked(struct listing_blob *blob) {
+    if (--blob->refs > 0) return;
+    free(blob->data);
+    free(blob->offsets);
+    free(blob);
+}
+
+static struct cache_entry *find_locked(const char *path) {
+    for (struct cache_entry *e = g_buckets[bucket_of(path)]; e; e = e->bucket_next) {
+        if (strcmp(e->path, path) == 0) return e;
+    }
+    return NULL;
+}
+
+static void lru_unlink(struct cache_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else g_lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else g_lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(struct cache_entry *e) {
+    e->lru_next = g_lru_head;
+    if (g_lru_head) g_lru_head->lru_prev = e; else g_lru_tail = e;
+    g_lru_head = e;
+}
+
+/**
+ * @brief Remove an inotify watch unless a cached entry still uses it
+ */
+static void drop_watch_locked(int wd) {
+    if (wd < 0) return;
+    for (struct cache_entry *o = g_lru_head; o; o = o->lru_next) {
+        if (o->wd == wd) return;
+    }
+    // IN_IGNORED for this wd arrives later and finds nothing to drop
+    inotify_rm_watch(g_inotify_fd, wd);
+}
+
+/**
+ * @brief Unlink and free an entry; drops its watch unless still shared
+ */
+static void remove_locked(struct cache_entry *e) {
+    struct cache_entry **pp = &g_buckets[bucket_of(e->path)];
+    while (*pp != e) pp = &(*pp)->bucket_next;
+    *pp = e->bucket_next;
+    lru_unlink(e);
+    drop_watch_locked(e->wd);
+
+    g_used_bytes -= blob_bytes(e->blob);
+    blob_unref_locked(e->blob);
+    free(e->path);
+    free(e);
+}
+
+/* ========== inotify Thread ========== */
+
+/**
+ * @brief Drop every entry whose directory changed; all of them on overflow
+ */
+static void *inotify_main(void *arg) {
+    (void)arg;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(g_inotify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            log_errno("inotify read");
+            return NULL;
+        }
+
+        pthread_mutex_lock(&g_lock);
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            struct cache_entry *e = g_lru_head;
+            while (e) {
+                struct cache_entry *next = e->lru_next;
+                if ((ev->mask & IN_Q_OVERFLOW) || e->wd == ev->wd) {
+                    if (ev->mask & IN_IGNORED) e->wd = -1;  // Kernel already dropped it
+                    remove_locked(e);
+                }
+                e = next;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_mutex_unlock(&g_lock);
+    }
+}
+
+/* ========== Public API ========== */
+
+/**
+ * @brief Enable the cache and start the invalidation thread
+ *
+ * @param max_bytes Memory budget for cached listings; 0 disables the cache
+ * @return 0; if inotify can't be set up the cache still works, validating
+ *         every hit against the directory mtime
+ */
+int listcache_init(size_t max_bytes) {
+    g_max_bytes = max_bytes;
+    if (max_bytes == 0) return 0;
+
+    g_inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (g_inotify_fd < 0) {
+        log_errno("inotify_init1 (listing cache falls back to mtime checks)");
+        return 0;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, inotify_main, NULL) != 0) {
+        log_error("Failed to start listing cache thread.");
+        close(g_inotify_fd);
+        g_inotify_fd = -1;
+        return 0;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * @brief Look up the cached listing of a directory
+ *
+ * @param resolved_path realpath() of the directory
+ * @return A referenced blob (give it back with listcache_release()), or
+ *         NULL if nothing valid is cached
+ */
+struct listing_blob *listcache_get(const char *resolved_path) {
+    if (g_max_bytes == 0) return NULL;
+
+    pthread_mutex_lock(&g_lock);
+    struct cache_entry *e = find_locked(resolved_path);
+    if (!e) {
+        pthread_mutex_unlock(&g_lock);
+        return NULL;
+    }
+    lru_unlink(e);
+    lru_push_front(e);
+    struct listing_blob *blob = e->blob;
+    blob->refs++;
+    int watched = (e->wd >= 0);
+    struct timespec mtime = e->mtime;
+    pthread_mutex_unlock(&g_lock);
+
+    if (watched) return blob;
+
+    // Unwatched: trust the entry only while the directory mtime is unchanged
+    struct stat st;
+    if (stat(resolved_path, &st) == 0 &&
+        st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec == mtime.tv_nsec) {
+        return blob;
+    }
+
+    pthread_mutex_lock(&g_lock);
+    e = find_locked(resolved_path);
+    if (e && e->blob == blob) remove_locked(e);
+    blob_unref_locked(blob);
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+/**
+ * @brief Offer a freshly built listing to the cache
+ *
+ * The caller keeps its own reference. mtime must be the directory's mtime
+ * from before it was read; if the directory changed in the meantime (or
+ * before the watch was in place) the blob is not cached.
+ *
+ * @param resolved_path realpath() of the directory
+ * @param mtime         Directory mtime sampled before readdir()
+ * @param blob          Listing built from that directory
+ */
+void listcache_put(const char *resolved_path, const struct timespec *mtime,
+                   struct listing_blob *blob) {
+    // One giant directory shouldn't flush everything else
+    if (g_max_bytes == 0 || blob_bytes(blob) > g_max_bytes / 4) return;
+
+    int wd = -1;
+    if (g_inotify_fd >= 0) {
+        wd = inotify_add_watch(g_inotify_fd, resolved_path, LISTCACHE_EVENTS);
+    }
+
+    // Anything that happened before the watch existed shows up as a new mtime
+    struct stat st;
+    struct cache_entry *e = NULL;
+    if (stat(resolved_path, &st) != 0 ||
+        st.st_mtim.tv_sec != mtime->tv_sec || st.st_mtim.tv_nsec != mtime->tv_nsec ||
+        !(e = calloc(1, sizeof(*e))) || !(e->path = strdup(resolved_path))) {
+        free(e);
+        pthread_mutex_lock(&g_lock);
+        drop_watch_locked(wd);
+        pthread_mutex_unlock(&g_lock);
+        return;
+    }
+    e->mtime = *mtime;
+    e->wd = wd;
+
+    pthread_mutex_lock(&g_lock);
+    struct cache_entry *old = find_locked(resolved_path);
+    if (old) {
+        if (old->wd == wd) old->wd = -1;  // Same watch: keep it for the new entry
+        remove_locked(old);
+    }
+
+    blob->refs++;
+    e->blob = blob;
+    unsigned b = bucket_of(resolved_path);
+    e->bucket_next = g_buckets[b];
+    g_buckets[b] = e;
+    lru_push_front(e);
+    g_used_bytes += blob_bytes(blob);
+
+    while (g_used_bytes > g_max_bytes && g_lru_tail && g_lru_tail != e) {
+        remove_locked(g_lru_tail);
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+/**
+ * @brief Give back a reference from listcache_get() or the builder
+ */
+void listcache_release(struct listing_blob *blob) {
+    if (!blob) return;
+    pthread_mutex_lock(&g_lock);
+    blob_unref_locked(blob);
+    pthread_mutex_unlock(&g_lock);
+}
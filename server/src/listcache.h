@@ -0,0 +1,33 @@
+#ifndef LISTCACHE_H
+#define LISTCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Serialized listing of one directory, shared between sessions
+ *
+ * data holds every entry (excluding "." and ".."), sorted directories
+ * first and then by name ignoring case, each encoded exactly as on the
+ * wire: [type byte][4-byte BE name length][name]. Entry i starts at
+ * offsets[i]; offsets[count] == len. A blob never changes once built and
+ * is freed when its last reference is released. hash identifies the
+ * contents and seeds the revalidation tokens of conditional listings.
+ */
+struct listing_blob {
+    char     *data;
+    size_t    len;
+    size_t   *offsets;
+    uint32_t  count;
+    uint64_t  hash;      /**< 64-bit FNV-1a of data */
+    int       refs;      /**< Managed by listcache.c */
+};
+
+int listcache_init(size_t max_bytes);
+struct listing_blob *listcache_get(const char *resolved_path);
+void listcache_put(const char *resolved_path, const struct timespec *mtime,
+                   struct listing_blob *blob);
+void listcache_release(struct listing_blob *blob);
+
+#endif
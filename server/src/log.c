@@ -0,0 +1,321 @@
+/**
+ * @file log.c
+ * @brief Asynchronous structured logging through a lock-free ring buffer
+ *
+ * Workers never write to stdout themselves. log_write() formats the
+ * message straight into a slot of a bounded multi-producer ring (one CAS
+ * to claim the slot, one release store to publish it) and returns; a
+ * background thread drains the ring, adds the timestamp text, and writes
+ * whole batches with a single write(2). A slow terminal or journald
+ * therefore only delays the log thread, and sessions never contend on the
+ * stdio lock.
+ *
+ * When the ring is full the message is dropped rather than blocking the
+ * transfer; the log thread reports how many were lost.
+ *
+ * Output is one line per event, either text
+ *   2026-10-14T09:30:01.123456Z INFO  s=12 Sending file to client: /home/a/x
+ * or, with -j, JSON lines
+ *   {"ts":"2026-10-14T09:30:01.123456Z","level":"info","session":12,"msg":"..."}
+ *
+ * Before log_init() (command-line errors, startup) messages are written
+ * synchronously to stderr.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define LOG_RING_SLOTS 4096         /**< Power of two */
+#define LOG_MSG_MAX    480          /**< Longer messages are truncated */
+#define LOG_OUT_BUF    (64 * 1024)  /**< Batched output per write() */
+#define LOG_IDLE_NS    (5 * 1000 * 1000)    /**< First poll interval after traffic */
+#define LOG_IDLE_MAX_NS (200 * 1000 * 1000) /**< Longest poll interval when idle */
+
+struct log_slot {
+    atomic_size_t   seq;            /**< Vyukov sequence: == pos when free, pos + 1 when full */
+    struct timespec ts;
+    unsigned long   session;
+    unsigned short  len;
+    unsigned char   level;
+    char            msg[LOG_MSG_MAX];
+};
+
+_Atomic int g_log_level = LOG_LEVEL_INFO;
+
+static struct log_slot *g_ring;
+static atomic_size_t g_enqueue_pos;
+static size_t g_dequeue_pos;        /**< Only touched by the log thread */
+static atomic_ulong g_dropped;
+static int g_json;
+static atomic_int g_flush_waiting;
+static _Thread_local unsigned long t_session;
+
+static const char *const g_level_names[] = { "debug", "info", "warn", "error" };
+static const char *const g_level_tags[]  = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+/* ========== Consumer ========== */
+
+struct out_buf {
+    char   data[LOG_OUT_BUF];
+    size_t len;
+};
+
+static void out_flush(struct out_buf *o) {
+    size_t done = 0;
+    while (done < o->len) {
+        ssize_t n = write(STDOUT_FILENO, o->data + done, o->len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;  // Nowhere to report it; drop the batch
+        done += (size_t)n;
+    }
+    o->len = 0;
+}
+
+static void out_put(struct out_buf *o, const char *s, size_t len) {
+    if (o->len + len > sizeof(o->data)) out_flush(o);
+    memcpy(o->data + o->len, s, len);
+    o->len += len;
+}
+
+/**
+ * @brief Append msg as the body of a JSON string
+ */
+static void out_json_string(struct out_buf *o, const char *msg, size_t len) {
+    char esc[8];
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)msg[i];
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = (char)c;
+            out_put(o, esc, 2);
+        } else if (c < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out_put(o, esc, 6);
+        } else {
+            out_put(o, &msg[i], 1);
+        }
+    }
+}
+
+static void format_event(struct out_buf *o, const struct log_slot *s) {
+    struct tm tm;
+    char ts[40], head[96];
+    gmtime_r(&s->ts.tv_sec, &tm);
+    size_t n = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(ts + n, sizeof(ts) - n, ".%06ldZ", s->ts.tv_nsec / 1000);
+
+    if (g_json) {
+        int h = snprintf(head, sizeof(head), "{\"ts\":\"%s\",\"level\":\"%s\",\"session\":%lu,\"msg\":\"",
+                         ts, g_level_names[s->level], s->session);
+        out_put(o, head, (size_t)h);
+        out_json_string(o, s->msg, s->len);
+        out_put(o, "\"}\n", 3);
+    } else {
+        int h = snprintf(head, sizeof(head), "%s %s s=%lu ", ts, g_level_tags[s->level], s->session);
+        out_put(o, head, (size_t)h);
+        out_put(o, s->msg, s->len);
+        out_put(o, "\n", 1);
+    }
+}
+
+/**
+ * @brief Move every published event to the output; returns how many there were
+ */
+static size_t drain(struct out_buf *o) {
+    size_t count = 0;
+    while (1) {
+        struct log_slot *s = &g_ring[g_dequeue_pos & (LOG_RING_SLOTS - 1)];
+        if (atomic_load_explicit(&s->seq, memory_order_acquire) != g_dequeue_pos + 1) break;
+        format_event(o, s);
+        atomic_store_explicit(&s->seq, g_dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+        g_dequeue_pos++;
+        count++;
+    }
+
+    unsigned long dropped = atomic_exchange_explicit(&g_dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        struct log_slot note = { .level = LOG_LEVEL_WARN };
+        clock_gettime(CLOCK_REALTIME, &note.ts);
+        note.len = (unsigned short)snprintf(note.msg, sizeof(note.msg),
+                                            "%lu log messages dropped (ring full)", dropped);
+        format_event(o, &note);
+    }
+    if (o->len > 0) out_flush(o);
+    return count;
+}
+
+static void *log_main(void *arg) {
+    (void)arg;
+    static struct out_buf out;
+    long idle_ns = LOG_IDLE_NS;
+    while (1) {
+        int waiting = atomic_load_explicit(&g_flush_waiting, memory_order_acquire);
+        if (drain(&out) > 0) {
+            idle_ns = LOG_IDLE_NS;
+            continue;
+        }
+        if (waiting) atomic_fetch_sub_explicit(&g_flush_waiting, waiting, memory_order_release);
+        // Polling keeps producers free of wakeup syscalls; back off so an idle server stays quiet
+        if (atomic_load_explicit(&g_flush_waiting, memory_order_acquire) > 0) continue;
+        const struct timespec idle = { 0, idle_ns };
+        nanosleep(&idle, NULL);
+        idle_ns = idle_ns * 2 < LOG_IDLE_MAX_NS ? idle_ns * 2 : LOG_IDLE_MAX_NS;
+    }
+    return NULL;
+}
+
+/* ========== Producers ========== */
+
+/**
+ * @brief Claim a free slot, or NULL if the ring is full
+ */
+static struct log_slot *claim_slot(size_t *pos_out) {
+    size_t pos = atomic_load_explicit(&g_enqueue_pos, memory_order_relaxed);
+    while (1) {
+        struct log_slot *s = &g_ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&g_enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *pos_out = pos;
+                return s;
+            }
+        } else if (seq < pos) {
+            return NULL;  // Still holds an event from one lap ago
+        } else {
+            pos = atomic_load_explicit(&g_enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Queue one event (use the log_* macros, which filter by level first)
+ *
+ * @param level LOG_LEVEL_*
+ * @param fmt   printf-style format; no trailing newline needed
+ */
+void log_write(int level, const char *fmt, ...) {
+    va_list ap;
+    if (!g_ring) {
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+        return;
+    }
+
+    size_t pos;
+    struct log_slot *s = claim_slot(&pos);
+    if (!s) {
+        atomic_fetch_add_explicit(&g_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &s->ts);
+    va_start(ap, fmt);
+    int n = vsnprintf(s->msg, sizeof(s->msg), fmt, ap);
+    va_end(ap);
+    if (n < 0) n = 0;
+    if ((size_t)n >= sizeof(s->msg)) n = sizeof(s->msg) - 1;
+    while (n > 0 && s->msg[n - 1] == '\n') n--;  // Old printf-style messages
+    s->len = (unsigned short)n;
+    s->level = (unsigned char)level;
+    s->session = t_session;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+}
+
+/**
+ * @brief Change the lowest level written; safe while other threads log
+ */
+void log_set_level(int min_level) {
+    atomic_store_explicit(&g_log_level, min_level, memory_order_relaxed);
+}
+
+/**
+ * @brief perror() replacement: logs "what: strerror(errno)" at error level
+ */
+void log_errno(const char *what) {
+    int err = errno;
+    if (LOG_LEVEL_ERROR < atomic_load_explicit(&g_log_level, memory_order_relaxed)) return;
+    char buf[128];
+    if (strerror_r(err, buf, sizeof(buf)) != 0) snprintf(buf, sizeof(buf), "error %d", err);
+    log_write(LOG_LEVEL_ERROR, "%s: %s", what, buf);
+    errno = err;
+}
+
+/**
+ * @brief Tag this thread's following events with a session number (0 = none)
+ */
+void log_set_session(unsigned long id) {
+    t_session = id;
+}
+
+/* ========== Setup ========== */
+
+/**
+ * @brief Translate "debug", "info", "warn" or "error" into a level
+ *
+ * @return 0 on success, -1 for an unknown name
+ */
+int log_parse_level(const char *name, int *level) {
+    for (int i = 0; i < (int)(sizeof(g_level_names) / sizeof(g_level_names[0])); i++) {
+        if (strcasecmp(name, g_level_names[i]) == 0) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Start the log thread; until then messages go straight to stderr
+ *
+ * @param min_level Lowest level written
+ * @param json      1 for JSON lines, 0 for text
+ * @return 0 on success, -1 if the ring or thread could not be created
+ *         (logging then stays synchronous)
+ */
+int log_init(int min_level, int json) {
+    log_set_level(min_level);
+    g_json = json;
+
+    struct log_slot *ring = calloc(LOG_RING_SLOTS, sizeof(*ring));
+    if (!ring) return -1;
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) atomic_init(&ring[i].seq, i);
+    g_ring = ring;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_main, NULL) != 0) {
+        g_ring = NULL;
+        free(ring);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * @brief Wait until everything logged so far has been written (at exit)
+ */
+void log_flush(void) {
+    if (!g_ring) return;
+    atomic_fetch_add_explicit(&g_flush_waiting, 1, memory_order_release);
+    const struct timespec tick = { 0, 1000 * 1000 };
+    for (int i = 0; i < 2000 && atomic_load_explicit(&g_flush_waiting, memory_order_acquire) > 0; i++) {
+        nanosleep(&tick, NULL);
+    }
+}
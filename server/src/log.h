@@ -0,0 +1,35 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+/** Severity levels, lowest first; messages below the configured level are dropped */
+enum log_level {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+extern _Atomic int g_log_level;  /**< Changed by SIGHUP while workers log */
+
+int log_init(int min_level, int json);
+void log_flush(void);
+void log_set_level(int min_level);
+void log_set_session(unsigned long id);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_errno(const char *what);
+int log_parse_level(const char *name, int *level);
+
+/* The level check is inlined so filtered messages cost a load and a branch */
+#define log_at(level, ...) \
+    do { \
+        if ((level) >= atomic_load_explicit(&g_log_level, memory_order_relaxed)) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -1,64 +1,323 @@
-#include <stdio.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   /* accept4 */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include "bufpool.h"
+#include "config.h"
+#include "daemon.h"
+#include "listcache.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
 #include "session.h"
+#include "sockopt.h"
+#include "tls.h"
+#include "token.h"
+#include "usercache.h"
 
-#define PORT 9001
 #define UNLOCK_SIGNAL 0x01
+#define UNLOCK_TOKEN  0x02  /**< Unlock followed by a resumption token, see token.c */
 
-int main(void) {
-	int server_fd, client_fd;
-	struct sockaddr_in addr;
+/** Connection ids shown in the log; 0 means "not in a session" */
+static atomic_ulong g_next_session = 1;
 
-	server_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (server_fd < 0) { perror("socket"); exit(1); }
+/**
+ * Runs on a worker thread for every accepted connection: runs the TLS
+ * handshake if the client starts one, waits for the unlock byte, hands the
+ * socket to the session handler, then closes it.
+ */
+static void serve_client(int client_fd) {
+	log_set_session(atomic_fetch_add_explicit(&g_next_session, 1, memory_order_relaxed));
+	log_debug("Client connected, waiting for unlock...");
+	metrics_count(METRIC_CONNECTIONS, 1);
 
-	// Allow immediate port reuse after server restart
-	int opt = 1;
-	if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-		perror("setsockopt SO_REUSEADDR"); exit(1);
+	unsigned char sig;
+	int n;
+	if (tls_enabled()) {
+		// TLS and plaintext clients share the port; the first byte tells them apart
+		n = recv(client_fd, &sig, 1, MSG_PEEK | MSG_WAITALL);
+		if (n == 1 && sig == TLS_RECORD_HANDSHAKE) {
+			if (tls_accept(client_fd) != 0) {
+				close(client_fd);
+				log_set_session(0);
+				return;
+			}
+		} else if (n == 1 && config_get(tls_required)) {
+			log_warn("Plaintext connection refused, TLS is required.");
+			metrics_count(METRIC_UNLOCK_FAILED, 1);
+			close(client_fd);
+			log_set_session(0);
+			return;
+		}
 	}
 
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons(PORT);
-
-	if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-		perror("bind"); exit(1);
+	n = (int)tls_recv(client_fd, &sig, 1, MSG_WAITALL);
+	if (n <= 0 || (sig != UNLOCK_SIGNAL && sig != UNLOCK_TOKEN)) {
+		log_warn("Bad or missing unlock signal.");
+		metrics_count(METRIC_UNLOCK_FAILED, 1);
+		tls_end(client_fd);
+		close(client_fd);
+		log_set_session(0);
+		return;
 	}
-	if (listen(server_fd, 5) < 0) {
-		perror("listen"); exit(1);
+
+	log_debug("Unlock signal received, starting transfer.");
+
+	struct session_ctx ctx;
+	session_init(&ctx, client_fd);
+	ctx.token_auth = (sig == UNLOCK_TOKEN);
+	metrics_sessions_active(1);
+	if (handle_unlocked_session(&ctx) != 0) {
+		log_warn("Transfer aborted due to error.");
 	}
+	metrics_sessions_active(-1);
 
-	printf("Server running on port %d, idle mode\n", PORT);
+	log_info("Session done (%llu requests, %llu bytes in, %llu bytes out, %llu ms), worker returning to idle.",
+	       (unsigned long long)ctx.stats.requests, (unsigned long long)ctx.stats.bytes_in,
+	       (unsigned long long)ctx.stats.bytes_out,
+	       (unsigned long long)((metrics_now_usec() - ctx.stats.started_usec) / 1000));
+	session_release(&ctx);
+	tls_end(client_fd);
+	close(client_fd);
+	log_set_session(0);
+}
+
+/** A listening socket and the pool its accept thread feeds */
+struct listener {
+	int fd;
+	struct worker_pool *pool;
+	pthread_t thread;
+};
+
+/**
+ * Accepts connections on one listening socket until the server drains and
+ * queues them for the workers. With -A there is one of these per
+ * SO_REUSEPORT socket.
+ */
+static void *accept_loop(void *arg) {
+	struct listener *l = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = l->fd, .events = POLLIN },
+		{ .fd = daemon_drain_fd(), .events = POLLIN },
+	};
 
+	// During an upgrade the new process accepts from the same socket, so a
+	// connection poll() reported may be gone by the time accept() runs
+	fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
 	while (1) {
-		client_fd = accept(server_fd, NULL, NULL);
-		if (client_fd < 0) { perror("accept"); continue; }
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno != EINTR) log_errno("poll");
+			continue;
+		}
+		if (pfd[1].revents) break;
 
-		printf("Client connected, waiting for unlock...\n");
+		int client_fd = accept4(l->fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) log_errno("accept");
+			continue;
+		}
 
-		unsigned char sig;
-		int n = recv(client_fd, &sig, 1, MSG_WAITALL);
-		if (n <= 0 || sig != UNLOCK_SIGNAL) {
-			printf("Bad or missing unlock signal.\n");
+		sockopt_tune_client(client_fd);
+		if (pool_submit(l->pool, client_fd) != 0) {
 			close(client_fd);
-			continue;
 		}
+	}
+	return NULL;
+}
+
+/**
+ * Reads the config file and command line again (SIGHUP) and applies what
+ * can change while sessions run. Invalid settings leave the running
+ * configuration untouched.
+ */
+static void reload_config(int argc, char **argv) {
+	struct server_config next;
+	config_set_defaults(&next);
+	if (config_parse_args(&next, argc, argv) != 0) {
+		log_error("Reload failed, keeping the current configuration.");
+		return;
+	}
+	if (!next.tls_cert && g_config.tls_cert) {
+		log_warn("TLS cannot be turned off by a reload; it stays on until a restart.");
+		next.tls_cert = g_config.tls_cert;
+		next.tls_key = g_config.tls_key;
+	} else if (next.tls_cert && tls_reload(next.tls_cert, next.tls_key) != 0) {
+		log_error("Reload failed, keeping the current configuration.");
+		return;
+	}
+	config_report_restart_only(&g_config, &next);
+
+	// Workers read these per connection or per request, through config_get()
+	atomic_store_explicit(&g_config.idle_timeout, next.idle_timeout, memory_order_relaxed);
+	atomic_store_explicit(&g_config.zero_copy, next.zero_copy, memory_order_relaxed);
+	atomic_store_explicit(&g_config.compress_level, next.compress_level, memory_order_relaxed);
+	atomic_store_explicit(&g_config.durability, next.durability, memory_order_relaxed);
+	atomic_store_explicit(&g_config.max_upload, next.max_upload, memory_order_relaxed);
+	atomic_store_explicit(&g_config.tls_required, next.tls_required, memory_order_relaxed);
+	atomic_store_explicit(&g_config.drain_timeout, next.drain_timeout, memory_order_relaxed);
+	log_set_level(next.log_level);
+	usercache_init(next.user_cache_ttl);
+	token_set_lifetime(next.token_lifetime);
 
-		printf("Unlock signal received, starting transfer.\n");
+	// Only this thread reads the rest
+	g_config.log_level      = next.log_level;
+	g_config.tls_cert       = next.tls_cert;
+	g_config.tls_key        = next.tls_key;
+	g_config.user_cache_ttl = next.user_cache_ttl;
+	g_config.token_lifetime = next.token_lifetime;
+	g_config.config_file    = next.config_file;
+	log_info("Configuration reloaded.");
+}
 
-		if (handle_unlocked_session(client_fd) != 0) {
-			printf("Transfer aborted due to error.\n");
+/**
+ * Runs on the main thread and handles the process signals until
+ * SIGTERM/SIGINT: SIGHUP reloads, SIGUSR2 starts an upgrade, SIGCHLD
+ * collects a failed upgrade.
+ */
+static void signal_loop(const sigset_t *signals, int argc, char **argv,
+			const int *fds, int nfds) {
+	while (1) {
+		int sig;
+		if (sigwait(signals, &sig) != 0) continue;
+		switch (sig) {
+		case SIGHUP:  reload_config(argc, argv); break;
+		case SIGUSR2: daemon_upgrade(fds, nfds); break;
+		case SIGCHLD: daemon_reap(); break;
+		default:
+			log_info("Received %s, draining (up to %d s).", strsignal(sig), config_get(drain_timeout));
+			return;
 		}
+	}
+}
 
-		close(client_fd);
-		printf("Session done, returning to idle mode.\n");
+/**
+ * Waits for queued and running connections to finish after the accept
+ * threads stopped. Gives up after -g seconds, or at once on a second
+ * SIGTERM/SIGINT.
+ *
+ * @return 1 when every connection finished, 0 if some are still open
+ */
+static int wait_for_drain(struct worker_pool *pool, const sigset_t *signals) {
+	const struct timespec tick = { 0, 200 * 1000 * 1000 };
+	uint64_t deadline = metrics_now_usec() + (uint64_t)config_get(drain_timeout) * 1000000;
+	int busy;
+	while ((busy = pool_busy(pool)) > 0) {
+		if (metrics_now_usec() >= deadline) {
+			log_warn("Drain timed out with %d connection%s open, exiting anyway.",
+			         busy, busy == 1 ? "" : "s");
+			return 0;
+		}
+		int sig = sigtimedwait(signals, NULL, &tick);
+		if (sig == SIGTERM || sig == SIGINT) {
+			log_warn("Second %s, exiting with %d connection%s open.",
+			         strsignal(sig), busy, busy == 1 ? "" : "s");
+			return 0;
+		}
+		if (sig == SIGCHLD) daemon_reap();
+	}
+	return 1;
+}
+
+/**
+ * Port a listening socket is bound to; inherited sockets need not match -p
+ */
+static int listener_port(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0) return g_config.port;
+	if (addr.ss_family == AF_INET) return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	if (addr.ss_family == AF_INET6) return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	return g_config.port;
+}
+
+int main(int argc, char **argv) {
+	static struct listener listeners[MAX_LISTENERS];
+	static int listen_fds[MAX_LISTENERS];
+	struct worker_pool pool;
+	sigset_t signals;
+
+	// Taken by signal_loop() with sigwait(); blocked before any thread
+	// starts, so every thread inherits the mask and none of them gets one
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR2);
+	sigaddset(&signals, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	config_set_defaults(&g_config);
+	if (config_parse_args(&g_config, argc, argv) != 0) exit(1);
+	log_init(g_config.log_level, g_config.log_json);
+	if (daemon_init(argv) != 0) { log_flush(); exit(1); }
+	int inherited = daemon_listen_fds(listen_fds, MAX_LISTENERS);
+	if (inherited < 0) { log_flush(); exit(1); }
+	bufpool_init(g_config.chunk_size, (unsigned)g_config.worker_threads);
+	listcache_init(g_config.list_cache_bytes);
+	usercache_init(g_config.user_cache_ttl);
+	token_init(g_config.token_lifetime);
+	if (g_config.tls_cert && tls_init(g_config.tls_cert, g_config.tls_key) != 0) {
+		log_error("Cannot load the TLS certificate."); log_flush(); exit(1);
+	}
+
+	// A client vanishing mid-transfer must not kill every other session
+	signal(SIGPIPE, SIG_IGN);
+
+	if (inherited > 0) {
+		// Socket options were set by whoever created them (or a .socket unit)
+		if (inherited != g_config.listeners) {
+			log_info("Using %d inherited listening socket%s instead of -A %d.",
+			         inherited, inherited == 1 ? "" : "s", g_config.listeners);
+		}
+		g_config.listeners = inherited;
+	} else {
+		for (int i = 0; i < g_config.listeners; i++) {
+			listen_fds[i] = sockopt_open_listener(g_config.listeners > 1);
+			if (listen_fds[i] < 0) { log_flush(); exit(1); }
+		}
+	}
+
+	if (pool_start(&pool, g_config.worker_threads, g_config.queue_depth, serve_client) != 0) {
+		log_error("Failed to start worker pool."); log_flush(); exit(1);
+	}
+
+	for (int i = 0; i < g_config.listeners; i++) {
+		listeners[i].fd = listen_fds[i];
+		listeners[i].pool = &pool;
+		if (pthread_create(&listeners[i].thread, NULL, accept_loop, &listeners[i]) != 0) {
+			log_error("Failed to start accept thread."); log_flush(); exit(1);
+		}
 	}
 
-	close(server_fd);
+	log_info("Server running on port %d with %d workers and %d accept thread%s%s, idle mode",
+	       listener_port(listen_fds[0]), g_config.worker_threads, g_config.listeners,
+	       g_config.listeners == 1 ? "" : "s", inherited > 0 ? " (inherited sockets)" : "");
+	daemon_ready();
+
+	signal_loop(&signals, argc, argv, listen_fds, g_config.listeners);
+
+	daemon_drain_begin();
+	for (int i = 0; i < g_config.listeners; i++) {
+		pthread_join(listeners[i].thread, NULL);
+		close(listen_fds[i]);
+	}
+	if (wait_for_drain(&pool, &signals)) {
+		pool_shutdown(&pool);
+		log_info("All sessions finished, server stopped.");
+	}
+	log_flush();
 	return 0;
 }
@@ -0,0 +1,279 @@
+/**
+ * @file metrics.c
+ * @brief Lock-free server counters and their Prometheus text export
+ *
+ * Every value is a C11 atomic updated with relaxed ordering: a worker
+ * bumps a few counters per request without taking a lock, and the export
+ * (mode 'M', see handle_metrics() in session.c) reads them without
+ * stopping anyone, so the numbers it shows are each exact but not a
+ * consistent snapshot of one instant.
+ *
+ * Bytes and operations are kept per mode byte, which shows where the
+ * traffic goes; histograms use power-of-two buckets so one observation is
+ * a count-leading-zeros and three atomic adds.
+ */
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include "metrics.h"
+
+#define METRICS_HIST_BUCKETS 28   /**< Upper bounds 1, 2, 4 ... 2^26, then +Inf */
+#define METRICS_MODES        128  /**< Mode bytes are ASCII letters, slot 0 is "other" */
+
+struct hist {
+    atomic_uint_fast64_t buckets[METRICS_HIST_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+};
+
+/** Request totals for one mode byte */
+struct mode_stats {
+    atomic_uint_fast64_t requests;
+    atomic_uint_fast64_t bytes_in;
+    atomic_uint_fast64_t bytes_out;
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} g_counter_info[METRIC_COUNTERS] = {
+    [METRIC_CONNECTIONS]     = { "pap_connections_total", "Accepted connections" },
+    [METRIC_UNLOCK_FAILED]   = { "pap_unlock_failed_total", "Connections without a valid unlock byte" },
+    [METRIC_AUTH_OK]         = { "pap_auth_ok_total", "Successful authentications" },
+    [METRIC_AUTH_FAILED]     = { "pap_auth_failed_total", "Failed authentications" },
+    [METRIC_AUTH_TOKEN]      = { "pap_auth_token_total", "Authentications by session resumption token" },
+    [METRIC_REJECTED]        = { "pap_requests_rejected_total", "Requests refused with STATUS_ERROR" },
+    [METRIC_FAILED]          = { "pap_requests_failed_total", "Requests that dropped the connection" },
+    [METRIC_LISTCACHE_HITS]  = { "pap_listcache_hits_total", "Listings served from the listing cache" },
+    [METRIC_LISTCACHE_MISSES] = { "pap_listcache_misses_total", "Listings read from disk" },
+    [METRIC_TLS_SESSIONS]    = { "pap_tls_sessions_total", "Connections that completed a TLS handshake" },
+    [METRIC_KTLS_SESSIONS]   = { "pap_ktls_sessions_total", "TLS connections with kernel send offload" },
+    [METRIC_TLS_FAILED]      = { "pap_tls_handshake_failed_total", "Failed TLS handshakes" },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} g_hist_info[METRIC_HISTS] = {
+    [METRIC_AUTH_USEC]    = { "pap_auth_duration_microseconds", "Time from username to authentication result" },
+    [METRIC_TTFB_USEC]    = { "pap_download_ttfb_microseconds", "Time from download request to first reply byte" },
+    [METRIC_REQUEST_USEC] = { "pap_request_duration_microseconds", "Time to serve one request" },
+    [METRIC_LIST_ENTRIES] = { "pap_listing_entries", "Entries per listed directory" },
+};
+
+static atomic_uint_fast64_t g_counters[METRIC_COUNTERS];
+static struct hist g_hists[METRIC_HISTS];
+static struct mode_stats g_modes[METRICS_MODES];
+static atomic_int g_sessions_active;
+
+/**
+ * @brief Microseconds on CLOCK_MONOTONIC
+ */
+uint64_t metrics_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+void metrics_count(enum metric_counter c, uint64_t n) {
+    atomic_fetch_add_explicit(&g_counters[c], n, memory_order_relaxed);
+}
+
+/**
+ * @brief Record one value; bucket i counts values up to 2^i
+ */
+void metrics_observe(enum metric_hist h, uint64_t value) {
+    unsigned b = value <= 1 ? 0 : 64 - (unsigned)__builtin_clzll(value - 1);
+    if (b >= METRICS_HIST_BUCKETS) b = METRICS_HIST_BUCKETS - 1;
+    atomic_fetch_add_explicit(&g_hists[h].buckets[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_hists[h].count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_hists[h].sum, value, memory_order_relaxed);
+}
+
+/**
+ * @brief Track sessions being served right now (+1 on start, -1 when done)
+ */
+void metrics_sessions_active(int delta) {
+    atomic_fetch_add_explicit(&g_sessions_active, delta, memory_order_relaxed);
+}
+
+/**
+ * @brief Read the socket's TCP byte counters
+ *
+ * @return 0, or -1 if they aren't available (not TCP, kernel before 4.1)
+ */
+static int socket_bytes(int sock_fd, uint64_t *in, uint64_t *out) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sock_fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+        len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) {
+        return -1;
+    }
+    *in = info.tcpi_bytes_received;
+    *out = info.tcpi_bytes_acked;
+    return 0;
+}
+
+/**
+ * @brief Slot for a mode byte: itself if it can be a label value as is, else "other"
+ */
+static int mode_slot(unsigned char mode) {
+    if (mode <= ' ' || mode >= 0x7f || mode == '"' || mode == '\\') return METRICS_MODE_OTHER;
+    return mode;
+}
+
+/**
+ * @brief Account a finished request to its mode and to the session
+ *
+ * Bytes are the change in the socket's counters since the previous call,
+ * so protocol overhead (paths, status bytes) is included. Outgoing bytes
+ * count once the client acknowledged them; anything still in flight is
+ * attributed to the next request.
+ *
+ * @param stats        The session's totals
+ * @param sock_fd      Client socket
+ * @param mode         Mode byte of the request, METRICS_MODE_OTHER if unknown
+ * @param started_usec metrics_now_usec() when the mode byte arrived
+ */
+void metrics_request_done(struct session_stats *stats, int sock_fd, unsigned char mode,
+                          uint64_t started_usec) {
+    uint64_t in = 0, out = 0, tcp_in, tcp_out;
+    if (socket_bytes(sock_fd, &tcp_in, &tcp_out) == 0) {
+        in = tcp_in - stats->tcp_in;
+        out = tcp_out - stats->tcp_out;
+        stats->tcp_in = tcp_in;
+        stats->tcp_out = tcp_out;
+    }
+    stats->requests++;
+    stats->bytes_in += in;
+    stats->bytes_out += out;
+
+    struct mode_stats *m = &g_modes[mode_slot(mode)];
+    atomic_fetch_add_explicit(&m->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->bytes_in, in, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->bytes_out, out, memory_order_relaxed);
+    metrics_observe(METRIC_REQUEST_USEC, metrics_now_usec() - started_usec);
+}
+
+/* ========== Export ========== */
+
+struct text_buf {
+    char  *data;
+    size_t len, cap;
+    int    failed;
+};
+
+static void text_printf(struct text_buf *t, const char *fmt, ...) {
+    if (t->failed) return;
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(t->data + t->len, t->cap - t->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            t->failed = 1;
+            return;
+        }
+        if ((size_t)n < t->cap - t->len) {
+            t->len += (size_t)n;
+            return;
+        }
+        char *grown = realloc(t->data, t->cap * 2 + (size_t)n);
+        if (!grown) {
+            t->failed = 1;
+            return;
+        }
+        t->data = grown;
+        t->cap = t->cap * 2 + (size_t)n;
+    }
+}
+
+static uint64_t load(atomic_uint_fast64_t *v) {
+    return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+/**
+ * @brief Render all metrics in the Prometheus text exposition format
+ *
+ * @param len_out Receives the text length
+ * @return malloc()ed text (caller frees), or NULL if out of memory
+ */
+char *metrics_render(size_t *len_out) {
+    struct text_buf t = { malloc(8192), 0, 8192, 0 };
+    if (!t.data) return NULL;
+
+    text_printf(&t, "# HELP pap_sessions_active Sessions being served\n"
+                    "# TYPE pap_sessions_active gauge\npap_sessions_active %d\n",
+                atomic_load_explicit(&g_sessions_active, memory_order_relaxed));
+
+    // Lets a load generator on another host work out server CPU per GB moved
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        long usec = ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+        text_printf(&t, "# HELP process_cpu_seconds_total User and system CPU time spent\n"
+                        "# TYPE process_cpu_seconds_total counter\nprocess_cpu_seconds_total %ld.%06ld\n",
+                    (long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) + usec / 1000000, usec % 1000000);
+    }
+
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        text_printf(&t, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                    g_counter_info[c].name, g_counter_info[c].help, g_counter_info[c].name,
+                    g_counter_info[c].name, (unsigned long long)load(&g_counters[c]));
+    }
+
+    static const char *const mode_fields[] = { "requests", "bytes_in", "bytes_out" };
+    for (int f = 0; f < 3; f++) {
+        text_printf(&t, "# TYPE pap_mode_%s_total counter\n", mode_fields[f]);
+        for (int m = 0; m < METRICS_MODES; m++) {
+            uint64_t requests = load(&g_modes[m].requests);
+            if (requests == 0) continue;
+            uint64_t v = f == 0 ? requests : f == 1 ? load(&g_modes[m].bytes_in)
+                                                   : load(&g_modes[m].bytes_out);
+            if (m == METRICS_MODE_OTHER) {
+                text_printf(&t, "pap_mode_%s_total{mode=\"other\"} %llu\n",
+                            mode_fields[f], (unsigned long long)v);
+            } else {
+                text_printf(&t, "pap_mode_%s_total{mode=\"%c\"} %llu\n",
+                            mode_fields[f], m, (unsigned long long)v);
+            }
+        }
+    }
+
+    for (int h = 0; h < METRIC_HISTS; h++) {
+        const char *name = g_hist_info[h].name;
+        text_printf(&t, "# HELP %s %s\n# TYPE %s histogram\n", name, g_hist_info[h].help, name);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_HIST_BUCKETS - 1; b++) {
+            cumulative += load(&g_hists[h].buckets[b]);
+            text_printf(&t, "%s_bucket{le=\"%llu\"} %llu\n", name,
+                        1ULL << b, (unsigned long long)cumulative);
+        }
+        cumulative += load(&g_hists[h].buckets[METRICS_HIST_BUCKETS - 1]);
+        text_printf(&t, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu\n%s_count %llu\n",
+                    name, (unsigned long long)cumulative,
+                    name, (unsigned long long)load(&g_hists[h].sum),
+                    name, (unsigned long long)load(&g_hists[h].count));
+    }
+
+    if (t.failed) {
+        free(t.data);
+        return NULL;
+    }
+    *len_out = t.len;
+    return t.data;
+}
@@ -0,0 +1,58 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Monotonic event counters (Prometheus counters) */
+enum metric_counter {
+    METRIC_CONNECTIONS,       /**< Accepted connections */
+    METRIC_UNLOCK_FAILED,     /**< Connections dropped for a bad/missing unlock byte */
+    METRIC_AUTH_OK,
+    METRIC_AUTH_FAILED,
+    METRIC_AUTH_TOKEN,        /**< Logins by resumption token (also in AUTH_OK) */
+    METRIC_REJECTED,          /**< Requests answered with STATUS_ERROR */
+    METRIC_FAILED,            /**< Requests that ended the connection with an error */
+    METRIC_LISTCACHE_HITS,
+    METRIC_LISTCACHE_MISSES,
+    METRIC_TLS_SESSIONS,      /**< Completed TLS handshakes */
+    METRIC_KTLS_SESSIONS,     /**< TLS sessions whose sends the kernel encrypts */
+    METRIC_TLS_FAILED,        /**< Failed TLS handshakes */
+    METRIC_COUNTERS
+};
+
+/** Value distributions with power-of-two buckets (Prometheus histograms) */
+enum metric_hist {
+    METRIC_AUTH_USEC,         /**< Username to authentication verdict */
+    METRIC_TTFB_USEC,         /**< Download request to first reply byte */
+    METRIC_REQUEST_USEC,      /**< Whole request, by any mode */
+    METRIC_LIST_ENTRIES,      /**< Entries in a listed directory */
+    METRIC_HISTS
+};
+
+/**
+ * @brief Per-session totals, owned by the session's worker thread
+ *
+ * Bytes come from the kernel's TCP byte counters, so every send path
+ * (sendfile, splice, buffered) is covered without instrumenting it.
+ */
+struct session_stats {
+    uint64_t started_usec;    /**< metrics_now_usec() at session_init() */
+    uint64_t requests;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t tcp_in;          /**< Socket byte counters at the last request boundary */
+    uint64_t tcp_out;
+};
+
+#define METRICS_MODE_OTHER 0  /**< Mode for unknown requests, exported as mode="other" */
+
+uint64_t metrics_now_usec(void);
+void metrics_count(enum metric_counter c, uint64_t n);
+void metrics_observe(enum metric_hist h, uint64_t value);
+void metrics_sessions_active(int delta);
+void metrics_request_done(struct session_stats *stats, int sock_fd, unsigned char mode,
+                          uint64_t started_usec);
+char *metrics_render(size_t *len_out);
+
+#endif
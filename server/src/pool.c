@@ -0,0 +1,150 @@
+/**
+ * @file pool.c
+ * @brief Bounded worker thread pool used to run client sessions concurrently
+ *
+ * main.c accepts connections and submits them here; each worker thread takes
+ * one client socket at a time and runs the whole session on it. The number of
+ * workers bounds how many sessions run at once, and the queue depth bounds
+ * how many accepted connections may wait for a free worker.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pool.h"
+
+/**
+ * @brief Worker thread body: pop client fds and run the job until shutdown
+ */
+static void *worker_main(void *arg) {
+    struct worker_pool *pool = arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        if (pool->count == 0 && pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        int client_fd = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pool->active++;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->job(client_fd);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Create the queue and spawn the worker threads
+ *
+ * @param pool        Pool to initialise
+ * @param threads     Number of worker threads (>= 1)
+ * @param queue_depth Maximum number of pending connections (>= 1)
+ * @param job         Function each worker runs for a connection
+ * @return 0 on success, -1 on error (no threads are left running)
+ */
+int pool_start(struct worker_pool *pool, int threads, int queue_depth, pool_job_fn job) {
+    memset(pool, 0, sizeof(*pool));
+    if (threads < 1 || queue_depth < 1) return -1;
+
+    pool->queue = malloc((size_t)queue_depth * sizeof(*pool->queue));
+    pool->threads = malloc((size_t)threads * sizeof(*pool->threads));
+    if (!pool->queue || !pool->threads) {
+        free(pool->queue);
+        free(pool->threads);
+        return -1;
+    }
+    pool->capacity = queue_depth;
+    pool->job = job;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            log_errno("pthread_create");
+            pool_shutdown(pool);
+            return -1;
+        }
+        pool->thread_count++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queue an accepted client socket for the next idle worker
+ *
+ * Blocks while the queue is full.
+ *
+ * @return 0 on success, -1 if the pool is shutting down (fd is not taken)
+ */
+int pool_submit(struct worker_pool *pool, int client_fd) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->capacity && !pool->stopping) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    int tail = (pool->head + pool->count) % pool->capacity;
+    pool->queue[tail] = client_fd;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/**
+ * @brief Connections queued or being served right now
+ *
+ * The SIGTERM drain in main.c waits for this to reach 0.
+ */
+int pool_busy(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    int busy = pool->count + pool->active;
+    pthread_mutex_unlock(&pool->lock);
+    return busy;
+}
+
+/**
+ * @brief Stop accepting work, let workers drain the queue, and join them
+ */
+void pool_shutdown(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->queue);
+    pool->threads = NULL;
+    pool->queue = NULL;
+    pool->thread_count = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+/** Function run by a worker for each accepted connection; must close the fd */
+typedef void (*pool_job_fn)(int client_fd);
+
+/**
+ * @brief Bounded pool of session worker threads
+ *
+ * Accepted client sockets are queued in a fixed-size ring buffer and picked
+ * up by the first idle worker. When the ring is full pool_submit() blocks,
+ * which in turn leaves new connections waiting in the kernel listen backlog.
+ */
+struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+    int            *queue;      /**< Ring buffer of pending client fds */
+    int             capacity;
+    int             head;       /**< Index of the next fd to hand out */
+    int             count;      /**< Number of queued fds */
+    int             active;     /**< Workers currently running a job */
+    int             stopping;
+    pthread_t      *threads;
+    int             thread_count;
+    pool_job_fn     job;
+};
+
+int pool_start(struct worker_pool *pool, int threads, int queue_depth, pool_job_fn job);
+int pool_submit(struct worker_pool *pool, int client_fd);
+int pool_busy(struct worker_pool *pool);
+void pool_shutdown(struct worker_pool *pool);
+
+#endif
@@ -4,14 +4,20 @@
  *
  * This module implements authenticated file transfer sessions, supporting:
  * - User authentication via username
- * - Download mode (server → client)
- * - Upload mode (client → server)
- * - Directory listing mode
+ * - Download mode (server → client), zero-copy via sendfile()/splice()
+ * - Ranged downloads (offset + length) for resuming broken transfers
+ * - CRC-32C checked downloads and checksum queries
+ * - Upload mode (client → server), plus delta uploads of changed blocks only
+ * - Directory listing mode, plus a paged listing with stat metadata
+ * - Recursive directory tree download as a single record stream
  * - Tilde (~) path expansion using system user database
  * - Automatic parent directory creation for uploads
  * - Status byte error reporting (0x00=OK, 0x01=ERROR)
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1       /* O_PATH for the openat2() home directory descriptor */
+#endif
 #ifndef _DEFAULT_SOURCE
 #define _DEFAULT_SOURCE 1   /* Expose DT_DIR / DT_REG / d_type from <dirent.h> */
 #endif
@@ -22,43 +28,72 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <pwd.h>
 #include <wordexp.h>
 #include <dirent.h>
 #include <limits.h>
-#include <shadow.h>
-
-#ifndef PATH_MAX
-#define PATH_MAX 4096
-#endif
-
+#include <fcntl.h>
+#include <endian.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "checksum.h"
+#include "config.h"
+#include "daemon.h"
+#include "delta.h"
+#include "listcache.h"
+#include "log.h"
+#include "metrics.h"
 #include "session.h"
+#include "sockopt.h"
+#include "tls.h"
+#include "token.h"
+#include "transfer.h"
+#include "usercache.h"
 
 /* ========== Forward Declarations ========== */
-static int authenticate_user(int client_fd);
-static int enforce_user_path_policy(const char *expanded_path, int for_upload);
+static int authenticate_user(struct session_ctx *ctx, const char *stored_hash);
+static int enforce_user_path_policy(const struct session_ctx *ctx, const char *expanded_path, int for_upload);
+static int open_user_path(const struct session_ctx *ctx, const char *expanded_path, int flags, mode_t mode);
 
 /* ========== Protocol Constants ========== */
-#define BUFFER_SIZE 4096          /**< Size of file transfer buffer */
 #define MODE_DOWNLOAD 'D'         /**< Download mode: server → client */
 #define MODE_UPLOAD   'U'         /**< Upload mode: client → server */
 #define MODE_LIST     'L'         /**< List mode: directory listing */
+#define MODE_DOWNLOAD_FRAMED 'd'  /**< Download with size header (or chunked frames) */
+#define MODE_UPLOAD_FRAMED   'u'  /**< Upload with size header (or chunked frames) */
+#define MODE_DOWNLOAD_Z 'C'       /**< Framed download, optionally zlib-compressed */
+#define MODE_UPLOAD_Z   'P'       /**< Framed upload, optionally zlib-compressed */
+#define MODE_DOWNLOAD_SUM 'H'     /**< MODE_DOWNLOAD_Z followed by a CRC-32C trailer */
+#define MODE_CHECKSUM 'K'         /**< Size and CRC-32C of a file, without its data */
+#define MODE_RANGE    'G'         /**< Ranged download: offset + length, always framed */
+#define MODE_LIST_EX  'X'         /**< Extended list: paged, sorted, optional stat data */
+#define MODE_LIST_COND 'W'        /**< MODE_LIST_EX unless the client's token is still current */
+#define MODE_TREE     'R'         /**< Recursive download of a directory tree */
+#define MODE_DELTA    'Y'         /**< Upload only the blocks that differ from the existing file */
+#define MODE_METRICS  'M'         /**< Server metrics as Prometheus text (root only) */
+#define MODE_SESSION  'S'         /**< Persistent session: run commands until MODE_QUIT */
+#define MODE_QUIT     'Q'         /**< Leave a persistent session */
 #define STATUS_OK 0x00            /**< Status byte: operation succeeded */
 #define STATUS_ERROR 0x01         /**< Status byte: operation failed */
-
-/**
- * @brief Current authenticated username for tilde expansion
- *
- * This global stores the username sent by the client during authentication.
- * It is used by expand_tilde() to resolve ~ and ~user/ paths.
- */
-static char current_username[256] = {0};
+#define STATUS_NOT_MODIFIED 0x02  /**< Status byte: conditional listing unchanged */
+#define AUTH_PASSWORD 0x02        /**< Token refused: the password exchange follows */
+#define FRAMED_SIZE_CHUNKED UINT64_MAX  /**< Size header value: chunked frames follow */
+#define RANGE_TO_END UINT64_MAX         /**< Range length: up to the end of the file */
+#define FRAMED_COMPRESSIBLE 0x02  /**< handle_download/upload framed flag: negotiate encoding */
+#define FRAMED_CHECKSUM     0x04  /**< handle_download framed flag: CRC-32C trailer */
+#define ENCODING_NONE    0x00     /**< Encoding byte: data as in a framed transfer */
+#define ENCODING_DEFLATE 0x01     /**< Encoding byte: zlib stream in chunked frames */
+#define COMPRESS_MIN_SIZE 512     /**< Smaller files are never worth compressing */
+#define REQUEST_REJECTED 1        /**< Handler result: STATUS_ERROR sent, connection still usable */
+#define UNKNOWN_MODE    -2        /**< dispatch_mode() result: not a mode byte, drop the connection */
 
 /* ========== Low-Level Socket Helpers ========== */
 
@@ -77,7 +112,7 @@ static int recv_exact(int fd, void *buf, size_t len) {
     size_t total = 0;
     char *p = (char *)buf;
     while (total < len) {
-        int n = recv(fd, p + total, len - total, 0);
+        int n = (int)tls_recv(fd, p + total, len - total, 0);
         if (n <= 0) return n;  // Error or connection closed
         total += n;
     }
@@ -91,12 +126,12 @@ static int recv_exact(int fd, void *buf, size_t len) {
  * - 4 bytes: big-endian uint32_t length
  * - N bytes: UTF-8 string data (not null-terminated on wire)
  *
- * @param fd Socket file descriptor
- * @return Malloc'd null-terminated string, or NULL on error
- * @note Caller must free() the returned string
+ * @param ctx Session whose request arena holds the string
+ * @param fd  Socket file descriptor
+ * @return Null-terminated string valid until the next request, or NULL on error
  * @note Rejects lengths > 4096 to prevent memory exhaustion attacks
  */
-static char *recv_path_alloc(int fd) {
+static char *recv_path_alloc(struct session_ctx *ctx, int fd) {
     uint32_t len_be;
     int n = recv_exact(fd, &len_be, sizeof(len_be));
     if (n <= 0) return NULL;
@@ -105,11 +140,11 @@ static char *recv_path_alloc(int fd) {
     uint32_t len = ntohl(len_be);
     if (len == 0 || len > 4096) return NULL;  // Sanity check
 
-    char *path = malloc(len + 1);  // +1 for null terminator
+    char *path = arena_alloc(&ctx->arena, len + 1);  // +1 for null terminator
     if (!path) return NULL;
 
     n = recv_exact(fd, path, len);
-    if (n <= 0) { free(path); return NULL; }
+    if (n <= 0) return NULL;
     path[len] = '\0';  // Add null terminator
     return path;
 }
@@ -129,7 +164,7 @@ static int send_all(int fd, const void *buf, size_t len) {
     size_t total = 0;
     const char *p = (const char *)buf;
     while (total < len) {
-        int n = send(fd, p + total, len - total, 0);
+        int n = (int)tls_send(fd, p + total, len - total, 0);
         if (n <= 0) return n;  // Error or connection closed
         total += n;
     }
@@ -149,6 +184,92 @@ static int send_path_raw(int fd, const char *s) {
     return 0;
 }
 
+/**
+ * @brief Get the session's transfer buffer, taking it from the pool on first use
+ *
+ * The buffer is g_config.chunk_size bytes and page-aligned so it can be
+ * handed to any I/O path. session_release() gives it back to the pool.
+ *
+ * @return Buffer of ctx->xfer_buf_size bytes, or NULL on allocation failure
+ */
+static char *session_xfer_buffer(struct session_ctx *ctx) {
+    if (!ctx->xfer_buf) {
+        ctx->xfer_buf = bufpool_get();
+        if (!ctx->xfer_buf) return NULL;
+        ctx->xfer_buf_size = bufpool_buf_size();
+    }
+    return ctx->xfer_buf;
+}
+
+/**
+ * @brief Send a 64-bit unsigned integer in big-endian byte order
+ */
+static int send_u64(int fd, uint64_t value) {
+    uint64_t be = htobe64(value);
+    return send_all(fd, &be, sizeof(be)) <= 0 ? -1 : 0;
+}
+
+/**
+ * @brief Receive a 64-bit big-endian unsigned integer
+ */
+static int recv_u64(int fd, uint64_t *value) {
+    uint64_t be;
+    if (recv_exact(fd, &be, sizeof(be)) <= 0) return -1;
+    *value = be64toh(be);
+    return 0;
+}
+
+/**
+ * @brief Output buffer that coalesces many small writes into few send()s
+ *
+ * Backed by the session transfer buffer; sendbuf_flush() must be called
+ * once at the end.
+ */
+struct send_buffer {
+    int     fd;
+    char   *buf;
+    size_t  cap;
+    size_t  used;
+};
+
+/**
+ * @brief Send whatever is buffered
+ * @return 0 on success, -1 on send failure
+ */
+static int sendbuf_flush(struct send_buffer *sb) {
+    if (sb->used > 0 && send_all(sb->fd, sb->buf, sb->used) <= 0) return -1;
+    sb->used = 0;
+    return 0;
+}
+
+/**
+ * @brief Append bytes, flushing first if they don't fit
+ * @return 0 on success, -1 on send failure
+ */
+static int sendbuf_put(struct send_buffer *sb, const void *data, size_t len) {
+    if (sb->used + len > sb->cap) {
+        if (sendbuf_flush(sb) != 0) return -1;
+        if (len > sb->cap) return send_all(sb->fd, data, len) > 0 ? 0 : -1;
+    }
+    memcpy(sb->buf + sb->used, data, len);
+    sb->used += len;
+    return 0;
+}
+
+/**
+ * @brief Refuse the current request with a STATUS_ERROR byte
+ *
+ * Used when a request fails before any reply was sent, so the client can
+ * read the status normally and, in a persistent session, send its next
+ * command on the same connection.
+ *
+ * @return REQUEST_REJECTED if the status byte was sent, -1 otherwise
+ */
+static int reject_request(int client_fd) {
+    unsigned char status = STATUS_ERROR;
+    return send_all(client_fd, &status, 1) <= 0 ? -1 : REQUEST_REJECTED;
+}
+
 /* ========== Path Manipulation Utilities ========== */
 
 /**
@@ -169,6 +290,28 @@ static const char *path_basename(const char *path) {
     return slash ? slash + 1 : path;
 }
 
+/**
+ * @brief Check whether a file name says its content is already compressed
+ *
+ * Archives, images, audio and video gain nothing from another deflate
+ * pass, so compressed transfers send them as-is. This is the same set of
+ * types the client TUI shows as archive/image/video/audio files, plus the
+ * usual compressed document and package formats.
+ */
+static int name_is_precompressed(const char *name) {
+    static const char *const exts[] = {
+        "zip", "gz", "tgz", "bz2", "xz", "zst", "lz4", "7z", "rar", "jar", "apk", "deb", "rpm",
+        "png", "jpg", "jpeg", "gif", "webp", "mp4", "mkv", "avi", "mov", "webm",
+        "mp3", "ogg", "flac", "aac", "m4a", "pdf", "docx", "xlsx", "pptx", "odt",
+    };
+    const char *dot = strrchr(name, '.');
+    if (!dot || dot == name) return 0;
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        if (strcasecmp(dot + 1, exts[i]) == 0) return 1;
+    }
+    return 0;
+}
+
 /**
  * @brief Expand tilde (~) in paths to actual home directories
  *
@@ -178,32 +321,31 @@ static const char *path_basename(const char *path) {
  * - Paths without ~ → returned as-is (duplicated)
  *
  * Resolution order for "~/":
- * 1. Authenticated user (current_username) via getpwnam()
+ * 1. Authenticated user's home (ctx->home)
  * 2. $HOME environment variable
  * 3. Fallback to "/root"
  *
+ * @param ctx  Session whose user "~" refers to
  * @param path Path to expand
- * @return Malloc'd expanded path, or duplicate of original on failure
- * @note Caller must free() the returned string
- * @note Uses system password database (pwd.h) for user lookup
+ * @return Expanded path in the request arena, a copy of the original if
+ *         expansion failed, or NULL if the arena is full
+ * @note "~username" is looked up through the shared user cache
  */
-static char *expand_tilde(const char *path) {
+static char *expand_tilde(struct session_ctx *ctx, const char *path) {
     // No tilde? Return a copy unchanged
     if (!path || path[0] != '~') {
-        return strdup(path);
+        return arena_strdup(&ctx->arena, path);
     }
 
     const char *home = NULL;
     const char *rest = path + 1;  // Skip the '~'
+    struct user_record rec;
 
     // Case 1: "~" or "~/..." (authenticated user's home)
     if (rest[0] == '/' || rest[0] == '\0') {
         // Try authenticated user first
-        if (current_username[0] != '\0') {
-            struct passwd *pw = getpwnam(current_username);
-            if (pw) {
-                home = pw->pw_dir;
-            }
+        if (ctx->user_known) {
+            home = ctx->home;
         }
         // Fallback to $HOME environment variable
         if (!home) {
@@ -222,9 +364,8 @@ static char *expand_tilde(const char *path) {
         if (userlen < sizeof(username)) {
             memcpy(username, rest, userlen);
             username[userlen] = '\0';
-            struct passwd *pw = getpwnam(username);
-            if (pw) {
-                home = pw->pw_dir;
+            if (usercache_lookup(username, &rec) == 0) {
+                home = rec.home;
                 rest = slash ? slash : "";  // Point to remainder after username
             }
         }
@@ -232,13 +373,13 @@ static char *expand_tilde(const char *path) {
 
     // If expansion failed, return original path as copy
     if (!home) {
-        return strdup(path);
+        return arena_strdup(&ctx->arena, path);
     }
 
     // Concatenate home + rest
     size_t homelen = strlen(home);
     size_t restlen = strlen(rest);
-    char *expanded = malloc(homelen + restlen + 1);
+    char *expanded = arena_alloc(&ctx->arena, homelen + restlen + 1);
     if (!expanded) return NULL;
 
     memcpy(expanded, home, homelen);
@@ -247,50 +388,35 @@ static char *expand_tilde(const char *path) {
 }
 
 /**
- * @brief Recursively create all parent directories for a given path
- *
- * Splits the path at each '/' and creates directories incrementally.
- * Ignores EEXIST errors (directory already exists).
- * Used during uploads to ensure target directories exist.
+ * @brief Look up the session user once and cache uid, home and root status
  *
- * @param path Full file path whose parents should be created
- * @return 0 on success, -1 on error (sets errno)
+ * Fills ctx->uid, ctx->gid, ctx->home, ctx->resolved_home and ctx->is_root
+ * from the shared user cache (see usercache.c), so neither this session
+ * nor a repeat connection within the cache TTL goes back to NSS.
+ * resolved_home stays empty if the home directory cannot be resolved, which
+ * makes enforce_user_path_policy() deny every path for non-root users.
  *
- * @example
- *   ensure_parent_dirs("/a/b/c/file.txt") creates /a, /a/b, /a/b/c
- *
- * @note Does not create the final component (assumes it's a file)
- * @note Directories are created with mode 0755 (rwxr-xr-x)
+ * @param ctx Session whose username is set
+ * @param rec Output: the full record, including the shadow hash for
+ *            authenticate_user() (hash is "" if the user is unknown)
+ * @return 0 on success, -1 if the user does not exist
  */
-static int ensure_parent_dirs(const char *path) {
-    char tmp[4096 + 1];
-    size_t len = strlen(path);
-    if (len >= sizeof(tmp)) return -1;  // Path too long
-    memcpy(tmp, path, len + 1);
-    
-    // Walk through path, creating each directory component
-    for (size_t i = 1; i < len; ++i) {  // Start at 1 to skip leading '/'
-        if (tmp[i] == '/') {
-            tmp[i] = '\0';  // Temporarily terminate string
-            if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
-                return -1;  // mkdir failed for reason other than "already exists"
-            }
-            tmp[i] = '/';  // Restore slash
-        }
+static int session_load_user(struct session_ctx *ctx, struct user_record *rec) {
+    ctx->user_known = 0;
+    if (usercache_lookup(ctx->username, rec) != 0) {
+        rec->hash[0] = '\0';
+        return -1;
     }
-    return 0;
-}
-
-/**
- * @brief Get current authenticated user's home directory and root status
- */
-static int get_user_home(char *home_out, size_t out_size, int *is_root_out) {
-    struct passwd *pw = getpwnam(current_username);
-    if (!pw || !pw->pw_dir) return -1;
 
-    if (strlen(pw->pw_dir) >= out_size) return -1;
-    strcpy(home_out, pw->pw_dir);
-    *is_root_out = (pw->pw_uid == 0) ? 1 : 0;
+    strcpy(ctx->home, rec->home);
+    strcpy(ctx->resolved_home, rec->resolved_home);
+    ctx->uid = rec->uid;
+    ctx->gid = rec->gid;
+    ctx->is_root = (rec->uid == 0) ? 1 : 0;
+    if (!ctx->is_root && ctx->resolved_home[0] != '\0') {
+        ctx->home_fd = open(ctx->resolved_home, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    ctx->user_known = 1;
     return 0;
 }
 
@@ -332,15 +458,16 @@ static int resolve_existing_ancestor(const char *path, char *resolved, size_t re
 
 /**
  * @brief Enforce per-user path policy (non-root users restricted to home)
+ *
+ * This is the realpath() based check used when openat2() is unavailable
+ * (see open_user_path()). It is racy: the path may change between the
+ * check and the open() that follows.
  */
-static int enforce_user_path_policy(const char *expanded_path, int for_upload) {
-    char user_home[PATH_MAX];
-    int is_root = 0;
-
-    if (get_user_home(user_home, sizeof(user_home), &is_root) != 0) {
+static int enforce_user_path_policy(const struct session_ctx *ctx, const char *expanded_path, int for_upload) {
+    if (!ctx->user_known) {
         return -1;
     }
-    if (is_root) {
+    if (ctx->is_root) {
         return 0;
     }
 
@@ -348,8 +475,8 @@ static int enforce_user_path_policy(const char *expanded_path, int for_upload) {
         return -1;
     }
 
-    char resolved_home[PATH_MAX];
-    if (!realpath(user_home, resolved_home)) {
+    const char *resolved_home = ctx->resolved_home;
+    if (resolved_home[0] == '\0') {
         return -1;
     }
 
@@ -370,6 +497,417 @@ static int enforce_user_path_policy(const char *expanded_path, int for_upload) {
     return ok ? 0 : -1;
 }
 
+/** Set once openat2() returned ENOSYS; every open then uses the realpath() policy. */
+static int g_no_openat2;
+
+/**
+ * @brief openat2() with RESOLVE_BENEATH: rel may not leave dir_fd
+ *
+ * ".." above dir_fd, absolute symlinks and symlinks pointing outside are
+ * refused by the kernel with EXDEV, atomically with the open itself.
+ *
+ * @return New descriptor, or -1 with errno set (ENOSYS if unsupported)
+ */
+static int open_beneath(int dir_fd, const char *rel, int flags, mode_t mode) {
+    if (g_no_openat2) {
+        errno = ENOSYS;
+        return -1;
+    }
+    struct open_how how = {
+        .flags = (uint64_t)(flags | O_CLOEXEC),
+        .mode = (flags & O_CREAT) ? mode : 0,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    long fd = syscall(SYS_openat2, dir_fd, rel, &how, sizeof(how));
+    if (fd < 0 && errno == ENOSYS) g_no_openat2 = 1;
+    return (int)fd;
+}
+
+/**
+ * @brief Path of expanded_path relative to the session user's home
+ *
+ * @return Pointer into expanded_path ("." for the home itself), or NULL
+ *         if the path does not start with the home directory
+ */
+static const char *home_relative(const struct session_ctx *ctx, const char *expanded_path) {
+    const char *bases[2] = { ctx->home, ctx->resolved_home };
+    for (int i = 0; i < 2; i++) {
+        size_t len = strlen(bases[i]);
+        while (len > 1 && bases[i][len - 1] == '/') len--;
+        if (len == 0 || strncmp(expanded_path, bases[i], len) != 0) continue;
+        const char *rest = expanded_path + len;
+        if (*rest != '\0' && *rest != '/') continue;
+        while (*rest == '/') rest++;
+        return *rest ? rest : ".";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Open a path on behalf of the session user
+ *
+ * Non-root users are confined to their home directory. Paths under the
+ * home are opened with openat2(RESOLVE_BENEATH) relative to ctx->home_fd,
+ * so the confinement check and the open are one syscall and cannot be
+ * raced by swapping a symlink in. Other paths, and kernels without
+ * openat2(), go through enforce_user_path_policy() and a plain open().
+ *
+ * @return Descriptor, or -1 with errno set (EACCES/EXDEV when the path is
+ *         outside the user's home)
+ */
+static int open_user_path(const struct session_ctx *ctx, const char *expanded_path, int flags, mode_t mode) {
+    if (!ctx->user_known) {
+        errno = EACCES;
+        return -1;
+    }
+    if (!ctx->is_root && ctx->home_fd >= 0) {
+        const char *rel = home_relative(ctx, expanded_path);
+        if (rel) {
+            int fd = open_beneath(ctx->home_fd, rel, flags, mode);
+            if (fd >= 0 || errno != ENOSYS) return fd;
+        }
+    }
+    if (enforce_user_path_policy(ctx, expanded_path, (flags & O_CREAT) != 0) != 0) {
+        errno = EACCES;
+        return -1;
+    }
+    return open(expanded_path, flags | O_CLOEXEC, mode);
+}
+
+/**
+ * @brief Open a directory for the dir walks below
+ *
+ * @param confined 1 = resolve beneath base_fd with openat2(), 0 = openat()
+ */
+static int open_dir_at(int base_fd, const char *path, int confined) {
+    if (confined) return open_beneath(base_fd, path, O_PATH | O_DIRECTORY, 0);
+    return openat(base_fd, path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * @brief Open a directory, creating it and any missing parents (mode 0755)
+ *
+ * An existing directory costs a single open. Otherwise the walk goes
+ * backwards to the deepest ancestor that exists, and only the missing
+ * tail is created with mkdirat() relative to that descriptor, never by
+ * re-resolving the full path from '/'.
+ *
+ * @param base_fd  Directory that relative paths start from (or AT_FDCWD)
+ * @param dir      Directory path (scratch copy: modified during the walk)
+ * @param confined 1 = every step with open_beneath() (see open_dir_at())
+ * @return O_PATH descriptor of dir, or -1 with errno set
+ */
+static int open_or_create_dir(int base_fd, char *dir, int confined) {
+    int fd = open_dir_at(base_fd, dir, confined);
+    if (fd >= 0 || errno != ENOENT) return fd;
+
+    size_t len = strlen(dir);
+    char *start = dir;
+    while (fd < 0) {
+        size_t span = start > dir ? (size_t)(start - 1 - dir) : len;
+        char *cut = memrchr(dir, '/', span);
+        if (!cut) {
+            start = dir;
+            fd = open_dir_at(base_fd, ".", confined);
+        } else if (cut == dir) {
+            start = dir + 1;
+            fd = open_dir_at(base_fd, "/", confined);
+        } else {
+            *cut = '\0';
+            start = cut + 1;
+            fd = open_dir_at(base_fd, dir, confined);
+        }
+        if (fd < 0 && (errno != ENOENT || !cut)) return -1;
+    }
+    for (char *p = dir; p < dir + len; p++) {
+        if (*p == '\0') *p = '/';  // Undo the cuts
+    }
+
+    char *save = NULL;
+    for (char *comp = strtok_r(start, "/", &save); comp && fd >= 0; comp = strtok_r(NULL, "/", &save)) {
+        int next = -1;
+        if (mkdirat(fd, comp, 0755) == 0 || errno == EEXIST) {
+            next = open_dir_at(fd, comp, confined);
+        }
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = next;
+    }
+    for (char *p = dir; p < dir + len; p++) {
+        if (*p == '\0') *p = '/';  // strtok_r() cuts as well
+    }
+    return fd;
+}
+
+/**
+ * @brief Descriptor of an upload parent remembered in this session, or -1
+ *
+ * The descriptor stays owned by the session.
+ */
+static int session_dir_fd(const struct session_ctx *ctx, const char *dir) {
+    for (int i = 0; i < SESSION_KNOWN_DIRS; i++) {
+        const struct known_dir *k = &ctx->known_dirs[i];
+        if (k->path && strcmp(k->path, dir) == 0) return k->fd;
+    }
+    return -1;
+}
+
+/**
+ * @brief Remember an upload parent and its descriptor (oldest entry goes)
+ *
+ * @return fd, now owned by the session, or -1 (fd closed) if out of memory
+ */
+static int session_remember_dir(struct session_ctx *ctx, const char *dir, int fd) {
+    char *copy = strdup(dir);
+    if (!copy) {
+        close(fd);
+        return -1;
+    }
+    struct known_dir *k = &ctx->known_dirs[ctx->known_next++ % SESSION_KNOWN_DIRS];
+    if (k->path) {
+        free(k->path);
+        close(k->fd);
+    }
+    k->path = copy;
+    k->fd = fd;
+    return fd;
+}
+
+/**
+ * @brief Forget every remembered directory (one of them disappeared)
+ */
+static void session_forget_dirs(struct session_ctx *ctx) {
+    for (int i = 0; i < SESSION_KNOWN_DIRS; i++) {
+        struct known_dir *k = &ctx->known_dirs[i];
+        if (!k->path) continue;
+        free(k->path);
+        close(k->fd);
+        k->path = NULL;
+        k->fd = -1;
+    }
+}
+
+/**
+ * @brief Check and split an upload target into parent directory and leaf
+ *
+ * @param ctx           Session state
+ * @param expanded_path Upload target after tilde expansion
+ * @param parent        Output: parent directory ("" for a bare name), PATH_MAX bytes
+ * @param leaf          Output: last component (points into expanded_path)
+ * @param rel           Output: path relative to the home when the target is
+ *                      confined with openat2(), otherwise NULL
+ * @return 0, or -1 with errno set (EACCES when outside the user's home)
+ */
+static int split_upload_target(const struct session_ctx *ctx, const char *expanded_path,
+                               char *parent, const char **leaf, const char **rel) {
+    if (!ctx->user_known) {
+        errno = EACCES;
+        return -1;
+    }
+
+    const char *slash = strrchr(expanded_path, '/');
+    size_t parent_len = slash ? (size_t)(slash - expanded_path) : 0;
+    *leaf = slash ? slash + 1 : expanded_path;
+    if (**leaf == '\0' || strcmp(*leaf, ".") == 0 || strcmp(*leaf, "..") == 0) {
+        errno = EISDIR;
+        return -1;
+    }
+    if (parent_len >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(parent, expanded_path, parent_len);
+    parent[parent_len] = '\0';
+    if (slash == expanded_path) strcpy(parent, "/");
+
+    *rel = (!ctx->is_root && ctx->home_fd >= 0 && !g_no_openat2)
+           ? home_relative(ctx, expanded_path) : NULL;
+    if (!*rel && enforce_user_path_policy(ctx, expanded_path, 1) != 0) {
+        errno = EACCES;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open (creating as needed) the parent directory of an upload target
+ *
+ * @param ctx    Session state
+ * @param parent Parent from split_upload_target()
+ * @param rel    Confined relative path from split_upload_target(), or NULL
+ * @return O_PATH descriptor, or -1 with errno set
+ */
+static int open_upload_dir(const struct session_ctx *ctx, const char *parent, const char *rel) {
+    char dir[PATH_MAX];
+    if (rel) {
+        const char *rel_slash = strrchr(rel, '/');
+        size_t len = rel_slash ? (size_t)(rel_slash - rel) : 0;
+        if (len == 0) return open_beneath(ctx->home_fd, ".", O_PATH | O_DIRECTORY, 0);
+        memcpy(dir, rel, len);
+        dir[len] = '\0';
+        return open_or_create_dir(ctx->home_fd, dir, 1);
+    }
+    if (!parent[0]) return open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    strcpy(dir, parent);
+    return open_or_create_dir(AT_FDCWD, dir, 0);
+}
+
+/**
+ * @brief An upload being written next to its target
+ *
+ * Uploads never write into the target itself: the data goes to a
+ * temporary file in the same directory, which is renamed over the target
+ * only once it is complete (and flushed as far as -D asks). Readers see
+ * either the old file or the new one, and a failed upload leaves the old
+ * file untouched.
+ */
+struct upload_stage {
+    int  dir_fd;                    /**< O_PATH descriptor of the target's directory */
+    int  own_dir;                   /**< 1 if dir_fd is ours to close (not a known_dir) */
+    int  fd;                        /**< Temporary file receiving the data */
+    int  old_fd;                    /**< Target being replaced, opened read-only, or -1 */
+    struct stat old_st;             /**< fstat() of old_fd */
+    const char *leaf;               /**< Target name in dir_fd */
+    char temp_name[NAME_MAX + 1];
+};
+
+/**
+ * @brief Drop an unfinished upload: remove the temporary file
+ */
+static void stage_abort(struct upload_stage *st) {
+    if (st->fd >= 0) {
+        close(st->fd);
+        unlinkat(st->dir_fd, st->temp_name, 0);
+    }
+    if (st->old_fd >= 0) close(st->old_fd);
+    if (st->own_dir) close(st->dir_fd);
+    st->fd = st->old_fd = -1;
+    st->own_dir = 0;
+}
+
+/**
+ * @brief Open the target's directory, the old target and a temporary file
+ *
+ * The parent is created as needed and kept open for the rest of the
+ * session, so a batch of uploads into the same directory costs no path
+ * lookups. For non-root users with openat2() every step stays beneath
+ * ctx->home_fd; otherwise the realpath() policy is checked and the parents
+ * are created relative to the current directory. The target itself is
+ * opened with O_NOFOLLOW, so a symlink is refused rather than replaced.
+ *
+ * @param ctx           Session state
+ * @param expanded_path Upload target after tilde expansion
+ * @param tag           Middle part of the temporary name (".<leaf>.pap-<tag>.<pid>.<n>")
+ * @param st            Output; release with stage_commit() or stage_abort()
+ * @return 0, or -1 with errno set (EACCES/EXDEV when the target is outside
+ *         the user's home, ELOOP for a symlink, EISDIR for anything else
+ *         that is not a regular file)
+ */
+static int stage_open(struct session_ctx *ctx, const char *expanded_path, const char *tag,
+                      struct upload_stage *st) {
+    static unsigned temp_seq;
+    char parent[PATH_MAX];
+    const char *rel;
+    st->fd = st->old_fd = -1;
+    st->own_dir = 0;
+    if (split_upload_target(ctx, expanded_path, parent, &st->leaf, &rel) != 0) return -1;
+
+    int n = snprintf(st->temp_name, sizeof(st->temp_name), ".%.200s.pap-%s.%ld.%u", st->leaf,
+                     tag, (long)getpid(), __atomic_fetch_add(&temp_seq, 1, __ATOMIC_RELAXED));
+    if (n < 0 || (size_t)n >= sizeof(st->temp_name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    // A remembered parent that was removed since fails with ENOENT: forget
+    // them all and open it afresh
+    for (int attempt = 0; attempt < 2 && st->fd < 0; attempt++) {
+        st->dir_fd = parent[0] ? session_dir_fd(ctx, parent) : -1;
+        if (st->dir_fd < 0) {
+            st->dir_fd = open_upload_dir(ctx, parent, rel);
+            if (st->dir_fd < 0) return -1;
+            st->own_dir = !parent[0];
+            if (parent[0] && session_remember_dir(ctx, parent, st->dir_fd) < 0) return -1;
+        }
+        st->fd = openat(st->dir_fd, st->temp_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (st->fd < 0 && errno == ENOENT && !st->own_dir && attempt == 0) {
+            session_forget_dirs(ctx);
+            continue;
+        }
+        if (st->fd < 0) break;
+    }
+    if (st->fd < 0) {
+        int saved = errno;
+        if (st->own_dir) close(st->dir_fd);
+        errno = saved;
+        return -1;
+    }
+
+    // The leaf is a single component of a confined directory: O_NOFOLLOW
+    // keeps the old file from being a symlink out of it
+    st->old_fd = openat(st->dir_fd, st->leaf, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    int saved = errno;
+    if (st->old_fd >= 0 && (fstat(st->old_fd, &st->old_st) != 0 || !S_ISREG(st->old_st.st_mode))) {
+        saved = EISDIR;
+    } else if (st->old_fd >= 0 || saved == ENOENT) {
+        return 0;
+    }
+    stage_abort(st);
+    errno = saved;
+    return -1;
+}
+
+/**
+ * @brief Flush a complete upload according to -D and rename it over the target
+ *
+ * The new file takes over the permission bits and owner of the file it
+ * replaces.
+ *
+ * @return 0 once the target is replaced, -1 if it is unchanged (logged)
+ */
+static int stage_commit(struct upload_stage *st) {
+    int rc = 0;
+    if (st->old_fd >= 0) {
+        fchmod(st->fd, st->old_st.st_mode & 07777);
+        if (fchown(st->fd, st->old_st.st_uid, st->old_st.st_gid) != 0 && errno != EPERM) {
+            log_errno("fchown");
+        }
+    }
+    int durability = config_get(durability);  // One reload mid-commit must not mix levels
+    if (durability == DURABILITY_DATA && fdatasync(st->fd) != 0) {
+        log_errno("fdatasync");
+        rc = -1;
+    } else if (durability == DURABILITY_FULL && fsync(st->fd) != 0) {
+        log_errno("fsync");
+        rc = -1;
+    }
+    if (close(st->fd) < 0) {
+        log_errno("close");
+        rc = -1;
+    }
+    st->fd = -1;
+
+    if (rc == 0 && renameat(st->dir_fd, st->temp_name, st->dir_fd, st->leaf) != 0) {
+        log_errno("rename upload");
+        rc = -1;
+    }
+    if (rc != 0) unlinkat(st->dir_fd, st->temp_name, 0);
+
+    // The rename itself is only on disk once the directory is
+    if (rc == 0 && durability == DURABILITY_FULL) {
+        int dfd = openat(st->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd < 0 || fsync(dfd) != 0) log_errno("fsync directory");
+        if (dfd >= 0) close(dfd);
+    }
+
+    if (st->old_fd >= 0) close(st->old_fd);
+    if (st->own_dir) close(st->dir_fd);
+    st->old_fd = -1;
+    st->own_dir = 0;
+    return rc;
+}
+
 /**
  * @brief Extract crypt setting (algorithm+salt) from shadow hash
  */
@@ -397,19 +935,22 @@ static int extract_crypt_setting(const char *stored_hash, char *out, size_t out_
 }
 
 /**
- * @brief Authenticate current user with password hash response
+ * @brief Authenticate the session user with password hash response
+ *
+ * @param ctx         Session state
+ * @param stored_hash Shadow hash from session_load_user() ("" if none)
  */
-static int authenticate_user(int client_fd) {
-    struct spwd *sp = getspnam(current_username);
-    if (!sp || !sp->sp_pwdp || sp->sp_pwdp[0] == '\0' ||
-        sp->sp_pwdp[0] == '!' || sp->sp_pwdp[0] == '*') {
+static int authenticate_user(struct session_ctx *ctx, const char *stored_hash) {
+    int client_fd = ctx->client_fd;
+
+    if (stored_hash[0] == '\0' || stored_hash[0] == '!' || stored_hash[0] == '*') {
         unsigned char status = STATUS_ERROR;
         send_all(client_fd, &status, 1);
         return -1;
     }
 
     char setting[512];
-    if (extract_crypt_setting(sp->sp_pwdp, setting, sizeof(setting)) != 0) {
+    if (extract_crypt_setting(stored_hash, setting, sizeof(setting)) != 0) {
         unsigned char status = STATUS_ERROR;
         send_all(client_fd, &status, 1);
         return -1;
@@ -419,7 +960,7 @@ static int authenticate_user(int client_fd) {
         return -1;
     }
 
-    char *client_hash = recv_path_alloc(client_fd);
+    char *client_hash = recv_path_alloc(ctx, client_fd);
     if (!client_hash) {
         unsigned char status = STATUS_ERROR;
         send_all(client_fd, &status, 1);
@@ -429,17 +970,19 @@ static int authenticate_user(int client_fd) {
     /* Use constant-time comparison to prevent timing side-channel attacks.
      * strcmp() short-circuits on the first mismatched byte, which leaks
      * information about how many leading characters are correct. */
-    size_t stored_len = strlen(sp->sp_pwdp);
+    size_t stored_len = strlen(stored_hash);
     size_t client_len = strlen(client_hash);
     int ok = 0;
     if (stored_len == client_len) {
         unsigned char diff = 0;
         for (size_t i = 0; i < stored_len; i++) {
-            diff |= (unsigned char)client_hash[i] ^ (unsigned char)sp->sp_pwdp[i];
+            diff |= (unsigned char)client_hash[i] ^ (unsigned char)stored_hash[i];
         }
         ok = (diff == 0);
     }
-    free(client_hash);
+
+    // The cached hash may be stale (password just changed): look it up again next time
+    if (!ok) usercache_invalidate(ctx->username);
 
     unsigned char status = ok ? STATUS_OK : STATUS_ERROR;
     if (send_all(client_fd, &status, 1) <= 0) {
@@ -449,124 +992,414 @@ static int authenticate_user(int client_fd) {
     return ok ? 0 : -1;
 }
 
+/**
+ * @brief Log in with a resumption token, falling back to the password
+ *
+ * Used after the 0x02 unlock byte. The client sends a token frame (4-byte
+ * BE length, 0..TOKEN_MAX bytes) right after the username. A valid token
+ * is answered with STATUS_OK and no crypt exchange. Otherwise (none, expired,
+ * password changed, unknown user) the server sends AUTH_PASSWORD and runs
+ * authenticate_user(); after its STATUS_OK comes a token frame with a new
+ * token, or length 0 when tokens are disabled (-k 0).
+ *
+ * @param ctx         Session state
+ * @param stored_hash Shadow hash from session_load_user() ("" if none)
+ * @param by_token    Output: 1 if the token was accepted
+ * @return 0 once authenticated, -1 otherwise
+ */
+static int authenticate_with_token(struct session_ctx *ctx, const char *stored_hash, int *by_token) {
+    int client_fd = ctx->client_fd;
+    unsigned char token[TOKEN_MAX];
+    uint32_t len_be;
+
+    *by_token = 0;
+    if (recv_exact(client_fd, &len_be, sizeof(len_be)) <= 0) return -1;
+    uint32_t len = ntohl(len_be);
+    if (len > TOKEN_MAX) return -1;
+    if (len > 0 && recv_exact(client_fd, token, len) <= 0) return -1;
+
+    if (token_verify(ctx->username, stored_hash, token, len) == 0) {
+        unsigned char status = STATUS_OK;
+        if (send_all(client_fd, &status, 1) <= 0) return -1;
+        *by_token = 1;
+        return 0;
+    }
+
+    unsigned char challenge = AUTH_PASSWORD;
+    if (send_all(client_fd, &challenge, 1) <= 0) return -1;
+    if (authenticate_user(ctx, stored_hash) != 0) return -1;
+
+    unsigned char frame[4 + TOKEN_LEN];
+    uint32_t issued = (uint32_t)token_issue(ctx->username, stored_hash, frame + 4);
+    len_be = htonl(issued);
+    memcpy(frame, &len_be, 4);
+    int rc = send_all(client_fd, frame, 4 + issued) <= 0 ? -1 : 0;
+    explicit_bzero(frame, sizeof(frame));
+    return rc;
+}
+
 /* ========== Protocol Mode Handlers ========== */
 
 /**
- * @brief Handle DOWNLOAD mode (server → client)
- *
- * Protocol flow:
- * 1. Receive requested file path from client
- * 2. Expand tilde (~) in path
- * 3. Open file for reading
- * 4. Send STATUS_OK byte
- * 5. Send filename length (4-byte big-endian) + filename string
- * 6. Stream file contents in BUFFER_SIZE chunks until EOF
+ * @brief Resolve and open a file a client asked to download
  *
- * @param client_fd Connected client socket
- * @return 0 on success, -1 on error
+ * Expands the tilde, applies the user path policy and opens the file.
+ * Nothing is sent on success, so the caller can still refuse the request
+ * (e.g. a bad range) before the reply starts.
  *
- * @note Sends STATUS_ERROR and closes on failure (file not found, etc.)
- * @note Only sends the basename of the file, not the full path
+ * @param ctx            Session state
+ * @param requested_path Path received from the client (freed here)
+ * @param name           Output: basename to announce to the client
+ * @param name_size      Size of name
+ * @param st             Output: fstat() of the opened file
+ * @param fd_out         Output: open descriptor (caller closes)
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
  */
-static int handle_download(int client_fd) {
-    char buffer[BUFFER_SIZE];
-    
-    // Step 1: Receive the file path client wants to download
-    char *requested_path = recv_path_alloc(client_fd);
-    if (!requested_path) {
-        printf("Invalid or missing requested path.\n");
-        return -1;
-    }
+static int open_download(struct session_ctx *ctx, char *requested_path,
+                         char *name, size_t name_size, struct stat *st, int *fd_out) {
+    int client_fd = ctx->client_fd;
 
-    // Step 2: Expand tilde (~) to actual home directory
-    char *expanded_path = expand_tilde(requested_path);
-    free(requested_path);
+    // Expand tilde (~) to actual home directory
+    char *expanded_path = expand_tilde(ctx, requested_path);
     if (!expanded_path) {
-        printf("Path expansion failed.\n");
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
-        return -1;
+        log_warn("Path expansion failed.");
+        return reject_request(client_fd);
     }
 
-    if (enforce_user_path_policy(expanded_path, 0) != 0) {
-        printf("Access denied for user '%s': %s\n", current_username, expanded_path);
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
-        free(expanded_path);
-        return -1;
+    // Copy the basename out: it points into expanded_path, which is freed below
+    const char *base = path_basename(expanded_path);
+    size_t name_len = strlen(base);
+    if (name_len >= name_size) {
+        log_warn("Filename too long.");
+        return reject_request(client_fd);
     }
+    memcpy(name, base, name_len + 1);
 
-    // Extract the filename (basename) for sending to client
-    const char *name = path_basename(expanded_path);
-    uint32_t name_len = (uint32_t)strlen(name);
-    
-    // CRITICAL: Copy filename before freeing expanded_path!
-    // The 'name' pointer points into 'expanded_path' memory,
-    // so we must copy it before free() to avoid use-after-free.
-    char name_copy[4096];
-    if (name_len >= sizeof(name_copy)) {
-        printf("Filename too long.\n");
-        free(expanded_path);
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
-        return -1;
+    // Open the file for binary reading (inside the user's home)
+    int fd = open_user_path(ctx, expanded_path, O_RDONLY, 0);
+    if (fd < 0 && (errno == EACCES || errno == EXDEV)) {
+        log_warn("Access denied for user '%s': %s", ctx->username, expanded_path);
+        return reject_request(client_fd);
+    }
+    if (fd < 0) {
+        log_errno("open");
+        log_warn("Hint: ensure requested file exists: %s", expanded_path);
+        return reject_request(client_fd);
     }
-    memcpy(name_copy, name, name_len + 1);
 
-    // Step 3: Open the file for binary reading
-    FILE *f = fopen(expanded_path, "rb");
-    if (!f) {
-        perror("fopen");
-        printf("Hint: ensure requested file exists: %s\n", expanded_path);
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
-        free(expanded_path);
-        return -1;
+    if (fstat(fd, st) < 0 || S_ISDIR(st->st_mode)) {
+        log_warn("Not a regular file: %s", expanded_path);
+        close(fd);
+        return reject_request(client_fd);
     }
 
-    printf("Sending file to client: %s\n", expanded_path);
-    free(expanded_path);  // No longer needed after opening file
+    log_info("Sending file to client: %s", expanded_path);
+    *fd_out = fd;
+    return 0;
+}
 
-    // Step 4: Send STATUS_OK to indicate file was opened successfully
+/**
+ * @brief Send STATUS_OK followed by the length-prefixed basename
+ *
+ * @param client_fd Client socket
+ * @param name      Basename of the file being sent
+ * @return 0 on success, -1 on send failure
+ */
+static int send_download_header(int client_fd, const char *name) {
     unsigned char status = STATUS_OK;
     if (send_all(client_fd, &status, 1) <= 0) {
-        perror("send status");
-        fclose(f);
+        log_errno("send status");
         return -1;
     }
 
-    // Step 5: Send filename length (big-endian) and filename string
+    uint32_t name_len = (uint32_t)strlen(name);
     uint32_t name_len_be = htonl(name_len);
     if (send_all(client_fd, &name_len_be, sizeof(name_len_be)) <= 0) {
-        perror("send filename length");
-        fclose(f);
+        log_errno("send filename length");
         return -1;
     }
-    if (send_all(client_fd, name_copy, name_len) <= 0) {
-        perror("send filename");
-        fclose(f);
+    if (send_all(client_fd, name, name_len) <= 0) {
+        log_errno("send filename");
         return -1;
     }
+    return 0;
+}
 
-    // Step 6: Stream file contents in chunks until EOF
-    size_t nread;
-    while ((nread = fread(buffer, 1, BUFFER_SIZE, f)) > 0) {
-        if (send_all(client_fd, buffer, nread) <= 0) {
-            perror("send file data");
-            fclose(f);
-            return -1;
-        }
-    }
+/**
+ * @brief Handle DOWNLOAD mode (server → client)
+ *
+ * Protocol flow:
+ * 1. Receive requested file path from client
+ * 2. Expand tilde (~) in path
+ * 3. Open file for reading
+ * 4. Send STATUS_OK byte
+ * 5. Send filename length (4-byte big-endian) + filename string
+ * 6. Framed only: send file size (8-byte big-endian)
+ * 7. Stream file contents (see transfer_send_file()): until EOF, or exactly
+ *    the announced size when framed
+ *
+ * Framed downloads of files whose size can't be trusted (pipes, devices,
+ * zero-sized /proc entries) announce FRAMED_SIZE_CHUNKED and send chunked
+ * frames instead (see transfer_send_chunked()).
+ *
+ * MODE_DOWNLOAD_Z adds a 1-byte requested zlib level (0-9) after the path
+ * and a 1-byte encoding after the size. With ENCODING_DEFLATE the data is
+ * a zlib stream in chunked frames (see transfer_send_deflate()); the size
+ * still gives the uncompressed length. The server answers ENCODING_NONE
+ * for already-compressed file types, small files, level 0, or when
+ * compression is disabled with -z 0.
+ *
+ * MODE_DOWNLOAD_SUM is MODE_DOWNLOAD_Z plus step 8: a 4-byte big-endian
+ * CRC-32C of the (uncompressed) file data after the data, so the client
+ * can tell a complete file from a damaged or changed one.
+ *
+ * @param ctx    Session state (client socket and authenticated user)
+ * @param framed 1 for MODE_DOWNLOAD_FRAMED and inside persistent sessions,
+ *               where the end of the data must not depend on connection
+ *               close; FRAMED_COMPRESSIBLE for MODE_DOWNLOAD_Z, plus
+ *               FRAMED_CHECKSUM for MODE_DOWNLOAD_SUM
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ *
+ * @note Sends STATUS_ERROR on failure (file not found, etc.)
+ * @note Only sends the basename of the file, not the full path
+ */
+static int handle_download(struct session_ctx *ctx, int framed) {
+    int client_fd = ctx->client_fd;
+
+    // Step 1: Receive the file path client wants to download
+    char *requested_path = recv_path_alloc(ctx, client_fd);
+    if (!requested_path) {
+        log_warn("Invalid or missing requested path.");
+        return -1;
+    }
+    unsigned char level = 0;
+    if ((framed & FRAMED_COMPRESSIBLE) && recv_exact(client_fd, &level, 1) <= 0) {
+        log_errno("recv compression level");
+        return -1;
+    }
 
-    // Check if loop ended due to error (not just EOF)
-    if (ferror(f)) {
-        perror("fread");
-        fclose(f);
+    // Steps 2-3: Expand, check policy and open
+    char name[4096];
+    struct stat st;
+    int fd;
+    int rc = open_download(ctx, requested_path, name, sizeof(name), &st, &fd);
+    if (rc != 0) return rc;
+
+    // Steps 4-5: STATUS_OK and filename
+    char *buffer = session_xfer_buffer(ctx);
+    if (!buffer) {
+        log_errno("transfer buffer");
+        close(fd);
+        return -1;
+    }
+    if (send_download_header(client_fd, name) != 0) {
+        close(fd);
         return -1;
     }
+    metrics_observe(METRIC_TTFB_USEC, metrics_now_usec() - ctx->request_usec);
+
+    // Step 6: Framed transfers announce the size so the connection can stay open
+    uint64_t length = TRANSFER_UNTIL_EOF;
+    int chunked = 0;
+    unsigned char encoding = ENCODING_NONE;
+    if (framed) {
+        chunked = !S_ISREG(st.st_mode) || st.st_size == 0;
+        length = chunked ? FRAMED_SIZE_CHUNKED : (uint64_t)st.st_size;
+        if (send_u64(client_fd, length) != 0) {
+            log_errno("send file size");
+            close(fd);
+            return -1;
+        }
+        if (framed & FRAMED_COMPRESSIBLE) {
+            int max_level = config_get(compress_level);
+            if (level > max_level) level = (unsigned char)max_level;
+            if (level > 0 && !name_is_precompressed(name) && (chunked || length >= COMPRESS_MIN_SIZE)) {
+                encoding = ENCODING_DEFLATE;
+            }
+            if (send_all(client_fd, &encoding, 1) <= 0) {
+                log_errno("send encoding");
+                close(fd);
+                return -1;
+            }
+        }
+    }
 
-    fclose(f);
-    printf("File sent.\n");
+    // Step 7: Stream file contents (sendfile → splice → copy, or frames)
+    uint32_t crc = 0;
+    uint32_t *crc_out = (framed & FRAMED_CHECKSUM) ? &crc : NULL;
+    uint64_t sent = 0;
+    if (encoding == ENCODING_DEFLATE) {
+        rc = transfer_send_deflate(client_fd, fd, level, buffer, ctx->xfer_buf_size, &sent, crc_out);
+        if (rc == 0 && !chunked && sent != length) {
+            // The client checks the size and will discard the file
+            log_warn("File changed size during transfer (%llu of %llu bytes).",
+                   (unsigned long long)sent, (unsigned long long)length);
+        }
+    } else if (chunked) {
+        rc = transfer_send_chunked(client_fd, fd, buffer, ctx->xfer_buf_size, NULL, crc_out);
+    } else {
+        rc = transfer_send_file(client_fd, fd, 0, length, buffer, ctx->xfer_buf_size, &sent);
+        if (rc == 0 && framed && sent != length) {
+            // File shrank while sending; the client can't resync, so drop it
+            log_error("File truncated during transfer (%llu of %llu bytes).",
+                   (unsigned long long)sent, (unsigned long long)length);
+            rc = -1;
+        }
+        // Zero-copy never sees the bytes: checksum them from the page cache.
+        // A file rewritten meanwhile gives a mismatch, which the client
+        // should treat like any other corrupt transfer.
+        if (rc == 0 && crc_out) {
+            rc = checksum_file(fd, 0, length, buffer, ctx->xfer_buf_size, crc_out);
+        }
+    }
+    close(fd);
+    if (rc != 0) return -1;
+
+    // Step 8: Checked downloads end with the CRC-32C trailer
+    if (crc_out) {
+        uint32_t crc_be = htonl(crc);
+        if (send_all(client_fd, &crc_be, sizeof(crc_be)) <= 0) {
+            log_errno("send checksum");
+            return -1;
+        }
+    }
+
+    if (encoding == ENCODING_DEFLATE) {
+        log_debug("File sent (zlib level %u).", level);
+    } else {
+        log_debug("File sent.");
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle CHECKSUM mode: report a file's size and CRC-32C
+ *
+ * Protocol flow:
+ * 1. Receive requested file path; expand, check policy and open as for a
+ *    download
+ * 2. Refuse anything but regular files
+ * 3. Send STATUS_OK, the 8-byte big-endian size and the 4-byte big-endian
+ *    CRC-32C of the contents (the same value MODE_DOWNLOAD_SUM ends with)
+ *
+ * Lets a client skip downloading a file it already has an identical copy of.
+ *
+ * @param ctx Session state (client socket and authenticated user)
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ */
+static int handle_checksum(struct session_ctx *ctx) {
+    int client_fd = ctx->client_fd;
+
+    char *requested_path = recv_path_alloc(ctx, client_fd);
+    if (!requested_path) {
+        log_warn("Invalid or missing requested path.");
+        return -1;
+    }
+
+    char name[4096];
+    struct stat st;
+    int fd;
+    int rc = open_download(ctx, requested_path, name, sizeof(name), &st, &fd);
+    if (rc != 0) return rc;
+
+    char *buffer = session_xfer_buffer(ctx);
+    uint32_t crc;
+    if (!S_ISREG(st.st_mode) || !buffer ||
+        checksum_file(fd, 0, (uint64_t)st.st_size, buffer, ctx->xfer_buf_size, &crc) != 0) {
+        log_warn("Cannot checksum %s.", name);
+        close(fd);
+        return reject_request(client_fd);
+    }
+    close(fd);
+
+    unsigned char status = STATUS_OK;
+    uint32_t crc_be = htonl(crc);
+    if (send_all(client_fd, &status, 1) <= 0 || send_u64(client_fd, (uint64_t)st.st_size) != 0 ||
+        send_all(client_fd, &crc_be, sizeof(crc_be)) <= 0) {
+        log_errno("send checksum");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle RANGE mode: download part of a regular file
+ *
+ * Protocol flow:
+ * 1. Receive requested file path, then 8-byte big-endian offset and length
+ *    (RANGE_TO_END for "everything from offset on")
+ * 2. Expand, check policy and open as for a download
+ * 3. Refuse non-regular files and offsets past the end of the file
+ * 4. Send STATUS_OK byte and length-prefixed filename
+ * 5. Send total file size and the (clamped) range length, 8 bytes each
+ * 6. Send exactly the range length bytes starting at offset
+ *
+ * An offset equal to the file size is valid and yields an empty range, so
+ * a client resuming an already complete file just gets the sizes back.
+ *
+ * @param ctx Session state (client socket and authenticated user)
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ */
+static int handle_range_download(struct session_ctx *ctx) {
+    int client_fd = ctx->client_fd;
+
+    // Step 1: Path and range; all of it arrives before any reply is sent
+    char *requested_path = recv_path_alloc(ctx, client_fd);
+    if (!requested_path) {
+        log_warn("Invalid or missing requested path.");
+        return -1;
+    }
+    uint64_t offset, length;
+    if (recv_u64(client_fd, &offset) != 0 || recv_u64(client_fd, &length) != 0) {
+        log_errno("recv range");
+        return -1;
+    }
+
+    // Step 2: Expand, check policy and open
+    char name[4096];
+    struct stat st;
+    int fd;
+    int rc = open_download(ctx, requested_path, name, sizeof(name), &st, &fd);
+    if (rc != 0) return rc;
+
+    // Step 3: Ranges only make sense on files with a stable size
+    uint64_t total = (uint64_t)st.st_size;
+    if (!S_ISREG(st.st_mode) || offset > total) {
+        log_warn("Bad range: offset %llu of %llu bytes.",
+               (unsigned long long)offset, (unsigned long long)total);
+        close(fd);
+        return reject_request(client_fd);
+    }
+    if (length > total - offset) length = total - offset;
+
+    char *buffer = session_xfer_buffer(ctx);
+    if (!buffer) {
+        log_errno("transfer buffer");
+        close(fd);
+        return -1;
+    }
+
+    // Steps 4-5: Header, total size, range length
+    if (send_download_header(client_fd, name) != 0 ||
+        send_u64(client_fd, total) != 0 || send_u64(client_fd, length) != 0) {
+        close(fd);
+        return -1;
+    }
+    metrics_observe(METRIC_TTFB_USEC, metrics_now_usec() - ctx->request_usec);
+
+    // Step 6: Range contents
+    uint64_t sent = 0;
+    if (transfer_send_file(client_fd, fd, (off_t)offset, length,
+                           buffer, ctx->xfer_buf_size, &sent) != 0 || sent != length) {
+        log_error("Range transfer failed (%llu of %llu bytes).",
+               (unsigned long long)sent, (unsigned long long)length);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    log_debug("Range sent: %llu bytes at offset %llu.",
+           (unsigned long long)length, (unsigned long long)offset);
     return 0;
 }
 
@@ -577,94 +1410,424 @@ static int handle_download(int client_fd) {
  * 1. Receive target file path from client
  * 2. Expand tilde (~) in path
  * 3. Create parent directories if needed
- * 4. Open file for writing
+ * 4. Open a temporary file next to the target (see stage_open())
  * 5. Send STATUS_OK byte
- * 6. Receive file contents in chunks until connection closes
- * 7. Write received data to file
+ * 6. Framed only: receive file size (8-byte big-endian)
+ * 7. Receive file contents and write them to the temporary file (see
+ *    transfer_recv_file()): until connection close, or exactly the
+ *    announced size when framed
+ * 8. Flush it as -D asks and rename it over the target (stage_commit())
+ * 9. Framed only: send a final status byte once the target is replaced
  *
- * @param client_fd Connected client socket
- * @return 0 on success, -1 on error
+ * A framed size of FRAMED_SIZE_CHUNKED means the client streams chunked
+ * frames (see transfer_recv_chunked()), e.g. when uploading from a pipe.
+ *
+ * MODE_UPLOAD_Z adds a 1-byte encoding after the size. ENCODING_DEFLATE
+ * means a zlib stream in chunked frames follows (see
+ * transfer_recv_inflate()); a known size must match the inflated length.
+ *
+ * @param ctx    Session state (client socket and authenticated user)
+ * @param framed 1 for MODE_UPLOAD_FRAMED and inside persistent sessions;
+ *               FRAMED_COMPRESSIBLE for MODE_UPLOAD_Z
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
  *
- * @note Sends STATUS_ERROR and closes on failure (permission denied, etc.)
+ * @note Sends STATUS_ERROR on failure (permission denied, etc.)
  * @note Automatically creates parent directories with mode 0755
- * @note Overwrites existing files without warning
+ * @note Replaces existing files without warning, but only once the upload
+ *       is complete; a failed upload leaves the old file as it was
  */
-static int handle_upload(int client_fd) {
-    char buffer[BUFFER_SIZE];
-    
+static int handle_upload(struct session_ctx *ctx, int framed) {
+    int client_fd = ctx->client_fd;
+
     // Step 1: Receive target path where file should be saved
-    char *target_path = recv_path_alloc(client_fd);
+    char *target_path = recv_path_alloc(ctx, client_fd);
     if (!target_path) {
-        printf("Invalid or missing target path.\n");
+        log_warn("Invalid or missing target path.");
         return -1;
     }
 
     // Step 2: Expand tilde (~) to actual home directory
-    char *expanded_path = expand_tilde(target_path);
-    free(target_path);
+    char *expanded_path = expand_tilde(ctx, target_path);
     if (!expanded_path) {
-        printf("Path expansion failed.\n");
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
+        log_warn("Path expansion failed.");
+        return reject_request(client_fd);
+    }
+
+    // Steps 3-4: Create parent directories and the temporary file, both
+    // confined to the user's home
+    struct upload_stage stage;
+    if (stage_open(ctx, expanded_path, "upload", &stage) != 0) {
+        if (errno == EACCES || errno == EXDEV) {
+            log_warn("Access denied for user '%s': %s", ctx->username, expanded_path);
+        } else {
+            log_errno("open");
+        }
+        return reject_request(client_fd);
+    }
+    log_info("Receiving file for path: %s", expanded_path);
+    char *buffer = session_xfer_buffer(ctx);
+    if (!buffer) {
+        log_errno("transfer buffer");
+        stage_abort(&stage);
+        return reject_request(client_fd);
+    }
+    int fd = stage.fd;
+
+    // Step 5: Send STATUS_OK to tell client we're ready to receive
+    unsigned char status = STATUS_OK;
+    send_all(client_fd, &status, 1);
+
+    // Step 6: Framed uploads announce their size; legacy ones end at close
+    uint64_t length = TRANSFER_UNTIL_EOF;
+    if (framed && recv_u64(client_fd, &length) != 0) {
+        log_errno("recv file size");
+        stage_abort(&stage);
         return -1;
     }
 
-    if (enforce_user_path_policy(expanded_path, 1) != 0) {
-        printf("Access denied for user '%s': %s\n", current_username, expanded_path);
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
-        free(expanded_path);
+    unsigned char encoding = ENCODING_NONE;
+    if ((framed & FRAMED_COMPRESSIBLE) && recv_exact(client_fd, &encoding, 1) <= 0) {
+        log_errno("recv encoding");
+        stage_abort(&stage);
         return -1;
     }
 
-    // Step 3: Create parent directories if they don't exist
-    if (ensure_parent_dirs(expanded_path) != 0) {
-        perror("mkdir");
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
-        free(expanded_path);
+    // Step 7: Receive file data
+    int rc;
+    if (encoding == ENCODING_DEFLATE) {
+        uint64_t received = 0;
+        rc = transfer_recv_inflate(client_fd, fd, buffer, ctx->xfer_buf_size, &received);
+        if (rc == 0 && length != FRAMED_SIZE_CHUNKED && received != length) {
+            log_error("Inflated size %llu does not match announced %llu.",
+                   (unsigned long long)received, (unsigned long long)length);
+            rc = -1;
+        }
+    } else if (encoding != ENCODING_NONE) {
+        log_error("Unknown upload encoding 0x%02x.", encoding);
+        rc = -1;
+    } else if (framed && length == FRAMED_SIZE_CHUNKED) {  // Same value as TRANSFER_UNTIL_EOF
+        rc = transfer_recv_chunked(client_fd, fd, buffer, ctx->xfer_buf_size, NULL);
+    } else {
+        rc = transfer_recv_file(client_fd, fd, 0, length,
+                                buffer, ctx->xfer_buf_size, NULL);
+    }
+    // Step 8: Only a complete file replaces the target
+    if (rc != 0) {
+        stage_abort(&stage);
         return -1;
     }
+    if (stage_commit(&stage) != 0) {
+        return framed ? reject_request(client_fd) : -1;
+    }
 
-    printf("Receiving file for path: %s\n", expanded_path);
+    // Step 9: Framed uploads get a final confirmation that the file is stored
+    if (framed) {
+        status = STATUS_OK;
+        if (send_all(client_fd, &status, 1) <= 0) return -1;
+    }
 
-    // Step 4: Open file for binary writing (overwrites existing file)
-    FILE *f = fopen(expanded_path, "wb");
-    if (!f) {
-        perror("fopen");
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
-        free(expanded_path);
+    log_debug("File saved.");
+    return 0;
+}
+
+/**
+ * @brief Handle DELTA mode: rebuild an upload from the existing target file
+ *
+ * Protocol flow:
+ * 1. Receive target path; expand ~ and check it like a normal upload
+ * 2. Send STATUS_OK (or STATUS_ERROR and keep the session)
+ * 3. Send block size, block count and one signature per full block of the
+ *    current target (see delta_send_signature()); a missing target has none
+ * 4. Receive copy/literal ops ending in DELTA_OP_END (see delta_apply())
+ *    and write the new content to a temporary file next to the target
+ * 5. Send a final status byte: STATUS_OK once the CRC-32 matched and the
+ *    temporary file was renamed over the target, STATUS_ERROR otherwise
+ *    (the target is left untouched and the client can fall back to a
+ *    full upload on the same connection)
+ *
+ * @param ctx Session state (client socket and authenticated user)
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ *
+ * @note The rebuilt file keeps the permission bits and owner of the file it replaces
+ */
+static int handle_delta_upload(struct session_ctx *ctx) {
+    int client_fd = ctx->client_fd;
+
+    char *target_path = recv_path_alloc(ctx, client_fd);
+    if (!target_path) {
+        log_warn("Invalid or missing target path.");
         return -1;
     }
+    char *expanded_path = expand_tilde(ctx, target_path);
+    if (!expanded_path) {
+        log_warn("Path expansion failed.");
+        return reject_request(client_fd);
+    }
 
-    // Step 5: Send STATUS_OK to tell client we're ready to receive
+    struct upload_stage stage;
+    if (stage_open(ctx, expanded_path, "delta", &stage) != 0) {
+        if (errno == EACCES || errno == EXDEV) {
+            log_warn("Access denied for user '%s': %s", ctx->username, expanded_path);
+        } else {
+            log_errno("delta target");
+        }
+        return reject_request(client_fd);
+    }
+    log_info("Receiving delta for path: %s", expanded_path);
+
+    int old_fd = stage.old_fd;
+    uint64_t old_size = old_fd >= 0 ? (uint64_t)stage.old_st.st_size : 0;
+    uint32_t block = delta_block_size(old_size);
+    // Block CRCs let delta_apply() copy (or reflink) blocks without reading them
+    uint32_t *crcs = old_size >= block ? malloc((size_t)(old_size / block) * sizeof(*crcs)) : NULL;
+    char *buffer = session_xfer_buffer(ctx);
+    if (!buffer) {
+        log_errno("transfer buffer");
+        free(crcs);
+        stage_abort(&stage);
+        return reject_request(client_fd);
+    }
+
+    // Steps 2-4: signatures out, ops in
+    uint64_t written = 0;
     unsigned char status = STATUS_OK;
-    send_all(client_fd, &status, 1);
-    free(expanded_path);  // No longer needed
+    int rc = -1;
+    if (send_all(client_fd, &status, 1) > 0 &&
+        delta_send_signature(client_fd, old_fd, old_size, block, buffer, ctx->xfer_buf_size,
+                             crcs) == 0) {
+        rc = delta_apply(client_fd, old_fd, old_size, block, stage.fd,
+                         buffer, ctx->xfer_buf_size, crcs, &written);
+    }
+    free(crcs);
+
+    // Copied blocks were checked against the signatures, not re-read: the
+    // old file must not have been written to since
+    struct stat now;
+    if (rc == 0 && old_fd >= 0 &&
+        (fstat(old_fd, &now) != 0 || now.st_size != stage.old_st.st_size ||
+         now.st_mtim.tv_sec != stage.old_st.st_mtim.tv_sec ||
+         now.st_mtim.tv_nsec != stage.old_st.st_mtim.tv_nsec)) {
+        log_warn("Delta base changed during the upload.");
+        rc = DELTA_MISMATCH;
+    }
 
-    // Step 6: Receive file data in chunks until connection closes
-    int n;
-    while ((n = recv(client_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-        // Step 7: Write received chunk to disk
-        if (fwrite(buffer, 1, n, f) != (size_t)n) {
-            perror("fwrite");
-            fclose(f);
-            return -1;
+    // Step 5: only a verified file replaces the target
+    if (rc == 0 && stage_commit(&stage) != 0) {
+        rc = DELTA_MISMATCH;
+    } else if (rc != 0) {
+        stage_abort(&stage);
+    }
+
+    if (rc < 0) return -1;
+    if (rc == DELTA_MISMATCH) {
+        log_warn("Delta upload did not verify; target left unchanged.");
+        return reject_request(client_fd);
+    }
+    if (send_all(client_fd, &status, 1) <= 0) return -1;
+    log_debug("File saved (%llu bytes rebuilt from delta).", (unsigned long long)written);
+    return 0;
+}
+
+/** Type byte values for directory listing entries. */
+#define LIST_TYPE_EOL  0x00   /**< End-of-list marker (no length/name follows) */
+#define LIST_TYPE_FILE 0x01   /**< Regular file (or unknown type)              */
+#define LIST_TYPE_DIR  0x02   /**< Directory                                   */
+
+#define FNV1A64_INIT 0xcbf29ce484222325ULL  /**< 64-bit FNV-1a offset basis */
+
+/**
+ * @brief Continue a 64-bit FNV-1a hash over len bytes
+ */
+static uint64_t fnv1a64(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/** One collected directory entry; name points into the shared pool. */
+struct listx_entry {
+    size_t         name_off;
+    const char    *name;
+    uint32_t       name_len;
+    unsigned char  type;
+};
+
+/**
+ * @brief qsort() order for listings: directories first, then
+ *        case-insensitive by name (same order the TUI shows)
+ */
+static int listx_compare(const void *a, const void *b) {
+    const struct listx_entry *x = a, *y = b;
+    if (x->type != y->type) return x->type == LIST_TYPE_DIR ? -1 : 1;
+    int c = strcasecmp(x->name, y->name);
+    return c != 0 ? c : strcmp(x->name, y->name);
+}
+
+/**
+ * @brief Read a directory into a sorted, wire-encoded listing_blob
+ *
+ * Names are first packed into one growing pool instead of one allocation
+ * each, sorted, then serialized as [type][4-byte BE length][name] records
+ * with an offset index for paging.
+ *
+ * @param dir Open directory stream
+ * @return New blob holding one reference, or NULL on allocation failure
+ */
+static struct listing_blob *build_listing_blob(DIR *dir) {
+    struct listx_entry *entries = NULL;
+    struct listing_blob *blob = NULL;
+    char *pool = NULL;
+    size_t count = 0, cap = 0, pool_used = 0, pool_cap = 0;
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        size_t len = strlen(entry->d_name);
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            struct listx_entry *tmp = realloc(entries, cap * sizeof(*entries));
+            if (!tmp) goto out;
+            entries = tmp;
+        }
+        if (pool_used + len + 1 > pool_cap) {
+            pool_cap = (pool_used + len + 1) * 2;
+            char *tmp = realloc(pool, pool_cap);
+            if (!tmp) goto out;
+            pool = tmp;
+        }
+
+        unsigned char type = LIST_TYPE_FILE;  /* DT_REG, DT_LNK, DT_UNKNOWN, etc. */
+        if (entry->d_type == DT_DIR) {
+            type = LIST_TYPE_DIR;
+        } else if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+                type = LIST_TYPE_DIR;
         }
+
+        memcpy(pool + pool_used, entry->d_name, len + 1);
+        entries[count].name_off = pool_used;
+        entries[count].name_len = (uint32_t)len;
+        entries[count].type = type;
+        pool_used += len + 1;
+        count++;
     }
 
-    // Check if loop ended due to error (not just connection close)
-    if (n < 0) {
-        perror("recv file data");
+    // The pool has stopped moving, so names can become pointers now
+    for (size_t i = 0; i < count; i++) {
+        entries[i].name = pool + entries[i].name_off;
     }
+    if (count > 1) qsort(entries, count, sizeof(*entries), listx_compare);
+
+    // Serialize: 5 bytes of header per entry plus the names without NULs
+    blob = calloc(1, sizeof(*blob));
+    if (!blob) goto out;
+    blob->refs = 1;
+    blob->count = (uint32_t)count;
+    blob->offsets = malloc((count + 1) * sizeof(size_t));
+    blob->data = malloc(count * 5 + pool_used + 1);
+    if (!blob->offsets || !blob->data) {
+        listcache_release(blob);
+        blob = NULL;
+        goto out;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint32_t len_be = htonl(entries[i].name_len);
+        blob->offsets[i] = blob->len;
+        blob->data[blob->len++] = (char)entries[i].type;
+        memcpy(blob->data + blob->len, &len_be, 4);
+        memcpy(blob->data + blob->len + 4, entries[i].name, entries[i].name_len);
+        blob->len += 4 + entries[i].name_len;
+    }
+    blob->offsets[count] = blob->len;
+    blob->hash = fnv1a64(FNV1A64_INIT, blob->data, blob->len);
 
-    fclose(f);
-    if (n < 0) {
-        return -1;
+out:
+    free(entries);
+    free(pool);
+    return blob;
+}
+
+/**
+ * @brief Get the sorted listing of a requested directory
+ *
+ * Expands the tilde and applies the user path policy, then serves the
+ * listing from the shared cache (see listcache.c) or reads the directory
+ * and offers the result to the cache.
+ *
+ * @param ctx       Session state
+ * @param dir_path  Path received from the client
+ * @param dir_fd_out Output: open descriptor of the directory (caller closes)
+ * @param blob_out  Output: referenced listing; release with listcache_release()
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ */
+static int load_listing(struct session_ctx *ctx, char *dir_path, int *dir_fd_out,
+                        struct listing_blob **blob_out) {
+    int client_fd = ctx->client_fd;
+
+    char *expanded_path = expand_tilde(ctx, dir_path);
+    if (!expanded_path) {
+        return reject_request(client_fd);
+    }
+    int dir_fd = open_user_path(ctx, expanded_path, O_RDONLY | O_DIRECTORY, 0);
+    if (dir_fd < 0) {
+        if (errno == EACCES || errno == EXDEV) {
+            log_warn("Access denied for user '%s': %s", ctx->username, expanded_path);
+        } else {
+            log_errno("opendir");
+        }
+        return reject_request(client_fd);
     }
 
-    printf("File saved.\n");
+    // The cache key is the canonical path of what was actually opened
+    char resolved[PATH_MAX], link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+    ssize_t n = readlink(link, resolved, sizeof(resolved) - 1);
+    if (n > 0) {
+        resolved[n] = '\0';
+    } else if (!realpath(expanded_path, resolved)) {
+        resolved[0] = '\0';  // Still listable, just not cacheable
+    }
+
+    struct listing_blob *blob = resolved[0] ? listcache_get(resolved) : NULL;
+    if (blob) {
+        metrics_count(METRIC_LISTCACHE_HITS, 1);
+        metrics_observe(METRIC_LIST_ENTRIES, blob->count);
+        log_debug("Listing directory (cached): %s", resolved);
+        *dir_fd_out = dir_fd;
+        *blob_out = blob;
+        return 0;
+    }
+
+    // Sample the mtime first so a change during readdir() keeps it uncached
+    struct stat st;
+    int read_fd = -1;
+    DIR *dir = NULL;
+    if (fstat(dir_fd, &st) != 0 || (read_fd = dup(dir_fd)) < 0 || !(dir = fdopendir(read_fd))) {
+        log_errno("opendir");
+        if (read_fd >= 0) close(read_fd);
+        close(dir_fd);
+        return reject_request(client_fd);
+    }
+    blob = build_listing_blob(dir);
+    closedir(dir);
+    if (!blob) {
+        log_errno("listing");
+        close(dir_fd);
+        return reject_request(client_fd);
+    }
+    if (resolved[0]) listcache_put(resolved, &st.st_mtim, blob);
+    metrics_count(METRIC_LISTCACHE_MISSES, 1);
+    metrics_observe(METRIC_LIST_ENTRIES, blob->count);
+
+    log_debug("Listing directory: %s", resolved);
+    *dir_fd_out = dir_fd;
+    *blob_out = blob;
     return 0;
 }
 
@@ -674,170 +1837,762 @@ static int handle_upload(int client_fd) {
  * Protocol flow:
  * 1. Receive directory path from client
  * 2. Expand tilde (~) in path
- * 3. Open directory for reading
+ * 3. Load the listing (see load_listing())
  * 4. Send STATUS_OK byte
- * 5. For each entry (excluding "." and ".."):
+ * 5. For each entry (excluding "." and ".."), sorted directories first:
  *    - Send entry type byte (LIST_TYPE_DIR or LIST_TYPE_FILE)
  *    - Send entry name length (4-byte big-endian)
  *    - Send entry name string
  * 6. Send end-of-list marker: type byte LIST_TYPE_EOL (0x00)
  *
- * @param client_fd Connected client socket
- * @return 0 on success, -1 on error
+ * The entries are the pre-serialized bytes of the listing blob, so the
+ * whole reply costs a handful of send() calls regardless of its size.
  *
- * @note Sends STATUS_ERROR and closes on failure (permission denied, not a directory, etc.)
+ * @param ctx Session state (client socket and authenticated user)
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ *
+ * @note Sends STATUS_ERROR on failure (permission denied, not a directory, etc.)
  * @note Excludes "." and ".." entries from listing
  * @note End-of-list is signaled by a LIST_TYPE_EOL (0x00) type byte with no following data
- * @note Entries whose d_type is DT_UNKNOWN are treated as LIST_TYPE_FILE
+ * @note Entries whose d_type is DT_UNKNOWN are classified with fstatat()
  */
-
-/** Type byte values for directory listing entries. */
-#define LIST_TYPE_EOL  0x00   /**< End-of-list marker (no length/name follows) */
-#define LIST_TYPE_FILE 0x01   /**< Regular file (or unknown type)              */
-#define LIST_TYPE_DIR  0x02   /**< Directory                                   */
-
-static int handle_list(int client_fd) {
+static int handle_list(struct session_ctx *ctx) {
+	int client_fd = ctx->client_fd;
 	// Step 1: Receive directory path to list
-	char *dir_path = recv_path_alloc(client_fd);
+	char *dir_path = recv_path_alloc(ctx, client_fd);
 	if (!dir_path) {
 		unsigned char status = STATUS_ERROR;
 		send_all(client_fd, &status, 1);
 		return -1;
 	}
 
-	// Step 2: Expand tilde (~) to actual home directory
-	char *expanded_path = expand_tilde(dir_path);
-	free(dir_path);
-	if (!expanded_path) {
-		unsigned char status = STATUS_ERROR;
-		send_all(client_fd, &status, 1);
+	// Steps 2-3: Expand, check policy, load (cached) listing
+	int dir_fd;
+	struct listing_blob *blob;
+	int rc = load_listing(ctx, dir_path, &dir_fd, &blob);
+	if (rc != 0) return rc;
+	close(dir_fd);
+
+	struct send_buffer out = { .fd = client_fd, .buf = session_xfer_buffer(ctx),
+	                           .cap = ctx->xfer_buf_size };
+	if (!out.buf) {
+		listcache_release(blob);
 		return -1;
 	}
 
-    if (enforce_user_path_policy(expanded_path, 0) != 0) {
-        printf("Access denied for user '%s': %s\n", current_username, expanded_path);
-        unsigned char status = STATUS_ERROR;
-        send_all(client_fd, &status, 1);
-        free(expanded_path);
+	// Steps 4-6: STATUS_OK, entries, end-of-list marker
+	unsigned char status = STATUS_OK;
+	unsigned char eol = LIST_TYPE_EOL;
+	rc = (sendbuf_put(&out, &status, 1) == 0 &&
+	      sendbuf_put(&out, blob->data, blob->len) == 0 &&
+	      sendbuf_put(&out, &eol, 1) == 0 &&
+	      sendbuf_flush(&out) == 0) ? 0 : -1;
+	if (rc != 0) log_errno("send directory listing");
+
+	listcache_release(blob);
+	if (rc == 0) log_debug("Directory listing sent.");
+	return rc;
+}
+
+/** Flag bits of an extended LIST request. */
+#define LISTX_WANT_STAT 0x01  /**< Add size, mtime and mode to every entry */
+#define LISTX_META_SIZE 20    /**< Bytes of metadata per entry with LISTX_WANT_STAT */
+
+/**
+ * @brief Look up size, mtime and mode for the entries of one page
+ *
+ * @param dir_fd Directory the listing was read from
+ * @param blob   The listing
+ * @param first  Index of the first entry of the page
+ * @param count  Entries in the page
+ * @param meta   Output: count records of [8-byte BE size][8-byte BE mtime]
+ *               [4-byte BE st_mode]
+ */
+static void listx_page_meta(int dir_fd, const struct listing_blob *blob, uint32_t first,
+                            uint32_t count, unsigned char *meta) {
+    for (uint32_t i = 0; i < count; i++) {
+        const char *rec = blob->data + blob->offsets[first + i];
+        size_t rec_len = blob->offsets[first + i + 1] - blob->offsets[first + i];
+        char name[PATH_MAX];
+        size_t name_len = rec_len - 5;
+        if (name_len >= sizeof(name)) name_len = sizeof(name) - 1;
+        memcpy(name, rec + 5, name_len);
+        name[name_len] = '\0';
+
+        // Never follow: a link may point outside what the user can read
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            memset(&st, 0, sizeof(st));
+        }
+        unsigned char *m = meta + (size_t)i * LISTX_META_SIZE;
+        uint64_t size_be = htobe64((uint64_t)st.st_size);
+        uint64_t mtime_be = htobe64((uint64_t)(int64_t)st.st_mtime);
+        uint32_t mode_be = htonl((uint32_t)st.st_mode);
+        memcpy(m, &size_be, 8);
+        memcpy(m + 8, &mtime_be, 8);
+        memcpy(m + 16, &mode_be, 4);
+    }
+}
+
+/**
+ * @brief Revalidation token of a conditional listing reply
+ *
+ * Covers exactly what the reply would carry: the directory's entries
+ * (through the blob hash), the page bounds, the flags and, with
+ * LISTX_WANT_STAT, the page's metadata. Never 0, which clients send
+ * when they hold no copy.
+ */
+static uint64_t listx_token(const struct listing_blob *blob, uint32_t first, uint32_t count,
+                            unsigned char flags, const unsigned char *meta) {
+    uint32_t page[2] = { first, count };
+    uint64_t h = fnv1a64(blob->hash, page, sizeof(page));
+    h = fnv1a64(h, &flags, 1);
+    if (meta) h = fnv1a64(h, meta, (size_t)count * LISTX_META_SIZE);
+    return h ? h : 1;
+}
+
+/**
+ * @brief Handle extended LIST mode: sorted, paged, optional metadata
+ *
+ * Protocol flow:
+ * 1. Receive directory path, then 4-byte BE offset, 4-byte BE limit
+ *    (0 = no limit) and a 1-byte flags field (LISTX_WANT_STAT). In the
+ *    conditional mode (MODE_LIST_COND) an 8-byte BE token follows: the
+ *    one from the client's copy of this page, or 0
+ * 2. Expand tilde, apply the user path policy and load the listing
+ *    (directories first, then case-insensitive by name, so pages are
+ *    stable across requests)
+ * 3. Conditional mode only: if the page's current token equals the
+ *    client's, send STATUS_NOT_MODIFIED and the token, and stop.
+ *    Otherwise send STATUS_OK followed by the new 8-byte BE token
+ * 4. Send STATUS_OK (plain mode), 4-byte BE total entry count, 4-byte BE
+ *    count of entries in this page
+ * 5. For each entry in [offset, offset + limit):
+ *    - [type byte][4-byte BE name length][name]
+ *    - with LISTX_WANT_STAT: [8-byte BE size][8-byte BE mtime (seconds
+ *      since the epoch)][4-byte BE st_mode]
+ *
+ * Metadata comes from fstatat() relative to the directory and is only
+ * looked up for entries in the page, never cached. Symlinks report the
+ * link itself (S_IFLNK), not their target, which may lie outside the
+ * user's home. Without metadata the page is a single slice of the listing
+ * blob.
+ *
+ * @param ctx         Session state (client socket and authenticated user)
+ * @param conditional Nonzero for MODE_LIST_COND
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ */
+static int handle_list_ex(struct session_ctx *ctx, int conditional) {
+    int client_fd = ctx->client_fd;
+
+    // Step 1: Path and paging parameters, all read before replying
+    char *dir_path = recv_path_alloc(ctx, client_fd);
+    if (!dir_path) {
+        log_warn("Invalid or missing directory path.");
+        return -1;
+    }
+    uint32_t page[2];
+    unsigned char flags;
+    uint64_t client_token = 0;
+    if (recv_exact(client_fd, page, sizeof(page)) <= 0 || recv_exact(client_fd, &flags, 1) <= 0 ||
+        (conditional && recv_exact(client_fd, &client_token, sizeof(client_token)) <= 0)) {
+        log_errno("recv list parameters");
+        return -1;
+    }
+    uint32_t offset = ntohl(page[0]);
+    uint32_t limit = ntohl(page[1]);
+    client_token = be64toh(client_token);
+
+    // Step 2: Expand, check policy and load (cached) listing
+    int dir_fd;
+    struct listing_blob *blob;
+    int rc = load_listing(ctx, dir_path, &dir_fd, &blob);
+    if (rc != 0) return rc;
+
+    uint32_t first = offset < blob->count ? offset : blob->count;
+    uint32_t count = blob->count - first;
+    if (limit != 0 && count > limit) count = limit;
+
+    struct send_buffer out = { .fd = client_fd, .buf = session_xfer_buffer(ctx),
+                               .cap = ctx->xfer_buf_size };
+    unsigned char *meta = NULL;
+    if (flags & LISTX_WANT_STAT) {
+        meta = malloc((size_t)count * LISTX_META_SIZE + 1);
+        if (meta) listx_page_meta(dir_fd, blob, first, count, meta);
+    }
+    close(dir_fd);
+    if (!out.buf || ((flags & LISTX_WANT_STAT) && !meta)) {
+        log_errno("list setup");
+        free(meta);
+        listcache_release(blob);
         return -1;
     }
 
-	// Step 3: Open directory for reading
-	DIR *dir = opendir(expanded_path);
-	if (!dir) {
-		perror("opendir");
-		unsigned char status = STATUS_ERROR;
-		send_all(client_fd, &status, 1);
-		free(expanded_path);
-		return -1;
-	}
+    // Step 3: Conditional requests may need no more than the token
+    unsigned char status = STATUS_OK;
+    rc = 0;
+    if (conditional) {
+        uint64_t token = listx_token(blob, first, count, flags, meta);
+        uint64_t token_be = htobe64(token);
+        if (token == client_token) status = STATUS_NOT_MODIFIED;
+        rc = (sendbuf_put(&out, &status, 1) == 0 &&
+              sendbuf_put(&out, &token_be, sizeof(token_be)) == 0) ? 0 : -1;
+    }
 
-	printf("Listing directory: %s\n", expanded_path);
-	free(expanded_path);
+    // Step 4: Header
+    uint32_t counts_be[2] = { htonl(blob->count), htonl(count) };
+    if (rc == 0 && status == STATUS_OK) {
+        rc = ((conditional || sendbuf_put(&out, &status, 1) == 0) &&
+              sendbuf_put(&out, counts_be, sizeof(counts_be)) == 0) ? 0 : -1;
 
-	// Step 4: Send STATUS_OK to indicate success
-	unsigned char status = STATUS_OK;
-	if (send_all(client_fd, &status, 1) <= 0) {
-		closedir(dir);
-		return -1;
-	}
+        // Step 5: Entries of the page
+        if (rc == 0 && !meta) {
+            size_t start = blob->offsets[first];
+            rc = sendbuf_put(&out, blob->data + start, blob->offsets[first + count] - start);
+        }
+        for (uint32_t i = 0; rc == 0 && meta && i < count; i++) {
+            const char *rec = blob->data + blob->offsets[first + i];
+            size_t rec_len = blob->offsets[first + i + 1] - blob->offsets[first + i];
+            if (sendbuf_put(&out, rec, rec_len) != 0 ||
+                sendbuf_put(&out, meta + (size_t)i * LISTX_META_SIZE, LISTX_META_SIZE) != 0) {
+                rc = -1;
+            }
+        }
+    }
+    if (rc == 0) rc = sendbuf_flush(&out);
 
-	// Step 5: Iterate through directory entries
-	struct dirent *entry;
-	while ((entry = readdir(dir)) != NULL) {
-		// Skip current directory and parent directory
-		if (strcmp(entry->d_name, ".") == 0 ||
-		    strcmp(entry->d_name, "..") == 0)
-			continue;
-
-		// Determine entry type byte from d_type
-		unsigned char type_byte;
-		if (entry->d_type == DT_DIR)
-			type_byte = LIST_TYPE_DIR;
-		else
-			type_byte = LIST_TYPE_FILE;  /* DT_REG, DT_LNK, DT_UNKNOWN, etc. */
-
-		// Send entry: type byte + length (4-byte big-endian) + name string
-		uint32_t len = (uint32_t)strlen(entry->d_name);
-		uint32_t len_be = htonl(len);
-
-		if (send_all(client_fd, &type_byte, 1) <= 0 ||
-		    send_all(client_fd, &len_be, sizeof(len_be)) <= 0 ||
-		    send_all(client_fd, entry->d_name, len) <= 0) {
-			perror("send directory entry");
-			closedir(dir);
-			return -1;
-		}
-	}
+    if (rc == 0 && status == STATUS_NOT_MODIFIED) {
+        log_debug("Directory listing unchanged (%u entries).", blob->count);
+    } else if (rc == 0) {
+        log_debug("Directory listing sent (%u of %u entries).", count, blob->count);
+    } else {
+        log_errno("send directory listing");
+    }
+    free(meta);
+    listcache_release(blob);
+    return rc;
+}
 
-	// Step 6: Send end-of-list marker (LIST_TYPE_EOL byte, no length/name follows)
-	unsigned char eol = LIST_TYPE_EOL;
-	send_all(client_fd, &eol, 1);
+/** Record type bytes in a TREE stream. */
+#define TREE_TYPE_END  0x00   /**< End of stream (nothing follows)          */
+#define TREE_TYPE_FILE 0x01   /**< Regular file: path, 8-byte size, data    */
+#define TREE_TYPE_DIR  0x02   /**< Directory: path only                     */
+#define TREE_MAX_DEPTH 64     /**< Deeper directories are skipped           */
+#define TREE_INLINE_MAX 65536 /**< Files up to this size share the header's send() */
+
+/** State shared by the recursive directory walk of one TREE request. */
+struct tree_walk {
+    struct session_ctx *ctx;
+    char     *buf;            /**< Session transfer buffer */
+    char      path[PATH_MAX]; /**< Relative path of the entry being sent */
+    uint64_t  files;
+    uint64_t  bytes;
+};
 
-	closedir(dir);
-	printf("Directory listing sent.\n");
-	return 0;
+/**
+ * @brief Send one TREE record header, plus the contents of small files
+ *
+ * Files up to TREE_INLINE_MAX bytes are copied behind their header in the
+ * transfer buffer and go out in a single send(), so a tree of small files costs about one syscall per
+ * file instead of one per header field.
+ *
+ * @param w       Walk state (path holds the record's relative path)
+ * @param type    TREE_TYPE_FILE or TREE_TYPE_DIR
+ * @param fd      Open file for TREE_TYPE_FILE, -1 for directories
+ * @param size    File size (ignored for directories)
+ * @return 0 on success, -1 on error (stream can't be resumed)
+ */
+static int send_tree_record(struct tree_walk *w, unsigned char type, int fd, uint64_t size) {
+    int client_fd = w->ctx->client_fd;
+    unsigned char hdr[1 + 4 + PATH_MAX + 8];
+    uint32_t path_len = (uint32_t)strlen(w->path);
+    uint32_t path_len_be = htonl(path_len);
+    size_t hdr_len = 0;
+
+    hdr[hdr_len++] = type;
+    memcpy(hdr + hdr_len, &path_len_be, 4);
+    hdr_len += 4;
+    memcpy(hdr + hdr_len, w->path, path_len);
+    hdr_len += path_len;
+    if (type == TREE_TYPE_DIR) {
+        return send_all(client_fd, hdr, hdr_len) > 0 ? 0 : -1;
+    }
+
+    uint64_t size_be = htobe64(size);
+    memcpy(hdr + hdr_len, &size_be, 8);
+    hdr_len += 8;
+
+    // Small file: header and data in one send; larger ones stay zero-copy
+    if (size <= TREE_INLINE_MAX && hdr_len + size <= w->ctx->xfer_buf_size) {
+        memcpy(w->buf, hdr, hdr_len);
+        size_t got = 0;
+        while (got < size) {
+            ssize_t n = pread(fd, w->buf + hdr_len + got, (size_t)size - got, (off_t)got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                log_warn("File shrank while sending: %s", w->path);
+                return -1;
+            }
+            got += (size_t)n;
+        }
+        return send_all(client_fd, w->buf, hdr_len + (size_t)size) > 0 ? 0 : -1;
+    }
+
+    uint64_t sent = 0;
+    if (send_all(client_fd, hdr, hdr_len) <= 0 ||
+        transfer_send_file(client_fd, fd, 0, size, w->buf, w->ctx->xfer_buf_size, &sent) != 0) {
+        return -1;
+    }
+    if (sent != size) {
+        log_warn("File shrank while sending: %s", w->path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send every entry below an open directory, depth first
+ *
+ * Entries are opened relative to their parent's descriptor with
+ * O_NOFOLLOW, so symlinks are never followed (they, and anything that is
+ * neither a regular file nor a directory, are skipped). Entries that can't
+ * be opened are skipped too, keeping the rest of the tree transferable.
+ *
+ * @param w       Walk state; path holds the directory's relative path
+ * @param dir     Open directory stream (closed by the caller)
+ * @param depth   Current depth below the requested root
+ * @return 0 on success, -1 on send error
+ */
+static int send_tree_dir(struct tree_walk *w, DIR *dir, int depth) {
+    size_t base_len = strlen(w->path);
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        size_t name_len = strlen(entry->d_name);
+        if (base_len + 1 + name_len >= sizeof(w->path)) {
+            log_warn("Path too long, skipping: %s/%s", w->path, entry->d_name);
+            continue;
+        }
+        w->path[base_len] = '/';
+        memcpy(w->path + base_len + 1, entry->d_name, name_len + 1);
+
+        struct stat st;
+        int rc = 0;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            log_errno("fstatat");
+        } else if (S_ISDIR(st.st_mode)) {
+            if (depth >= TREE_MAX_DEPTH) {
+                log_warn("Too deep, skipping: %s", w->path);
+            } else {
+                int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                DIR *sub = fd >= 0 ? fdopendir(fd) : NULL;
+                if (!sub) {
+                    log_errno("open subdirectory");
+                    if (fd >= 0) close(fd);
+                } else {
+                    rc = send_tree_record(w, TREE_TYPE_DIR, -1, 0);
+                    if (rc == 0) rc = send_tree_dir(w, sub, depth + 1);
+                    closedir(sub);
+                }
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                log_errno("open file");
+            } else {
+                rc = send_tree_record(w, TREE_TYPE_FILE, fd, (uint64_t)st.st_size);
+                w->files++;
+                w->bytes += (uint64_t)st.st_size;
+            }
+            if (fd >= 0) close(fd);
+        }
+
+        w->path[base_len] = '\0';
+        if (rc != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle TREE mode: stream a whole directory tree
+ *
+ * Protocol flow:
+ * 1. Receive directory path from client
+ * 2. Expand tilde, apply the user path policy and open the directory
+ * 3. Send STATUS_OK byte
+ * 4. Send one record per entry, parents before their contents:
+ *    - [type byte][4-byte BE path length][relative path]
+ *    - TREE_TYPE_FILE records add [8-byte BE size][exactly size bytes]
+ *    The first record is the TREE_TYPE_DIR of the requested directory
+ *    itself (named after its basename); all paths start with that name and
+ *    use '/' separators.
+ * 5. Send TREE_TYPE_END
+ *
+ * Replaces one connection (and authentication) per file with a single
+ * stream, which is what makes trees of many small files fast.
+ *
+ * @param ctx Session state (client socket and authenticated user)
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ */
+static int handle_tree(struct session_ctx *ctx) {
+    int client_fd = ctx->client_fd;
+
+    // Step 1: Receive directory path
+    char *dir_path = recv_path_alloc(ctx, client_fd);
+    if (!dir_path) {
+        log_warn("Invalid or missing directory path.");
+        return -1;
+    }
+
+    // Step 2: Expand, check policy and open
+    char *expanded_path = expand_tilde(ctx, dir_path);
+    if (!expanded_path) {
+        return reject_request(client_fd);
+    }
+    int fd = open_user_path(ctx, expanded_path, O_RDONLY | O_DIRECTORY, 0);
+    if (fd < 0 && (errno == EACCES || errno == EXDEV)) {
+        log_warn("Access denied for user '%s': %s", ctx->username, expanded_path);
+        return reject_request(client_fd);
+    }
+
+    struct tree_walk w = { .ctx = ctx };
+    w.buf = session_xfer_buffer(ctx);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir || !w.buf) {
+        log_errno("opendir");
+        if (dir) closedir(dir);
+        else if (fd >= 0) close(fd);
+        return reject_request(client_fd);
+    }
+
+    // Root record name: basename without trailing slashes ("/" itself is "root")
+    size_t len = strlen(expanded_path);
+    while (len > 1 && expanded_path[len - 1] == '/') expanded_path[--len] = '\0';
+    const char *root = path_basename(expanded_path);
+    snprintf(w.path, sizeof(w.path), "%s", *root ? root : "root");
+
+    log_info("Sending tree: %s", expanded_path);
+
+    // Steps 3-5
+    unsigned char status = STATUS_OK;
+    unsigned char end = TREE_TYPE_END;
+    int rc = -1;
+    if (send_all(client_fd, &status, 1) > 0 &&
+        send_tree_record(&w, TREE_TYPE_DIR, -1, 0) == 0 &&
+        send_tree_dir(&w, dir, 1) == 0 &&
+        send_all(client_fd, &end, 1) > 0) {
+        rc = 0;
+    }
+    closedir(dir);
+
+    if (rc == 0) {
+        log_debug("Tree sent: %llu files, %llu bytes.",
+               (unsigned long long)w.files, (unsigned long long)w.bytes);
+    }
+    return rc;
+}
+
+/**
+ * @brief Handle METRICS mode: export the server counters
+ *
+ * Protocol flow:
+ * 1. Refuse with STATUS_ERROR unless the session user is root
+ * 2. Send STATUS_OK, a 4-byte big-endian length and that many bytes of
+ *    Prometheus text exposition format (see metrics_render())
+ *
+ * @param ctx Session state (client socket and authenticated user)
+ * @return 0 on success, REQUEST_REJECTED if STATUS_ERROR was sent, -1 on error
+ */
+static int handle_metrics(struct session_ctx *ctx) {
+    if (!ctx->is_root) {
+        log_warn("Metrics request from non-root user '%s' refused.", ctx->username);
+        return reject_request(ctx->client_fd);
+    }
+
+    size_t len;
+    char *text = metrics_render(&len);
+    if (!text) return reject_request(ctx->client_fd);
+
+    unsigned char status = STATUS_OK;
+    uint32_t len_be = htonl((uint32_t)len);
+    int rc = (send_all(ctx->client_fd, &status, 1) > 0 &&
+              send_all(ctx->client_fd, &len_be, sizeof(len_be)) > 0 &&
+              send_all(ctx->client_fd, text, len) > 0) ? 0 : -1;
+    free(text);
+    return rc;
+}
+
+/**
+ * @brief Run one request for the given mode byte
+ *
+ * @return Handler result (0, REQUEST_REJECTED or -1); UNKNOWN_MODE for unknown modes
+ */
+static int dispatch_mode(struct session_ctx *ctx, unsigned char mode, int framed) {
+    if (mode == MODE_DOWNLOAD) {
+        return handle_download(ctx, framed);
+    } else if (mode == MODE_UPLOAD) {
+        return handle_upload(ctx, framed);
+    } else if (mode == MODE_DOWNLOAD_FRAMED) {
+        return handle_download(ctx, 1);
+    } else if (mode == MODE_UPLOAD_FRAMED) {
+        return handle_upload(ctx, 1);
+    } else if (mode == MODE_DOWNLOAD_Z) {
+        return handle_download(ctx, FRAMED_COMPRESSIBLE);
+    } else if (mode == MODE_DOWNLOAD_SUM) {
+        return handle_download(ctx, FRAMED_COMPRESSIBLE | FRAMED_CHECKSUM);
+    } else if (mode == MODE_CHECKSUM) {
+        return handle_checksum(ctx);
+    } else if (mode == MODE_UPLOAD_Z) {
+        return handle_upload(ctx, FRAMED_COMPRESSIBLE);
+    } else if (mode == MODE_RANGE) {
+        return handle_range_download(ctx);
+    } else if (mode == MODE_LIST) {
+        return handle_list(ctx);
+    } else if (mode == MODE_LIST_EX) {
+        return handle_list_ex(ctx, 0);
+    } else if (mode == MODE_LIST_COND) {
+        return handle_list_ex(ctx, 1);
+    } else if (mode == MODE_TREE) {
+        return handle_tree(ctx);
+    } else if (mode == MODE_DELTA) {
+        return handle_delta_upload(ctx);
+    } else if (mode == MODE_METRICS) {
+        return handle_metrics(ctx);
+    }
+
+    log_warn("Unknown mode byte: 0x%02x", mode);
+    return UNKNOWN_MODE;
+}
+
+/**
+ * @brief Whether a mode reads its whole request before writing anything
+ *
+ * Those replies are corked: headers, file data and trailers leave in full
+ * segments and the rest goes out when the request ends. Uploads are not,
+ * since the client waits for their status byte before sending data.
+ */
+static int reply_only_mode(unsigned char mode) {
+    switch (mode) {
+    case MODE_DOWNLOAD: case MODE_DOWNLOAD_FRAMED: case MODE_DOWNLOAD_Z:
+    case MODE_DOWNLOAD_SUM: case MODE_RANGE: case MODE_CHECKSUM:
+    case MODE_LIST: case MODE_LIST_EX: case MODE_LIST_COND:
+    case MODE_TREE: case MODE_METRICS:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief dispatch_mode() plus per-request timing, byte and result metrics
+ */
+static int run_request(struct session_ctx *ctx, unsigned char mode, int framed) {
+    ctx->request_usec = metrics_now_usec();
+    arena_reset(&ctx->arena);  // Nothing from the previous request is still in use
+    int cork = reply_only_mode(mode);
+    if (cork) sockopt_cork(ctx->client_fd, 1);
+    int rc = dispatch_mode(ctx, mode, framed);
+    if (cork) sockopt_cork(ctx->client_fd, 0);
+    if (rc == UNKNOWN_MODE) {
+        mode = METRICS_MODE_OTHER;  // Any byte a client sends would otherwise get its own series
+        rc = -1;
+    }
+    metrics_request_done(&ctx->stats, ctx->client_fd, mode, ctx->request_usec);
+    if (rc == REQUEST_REJECTED) metrics_count(METRIC_REJECTED, 1);
+    if (rc < 0) metrics_count(METRIC_FAILED, 1);
+    return rc;
+}
+
+/**
+ * @brief Wait for the next session command, or for the server to drain
+ *
+ * A client whose command is already waiting is still served while the
+ * server drains; it is told to go away at the next boundary instead.
+ *
+ * @return 1 when the mode byte can be read, 0 when the session should end
+ *         because the server is shutting down, -1 on idle timeout or error
+ */
+static int wait_next_request(int client_fd) {
+    if (tls_pending(client_fd)) return 1;  // Already decrypted, poll() can't see it
+
+    struct pollfd pfd[2] = {
+        { .fd = client_fd, .events = POLLIN },
+        { .fd = daemon_drain_fd(), .events = POLLIN },
+    };
+    int idle = config_get(idle_timeout);
+    int timeout_ms = idle > 0 ? idle * 1000 : -1;
+    int n;
+    do {
+        n = poll(pfd, 2, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        log_errno("poll");
+        return -1;
+    }
+    if (pfd[0].revents) return 1;  // Data, EOF or an error: recv_exact() tells them apart
+    if (n == 0) {
+        errno = EAGAIN;  // What SO_RCVTIMEO reports for the same idle client
+        log_errno("recv mode");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Handle SESSION mode: serve commands until the client quits
+ *
+ * Protocol flow:
+ * 1. Send STATUS_OK byte
+ * 2. Repeatedly receive a mode byte and run that request on the same
+ *    connection. Downloads and uploads use the framed (size-prefixed) form.
+ * 3. Stop on MODE_QUIT ('Q') or when the client disconnects
+ *
+ * A request refused with STATUS_ERROR (bad path, access denied, ...) keeps
+ * the session open; any I/O error ends it. When the server drains
+ * (SIGTERM, upgrade) the connection is closed between two requests, which
+ * clients treat like an idle disconnect: they reconnect for the next one.
+ *
+ * @param ctx Authenticated session
+ * @return 0 when the client quits or disconnects between commands, -1 on error
+ */
+static int handle_session(struct session_ctx *ctx) {
+    int client_fd = ctx->client_fd;
+
+    unsigned char status = STATUS_OK;
+    if (send_all(client_fd, &status, 1) <= 0) return -1;
+
+    log_info("Persistent session started for user: %s", ctx->username);
+    while (1) {
+        int ready = wait_next_request(client_fd);
+        if (ready < 0) return -1;
+        if (ready == 0) {
+            log_info("Server is draining, ending persistent session.");
+            return 0;
+        }
+
+        unsigned char mode;
+        int n = recv_exact(client_fd, &mode, 1);
+        if (n == 0) return 0;  // Client went away between commands
+        if (n < 0) {
+            log_errno("recv mode");
+            return -1;
+        }
+        if (mode == MODE_QUIT) {
+            log_debug("Client ended persistent session.");
+            return 0;
+        }
+        if (mode == MODE_SESSION) {
+            log_warn("Nested session request rejected.");
+            return -1;
+        }
+        if (run_request(ctx, mode, 1) < 0) {
+            return -1;
+        }
+    }
 }
 
 /* ========== Public API ========== */
 
+/**
+ * @brief Prepare a fresh session context for an accepted connection
+ *
+ * @param ctx       Context to initialise (typically on the worker's stack)
+ * @param client_fd Connected client socket
+ */
+void session_init(struct session_ctx *ctx, int client_fd) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->client_fd = client_fd;
+    ctx->home_fd = -1;
+    ctx->stats.started_usec = metrics_now_usec();
+    arena_init(&ctx->arena, ctx->arena_mem, sizeof(ctx->arena_mem));
+}
+
+/**
+ * @brief Free resources owned by a session context (not the socket)
+ */
+void session_release(struct session_ctx *ctx) {
+    session_forget_dirs(ctx);
+    if (ctx->home_fd >= 0) close(ctx->home_fd);
+    ctx->home_fd = -1;
+    bufpool_put(ctx->xfer_buf);
+    ctx->xfer_buf = NULL;
+    ctx->xfer_buf_size = 0;
+}
+
 /**
  * @brief Main entry point for handling an authenticated client session
  *
- * Called by main.c after receiving the unlock byte (0x01).
+ * Called by a worker thread (see main.c) after receiving the unlock byte
+ * (0x01, or 0x02 when the client presents a resumption token).
  * This function orchestrates the entire session:
  * 1. Authenticate user (receive username for tilde expansion)
- * 2. Receive mode byte (D=download, U=upload, L=list)
+ * 2. Receive mode byte (D/d=download, G=ranged download, U/u=upload, L=list,
+ *    X=extended list, R=directory tree, S=persistent session)
  * 3. Dispatch to appropriate handler
  *
  * Protocol sequence:
  * - Client sends: 4-byte length + username string
- * - Client sends: 1-byte mode ('D', 'U', or 'L')
- * - Handler takes over based on mode
+ * - Client sends: 1-byte mode ('D', 'd', 'G', 'U', 'u', 'L', 'X', 'R' or 'S')
+ * - Handler takes over based on mode; 'S' keeps the connection open for
+ *   further commands (see handle_session())
  *
- * @param client_fd Connected client socket (already unlocked)
+ * @param ctx Session context from session_init() (socket already unlocked)
  * @return 0 on success, -1 on error or unknown mode
  *
- * @note Sets global current_username for tilde expansion
- * @note Closes connection after handling (or on error)
- * @note Returns to main.c's idle state after completion
+ * @note Fills ctx with the user's identity for tilde expansion and path policy
+ * @note Caller closes the connection after this returns
  */
-int handle_unlocked_session(int client_fd) {
+int handle_unlocked_session(struct session_ctx *ctx) {
+    int client_fd = ctx->client_fd;
+
     // Step 1: Receive and store username for path expansion
-    char *username = recv_path_alloc(client_fd);
+    char *username = recv_path_alloc(ctx, client_fd);
     if (!username) {
-        printf("Invalid or missing username.\n");
+        log_warn("Invalid or missing username.");
         return -1;
     }
-    // Store username globally for expand_tilde() to use
-    strncpy(current_username, username, sizeof(current_username) - 1);
-    current_username[sizeof(current_username) - 1] = '\0';  // Ensure null termination
-    printf("Authenticated as user: %s\n", current_username);
-    free(username);
-
-    // Step 2: Authenticate password hash against system shadow entry
-    if (authenticate_user(client_fd) != 0) {
-        printf("Authentication failed for user: %s\n", current_username);
+    strncpy(ctx->username, username, sizeof(ctx->username) - 1);
+    ctx->username[sizeof(ctx->username) - 1] = '\0';  // Ensure null termination
+    log_info("Authenticated as user: %s", ctx->username);
+    uint64_t auth_start = metrics_now_usec();
+
+    // Resolve uid/home once; unknown users still go through authentication
+    // below so they get the same STATUS_ERROR reply as a bad password.
+    struct user_record rec;
+    session_load_user(ctx, &rec);
+
+    // Step 2: Authenticate with a resumption token or the password hash
+    //         against the system shadow entry
+    int by_token = 0;
+    int auth = ctx->token_auth ? authenticate_with_token(ctx, rec.hash, &by_token)
+                               : authenticate_user(ctx, rec.hash);
+    explicit_bzero(rec.hash, sizeof(rec.hash));
+    metrics_observe(METRIC_AUTH_USEC, metrics_now_usec() - auth_start);
+    metrics_count(auth == 0 ? METRIC_AUTH_OK : METRIC_AUTH_FAILED, 1);
+    if (auth != 0) {
+        log_warn("Authentication failed for user: %s", ctx->username);
         return -1;
     }
+    if (by_token) {
+        metrics_count(METRIC_AUTH_TOKEN, 1);
+        log_debug("Resumed with a session token.");
+    }
 
     // Step 3: Receive mode byte to determine operation
     unsigned char mode;
     int n = recv_exact(client_fd, &mode, 1);
     if (n <= 0) {
-        perror("recv mode");
+        log_errno("recv mode");
         return -1;
     }
 
     // Step 4: Dispatch to appropriate handler
-    if (mode == MODE_DOWNLOAD) {
-        return handle_download(client_fd);
-    } else if (mode == MODE_UPLOAD) {
-        return handle_upload(client_fd);
-    } else if (mode == MODE_LIST) {
-        return handle_list(client_fd);
+    if (mode == MODE_SESSION) {
+        return handle_session(ctx);
     }
-
-    printf("Unknown mode byte: 0x%02x\n", mode);
-    return -1;
+    return run_request(ctx, mode, 0) == 0 ? 0 : -1;
 }
\ No newline at end of file
@@ -1,6 +1,55 @@
 #ifndef SESSION_H
 #define SESSION_H
 
-int handle_unlocked_session(int client_fd);
+#include <limits.h>
+#include <sys/types.h>
+
+#include "bufpool.h"
+#include "metrics.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define SESSION_KNOWN_DIRS 8  /**< Upload parent directories remembered per session */
+#define SESSION_ARENA_SIZE (32 * 1024)  /**< Per-request strings: paths, hashes, usernames */
+
+/** An upload parent directory kept open for later uploads into it */
+struct known_dir {
+    char *path;                       /**< Parent as named in the upload (after ~ expansion) */
+    int   fd;                         /**< O_PATH descriptor of it */
+};
+
+/**
+ * @brief Per-connection session state
+ *
+ * One instance lives on the stack of the worker thread serving the
+ * connection, so sessions never share mutable state. The user fields are
+ * filled once after the username arrives and then reused by every handler.
+ */
+struct session_ctx {
+    int   client_fd;                  /**< Connected client socket */
+    char  username[256];              /**< Username sent by the client */
+    int   user_known;                 /**< 1 once the passwd entry was found */
+    int   token_auth;                 /**< 1 if unlocked with 0x02: a resumption token follows */
+    uid_t uid;
+    gid_t gid;
+    int   is_root;                    /**< 1 if uid == 0 (no path restrictions) */
+    char  home[PATH_MAX];             /**< Home directory from the passwd entry */
+    char  resolved_home[PATH_MAX];    /**< realpath() of home, "" if unresolved */
+    int   home_fd;                    /**< O_PATH fd of resolved_home for openat2(), -1 if none */
+    struct known_dir known_dirs[SESSION_KNOWN_DIRS]; /**< Parents of earlier uploads */
+    unsigned known_next;              /**< Next known_dirs slot to overwrite */
+    char *xfer_buf;                   /**< Pooled transfer buffer, taken on first use */
+    size_t xfer_buf_size;
+    struct arena arena;               /**< Strings of the current request, reset per request */
+    _Alignas(16) char arena_mem[SESSION_ARENA_SIZE];
+    struct session_stats stats;       /**< Requests and bytes of this connection */
+    uint64_t request_usec;            /**< metrics_now_usec() when the current request began */
+};
+
+void session_init(struct session_ctx *ctx, int client_fd);
+void session_release(struct session_ctx *ctx);
+int handle_unlocked_session(struct session_ctx *ctx);
 
 #endif
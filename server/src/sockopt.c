@@ -0,0 +1,159 @@
+/**
+ * @file sockopt.c
+ * @brief Listening socket setup and per-connection TCP tuning
+ *
+ * Everything here comes from g_config, so a LAN and a high-BDP WAN site can
+ * run the same binary with different settings:
+ * - -S/-R set SO_SNDBUF/SO_RCVBUF on the listener; accepted sockets inherit
+ *   them, and because they are set before listen() the window scale offered
+ *   in the handshake matches. 0 leaves the kernel's autotuning alone.
+ * - -C sets TCP_CONGESTION (e.g. "bbr") on the listener, also inherited.
+ * - -F enables TCP Fast Open with the given queue length, so a returning
+ *   client's unlock byte (or TLS ClientHello) rides in the SYN.
+ * - -A runs several accept threads, each with its own SO_REUSEPORT socket,
+ *   so the kernel spreads the incoming connections over them.
+ * - Accepted sockets get TCP_NODELAY: the protocol is a sequence of small
+ *   request/reply exchanges, and Nagle would hold each reply until the
+ *   previous segment is acknowledged (a delayed-ACK stall per request).
+ *   File data is sent between sockopt_cork() calls instead, so a download
+ *   still leaves in full segments. -N turns both off.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1   /* TCP_CORK, TCP_CONGESTION, TCP_FASTOPEN */
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "log.h"
+#include "sockopt.h"
+
+/**
+ * @brief setsockopt() for an int option, logging failures
+ */
+static int set_int(int fd, int level, int name, int value, const char *what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        log_errno(what);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Warn when -F is set but the sysctl keeps server-side TFO off
+ */
+static void check_fastopen_sysctl(void) {
+    static int checked;  // Once, not per -A listener
+    if (checked++) return;
+    FILE *f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    if (!f) return;
+    int mode = 0;
+    if (fscanf(f, "%d", &mode) == 1 && !(mode & 2)) {
+        log_warn("TCP Fast Open requested but net.ipv4.tcp_fastopen=%d has no server bit (2); "
+                 "connections use the normal handshake.", mode);
+    }
+    fclose(f);
+}
+
+/**
+ * @brief Create, tune, bind and listen on the server socket
+ *
+ * @param reuseport 1 to set SO_REUSEPORT, for one socket per accept thread
+ * @return Listening socket, or -1 (already logged)
+ */
+int sockopt_open_listener(int reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_errno("socket");
+        return -1;
+    }
+
+    // Allow immediate port reuse after server restart
+    if (set_int(fd, SOL_SOCKET, SO_REUSEADDR, 1, "setsockopt SO_REUSEADDR") != 0 ||
+        (reuseport && set_int(fd, SOL_SOCKET, SO_REUSEPORT, 1, "setsockopt SO_REUSEPORT") != 0) ||
+        (g_config.sndbuf > 0 &&
+         set_int(fd, SOL_SOCKET, SO_SNDBUF, g_config.sndbuf, "setsockopt SO_SNDBUF") != 0) ||
+        (g_config.rcvbuf > 0 &&
+         set_int(fd, SOL_SOCKET, SO_RCVBUF, g_config.rcvbuf, "setsockopt SO_RCVBUF") != 0)) {
+        close(fd);
+        return -1;
+    }
+
+    if (g_config.congestion &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, g_config.congestion,
+                   (socklen_t)strlen(g_config.congestion)) < 0) {
+        log_errno("setsockopt TCP_CONGESTION");
+        log_error("Congestion control '%s' is not available (see "
+                  "/proc/sys/net/ipv4/tcp_allowed_congestion_control).", g_config.congestion);
+        close(fd);
+        return -1;
+    }
+
+    if (g_config.fastopen > 0) {
+        if (set_int(fd, IPPROTO_TCP, TCP_FASTOPEN, g_config.fastopen, "setsockopt TCP_FASTOPEN") != 0) {
+            close(fd);
+            return -1;
+        }
+        check_fastopen_sysctl();
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(g_config.port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_errno("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, g_config.listen_backlog) < 0) {
+        log_errno("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Per-connection options for a freshly accepted socket
+ *
+ * Sets the idle timeouts and, unless -N, TCP_NODELAY. Failures are
+ * harmless and ignored.
+ */
+void sockopt_tune_client(int fd) {
+    // Don't let a silent client pin a worker forever
+    int idle = config_get(idle_timeout);
+    if (idle > 0) {
+        struct timeval tv = { .tv_sec = idle, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    if (g_config.nodelay) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+/**
+ * @brief Hold back partial segments while a reply is being written (on = 1)
+ *
+ * Clearing the cork sends whatever is queued at once. No-op with -N, where
+ * Nagle does the coalescing.
+ */
+void sockopt_cork(int fd, int on) {
+    if (!g_config.nodelay) return;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
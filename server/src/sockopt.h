@@ -0,0 +1,8 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+int sockopt_open_listener(int reuseport);
+void sockopt_tune_client(int fd);
+void sockopt_cork(int fd, int on);
+
+#endif
@@ -0,0 +1,290 @@
+/**
+ * @file tls.c
+ * @brief Optional TLS 1.3 transport with kernel TLS offload (-T/-K/-E)
+ *
+ * A connection whose first byte is a TLS handshake record (0x16) instead of
+ * the unlock byte is wrapped in TLS before anything else is read, so the
+ * authentication exchange and every file byte are encrypted. Plaintext
+ * clients keep working unless -E requires TLS.
+ *
+ * The handshake runs in OpenSSL with SSL_OP_ENABLE_KTLS. When the kernel
+ * can take over the record layer (the "tls" ULP, AES-GCM), the session keys
+ * are installed on the socket and send(), sendfile() and splice() on it
+ * produce encrypted records, so downloads stay zero-copy. Without kTLS the
+ * records are built in user space with SSL_write()/SSL_read() and
+ * transfer.c uses its buffered paths for that session. OpenSSL 3.0 only
+ * offloads the send side of TLS 1.3, so uploads are decrypted in user
+ * space either way.
+ *
+ * Each worker thread serves one connection at a time, so the TLS state of
+ * the current connection is thread-local and the socket I/O helpers in
+ * session.c and transfer.c find it from the descriptor alone.
+ *
+ * SIGHUP loads the certificate again (tls_reload()); connections accepted
+ * from then on use the new one, and running ones keep the old context until
+ * they end (each SSL holds a reference to it).
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "tls.h"
+
+/** TLS state of the connection the calling worker is serving */
+struct tls_conn {
+    int  fd;          /**< Socket the state belongs to, -1 when idle */
+    SSL *ssl;
+    int  ktls_send;   /**< Kernel encrypts what is written to fd */
+    int  ktls_recv;   /**< Kernel decrypts what is read from fd */
+};
+
+static pthread_mutex_t g_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX *g_ctx;  /**< Guarded by g_ctx_lock once workers run */
+static _Thread_local struct tls_conn t_conn = { .fd = -1 };
+
+/**
+ * @brief Log and clear this thread's OpenSSL error queue
+ */
+static void log_ssl_errors(const char *what) {
+    unsigned long err;
+    int logged = 0;
+    while ((err = ERR_get_error()) != 0) {
+        char buf[256];
+        ERR_error_string_n(err, buf, sizeof(buf));
+        log_warn("%s: %s", what, buf);
+        logged = 1;
+    }
+    if (!logged) log_warn("%s failed", what);
+}
+
+/* ========== Setup ========== */
+
+/**
+ * @brief Build a server context from a certificate and key
+ *
+ * @return New context, or NULL (errors logged)
+ */
+static SSL_CTX *load_ctx(const char *cert_file, const char *key_file) {
+    if (!key_file) key_file = cert_file;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        log_ssl_errors("SSL_CTX_new");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // Sessions are long-lived and never resumed; a ticket would only be a
+    // stray record for the client to read after the handshake
+    SSL_CTX_set_num_tickets(ctx, 0);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        log_ssl_errors("TLS certificate/key");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * @brief Load the server certificate and key and enable TLS connections
+ *
+ * @param cert_file PEM certificate chain, leaf first
+ * @param key_file  PEM private key; NULL reads it from cert_file
+ * @return 0 on success, -1 if the files can't be used
+ */
+int tls_init(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = load_ctx(cert_file, key_file);
+    if (!ctx) return -1;
+
+    pthread_mutex_lock(&g_ctx_lock);
+    g_ctx = ctx;
+    pthread_mutex_unlock(&g_ctx_lock);
+    log_info("TLS enabled with certificate %s", cert_file);
+    return 0;
+}
+
+/**
+ * @brief Replace the certificate and key for connections accepted from now on
+ *
+ * Also enables TLS when it was off. On failure the current context stays
+ * in use.
+ *
+ * @return 0 on success, -1 if the files can't be used
+ */
+int tls_reload(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = load_ctx(cert_file, key_file);
+    if (!ctx) return -1;
+
+    pthread_mutex_lock(&g_ctx_lock);
+    SSL_CTX *old = g_ctx;
+    g_ctx = ctx;
+    pthread_mutex_unlock(&g_ctx_lock);
+    SSL_CTX_free(old);  // Running connections hold their own reference
+    log_info("TLS certificate reloaded from %s", cert_file);
+    return 0;
+}
+
+/**
+ * @brief Whether tls_init() succeeded, i.e. TLS clients are accepted
+ */
+int tls_enabled(void) {
+    pthread_mutex_lock(&g_ctx_lock);
+    int enabled = g_ctx != NULL;
+    pthread_mutex_unlock(&g_ctx_lock);
+    return enabled;
+}
+
+/* ========== Connections ========== */
+
+/**
+ * @brief Run the server side of the handshake and attach it to this thread
+ *
+ * @param fd Accepted socket whose next byte is a TLS handshake record
+ * @return 0 when the connection is encrypted, -1 on handshake failure
+ */
+int tls_accept(int fd) {
+    pthread_mutex_lock(&g_ctx_lock);
+    SSL *ssl = SSL_new(g_ctx);
+    pthread_mutex_unlock(&g_ctx_lock);
+    if (!ssl || SSL_set_fd(ssl, fd) != 1) {
+        log_ssl_errors("SSL_new");
+        SSL_free(ssl);
+        return -1;
+    }
+
+    ERR_clear_error();
+    if (SSL_accept(ssl) != 1) {
+        log_ssl_errors("TLS handshake");
+        metrics_count(METRIC_TLS_FAILED, 1);
+        SSL_free(ssl);
+        return -1;
+    }
+
+    t_conn.fd = fd;
+    t_conn.ssl = ssl;
+    t_conn.ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+    t_conn.ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0;
+    metrics_count(METRIC_TLS_SESSIONS, 1);
+    if (t_conn.ktls_send) metrics_count(METRIC_KTLS_SESSIONS, 1);
+
+    log_debug("%s %s, kernel TLS: send %s, receive %s",
+              SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+              t_conn.ktls_send ? "on" : "off", t_conn.ktls_recv ? "on" : "off");
+    return 0;
+}
+
+/**
+ * @brief Send close_notify and drop the TLS state of fd (no-op for plaintext)
+ *
+ * The socket itself stays open; the caller closes it as usual.
+ */
+void tls_end(int fd) {
+    if (t_conn.fd != fd || !t_conn.ssl) return;
+    ERR_clear_error();
+    SSL_shutdown(t_conn.ssl);
+    ERR_clear_error();
+    SSL_free(t_conn.ssl);
+    t_conn.ssl = NULL;
+    t_conn.fd = -1;
+}
+
+/* ========== I/O ========== */
+
+/**
+ * @brief Map a failed SSL_read()/SSL_write() to the send()/recv() convention
+ *
+ * @return 0 for a clean close_notify, otherwise -1 with errno set
+ */
+static ssize_t ssl_failure(SSL *ssl, int ret, const char *what) {
+    switch (SSL_get_error(ssl, ret)) {
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        // SO_RCVTIMEO/SO_SNDTIMEO expired inside OpenSSL
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0) errno = ECONNRESET;
+        ERR_clear_error();
+        return -1;
+    default:
+        log_ssl_errors(what);
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/**
+ * @brief send() that encrypts when fd is this thread's TLS connection
+ *
+ * With kTLS the kernel encrypts, so the data goes straight to send().
+ */
+ssize_t tls_send(int fd, const void *buf, size_t len, int flags) {
+    if (t_conn.fd != fd || !t_conn.ssl || t_conn.ktls_send) return send(fd, buf, len, flags);
+
+    if (len > INT32_MAX) len = INT32_MAX;
+    ERR_clear_error();
+    int n = SSL_write(t_conn.ssl, buf, (int)len);
+    if (n > 0) return n;
+    return ssl_failure(t_conn.ssl, n, "SSL_write");
+}
+
+/**
+ * @brief recv() that decrypts when fd is this thread's TLS connection
+ *
+ * Reads even with kTLS receive go through OpenSSL, which handles the
+ * non-data records the kernel hands back separately. @p flags only apply
+ * to plaintext connections.
+ */
+ssize_t tls_recv(int fd, void *buf, size_t len, int flags) {
+    if (t_conn.fd != fd || !t_conn.ssl) return recv(fd, buf, len, flags);
+
+    if (len > INT32_MAX) len = INT32_MAX;
+    ERR_clear_error();
+    int n = SSL_read(t_conn.ssl, buf, (int)len);
+    if (n > 0) return n;
+    return ssl_failure(t_conn.ssl, n, "SSL_read");
+}
+
+/**
+ * @brief Whether send()/sendfile()/splice() on fd may bypass tls_send()
+ *
+ * True for plaintext connections and for TLS with kernel send offload.
+ */
+int tls_raw_send_ok(int fd) {
+    return t_conn.fd != fd || !t_conn.ssl || t_conn.ktls_send;
+}
+
+/**
+ * @brief Whether recv()/splice() on fd may bypass tls_recv()
+ *
+ * Only plaintext connections: even with kTLS receive, a non-data record
+ * makes a raw read fail, so TLS uploads use the buffered path.
+ */
+int tls_raw_recv_ok(int fd) {
+    return t_conn.fd != fd || !t_conn.ssl;
+}
+
+/**
+ * @brief Whether OpenSSL already holds decrypted bytes for fd
+ *
+ * A poll() on the socket would not see them, so callers that wait for the
+ * next request check this first. Always 0 for plaintext connections.
+ */
+int tls_pending(int fd) {
+    return t_conn.fd == fd && t_conn.ssl && SSL_has_pending(t_conn.ssl);
+}
@@ -0,0 +1,22 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** First byte of a TLS handshake record; the plaintext protocol starts with 0x01 */
+#define TLS_RECORD_HANDSHAKE 0x16
+
+int tls_init(const char *cert_file, const char *key_file);
+int tls_reload(const char *cert_file, const char *key_file);
+int tls_enabled(void);
+int tls_accept(int fd);
+void tls_end(int fd);
+
+ssize_t tls_send(int fd, const void *buf, size_t len, int flags);
+ssize_t tls_recv(int fd, void *buf, size_t len, int flags);
+int tls_raw_send_ok(int fd);
+int tls_raw_recv_ok(int fd);
+int tls_pending(int fd);
+
+#endif
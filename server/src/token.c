@@ -0,0 +1,181 @@
+/**
+ * @file token.c
+ * @brief Short-lived HMAC-signed resumption tokens (-k)
+ *
+ * A password login makes the client run crypt() with the user's setting,
+ * which for yescrypt or many SHA-512 rounds costs tens to hundreds of
+ * milliseconds of client CPU, and it happens on every new connection.
+ * After a password login the server hands out a token; presenting it on a
+ * later connection replaces the crypt exchange with one round trip and a
+ * MAC check.
+ *
+ * Token layout (TOKEN_LEN bytes, opaque to the client):
+ *   [1 version][8 BE expiry, Unix seconds][32 HMAC-SHA256]
+ * The MAC covers version, expiry, the username and the user's current
+ * shadow hash. Nothing is stored on the server, and changing a password
+ * invalidates the user's tokens. The key is random per server process, so
+ * a restart revokes every token; a SIGUSR2 upgrade passes it on to the new
+ * process (token_key_save()/token_key_load()), so clients that reconnect
+ * during the upgrade still skip crypt.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "log.h"
+#include "token.h"
+
+#define TOKEN_VERSION 1
+#define TOKEN_HEAD    9   /**< Version + expiry */
+#define TOKEN_MAC_LEN 32
+
+static unsigned char g_key[32];    /**< Fixed once token_init() returned */
+static int g_have_key;
+static atomic_int g_lifetime;      /**< Changed by SIGHUP while workers issue and check */
+
+/**
+ * @brief Create the signing key (unless one was inherited) and set the lifetime
+ *
+ * Runs once, before any worker starts. The key is made even when tokens
+ * are off, so a reload that turns them on never writes it while
+ * token_verify() reads it.
+ *
+ * @param lifetime Seconds a token stays valid; 0 disables tokens
+ * @return 0 on success, -1 if no random key could be generated
+ */
+int token_init(int lifetime) {
+    if (!g_have_key) {
+        if (RAND_bytes(g_key, sizeof(g_key)) != 1) {
+            log_error("RAND_bytes failed; session tokens disabled.");
+            return -1;
+        }
+        g_have_key = 1;
+    }
+    token_set_lifetime(lifetime);
+    return 0;
+}
+
+/**
+ * @brief Change the token lifetime on SIGHUP
+ *
+ * Applies to tokens issued and checked from then on. The key is kept, so
+ * outstanding tokens stay valid unless the lifetime went to 0. Without a
+ * key (token_init() failed) tokens stay off.
+ *
+ * @param lifetime Seconds a token stays valid; 0 disables tokens
+ */
+void token_set_lifetime(int lifetime) {
+    if (!g_have_key || lifetime < 0) lifetime = 0;
+    atomic_store_explicit(&g_lifetime, lifetime, memory_order_relaxed);
+}
+
+/**
+ * @brief Write the signing key to fd for a successor process
+ *
+ * @return 0 on success (or when there is no key yet), -1 on a write error
+ */
+int token_key_save(int fd) {
+    if (!g_have_key) return 0;
+    return write(fd, g_key, sizeof(g_key)) == (ssize_t)sizeof(g_key) ? 0 : -1;
+}
+
+/**
+ * @brief Adopt the signing key a previous process wrote with token_key_save()
+ *
+ * Must run before token_init(). An empty or short read leaves the process
+ * to generate its own key.
+ *
+ * @return 0 if a key was read, -1 otherwise
+ */
+int token_key_load(int fd) {
+    size_t got = 0;
+    while (got < sizeof(g_key)) {
+        ssize_t n = read(fd, g_key + got, sizeof(g_key) - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += (size_t)n;
+    }
+    g_have_key = 1;
+    return 0;
+}
+
+/**
+ * @brief HMAC-SHA256 over the token head, username and shadow hash
+ *
+ * @return 0 on success, -1 if the input is too long or HMAC failed
+ */
+static int token_mac(const unsigned char *head, const char *username, const char *stored_hash,
+                     unsigned char *mac) {
+    unsigned char msg[TOKEN_HEAD + 256 + 1 + 512];
+    size_t ulen = strlen(username), hlen = strlen(stored_hash);
+    if (ulen > 256 || hlen > 512) return -1;
+
+    memcpy(msg, head, TOKEN_HEAD);
+    memcpy(msg + TOKEN_HEAD, username, ulen);
+    msg[TOKEN_HEAD + ulen] = '\0';  // Separates "ab"+"c..." from "a"+"bc..."
+    memcpy(msg + TOKEN_HEAD + ulen + 1, stored_hash, hlen);
+
+    unsigned int mac_len = 0;
+    unsigned char *ok = HMAC(EVP_sha256(), g_key, sizeof(g_key), msg,
+                             TOKEN_HEAD + ulen + 1 + hlen, mac, &mac_len);
+    OPENSSL_cleanse(msg, sizeof(msg));
+    return (ok && mac_len == TOKEN_MAC_LEN) ? 0 : -1;
+}
+
+static int hash_usable(const char *stored_hash) {
+    return stored_hash[0] != '\0' && stored_hash[0] != '!' && stored_hash[0] != '*';
+}
+
+/**
+ * @brief Issue a token for a user who just logged in with the password
+ *
+ * @param out Buffer of at least TOKEN_LEN bytes
+ * @return TOKEN_LEN, or 0 when tokens are disabled
+ */
+size_t token_issue(const char *username, const char *stored_hash, unsigned char *out) {
+    int lifetime = atomic_load_explicit(&g_lifetime, memory_order_relaxed);
+    if (lifetime <= 0 || !hash_usable(stored_hash)) return 0;
+
+    uint64_t expiry = (uint64_t)time(NULL) + (uint64_t)lifetime;
+    out[0] = TOKEN_VERSION;
+    for (int i = 0; i < 8; i++) out[1 + i] = (unsigned char)(expiry >> (56 - 8 * i));
+    if (token_mac(out, username, stored_hash, out + TOKEN_HEAD) != 0) return 0;
+    return TOKEN_LEN;
+}
+
+/**
+ * @brief Check a token presented by a client
+ *
+ * @return 0 if it was issued by this process for this user and password
+ *         and has not expired, -1 otherwise
+ */
+int token_verify(const char *username, const char *stored_hash,
+                 const unsigned char *token, size_t len) {
+    int lifetime = atomic_load_explicit(&g_lifetime, memory_order_relaxed);
+    if (lifetime <= 0 || len != TOKEN_LEN || token[0] != TOKEN_VERSION ||
+        !hash_usable(stored_hash)) {
+        return -1;
+    }
+
+    uint64_t expiry = 0;
+    for (int i = 0; i < 8; i++) expiry = expiry << 8 | token[1 + i];
+    uint64_t now = (uint64_t)time(NULL);
+    // Also refuse expiries beyond one lifetime from now, in case the clock went back
+    if (expiry < now || expiry > now + (uint64_t)lifetime) return -1;
+
+    unsigned char mac[TOKEN_MAC_LEN];
+    if (token_mac(token, username, stored_hash, mac) != 0) return -1;
+    return CRYPTO_memcmp(mac, token + TOKEN_HEAD, TOKEN_MAC_LEN) == 0 ? 0 : -1;
+}
@@ -0,0 +1,17 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include <stddef.h>
+
+#define TOKEN_LEN 41  /**< Version, expiry and HMAC-SHA256 */
+#define TOKEN_MAX 256 /**< Longest token frame a client may send */
+
+int token_init(int lifetime);
+void token_set_lifetime(int lifetime);
+int token_key_save(int fd);
+int token_key_load(int fd);
+size_t token_issue(const char *username, const char *stored_hash, unsigned char *out);
+int token_verify(const char *username, const char *stored_hash,
+                 const unsigned char *token, size_t len);
+
+#endif
@@ -0,0 +1,743 @@
+/**
+ * @file transfer.c
+ * @brief File data movement between open files and client sockets
+ *
+ * The session handlers in session.c deal with the protocol (paths, status
+ * bytes, headers); this module only moves the file bytes. Downloads try the
+ * cheapest kernel path first:
+ * 1. sendfile(2): file pages go straight to the socket, no user-space copy
+ * 2. splice(2) through a pipe, for files sendfile() refuses
+ * 3. pread() + send() through a buffer, which works for anything
+ *
+ * Uploads go the other way: splice(2) socket → pipe → file when zero-copy is
+ * enabled, otherwise recv() into the large session buffer and pwrite(). With
+ * -I the buffered steps of both directions run on the worker's io_uring
+ * instead (see uring.c), falling back to the plain loops if the kernel
+ * lacks it. When the upload size is known up front it is checked against
+ * -m and the free space, and the target is preallocated with fallocate()
+ * so the file is laid out contiguously. Uploads of unknown size (chunked,
+ * compressed) stop once they pass -m.
+ *
+ * Each syscall moves up to g_config.chunk_size bytes.
+ *
+ * On a TLS connection every socket read and write goes through tls.c.
+ * Downloads keep the zero-copy paths when the kernel encrypts (kTLS) and
+ * use the pread() + send() loop otherwise; uploads always take the recv()
+ * loop so OpenSSL can decrypt.
+ *
+ * When the size is not known in advance (pipes, /proc files, uploads from a
+ * client-side pipe) the data is sent as chunked frames instead:
+ *   [4-byte BE chunk length][chunk bytes] ... [0x00000000]
+ *
+ * Compressed transfers use the same frames to carry a zlib stream
+ * (transfer_send_deflate() / transfer_recv_inflate()).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   /* splice(), F_SETPIPE_SZ */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/statvfs.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "checksum.h"
+#include "config.h"
+#include "log.h"
+#include "tls.h"
+#include "transfer.h"
+#include "uring.h"
+
+/** Result of a zero-copy attempt that could not start on this file */
+#define XFER_UNSUPPORTED 1
+
+/**
+ * @brief Number of bytes to move in the next step
+ */
+static size_t next_chunk(uint64_t remaining, size_t chunk) {
+    return remaining < (uint64_t)chunk ? (size_t)remaining : chunk;
+}
+
+/**
+ * @brief Stream with sendfile(2)
+ *
+ * @return 0 when done, XFER_UNSUPPORTED if sendfile() rejected the file
+ *         before any byte was sent, -1 on error
+ */
+static int send_with_sendfile(int sock_fd, int file_fd, off_t *offset,
+                              uint64_t *remaining, uint64_t *sent) {
+    size_t chunk = g_config.chunk_size;
+
+    while (*remaining > 0) {
+        ssize_t n = sendfile(sock_fd, file_fd, offset, next_chunk(*remaining, chunk));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (*sent == 0 && (errno == EINVAL || errno == ENOSYS)) return XFER_UNSUPPORTED;
+            log_errno("sendfile");
+            return -1;
+        }
+        if (n == 0) break;  // EOF
+        *remaining -= (uint64_t)n;
+        *sent += (uint64_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Create a pipe sized for chunk-sized splices
+ *
+ * @param pipefd   Receives the pipe's read and write ends
+ * @param chunk    Desired capacity; updated to what the kernel granted
+ * @return 0 on success, -1 if no pipe could be created
+ */
+static int open_splice_pipe(int pipefd[2], size_t *chunk) {
+    if (pipe2(pipefd, O_CLOEXEC) < 0) return -1;
+
+    // A bigger pipe means fewer splice() calls per chunk; failure is harmless
+    int pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, (int)*chunk);
+    if (pipe_size > 0 && (size_t)pipe_size < *chunk) *chunk = (size_t)pipe_size;
+    else if (pipe_size < 0) *chunk = 65536;
+    return 0;
+}
+
+/**
+ * @brief Stream with splice(2): file → pipe → socket
+ *
+ * @return 0 when done, XFER_UNSUPPORTED if splicing is not possible for this
+ *         file (nothing was sent), -1 on error
+ */
+static int send_with_splice(int sock_fd, int file_fd, off_t *offset,
+                            uint64_t *remaining, uint64_t *sent) {
+    int pipefd[2];
+    size_t chunk = g_config.chunk_size;
+    if (open_splice_pipe(pipefd, &chunk) != 0) return XFER_UNSUPPORTED;
+
+    int rc = 0;
+    while (*remaining > 0) {
+        ssize_t in = splice(file_fd, offset, pipefd[1], NULL,
+                            next_chunk(*remaining, chunk), SPLICE_F_MOVE);
+        if (in < 0) {
+            if (errno == EINTR) continue;
+            if (*sent == 0 && (errno == EINVAL || errno == ENOSYS)) { rc = XFER_UNSUPPORTED; break; }
+            log_errno("splice file");
+            rc = -1;
+            break;
+        }
+        if (in == 0) break;  // EOF
+
+        // Drain everything that went into the pipe before reading more
+        ssize_t left = in;
+        while (left > 0) {
+            ssize_t out = splice(pipefd[0], NULL, sock_fd, NULL, (size_t)left,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                log_errno("splice socket");
+                rc = -1;
+                break;
+            }
+            left -= out;
+        }
+        if (rc != 0) break;
+        *remaining -= (uint64_t)in;
+        *sent += (uint64_t)in;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return rc;
+}
+
+/**
+ * @brief Stream through a user-space buffer with pread() + send()
+ */
+static int send_with_copy(int sock_fd, int file_fd, off_t *offset, uint64_t *remaining,
+                          uint64_t *sent, char *buf, size_t buf_size) {
+    while (*remaining > 0) {
+        ssize_t nread = pread(file_fd, buf, next_chunk(*remaining, buf_size), *offset);
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            log_errno("pread");
+            return -1;
+        }
+        if (nread == 0) break;  // EOF
+
+        ssize_t off = 0;
+        while (off < nread) {
+            ssize_t n = tls_send(sock_fd, buf + off, (size_t)(nread - off), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                log_errno("send file data");
+                return -1;
+            }
+            off += n;
+        }
+        *offset += nread;
+        *remaining -= (uint64_t)nread;
+        *sent += (uint64_t)nread;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send file contents to a socket, zero-copy when possible
+ *
+ * @param sock_fd  Connected client socket
+ * @param file_fd  File opened for reading
+ * @param offset   File offset to start at
+ * @param length   Bytes to send, or TRANSFER_UNTIL_EOF
+ * @param buf      Buffer for the copy fallback
+ * @param buf_size Size of buf
+ * @param sent_out Optional; receives the number of bytes actually sent
+ * @return 0 on success (length bytes or EOF reached), -1 on error
+ *
+ * @note Zero-copy is skipped when g_config.zero_copy is 0 or the session's
+ *       TLS records are built in user space; the buffered step uses
+ *       io_uring when g_config.io_uring is set
+ */
+int transfer_send_file(int sock_fd, int file_fd, off_t offset, uint64_t length,
+                       char *buf, size_t buf_size, uint64_t *sent_out) {
+    uint64_t remaining = length;
+    uint64_t sent = 0;
+    int rc = XFER_UNSUPPORTED;
+
+    // Userspace TLS has to see every byte; kTLS encrypts zero-copy sends itself
+    int raw_ok = tls_raw_send_ok(sock_fd);
+
+    if (config_get(zero_copy) && raw_ok) {
+        rc = send_with_sendfile(sock_fd, file_fd, &offset, &remaining, &sent);
+        if (rc == XFER_UNSUPPORTED) {
+            rc = send_with_splice(sock_fd, file_fd, &offset, &remaining, &sent);
+        }
+    }
+    if (rc == XFER_UNSUPPORTED && g_config.io_uring && raw_ok) {
+        rc = uring_send_file(sock_fd, file_fd, &offset, &remaining, &sent);
+        if (rc == URING_UNSUPPORTED) rc = XFER_UNSUPPORTED;
+    }
+    if (rc == XFER_UNSUPPORTED) {
+        rc = send_with_copy(sock_fd, file_fd, &offset, &remaining, &sent, buf, buf_size);
+    }
+
+    if (sent_out) *sent_out = sent;
+    return rc;
+}
+
+/**
+ * @brief Whether an upload has grown past -m
+ */
+static int over_upload_limit(uint64_t bytes) {
+    uint64_t max = config_get(max_upload);
+    if (max == 0 || bytes <= max) return 0;
+    log_warn("Upload exceeds the limit of %llu bytes (-m).", (unsigned long long)max);
+    return 1;
+}
+
+/**
+ * @brief Bytes free for unprivileged users on file_fd's filesystem (UINT64_MAX if unknown)
+ */
+static uint64_t free_bytes(int file_fd) {
+    struct statvfs vfs;
+    if (fstatvfs(file_fd, &vfs) != 0) return UINT64_MAX;
+    return (uint64_t)vfs.f_bavail * vfs.f_frsize;
+}
+
+/**
+ * @brief Most bytes an upload into file_fd may write: -m, capped by the free space
+ *
+ * For uploads whose final size is not announced (delta uploads).
+ */
+uint64_t transfer_upload_limit(int file_fd) {
+    uint64_t max = config_get(max_upload);
+    uint64_t limit = max > 0 ? max : UINT64_MAX;
+    uint64_t avail = free_bytes(file_fd);
+    return avail < limit ? avail : limit;
+}
+
+/**
+ * @brief Check an announced upload size before anything is reserved or received
+ *
+ * @param file_fd File the upload goes to; its filesystem's free space is checked
+ * @param length  Announced size, or TRANSFER_UNTIL_EOF (not checked)
+ * @return 0 if the upload may proceed, -1 if it is above -m or the free
+ *         space (logged)
+ */
+int transfer_upload_allowed(int file_fd, uint64_t length) {
+    if (length == TRANSFER_UNTIL_EOF) return 0;
+    if (over_upload_limit(length)) return -1;
+
+    uint64_t avail = free_bytes(file_fd);
+    if (length > avail) {
+        log_warn("Upload of %llu bytes is larger than the %llu bytes free.",
+                 (unsigned long long)length, (unsigned long long)avail);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reserve disk space for an upload of known size
+ *
+ * Uses fallocate() rather than posix_fallocate(): where the filesystem
+ * can't preallocate, glibc's fallback writes every block, which would tie
+ * up the worker before the first byte is received. Failure is not an
+ * error; the write path simply extends the file as it goes.
+ */
+static void preallocate(int file_fd, off_t offset, uint64_t length) {
+    if (length == 0 || length == TRANSFER_UNTIL_EOF) return;
+    if (fallocate(file_fd, 0, offset, (off_t)length) != 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL) {
+        log_errno("fallocate");
+    }
+}
+
+/**
+ * @brief Receive with splice(2): socket → pipe → file
+ *
+ * @return 0 when done, XFER_UNSUPPORTED if splicing is not possible (nothing
+ *         was received), -1 on error or early disconnect
+ */
+static int recv_with_splice(int sock_fd, int file_fd, off_t *offset,
+                            uint64_t *remaining, uint64_t *received) {
+    int pipefd[2];
+    size_t chunk = g_config.chunk_size;
+    if (open_splice_pipe(pipefd, &chunk) != 0) return XFER_UNSUPPORTED;
+
+    int rc = 0;
+    while (*remaining > 0) {
+        ssize_t in = splice(sock_fd, NULL, pipefd[1], NULL,
+                            next_chunk(*remaining, chunk), SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0) {
+            if (errno == EINTR) continue;
+            if (*received == 0 && (errno == EINVAL || errno == ENOSYS)) { rc = XFER_UNSUPPORTED; break; }
+            log_errno("splice socket");
+            rc = -1;
+            break;
+        }
+        if (in == 0) break;  // Connection closed
+
+        ssize_t left = in;
+        while (left > 0) {
+            ssize_t out = splice(pipefd[0], NULL, file_fd, offset, (size_t)left, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                log_errno("splice file");
+                rc = -1;
+                break;
+            }
+            left -= out;
+        }
+        if (rc != 0) break;
+        *remaining -= (uint64_t)in;
+        *received += (uint64_t)in;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return rc;
+}
+
+/**
+ * @brief Receive through a user-space buffer with recv() + pwrite()
+ */
+static int recv_with_copy(int sock_fd, int file_fd, off_t *offset, uint64_t *remaining,
+                          uint64_t *received, char *buf, size_t buf_size) {
+    while (*remaining > 0) {
+        ssize_t n = tls_recv(sock_fd, buf, next_chunk(*remaining, buf_size), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_errno("recv file data");
+            return -1;
+        }
+        if (n == 0) break;  // Connection closed
+
+        ssize_t off = 0;
+        while (off < n) {
+            ssize_t w = pwrite(file_fd, buf + off, (size_t)(n - off), *offset + off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                log_errno("pwrite");
+                return -1;
+            }
+            off += w;
+        }
+        *offset += n;
+        *remaining -= (uint64_t)n;
+        *received += (uint64_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive file contents from a socket and write them to a file
+ *
+ * @param sock_fd      Connected client socket
+ * @param file_fd      File opened for writing
+ * @param offset       File offset to start writing at
+ * @param length       Expected byte count, or TRANSFER_UNTIL_EOF to read
+ *                     until the client closes the connection
+ * @param buf          Buffer for the copy path (large and page-aligned)
+ * @param buf_size     Size of buf
+ * @param received_out Optional; receives the number of bytes written
+ * @return 0 on success, -1 on error, if length is not allowed (see
+ *         transfer_upload_allowed()), if the connection closed before
+ *         length bytes arrived, or if an upload until EOF passed
+ *         transfer_upload_limit()
+ *
+ * @note When length is known the file is preallocated and, if the client
+ *       sends less, truncated back to what was actually written
+ */
+int transfer_recv_file(int sock_fd, int file_fd, off_t offset, uint64_t length,
+                       char *buf, size_t buf_size, uint64_t *received_out) {
+    uint64_t remaining = length;
+    uint64_t received = 0;
+    off_t start = offset;
+    int rc = XFER_UNSUPPORTED;
+
+    if (transfer_upload_allowed(file_fd, length) != 0) return -1;
+    preallocate(file_fd, offset, length);
+
+    // Nothing announced: read one byte past the limit to tell a too large upload from one that fits
+    uint64_t limit = length == TRANSFER_UNTIL_EOF ? transfer_upload_limit(file_fd) : UINT64_MAX;
+    if (limit < UINT64_MAX) remaining = limit + 1;
+
+    int raw_ok = tls_raw_recv_ok(sock_fd);
+
+    if (config_get(zero_copy) && raw_ok) {
+        rc = recv_with_splice(sock_fd, file_fd, &offset, &remaining, &received);
+    }
+    if (rc == XFER_UNSUPPORTED && g_config.io_uring && raw_ok) {
+        rc = uring_recv_file(sock_fd, file_fd, &offset, &remaining, &received);
+        if (rc == URING_UNSUPPORTED) rc = XFER_UNSUPPORTED;
+    }
+    if (rc == XFER_UNSUPPORTED) {
+        rc = recv_with_copy(sock_fd, file_fd, &offset, &remaining, &received, buf, buf_size);
+    }
+
+    if (length != TRANSFER_UNTIL_EOF && received < length) {
+        // Drop the preallocated tail so a short upload doesn't look complete
+        if (ftruncate(file_fd, start + (off_t)received) < 0) log_errno("ftruncate");
+        rc = -1;
+    }
+    if (received > limit) {
+        log_warn("Upload exceeds the limit of %llu bytes (-m, free space).", (unsigned long long)limit);
+        rc = -1;
+    }
+
+    if (received_out) *received_out = received;
+    return rc;
+}
+
+/**
+ * @brief Send an exact number of bytes, retrying on EINTR and short writes
+ */
+int transfer_send_full(int sock_fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = tls_send(sock_fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Receive an exact number of bytes, retrying on EINTR and short reads
+ *
+ * @return 0 on success, -1 on error or if the peer closed the connection
+ */
+int transfer_recv_full(int sock_fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = tls_recv(sock_fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send a file of unknown size as chunked frames until EOF
+ *
+ * Each frame is a 4-byte big-endian length followed by that many bytes;
+ * a zero-length frame marks the end, so the receiver can tell a complete
+ * stream from a truncated one.
+ *
+ * @param sock_fd  Connected client socket
+ * @param file_fd  File (or pipe) opened for reading
+ * @param buf      Buffer holding one frame's data
+ * @param buf_size Size of buf (maximum frame length)
+ * @param sent_out Optional; receives the number of payload bytes sent
+ * @param crc_out  Optional; receives the CRC-32C of the payload
+ * @return 0 on success, -1 on error
+ */
+int transfer_send_chunked(int sock_fd, int file_fd, char *buf, size_t buf_size,
+                          uint64_t *sent_out, uint32_t *crc_out) {
+    uint64_t sent = 0;
+    uint32_t crc = CHECKSUM_CRC32C_INIT;
+    int rc = 0;
+
+    while (1) {
+        ssize_t nread = read(file_fd, buf, buf_size);
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            log_errno("read");
+            rc = -1;
+            break;
+        }
+
+        uint32_t len_be = htonl((uint32_t)nread);
+        if (transfer_send_full(sock_fd, &len_be, sizeof(len_be)) != 0 ||
+            transfer_send_full(sock_fd, buf, (size_t)nread) != 0) {
+            log_errno("send chunk");
+            rc = -1;
+            break;
+        }
+        if (nread == 0) break;  // Terminator frame sent
+        sent += (uint64_t)nread;
+        if (crc_out) crc = checksum_crc32c(crc, buf, (size_t)nread);
+    }
+
+    if (sent_out) *sent_out = sent;
+    if (crc_out) *crc_out = crc;
+    return rc;
+}
+
+/**
+ * @brief Receive chunked frames (see transfer_send_chunked()) into a file
+ *
+ * @param sock_fd      Connected client socket
+ * @param file_fd      File opened for writing (written from offset 0)
+ * @param buf          Receive buffer
+ * @param buf_size     Size of buf
+ * @param received_out Optional; receives the number of payload bytes written
+ * @return 0 once the terminator frame arrived, -1 on error or if the
+ *         connection closed first
+ */
+int transfer_recv_chunked(int sock_fd, int file_fd, char *buf, size_t buf_size,
+                          uint64_t *received_out) {
+    uint64_t received = 0;
+    int rc = -1;
+
+    while (1) {
+        uint32_t len_be;
+        if (transfer_recv_full(sock_fd, &len_be, sizeof(len_be)) != 0) {
+            log_warn("Chunked stream ended without terminator.");
+            break;
+        }
+        uint32_t left = ntohl(len_be);
+        if (left == 0) {
+            rc = 0;
+            break;
+        }
+        if (over_upload_limit(received + left)) break;
+
+        int failed = 0;
+        while (left > 0 && !failed) {
+            size_t want = left < buf_size ? left : buf_size;
+            if (transfer_recv_full(sock_fd, buf, want) != 0) {
+                log_warn("Chunked stream ended mid-frame.");
+                failed = 1;
+                break;
+            }
+            size_t off = 0;
+            while (off < want) {
+                ssize_t w = pwrite(file_fd, buf + off, want - off, (off_t)(received + off));
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) {
+                    log_errno("pwrite");
+                    failed = 1;
+                    break;
+                }
+                off += (size_t)w;
+            }
+            received += off;
+            left -= (uint32_t)want;
+        }
+        if (failed) break;
+    }
+
+    if (received_out) *received_out = received;
+    return rc;
+}
+
+/**
+ * @brief Send a file as one zlib stream split into chunked frames
+ *
+ * Uses the same framing as transfer_send_chunked(); the frame payloads,
+ * concatenated, form a zlib (RFC 1950) stream whose Adler-32 trailer lets
+ * the receiver verify the data. The first half of buf holds file data, the
+ * second half compressed output.
+ *
+ * @param sock_fd  Connected client socket
+ * @param file_fd  File (or pipe) opened for reading, read until EOF
+ * @param level    zlib compression level (1-9)
+ * @param buf      Scratch buffer
+ * @param buf_size Size of buf (at least 2 bytes; larger is faster)
+ * @param sent_out Optional; receives the number of uncompressed bytes sent
+ * @param crc_out  Optional; receives the CRC-32C of the uncompressed bytes
+ * @return 0 on success, -1 on error
+ */
+int transfer_send_deflate(int sock_fd, int file_fd, int level, char *buf, size_t buf_size,
+                          uint64_t *sent_out, uint32_t *crc_out) {
+    size_t half = buf_size / 2;
+    char *in = buf, *out = buf + half;
+    uint64_t sent = 0;
+    uint32_t crc = CHECKSUM_CRC32C_INIT;
+    int rc = -1;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, level) != Z_OK) {
+        log_error("deflateInit failed.");
+        return -1;
+    }
+
+    int flush = Z_NO_FLUSH;
+    while (1) {
+        if (zs.avail_in == 0 && flush != Z_FINISH) {
+            ssize_t nread = read(file_fd, in, half);
+            if (nread < 0) {
+                if (errno == EINTR) continue;
+                log_errno("read");
+                goto out;
+            }
+            zs.next_in = (Bytef *)in;
+            zs.avail_in = (uInt)nread;
+            sent += (uint64_t)nread;
+            if (crc_out) crc = checksum_crc32c(crc, in, (size_t)nread);
+            if (nread == 0) flush = Z_FINISH;
+        }
+
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = (uInt)half;
+        int zrc = deflate(&zs, flush);
+        if (zrc == Z_STREAM_ERROR) {
+            log_error("deflate failed.");
+            goto out;
+        }
+
+        size_t produced = half - zs.avail_out;
+        if (produced > 0) {
+            uint32_t len_be = htonl((uint32_t)produced);
+            if (transfer_send_full(sock_fd, &len_be, sizeof(len_be)) != 0 ||
+                transfer_send_full(sock_fd, out, produced) != 0) {
+                log_errno("send chunk");
+                goto out;
+            }
+        }
+        if (zrc == Z_STREAM_END) break;
+    }
+
+    uint32_t end = 0;
+    if (transfer_send_full(sock_fd, &end, sizeof(end)) != 0) {
+        log_errno("send chunk");
+        goto out;
+    }
+    rc = 0;
+
+out:
+    deflateEnd(&zs);
+    if (sent_out) *sent_out = sent;
+    if (crc_out) *crc_out = crc;
+    return rc;
+}
+
+/**
+ * @brief Receive a stream from transfer_send_deflate() and inflate it into a file
+ *
+ * @param sock_fd      Connected client socket
+ * @param file_fd      File opened for writing (written from offset 0)
+ * @param buf          Scratch buffer (first half compressed, second half output)
+ * @param buf_size     Size of buf
+ * @param received_out Optional; receives the number of uncompressed bytes written
+ * @return 0 once a complete, verified zlib stream and the terminator frame
+ *         arrived, -1 on error, corrupt data or early close
+ */
+int transfer_recv_inflate(int sock_fd, int file_fd, char *buf, size_t buf_size,
+                          uint64_t *received_out) {
+    size_t half = buf_size / 2;
+    char *in = buf, *out = buf + half;
+    uint64_t received = 0;
+    int rc = -1, done = 0;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        log_error("inflateInit failed.");
+        return -1;
+    }
+
+    while (1) {
+        uint32_t len_be;
+        if (transfer_recv_full(sock_fd, &len_be, sizeof(len_be)) != 0) {
+            log_warn("Compressed stream ended without terminator.");
+            goto out;
+        }
+        uint32_t left = ntohl(len_be);
+        if (left == 0) break;
+        if (done) {
+            log_warn("Data after end of compressed stream.");
+            goto out;
+        }
+
+        while (left > 0) {
+            size_t want = left < half ? left : half;
+            if (transfer_recv_full(sock_fd, in, want) != 0) {
+                log_warn("Compressed stream ended mid-frame.");
+                goto out;
+            }
+            left -= (uint32_t)want;
+            zs.next_in = (Bytef *)in;
+            zs.avail_in = (uInt)want;
+
+            while (zs.avail_in > 0 && !done) {
+                zs.next_out = (Bytef *)out;
+                zs.avail_out = (uInt)half;
+                int zrc = inflate(&zs, Z_NO_FLUSH);
+                if (zrc != Z_OK && zrc != Z_STREAM_END) {
+                    log_warn("Corrupt compressed stream (%s).", zs.msg ? zs.msg : "inflate");
+                    goto out;
+                }
+                size_t produced = half - zs.avail_out;
+                if (over_upload_limit(received + produced)) goto out;
+                size_t off = 0;
+                while (off < produced) {
+                    ssize_t w = pwrite(file_fd, out + off, produced - off, (off_t)(received + off));
+                    if (w < 0 && errno == EINTR) continue;
+                    if (w <= 0) {
+                        log_errno("pwrite");
+                        goto out;
+                    }
+                    off += (size_t)w;
+                }
+                received += produced;
+                if (zrc == Z_STREAM_END) done = 1;
+            }
+            if (done && (zs.avail_in > 0 || left > 0)) {
+                log_warn("Data after end of compressed stream.");
+                goto out;
+            }
+        }
+    }
+
+    if (!done) {
+        log_warn("Compressed stream is incomplete.");
+    } else {
+        rc = 0;
+    }
+
+out:
+    inflateEnd(&zs);
+    if (received_out) *received_out = received;
+    return rc;
+}
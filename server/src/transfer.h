@@ -0,0 +1,28 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Length value meaning "stream until end of file" */
+#define TRANSFER_UNTIL_EOF UINT64_MAX
+
+int transfer_send_full(int sock_fd, const void *data, size_t len);
+int transfer_recv_full(int sock_fd, void *data, size_t len);
+int transfer_send_file(int sock_fd, int file_fd, off_t offset, uint64_t length,
+                       char *buf, size_t buf_size, uint64_t *sent_out);
+int transfer_upload_allowed(int file_fd, uint64_t length);
+uint64_t transfer_upload_limit(int file_fd);
+int transfer_recv_file(int sock_fd, int file_fd, off_t offset, uint64_t length,
+                       char *buf, size_t buf_size, uint64_t *received_out);
+int transfer_send_chunked(int sock_fd, int file_fd, char *buf, size_t buf_size,
+                          uint64_t *sent_out, uint32_t *crc_out);
+int transfer_recv_chunked(int sock_fd, int file_fd, char *buf, size_t buf_size,
+                          uint64_t *received_out);
+int transfer_send_deflate(int sock_fd, int file_fd, int level, char *buf, size_t buf_size,
+                          uint64_t *sent_out, uint32_t *crc_out);
+int transfer_recv_inflate(int sock_fd, int file_fd, char *buf, size_t buf_size,
+                          uint64_t *received_out);
+
+#endif
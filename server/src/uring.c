@@ -0,0 +1,487 @@
+/**
+ * @file uring.c
+ * @brief io_uring backend for the buffered transfer paths (-I)
+ *
+ * Replaces the pread()+send() and recv()+pwrite() loops in transfer.c when
+ * enabled. Each worker thread owns one small ring, set up on first use
+ * with the raw syscalls (no liburing):
+ * - a registered buffer of two chunk-sized halves, so file reads and
+ *   writes are READ_FIXED/WRITE_FIXED without per-call page pinning
+ * - a two-slot fixed file table (socket, file), refreshed per transfer and
+ *   cleared afterwards so the ring never keeps a closed descriptor alive
+ *
+ * Downloads keep one file read and one socket send in flight at a time,
+ * on alternate halves, so reading chunk n+1 overlaps sending chunk n and
+ * each step is a single io_uring_enter(). Uploads receive into one half
+ * until it is full, then write it with WRITE_FIXED while the next receives
+ * go into the other half.
+ *
+ * The socket's SO_RCVTIMEO/SO_SNDTIMEO don't apply to ring operations, so
+ * waits use the idle timeout directly and cancel the socket operation when
+ * it expires. Socket operations don't use MSG_WAITALL: each completes as
+ * soon as some data moved and the rest is queued again, so the timeout
+ * measures how long the client made no progress, not how long a whole
+ * half (up to 4 MiB) took. Kernels without the needed opcodes or IORING_FEAT_EXT_ARG
+ * (5.11) make every call return URING_UNSUPPORTED and transfer.c falls
+ * back to the copy loops.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "config.h"
+#include "log.h"
+#include "transfer.h"
+#include "uring.h"
+
+#define URING_ENTRIES  8
+#define URING_MAX_HALF (4 * 1024 * 1024)   /**< Cap on each registered half */
+
+/** Fixed file slots */
+enum { SLOT_SOCK, SLOT_FILE };
+
+/** user_data carries the operation and the buffer half it uses */
+enum uring_op { OP_READ = 1, OP_SEND, OP_RECV, OP_WRITE, OP_CANCEL };
+#define TAG(op, half) ((uint64_t)(op) << 8 | (uint64_t)(half))
+
+struct ring {
+    int                  fd;
+    atomic_uint         *sq_tail;
+    unsigned             sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    atomic_uint         *cq_head;
+    atomic_uint         *cq_tail;
+    unsigned             cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned             queued;   /**< SQEs written but not yet submitted */
+    char                *buf;      /**< Registered buffer, two halves */
+    size_t               half;
+};
+
+static _Thread_local struct ring *t_ring;
+static _Thread_local int t_ring_failed;
+static atomic_int g_warned;
+
+/* ========== Setup ========== */
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static int probe_ops(int fd) {
+    static const int needed[] = { IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                                  IORING_OP_SEND, IORING_OP_RECV, IORING_OP_ASYNC_CANCEL };
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe) return -1;
+
+    int rc = sys_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+    for (size_t i = 0; rc == 0 && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            rc = -1;
+        }
+    }
+    free(probe);
+    return rc;
+}
+
+/**
+ * @brief Create this thread's ring with its registered buffer and file table
+ *
+ * @return 0 on success, -1 with errno set
+ */
+static int ring_init(struct ring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_setup(URING_ENTRIES, &p);
+    if (r->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (probe_ops(r->fd) != 0) return -1;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings = mmap(NULL, sq_len > cq_len ? sq_len : cq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) return -1;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) return -1;
+
+    r->sq_tail  = (atomic_uint *)(rings + p.sq_off.tail);
+    r->sq_mask  = *(unsigned *)(rings + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(rings + p.sq_off.array);
+    r->cq_head  = (atomic_uint *)(rings + p.cq_off.head);
+    r->cq_tail  = (atomic_uint *)(rings + p.cq_off.tail);
+    r->cq_mask  = *(unsigned *)(rings + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+
+    r->half = g_config.chunk_size < URING_MAX_HALF ? g_config.chunk_size : URING_MAX_HALF;
+    r->buf = mmap(NULL, 2 * r->half, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buf == MAP_FAILED) return -1;
+    struct iovec iov = { .iov_base = r->buf, .iov_len = 2 * r->half };
+    if (sys_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1) != 0) return -1;
+
+    int fds[2] = { -1, -1 };
+    return sys_register(r->fd, IORING_REGISTER_FILES, fds, 2);
+}
+
+/**
+ * @brief This thread's ring, created on first use; NULL if unavailable
+ *
+ * The ring lives as long as the worker thread. A failed setup is remembered
+ * so the thread doesn't retry on every transfer.
+ */
+static struct ring *ring_get(void) {
+    if (t_ring || t_ring_failed) return t_ring;
+
+    struct ring *r = calloc(1, sizeof(*r));
+    if (r && ring_init(r) == 0) {
+        t_ring = r;
+        return r;
+    }
+
+    int err = errno;
+    if (atomic_exchange(&g_warned, 1) == 0) {
+        log_warn("io_uring unavailable (%s), using the copy path.", strerror(err));
+    }
+    // Unmapping is left to process exit: this only happens once per thread
+    if (r && r->fd >= 0) close(r->fd);
+    free(r);
+    t_ring_failed = 1;
+    return NULL;
+}
+
+static int ring_set_files(struct ring *r, int sock_fd, int file_fd) {
+    int fds[2] = { sock_fd, file_fd };
+    struct io_uring_files_update upd = { .offset = 0, .fds = (uint64_t)(uintptr_t)fds };
+    return sys_register(r->fd, IORING_REGISTER_FILES_UPDATE, &upd, 2) == 2 ? 0 : -1;
+}
+
+/* ========== Submission and Completion ========== */
+
+static struct io_uring_sqe *ring_sqe(struct ring *r, uint8_t opcode, int slot, uint64_t tag) {
+    unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed) + r->queued;
+    unsigned idx = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = slot;
+    sqe->flags = (slot >= 0) ? IOSQE_FIXED_FILE : 0;
+    sqe->user_data = tag;
+    r->sq_array[idx] = idx;
+    r->queued++;
+    return sqe;
+}
+
+static void ring_publish(struct ring *r) {
+    unsigned tail = atomic_load_explicit(r->sq_tail, memory_order_relaxed);
+    atomic_store_explicit(r->sq_tail, tail + r->queued, memory_order_release);
+}
+
+/**
+ * @brief Submit queued SQEs and wait for one completion
+ *
+ * @param timed 1 to give up after the idle timeout (-t) without a completion
+ * @return 0 with *cqe filled, -ETIME on timeout, or -errno
+ */
+static int ring_wait(struct ring *r, struct io_uring_cqe *cqe, int timed) {
+    while (1) {
+        unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+        if (head != atomic_load_explicit(r->cq_tail, memory_order_acquire)) {
+            *cqe = r->cqes[head & r->cq_mask];
+            atomic_store_explicit(r->cq_head, head + 1, memory_order_release);
+            return 0;
+        }
+
+        int idle = config_get(idle_timeout);
+        struct __kernel_timespec ts = { .tv_sec = idle, .tv_nsec = 0 };
+        struct io_uring_getevents_arg arg = { .sigmask = 0, .sigmask_sz = _NSIG / 8,
+                                              .ts = (uint64_t)(uintptr_t)&ts };
+        unsigned flags = IORING_ENTER_GETEVENTS;
+        if (timed && idle > 0) flags |= IORING_ENTER_EXT_ARG;
+
+        unsigned to_submit = r->queued;
+        if (to_submit) ring_publish(r);
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, to_submit, 1, flags,
+                             (flags & IORING_ENTER_EXT_ARG) ? (void *)&arg : NULL,
+                             (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : (size_t)(_NSIG / 8));
+        if (to_submit) {
+            // Published SQEs belong to the kernel now, even if the wait failed
+            r->queued = 0;
+        }
+        // A call that submitted something reports the count, not the timeout
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+    }
+}
+
+/**
+ * @brief Give up on a socket operation that outlived the idle timeout
+ */
+static void ring_cancel(struct ring *r, uint64_t tag) {
+    struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, TAG(OP_CANCEL, 0));
+    sqe->addr = tag;
+}
+
+/**
+ * @brief Write what the kernel didn't, after a short or cancelled WRITE_FIXED
+ */
+static int write_rest(int file_fd, const char *data, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite(file_fd, data + done, len - done, offset + (off_t)done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            log_errno("pwrite");
+            return -1;
+        }
+        done += (size_t)w;
+    }
+    return 0;
+}
+
+/* ========== Public API ========== */
+
+/**
+ * @brief Send file contents through the thread's ring
+ *
+ * Same contract as the copy path in transfer.c: stops after *remaining
+ * bytes or at EOF and advances offset/remaining/sent as data goes out.
+ *
+ * @return 0 on success, -1 on error, URING_UNSUPPORTED if the ring can't be
+ *         used (nothing was sent)
+ */
+int uring_send_file(int sock_fd, int file_fd, off_t *offset,
+                    uint64_t *remaining, uint64_t *sent) {
+    struct ring *r = ring_get();
+    if (!r || ring_set_files(r, sock_fd, file_fd) != 0) return URING_UNSUPPORTED;
+
+    size_t ready[2] = { 0, 0 };      // Bytes read into a half and not yet sent
+    size_t done = 0;                 // Bytes of ready[next_send] already sent
+    int reading = -1, sending = -1;  // Half with an operation in flight
+    int next_read = 0, next_send = 0;
+    off_t read_off = *offset;
+    uint64_t to_read = *remaining;
+    int eof = 0, rc = 0;
+
+    while (1) {
+        if (rc == 0 && sending < 0 && ready[next_send] > 0) {
+            struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_SEND, SLOT_SOCK, TAG(OP_SEND, next_send));
+            sqe->addr = (uint64_t)(uintptr_t)(r->buf + (size_t)next_send * r->half + done);
+            sqe->len = (unsigned)(ready[next_send] - done);
+            sending = next_send;
+        }
+        if (rc == 0 && reading < 0 && !eof && to_read > 0 && ready[next_read] == 0) {
+            size_t n = to_read < (uint64_t)r->half ? (size_t)to_read : r->half;
+            struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_READ_FIXED, SLOT_FILE, TAG(OP_READ, next_read));
+            sqe->addr = (uint64_t)(uintptr_t)(r->buf + (size_t)next_read * r->half);
+            sqe->len = (unsigned)n;
+            sqe->off = (uint64_t)read_off;
+            sqe->buf_index = 0;
+            reading = next_read;
+        }
+        if (reading < 0 && sending < 0) break;
+
+        struct io_uring_cqe cqe;
+        int w = ring_wait(r, &cqe, rc == 0 && sending >= 0);
+        if (w == -ETIME) {
+            log_warn("Send timed out.");
+            rc = -1;
+            ring_cancel(r, TAG(OP_SEND, sending));
+            continue;
+        }
+        if (w < 0) {
+            // The ring itself broke; in-flight operations can't be tracked any more
+            errno = -w;
+            log_errno("io_uring_enter");
+            t_ring = NULL;
+            t_ring_failed = 1;
+            return -1;
+        }
+
+        int h = (int)(cqe.user_data & 0xff);
+        switch ((enum uring_op)(cqe.user_data >> 8)) {
+        case OP_READ:
+            reading = -1;
+            if (cqe.res < 0) {
+                errno = -cqe.res;
+                log_errno("io_uring read");
+                rc = -1;
+            } else if (cqe.res == 0) {
+                eof = 1;
+            } else {
+                ready[h] = (size_t)cqe.res;
+                read_off += cqe.res;
+                to_read -= (uint64_t)cqe.res;
+                next_read ^= 1;
+            }
+            break;
+        case OP_SEND:
+            sending = -1;
+            if (cqe.res <= 0) {
+                if (rc == 0 && cqe.res != -ECANCELED) {
+                    errno = cqe.res < 0 ? -cqe.res : EPIPE;
+                    log_errno("io_uring send");
+                }
+                rc = -1;
+                break;
+            }
+            *offset += cqe.res;
+            *remaining -= (uint64_t)cqe.res;
+            *sent += (uint64_t)cqe.res;
+            done += (size_t)cqe.res;
+            if (done == ready[h]) {  // Otherwise the rest of the half is sent next
+                ready[h] = 0;
+                done = 0;
+                next_send ^= 1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    ring_set_files(r, -1, -1);
+    return rc;
+}
+
+/**
+ * @brief Queue the write of a filled half to the file
+ */
+static void queue_write(struct ring *r, int half, size_t len, off_t at) {
+    struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_WRITE_FIXED, SLOT_FILE, TAG(OP_WRITE, half));
+    sqe->addr = (uint64_t)(uintptr_t)(r->buf + (size_t)half * r->half);
+    sqe->len = (unsigned)len;
+    sqe->off = (uint64_t)at;
+    sqe->buf_index = 0;
+}
+
+/**
+ * @brief Receive file contents through the thread's ring
+ *
+ * Same contract as the copy path in transfer.c: reads until *remaining
+ * bytes arrived or the client closed the connection, advancing
+ * offset/remaining/received as data is written.
+ *
+ * @return 0 on success, -1 on error, URING_UNSUPPORTED if the ring can't be
+ *         used (nothing was received)
+ */
+int uring_recv_file(int sock_fd, int file_fd, off_t *offset,
+                    uint64_t *remaining, uint64_t *received) {
+    struct ring *r = ring_get();
+    if (!r || ring_set_files(r, sock_fd, file_fd) != 0) return URING_UNSUPPORTED;
+
+    size_t fill[2] = { 0, 0 };        // Bytes received into the half
+    off_t at[2] = { 0, 0 };           // File offset of the half's first byte
+    int writing[2] = { 0, 0 };
+    int receiving = -1, cur = 0;      // cur is the half being filled
+    off_t recv_off = *offset;
+    uint64_t to_recv = *remaining;
+    int closed = 0, rc = 0;
+
+    while (1) {
+        if (rc == 0 && !closed && receiving < 0 && to_recv > 0 && !writing[cur]) {
+            size_t room = r->half - fill[cur];
+            size_t n = to_recv < (uint64_t)room ? (size_t)to_recv : room;
+            if (fill[cur] == 0) at[cur] = recv_off;
+
+            struct io_uring_sqe *sqe = ring_sqe(r, IORING_OP_RECV, SLOT_SOCK, TAG(OP_RECV, cur));
+            sqe->addr = (uint64_t)(uintptr_t)(r->buf + (size_t)cur * r->half + fill[cur]);
+            sqe->len = (unsigned)n;
+            receiving = cur;
+        }
+        if (receiving < 0 && !writing[0] && !writing[1]) break;
+
+        struct io_uring_cqe cqe;
+        int w = ring_wait(r, &cqe, rc == 0 && receiving >= 0);
+        if (w == -ETIME) {
+            log_warn("Receive timed out.");
+            rc = -1;
+            ring_cancel(r, TAG(OP_RECV, receiving));
+            continue;
+        }
+        if (w < 0) {
+            errno = -w;
+            log_errno("io_uring_enter");
+            t_ring = NULL;
+            t_ring_failed = 1;
+            return -1;
+        }
+
+        int h = (int)(cqe.user_data & 0xff);
+        switch ((enum uring_op)(cqe.user_data >> 8)) {
+        case OP_RECV:
+            receiving = -1;
+            if (cqe.res < 0) {
+                if (rc == 0 && cqe.res != -ECANCELED) {
+                    errno = -cqe.res;
+                    log_errno("io_uring recv");
+                }
+                rc = -1;
+                break;
+            }
+            if (cqe.res == 0) {
+                closed = 1;
+            } else {
+                fill[h] += (size_t)cqe.res;
+                recv_off += cqe.res;
+                to_recv -= (uint64_t)cqe.res;
+            }
+            // Write the half once it is full or nothing more will arrive
+            if (fill[h] > 0 && (fill[h] == r->half || to_recv == 0 || closed)) {
+                queue_write(r, h, fill[h], at[h]);
+                writing[h] = 1;
+                cur ^= 1;
+            }
+            break;
+        case OP_WRITE: {
+            writing[h] = 0;
+            size_t done = cqe.res > 0 ? (size_t)cqe.res : 0;
+            if (cqe.res < 0) {
+                errno = -cqe.res;
+                log_errno("io_uring write");
+                rc = -1;
+            }
+            if (rc == 0 && done < fill[h] &&
+                write_rest(file_fd, r->buf + (size_t)h * r->half + done, fill[h] - done,
+                           at[h] + (off_t)done) != 0) {
+                rc = -1;
+            }
+            if (rc == 0) {
+                *offset += (off_t)fill[h];
+                *remaining -= fill[h];
+                *received += fill[h];
+            }
+            fill[h] = 0;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    ring_set_files(r, -1, -1);
+    return rc;
+}
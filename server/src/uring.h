@@ -0,0 +1,15 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** This thread has no usable ring; nothing was transferred */
+#define URING_UNSUPPORTED 1
+
+int uring_send_file(int sock_fd, int file_fd, off_t *offset,
+                    uint64_t *remaining, uint64_t *sent);
+int uring_recv_file(int sock_fd, int file_fd, off_t *offset,
+                    uint64_t *remaining, uint64_t *received);
+
+#endif
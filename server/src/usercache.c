@@ -0,0 +1,197 @@
+/**
+ * @file usercache.c
+ * @brief Short-lived cache of passwd/shadow lookups shared by all sessions
+ *
+ * With NSS backed by LDAP/SSSD every getpwnam_r()/getspnam_r() can be a
+ * network round trip, and each connection used to make several of them
+ * plus a realpath() of the home directory. Lookups are now done once per
+ * user and then served from memory for ttl seconds.
+ *
+ * Only users that exist are cached, so a newly created account works at
+ * once. Changes to an existing account (password, home) take effect when
+ * its entry expires; a failed authentication drops the entry right away so
+ * the next attempt sees the current shadow hash.
+ */
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE 1
+#endif
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdint.h>
+
+#include "usercache.h"
+
+#define USERCACHE_BUCKETS 64
+#define USERCACHE_MAX     1024        /**< Entries kept before the oldest is dropped */
+#define PWBUF_SIZE        16384       /**< Scratch space for getpwnam_r()/getspnam_r() */
+
+struct user_entry {
+    char               name[256];
+    struct user_record rec;
+    time_t             expires;       /**< CLOCK_MONOTONIC seconds */
+    struct user_entry *next;
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct user_entry *g_buckets[USERCACHE_BUCKETS];
+static size_t g_count;
+static atomic_int g_ttl;            /**< Changed by SIGHUP while workers look users up */
+
+/* ========== Internal Helpers ========== */
+
+static time_t now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned bucket_of(const char *name) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h % USERCACHE_BUCKETS;
+}
+
+/**
+ * @brief Unlink the entry for name (call with g_lock held)
+ */
+static void remove_locked(const char *name) {
+    for (struct user_entry **pp = &g_buckets[bucket_of(name)]; *pp; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, name) == 0) {
+            struct user_entry *e = *pp;
+            *pp = e->next;
+            explicit_bzero(e->rec.hash, sizeof(e->rec.hash));
+            free(e);
+            g_count--;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Drop expired entries, or the one closest to expiry if none are
+ *        (call with g_lock held; only runs when the cache is full)
+ */
+static void make_room_locked(time_t now) {
+    struct user_entry *oldest = NULL;
+    for (int b = 0; b < USERCACHE_BUCKETS; b++) {
+        struct user_entry **pp = &g_buckets[b];
+        while (*pp) {
+            struct user_entry *e = *pp;
+            if (e->expires <= now) {
+                *pp = e->next;
+                explicit_bzero(e->rec.hash, sizeof(e->rec.hash));
+                free(e);
+                g_count--;
+                continue;
+            }
+            if (!oldest || e->expires < oldest->expires) oldest = e;
+            pp = &e->next;
+        }
+    }
+    if (g_count >= USERCACHE_MAX && oldest) remove_locked(oldest->name);
+}
+
+/**
+ * @brief Query NSS for a user (no locks held; may block on the network)
+ *
+ * @return 0 on success, -1 if there is no passwd entry
+ */
+static int fetch_user(const char *username, struct user_record *out) {
+    struct passwd pwd, *pw = NULL;
+    struct spwd spbuf, *sp = NULL;
+    char buf[PWBUF_SIZE];
+
+    if (getpwnam_r(username, &pwd, buf, sizeof(buf), &pw) != 0 || !pw || !pw->pw_dir ||
+        strlen(pw->pw_dir) >= sizeof(out->home)) {
+        return -1;
+    }
+    out->uid = pw->pw_uid;
+    out->gid = pw->pw_gid;
+    strcpy(out->home, pw->pw_dir);
+    if (!realpath(out->home, out->resolved_home)) {
+        out->resolved_home[0] = '\0';
+    }
+
+    // buf is reused: everything needed from pwd has been copied out
+    out->hash[0] = '\0';
+    if (getspnam_r(username, &spbuf, buf, sizeof(buf), &sp) == 0 && sp && sp->sp_pwdp &&
+        strlen(sp->sp_pwdp) < sizeof(out->hash)) {
+        strcpy(out->hash, sp->sp_pwdp);
+    }
+    explicit_bzero(buf, sizeof(buf));
+    return 0;
+}
+
+/* ========== Public API ========== */
+
+/**
+ * @brief Set how long lookups are reused
+ *
+ * @param ttl_seconds Lifetime of a cached user; 0 sends every lookup to NSS
+ */
+void usercache_init(int ttl_seconds) {
+    atomic_store_explicit(&g_ttl, ttl_seconds, memory_order_relaxed);
+}
+
+/**
+ * @brief Look up a user, from the cache when a fresh entry exists
+ *
+ * @param username User to look up
+ * @param out      Output: copy of the user's record
+ * @return 0 on success, -1 if the user does not exist
+ */
+int usercache_lookup(const char *username, struct user_record *out) {
+    if (strlen(username) >= sizeof(((struct user_entry *)0)->name)) return -1;
+
+    int ttl = atomic_load_explicit(&g_ttl, memory_order_relaxed);
+    if (ttl > 0) {
+        time_t now = now_seconds();
+        pthread_mutex_lock(&g_lock);
+        for (struct user_entry *e = g_buckets[bucket_of(username)]; e; e = e->next) {
+            if (strcmp(e->name, username) == 0 && e->expires > now) {
+                *out = e->rec;
+                pthread_mutex_unlock(&g_lock);
+                return 0;
+            }
+        }
+        pthread_mutex_unlock(&g_lock);
+    }
+
+    if (fetch_user(username, out) != 0) return -1;
+    if (ttl <= 0) return 0;
+
+    struct user_entry *e = malloc(sizeof(*e));
+    if (!e) return 0;  // Still a valid answer, just not cached
+    strcpy(e->name, username);
+    e->rec = *out;
+
+    pthread_mutex_lock(&g_lock);
+    time_t now = now_seconds();
+    e->expires = now + ttl;
+    remove_locked(username);  // A concurrent miss may have inserted it already
+    if (g_count >= USERCACHE_MAX) make_room_locked(now);
+    unsigned b = bucket_of(username);
+    e->next = g_buckets[b];
+    g_buckets[b] = e;
+    g_count++;
+    pthread_mutex_unlock(&g_lock);
+    return 0;
+}
+
+/**
+ * @brief Forget a user so the next lookup goes to NSS again
+ */
+void usercache_invalidate(const char *username) {
+    pthread_mutex_lock(&g_lock);
+    remove_locked(username);
+    pthread_mutex_unlock(&g_lock);
+}
@@ -0,0 +1,30 @@
+#ifndef USERCACHE_H
+#define USERCACHE_H
+
+#include <limits.h>
+#include <sys/types.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/**
+ * @brief Everything a session needs to know about a user, from one lookup
+ *
+ * Filled from getpwnam_r(), realpath() of the home directory and
+ * getspnam_r(). Empty strings mean "not available": no resolvable home,
+ * or no usable (locked/missing) password hash.
+ */
+struct user_record {
+    uid_t uid;
+    gid_t gid;
+    char  home[PATH_MAX];           /**< Home directory from the passwd entry */
+    char  resolved_home[PATH_MAX];  /**< realpath() of home, "" if unresolved */
+    char  hash[512];                /**< Shadow password hash, "" if unusable */
+};
+
+void usercache_init(int ttl_seconds);
+int usercache_lookup(const char *username, struct user_record *out);
+void usercache_invalidate(const char *username);
+
+#endif